@@ -0,0 +1,137 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+
+#include <codec.h>
+#include <clock.h>
+
+/**
+ *  Compression benchmark
+ *
+ *  Compresses generated JSON messages of a few sizes with every codec
+ *  that is compiled into the library, with and without a dictionary, and
+ *  reports the compression ratio against the CPU cost.
+ *
+ *  Results are written as CSV, one line per codec, dictionary and size:
+ *
+ *      codec,dictionary,size,ratio,compress_ns,decompress_ns,compress_mb_s
+ *
+ *  Usage: compress-bench [--messages N]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const char* SYMBOLS[] = { "AAPL", "MSFT", "GOOG", "AMZN", "NVDA", "META" };
+static const char* SIDES[] = { "buy", "sell" };
+
+static string quote(unsigned int seed) {
+    ostringstream out;
+
+    out << "{\"id\":" << seed * 7919
+        << ",\"symbol\":\"" << SYMBOLS[seed % 6] << "\""
+        << ",\"price\":" << 100 + (seed * 37) % 900 << "." << (seed * 13) % 100
+        << ",\"quantity\":" << (seed * 17) % 1000
+        << ",\"side\":\"" << SIDES[seed % 2] << "\""
+        << ",\"timestamp\":" << 1700000000000ULL + seed * 113
+        << "}";
+
+    return out.str();
+}
+
+static string message(unsigned int seed, unsigned int size) {
+    string result = "[";
+
+    while (result.size() < size) {
+        if (result.size() > 1) {
+            result += ",";
+        }
+
+        result += quote(seed++);
+    }
+
+    return result + "]";
+}
+
+static void run(unsigned char id, bool useDictionary, unsigned int size,
+                unsigned int count) {
+    Codec* codec = Codec::create(id);
+    string dictionary;
+    vector<string> messages;
+    vector<char> out(size * 2 + 1024);
+    vector<char> back(size * 2 + 1024);
+    unsigned long long in = 0;
+    unsigned long long compressed = 0;
+    unsigned long long compressTime = 0;
+    unsigned long long decompressTime = 0;
+    bool ok = true;
+
+    if (useDictionary) {
+        for (unsigned int i = 0; i < 32; i++) {
+            dictionary += quote(1000000 + i);
+        }
+
+        codec->setDictionary(dictionary);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        messages.push_back(message(i * 31, size));
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        string const &m = messages[i];
+        unsigned long long start = Clock::nanos();
+        unsigned int n = codec->compress(m.data(), m.size(), &out[0], out.size());
+        unsigned long long middle = Clock::nanos();
+
+        ok = ok && n > 0 && codec->decompress(&out[0], n, &back[0], m.size());
+
+        decompressTime += Clock::nanos() - middle;
+        compressTime += middle - start;
+        in += m.size();
+        compressed += n;
+    }
+
+    cout << Codec::getName(id) << ","
+         << (useDictionary ? "yes" : "no") << ","
+         << size << ","
+         << fixed << setprecision(2) << (double)in / compressed << ","
+         << setprecision(0) << (double)compressTime / count << ","
+         << (double)decompressTime / count << ","
+         << setprecision(1) << in * 1000.0 / compressTime
+         << (ok ? "" : ",failed") << endl;
+
+    delete codec;
+}
+
+int main(int argc, const char* argv[]) {
+    unsigned int count = 2000;
+
+    if (argc == 3 && string(argv[1]) == "--messages") {
+        count = strtoul(argv[2], NULL, 10);
+    } else if (argc != 1) {
+        cerr << "Usage: " << argv[0] << " [--messages N]" << endl;
+        return -1;
+    }
+
+    static const unsigned int SIZES[] = { 100, 1000, 16000 };
+
+    cout << "codec,dictionary,size,ratio,compress_ns,decompress_ns,compress_mb_s" << endl;
+
+    for (unsigned char id = Codec::ZLIB; id < Codec::CODEC_COUNT; id++) {
+        if (!Codec::isAvailable(id)) {
+            continue;
+        }
+
+        for (unsigned int i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++) {
+            run(id, false, SIZES[i], count);
+            run(id, true, SIZES[i], count);
+        }
+    }
+
+    return 0;
+}
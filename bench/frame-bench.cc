@@ -0,0 +1,246 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <new>
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <frame.h>
+#include <frameparser.h>
+#include <clock.h>
+
+/**
+ *  Frame micro-benchmark
+ *
+ *  Measures the cost of encoding frames (the Frame constructor), of
+ *  rewriting the channel of an encoded frame (Frame::setChannel()), of
+ *  parsing a stream of frames with FrameParser and of decoding a frame
+ *  and copying out its payload the way Connection::receiveHandler()
+ *  does. Sizes range from an empty payload to PAYLOAD_MAX_LIMIT.
+ *
+ *  Results are written as CSV, one line per benchmark and payload size:
+ *
+ *      benchmark,size,iterations,ns_per_frame,allocs_per_frame,bytes_per_frame
+ *
+ *  Usage: frame-bench [--budget MB]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static unsigned long long allocations = 0;
+static unsigned long long allocatedBytes = 0;
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+    allocations++;
+    allocatedBytes += size;
+
+    void* p = malloc(size ? size : 1);
+
+    if (!p) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc) {
+    return operator new(size);
+}
+
+// Kept out of line so the compiler does not pair free() with operator new.
+__attribute__((noinline)) void operator delete(void* p) throw() {
+    free(p);
+}
+
+void operator delete[](void* p) throw() {
+    operator delete(p);
+}
+
+static const unsigned int PARSE_CHUNK_SIZE = 4093;
+
+static volatile unsigned int sink;
+
+struct Result {
+    unsigned long long iterations;
+    unsigned long long nanos;
+    unsigned long long allocations;
+    unsigned long long bytes;
+};
+
+/**
+ *  Decodes a frame and copies out its payload the same way
+ *  Connection::receiveHandler() does.
+ */
+static inline void decode(FrameParser& parser, const char* data, unsigned int size) {
+    FrameView frame;
+
+    parser.feed(data, size);
+
+    while (parser.next(frame)) {
+        char* payload = new char[frame.size];
+        memcpy(payload, frame.payload, frame.size);
+
+        sink += frame.ch + frame.ctype + frame.op + frame.flag;
+
+        if (frame.size > 0) {
+            sink += payload[0];
+        }
+
+        delete[] payload;
+    }
+}
+
+static Result benchEncode(const char* payload, unsigned int size,
+                          unsigned long long iterations) {
+    Result result;
+    unsigned long long allocs = allocations;
+    unsigned long long bytes = allocatedBytes;
+    unsigned long long start = Clock::nanos();
+
+    for (unsigned long long i = 0; i < iterations; i++) {
+        Frame* frame = new Frame(i, 0, Frame::DATA, 0, payload, 0, size);
+        sink += frame->getData()[0];
+        delete frame;
+    }
+
+    result.nanos = Clock::nanos() - start;
+    result.iterations = iterations;
+    result.allocations = allocations - allocs;
+    result.bytes = allocatedBytes - bytes;
+    return result;
+}
+
+static Result benchSetChannel(const char* payload, unsigned int size,
+                              unsigned long long iterations) {
+    Result result;
+    Frame frame(0, 0, Frame::DATA, 0, payload, 0, size);
+    unsigned long long allocs = allocations;
+    unsigned long long bytes = allocatedBytes;
+    unsigned long long start = Clock::nanos();
+
+    for (unsigned long long i = 0; i < iterations; i++) {
+        frame.setChannel(i);
+        sink += frame.getData()[3];
+    }
+
+    result.nanos = Clock::nanos() - start;
+    result.iterations = iterations;
+    result.allocations = allocations - allocs;
+    result.bytes = allocatedBytes - bytes;
+    return result;
+}
+
+static Result benchDecode(const char* payload, unsigned int size,
+                          unsigned long long iterations) {
+    Result result;
+    Frame frame(1, 0, Frame::DATA, 0, payload, 0, size);
+    vector<char> data(frame.getData(), frame.getData() + frame.getSize());
+    FrameParser parser;
+    unsigned long long allocs = allocations;
+    unsigned long long bytes = allocatedBytes;
+    unsigned long long start = Clock::nanos();
+
+    for (unsigned long long i = 0; i < iterations; i++) {
+        decode(parser, &data[0], data.size());
+    }
+
+    result.nanos = Clock::nanos() - start;
+    result.iterations = iterations;
+    result.allocations = allocations - allocs;
+    result.bytes = allocatedBytes - bytes;
+    return result;
+}
+
+static Result benchParse(const char* payload, unsigned int size,
+                         unsigned long long iterations) {
+    Result result;
+    Frame frame(1, 0, Frame::DATA, 0, payload, 0, size);
+    vector<char> data;
+    FrameParser parser;
+    FrameView view;
+
+    // A stream of back to back frames, fed in chunks that split frames
+    // at arbitrary offsets.
+    while (data.size() < (1 << 20)) {
+        data.insert(data.end(), frame.getData(), frame.getData() + frame.getSize());
+    }
+
+    unsigned long long frames = 0;
+    unsigned long long allocs = allocations;
+    unsigned long long bytes = allocatedBytes;
+    unsigned long long start = Clock::nanos();
+
+    while (frames < iterations) {
+        for (unsigned int offset = 0; offset < data.size(); offset += PARSE_CHUNK_SIZE) {
+            unsigned int n = data.size() - offset;
+
+            parser.feed(&data[offset], n < PARSE_CHUNK_SIZE ? n : PARSE_CHUNK_SIZE);
+
+            while (parser.next(view)) {
+                sink += view.ch;
+
+                if (view.size > 0) {
+                    sink += view.payload[0];
+                }
+
+                frames++;
+            }
+        }
+    }
+
+    result.nanos = Clock::nanos() - start;
+    result.iterations = frames;
+    result.allocations = allocations - allocs;
+    result.bytes = allocatedBytes - bytes;
+    return result;
+}
+
+static void report(const char* name, unsigned int size, Result const &result) {
+    double n = (double)result.iterations;
+
+    cout << name << ","
+         << size << ","
+         << result.iterations << ","
+         << fixed << setprecision(1) << result.nanos / n << ","
+         << setprecision(2) << result.allocations / n << ","
+         << setprecision(1) << result.bytes / n << endl;
+}
+
+int main(int argc, const char* argv[]) {
+    unsigned long long budget = 256;
+
+    if (argc == 3 && string(argv[1]) == "--budget") {
+        budget = strtoull(argv[2], NULL, 10);
+    } else if (argc != 1) {
+        cerr << "Usage: " << argv[0] << " [--budget MB]" << endl;
+        return -1;
+    }
+
+    static const unsigned int SIZES[] = {
+        0, 16, 64, 256, 1024, 4096, 16384, Frame::PAYLOAD_MAX_LIMIT
+    };
+
+    vector<char> payload(Frame::PAYLOAD_MAX_LIMIT, 'x');
+
+    cout << "benchmark,size,iterations,ns_per_frame,allocs_per_frame,bytes_per_frame" << endl;
+
+    for (unsigned int i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++) {
+        unsigned int size = SIZES[i];
+        unsigned long long iterations = (budget << 20) / (size + 64);
+
+        if (iterations > 2000000) {
+            iterations = 2000000;
+        }
+
+        report("encode", size, benchEncode(&payload[0], size, iterations));
+        report("set_channel", size, benchSetChannel(&payload[0], size, iterations));
+        report("parse", size, benchParse(&payload[0], size, iterations));
+        report("decode", size, benchDecode(&payload[0], size, iterations));
+    }
+
+    return 0;
+}
@@ -0,0 +1,506 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/**
+ *  Loopback winksock server
+ *
+ *  A minimal, single threaded stand-in for a hydna server. It answers the
+ *  HTTP upgrade, resolves paths to stable channel ids, allows every open
+ *  request and broadcasts DATA and SIGNAL frames to every reader of the
+ *  channel (including the sender). KEEPALIVE frames are echoed back.
+ *
+ *  Usage: loopback-server [--port N] [--drop-after N] [--tls CERT KEY]
+ *                         [--unanswered PREFIX] [--drop-signal PAYLOAD]
+ *
+ *      --port N        The port to listen on (default 7010).
+ *      --drop-after N  Close each connection after N received frames. Used
+ *                      to exercise the client reconnect logic.
+ *      --tls CERT KEY  Accept TLS connections, with a certificate and key in
+ *                      PEM files. Used as a stand-in for "https" servers.
+ *      --unanswered PREFIX Never respond to open requests for paths that
+ *                      start with PREFIX, e.g. "/slow". Used to exercise
+ *                      the client open timeout.
+ *      --drop-signal PAYLOAD Close a connection when it emits a signal with
+ *                      PAYLOAD. Used to tear down connections with many
+ *                      open channels on demand.
+ */
+
+using namespace std;
+
+static const int HEADER_SIZE = 5;
+static const int LENGTH_OFFSET = 2;
+
+static const int OP_KEEPALIVE = 0x00;
+static const int OP_OPEN = 0x01;
+static const int OP_DATA = 0x02;
+static const int OP_SIGNAL = 0x03;
+static const int OP_RESOLVE = 0x04;
+
+static const int SIG_EMIT = 0x00;
+static const int SIG_END = 0x01;
+
+struct Client {
+    int fd;
+#ifdef WITH_TLS
+    SSL* ssl;
+#endif
+    bool upgraded;
+    bool dropping;
+    unsigned long received;
+    string in;
+    string out;
+    map<unsigned int, unsigned int> modes;
+};
+
+typedef map<int, Client*> ClientMap;
+typedef set<Client*> Subscribers;
+typedef map<unsigned int, Subscribers> SubscriberMap;
+
+static ClientMap clients;
+static SubscriberMap subscribers;
+static int epfd = -1;
+static unsigned long dropAfter = 0;
+static string unansweredPrefix;
+static string dropSignal;
+static set<unsigned int> unanswered;
+
+#ifdef WITH_TLS
+static SSL_CTX* tlsContext = NULL;
+
+static SSL_CTX* createTlsContext(const char* cert, const char* key) {
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+
+    if (!context ||
+        SSL_CTX_use_certificate_chain_file(context, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+
+    return context;
+}
+#endif
+
+/**
+ *  Reads from a client, through TLS if enabled. Returns -1 with errno
+ *  set to EAGAIN if there is nothing to read.
+ */
+static ssize_t clientRead(Client* client, char* buffer, size_t size) {
+#ifdef WITH_TLS
+    if (client->ssl) {
+        int n = SSL_read(client->ssl, buffer, size);
+
+        if (n <= 0) {
+            int error = SSL_get_error(client->ssl, n);
+
+            if (error == SSL_ERROR_ZERO_RETURN) {
+                return 0;
+            }
+
+            errno = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+            return -1;
+        }
+
+        return n;
+    }
+#endif
+
+    return read(client->fd, buffer, size);
+}
+
+static ssize_t clientWrite(Client* client, const char* data, size_t size) {
+#ifdef WITH_TLS
+    if (client->ssl) {
+        int n = SSL_write(client->ssl, data, size);
+        return n > 0 ? n : -1;
+    }
+#endif
+
+    return write(client->fd, data, size);
+}
+
+static unsigned int resolvePath(string const &path) {
+    // FNV-1a, never zero since channel 0 is reserved for resolves.
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < path.size(); i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+static void watch(Client* client) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (!client->out.empty()) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = client->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+static void flush(Client* client) {
+    size_t offset = 0;
+
+    // TLS writes one record at a time, so erase once rather than after
+    // every write.
+    while (offset < client->out.size()) {
+        ssize_t n = clientWrite(client, client->out.data() + offset,
+                                client->out.size() - offset);
+
+        if (n <= 0) {
+            break;
+        }
+
+        offset += n;
+    }
+
+    client->out.erase(0, offset);
+    watch(client);
+}
+
+static void queueFrame(Client* client, unsigned int ch, int ctype, int op,
+                       int flag, const char* payload, size_t size) {
+    char header[HEADER_SIZE + LENGTH_OFFSET];
+    unsigned short length = htons(size + HEADER_SIZE);
+    unsigned int nch = htonl(ch);
+
+    memcpy(header, &length, 2);
+    memcpy(header + 2, &nch, 4);
+    header[6] = (char)((ctype << 6) | (op << 3) | (flag & 7));
+
+    bool wasEmpty = client->out.empty();
+
+    client->out.append(header, sizeof(header));
+    client->out.append(payload, size);
+
+    if (wasEmpty) {
+        watch(client);
+    }
+}
+
+static void unsubscribe(Client* client) {
+    map<unsigned int, unsigned int>::iterator it;
+
+    for (it = client->modes.begin(); it != client->modes.end(); ++it) {
+        subscribers[it->first].erase(client);
+    }
+}
+
+static void disconnect(Client* client) {
+    unsubscribe(client);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+#ifdef WITH_TLS
+    if (client->ssl) {
+        SSL_free(client->ssl);
+    }
+#endif
+    close(client->fd);
+    clients.erase(client->fd);
+    delete client;
+}
+
+static void broadcast(unsigned int ch, int ctype, int op, int flag,
+                      const char* payload, size_t size) {
+    Subscribers& subs = subscribers[ch];
+    Subscribers::iterator it;
+
+    for (it = subs.begin(); it != subs.end(); ++it) {
+        queueFrame(*it, ch, ctype, op, flag, payload, size);
+    }
+}
+
+static void handleFrame(Client* client, unsigned int ch, int ctype, int op,
+                        int flag, const char* payload, size_t size) {
+    switch (op) {
+        case OP_KEEPALIVE:
+            queueFrame(client, ch, ctype, OP_KEEPALIVE, flag, payload, size);
+            break;
+
+        case OP_RESOLVE: {
+            string path(payload, size);
+            unsigned int id = resolvePath(path);
+
+            if (!unansweredPrefix.empty() && path.compare(0, unansweredPrefix.size(), unansweredPrefix) == 0) {
+                unanswered.insert(id);
+            }
+
+            queueFrame(client, id, ctype, OP_RESOLVE, 0, payload, size);
+            break;
+        }
+
+        case OP_OPEN:
+            if (unanswered.count(ch) > 0) {
+                break;
+            }
+
+            client->modes[ch] = flag;
+            if (flag & 0x01) {
+                subscribers[ch].insert(client);
+            }
+            queueFrame(client, ch, 0, OP_OPEN, 0, NULL, 0);
+            break;
+
+        case OP_DATA:
+            broadcast(ch, ctype, OP_DATA, flag, payload, size);
+            break;
+
+        case OP_SIGNAL:
+            if (flag == SIG_EMIT && !dropSignal.empty() &&
+                dropSignal.compare(0, string::npos, payload, size) == 0) {
+                client->dropping = true;
+            } else if (flag == SIG_EMIT) {
+                broadcast(ch, ctype, OP_SIGNAL, SIG_EMIT, payload, size);
+            } else if (flag == SIG_END) {
+                subscribers[ch].erase(client);
+                client->modes.erase(ch);
+                queueFrame(client, ch, 0, OP_SIGNAL, SIG_END, NULL, 0);
+            }
+            break;
+    }
+}
+
+static bool handleUpgrade(Client* client) {
+    size_t end = client->in.find("\r\n\r\n");
+
+    if (end == string::npos) {
+        return true;
+    }
+
+    client->in.erase(0, end + 4);
+    client->upgraded = true;
+    client->out += "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Connection: upgrade\r\n"
+                   "Upgrade: winksock/1\r\n"
+                   "\r\n";
+    watch(client);
+    return true;
+}
+
+static bool handleInput(Client* client) {
+    if (!client->upgraded && !handleUpgrade(client)) {
+        return false;
+    }
+
+    size_t offset = 0;
+
+    while (client->upgraded &&
+           client->in.size() - offset >= (size_t)(HEADER_SIZE + LENGTH_OFFSET)) {
+        const char* data = client->in.data() + offset;
+        unsigned short length;
+        unsigned int ch;
+
+        memcpy(&length, data, 2);
+        memcpy(&ch, data + 2, 4);
+        length = ntohs(length);
+        ch = ntohl(ch);
+
+        if (length < HEADER_SIZE) {
+            return false;
+        }
+
+        if (client->in.size() - offset < (size_t)(length + LENGTH_OFFSET)) {
+            break;
+        }
+
+        unsigned char desc = data[6];
+
+        handleFrame(client, ch, desc >> 6, (desc >> 3) & 7, desc & 7,
+                    data + HEADER_SIZE + LENGTH_OFFSET, length - HEADER_SIZE);
+
+        offset += length + LENGTH_OFFSET;
+
+        if (client->dropping) {
+            return false;
+        }
+
+        if (dropAfter && ++client->received >= dropAfter) {
+            return false;
+        }
+    }
+
+    client->in.erase(0, offset);
+    return true;
+}
+
+static int createListener(unsigned short port) {
+    int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int flag = 1;
+    struct sockaddr_in addr;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        ::listen(fd, 1024) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, const char* argv[]) {
+    unsigned short port = 7010;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--drop-after" && i + 1 < argc) {
+            dropAfter = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--unanswered" && i + 1 < argc) {
+            unansweredPrefix = argv[++i];
+        } else if (arg == "--drop-signal" && i + 1 < argc) {
+            dropSignal = argv[++i];
+#ifdef WITH_TLS
+        } else if (arg == "--tls" && i + 2 < argc) {
+            if ((tlsContext = createTlsContext(argv[i + 1], argv[i + 2])) == NULL) {
+                return -1;
+            }
+            i += 2;
+#endif
+        } else {
+            cerr << "Usage: " << argv[0] << " [--port N] [--drop-after N] [--tls CERT KEY]"
+                 << " [--unanswered PREFIX] [--drop-signal PAYLOAD]" << endl;
+            return -1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = createListener(port);
+
+    if (lfd == -1) {
+        cerr << "Could not listen on port " << port << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    epfd = epoll_create(1024);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = lfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    cout << "Listening on 127.0.0.1:" << port << endl;
+
+    struct epoll_event events[256];
+    char buffer[65536];
+
+    for (;;) {
+        int count = epoll_wait(epfd, events, 256, -1);
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == lfd) {
+                int cfd = accept(lfd, NULL, NULL);
+
+                if (cfd == -1) {
+                    continue;
+                }
+
+                int flag = 1;
+                setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+                fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+                Client* client = new Client();
+                client->fd = cfd;
+#ifdef WITH_TLS
+                client->ssl = NULL;
+
+                if (tlsContext) {
+                    client->ssl = SSL_new(tlsContext);
+                    SSL_set_fd(client->ssl, cfd);
+                    SSL_set_accept_state(client->ssl);
+                }
+#endif
+                client->upgraded = false;
+                client->received = 0;
+                client->dropping = false;
+                clients[cfd] = client;
+
+                ev.events = EPOLLIN;
+                ev.data.fd = cfd;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+                continue;
+            }
+
+            if (clients.count(fd) == 0) {
+                continue;
+            }
+
+            Client* client = clients[fd];
+
+            if (events[i].events & EPOLLOUT) {
+                flush(client);
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t n;
+
+                // TLS buffers decrypted records, so read until there is
+                // nothing left rather than once per event.
+                do {
+                    n = clientRead(client, buffer, sizeof(buffer));
+
+                    if (n > 0) {
+                        client->in.append(buffer, n);
+                    }
+                } while (n > 0);
+
+                if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                    disconnect(client);
+                    continue;
+                }
+
+                if (!handleInput(client)) {
+                    flush(client);
+                    disconnect(client);
+                    continue;
+                }
+
+                flush(client);
+            }
+        }
+    }
+
+    return 0;
+}
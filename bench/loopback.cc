@@ -0,0 +1,207 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <channel.h>
+#include <channelmode.h>
+#include <channeldata.h>
+#include <channellistener.h>
+#include <clock.h>
+#include <histogram.h>
+
+/**
+ *  Local loopback benchmark
+ *
+ *  Measures the latency from writing a message on a channel until it is
+ *  delivered to the same channel, as seen by a listener, first with the
+ *  copy that the server sends back and then with the local loopback. A second connection
+ *  reads the channel as a remote peer, to check that it still gets every
+ *  message and that the local channel gets no duplicates.
+ *
+ *  Intended to be run against bench/loopback-server, see
+ *  `make run-loopback`.
+ *
+ *  Usage: loopback [--host HOST:PORT] [--peer HOST:PORT] [--messages N]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const unsigned long long STALL_TIMEOUT = 10000000;
+
+struct Options {
+    string host;
+    string peer;
+    unsigned int messages;
+};
+
+/**
+ *  Records when data is delivered, on the I/O thread or, with the
+ *  loopback, on the writing thread.
+ */
+class DeliveryTimer : public ChannelListener {
+public:
+    DeliveryTimer() : m_delivered(0) {}
+
+    void onData(Channel&) {
+        m_delivered = Clock::nanos();
+    }
+
+    unsigned long long getDelivered() const {
+        return m_delivered;
+    }
+
+    void reset() {
+        m_delivered = 0;
+    }
+
+private:
+    volatile unsigned long long m_delivered;
+};
+
+static unsigned int drain(Channel& channel, unsigned int expected) {
+    unsigned long long start = Clock::now();
+    unsigned long long last = start;
+    unsigned int received = 0;
+    ChannelData* data;
+
+    // Waits a while past the expected count, to catch duplicates.
+    for (;;) {
+        while ((data = channel.popData()) != NULL) {
+            received++;
+            last = Clock::now();
+            delete data;
+        }
+
+        unsigned long long now = Clock::now();
+
+        if ((received >= expected && now - last > 200000) || now - start > STALL_TIMEOUT) {
+            return received;
+        }
+
+        usleep(1000);
+    }
+}
+
+static bool runCase(Options const &options, bool loopback, unsigned int id) {
+    Channel channel;
+    Channel peer;
+    DeliveryTimer timer;
+    Histogram latency;
+    char payload[16];
+    stringstream path;
+
+    path << "/loopback-" << getpid() << "-" << id;
+
+    // The peer uses another host name, which gives it a connection of
+    // its own.
+    peer.connect(options.peer + path.str(), ChannelMode::READ);
+    peer.waitForOpen();
+
+    channel.setLocalLoopback(loopback);
+    channel.setListener(&timer);
+    channel.connect(options.host + path.str(), ChannelMode::READWRITE);
+    channel.waitForOpen();
+
+    memset(payload, 0, sizeof(payload));
+
+    for (unsigned int i = 0; i < options.messages; i++) {
+        timer.reset();
+
+        unsigned long long sent = Clock::nanos();
+        ChannelData* data;
+
+        channel.writeBytes(payload, 0, sizeof(payload));
+
+        while ((data = channel.popData()) == NULL) {
+            if (Clock::nanos() - sent > STALL_TIMEOUT * 1000) {
+                cerr << "Stalled waiting for message " << i << endl;
+                return false;
+            }
+        }
+
+        // The listener is called after the data is queued.
+        while (!timer.getDelivered()) {
+        }
+
+        latency.record(timer.getDelivered() - sent);
+        delete data;
+    }
+
+    unsigned int extra = drain(channel, 0);
+    unsigned int remote = drain(peer, options.messages);
+    bool ok = extra == 0 && remote == options.messages;
+
+    cout << setw(10) << (loopback ? "loopback" : "server")
+         << setw(10) << fixed << setprecision(2)
+         << latency.getPercentile(50) / 1000.0
+         << setw(10) << latency.getPercentile(99) / 1000.0
+         << setw(10) << latency.getPercentile(99.9) / 1000.0
+         << setw(10) << remote
+         << setw(8) << channel.getStats().echoesDropped
+         << (ok ? "" : "  duplicates or lost messages") << endl;
+
+    channel.close();
+    peer.close();
+
+    while (channel.isConnected() || channel.isClosing() || peer.isConnected() || peer.isClosing()) {
+        usleep(1000);
+    }
+
+    return ok;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.host = "127.0.0.1:7010";
+    options.peer = "localhost:7010";
+    options.messages = 20000;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--peer") {
+            options.peer = value;
+        } else if (arg == "--messages") {
+            options.messages = strtoul(value.c_str(), NULL, 10);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    // Remote is what the peer received, echoes the copies from the server
+    // that were dropped.
+    cout << setw(10) << "mode"
+         << setw(10) << "p50 us"
+         << setw(10) << "p99 us"
+         << setw(10) << "p999 us"
+         << setw(10) << "remote"
+         << setw(8) << "echoes" << endl;
+
+    bool ok = true;
+
+    try {
+        ok = runCase(options, false, 0) && ok;
+        ok = runCase(options, true, 1) && ok;
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
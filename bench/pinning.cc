@@ -0,0 +1,172 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <channel.h>
+#include <channelmode.h>
+#include <channeldata.h>
+#include <clock.h>
+#include <histogram.h>
+#include <iothread.h>
+
+/**
+ *  I/O thread placement benchmark
+ *
+ *  Measures the round-trip latency of one message at a time on a single
+ *  channel, first with the I/O thread and the consumer left to the
+ *  scheduler and then with both pinned to the same CPUs, optionally with
+ *  buffers on a given NUMA node and a real-time priority for the I/O
+ *  thread. On a multi-socket machine, choose CPUs of one socket.
+ *
+ *  Intended to be run against bench/loopback-server, see
+ *  `make run-pinning`.
+ *
+ *  Usage: pinning [--host HOST:PORT] [--messages N] [--cpus LIST]
+ *                 [--node N] [--priority N]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const unsigned long long STALL_TIMEOUT = 10000000;
+static const unsigned int WARMUP = 1000;
+
+struct Options {
+    string host;
+    unsigned int messages;
+    string cpus;
+    int node;
+    int priority;
+};
+
+static bool runCase(Options const &options, bool pinned, unsigned int id) {
+    Channel channel;
+    Histogram latency;
+    char payload[16];
+    stringstream path;
+
+    if (pinned) {
+        channel.setIoThreadCpus(options.cpus);
+        channel.setIoThreadNumaNode(options.node);
+        channel.setIoThreadPriority(options.priority);
+        IoThread::configure(IoThread::parseCpuList(options.cpus), options.node, 0);
+    } else {
+        channel.setIoThreadCpus("");
+        channel.setIoThreadNumaNode(-1);
+        channel.setIoThreadPriority(0);
+    }
+
+    path << options.host << "/pinning-" << getpid() << "-" << id;
+    channel.connect(path.str(), ChannelMode::READWRITE);
+    channel.waitForOpen();
+
+    memset(payload, 0, sizeof(payload));
+
+    unsigned long long start = 0;
+
+    for (unsigned int i = 0; i < WARMUP + options.messages; i++) {
+        if (i == WARMUP) {
+            start = Clock::now();
+        }
+
+        unsigned long long sent = Clock::nanos();
+        ChannelData* data;
+
+        channel.writeBytes(payload, 0, sizeof(payload));
+
+        while ((data = channel.popData()) == NULL) {
+            if (Clock::nanos() - sent > STALL_TIMEOUT * 1000) {
+                cerr << "Stalled waiting for message " << i << endl;
+                return false;
+            }
+        }
+
+        if (i >= WARMUP) {
+            latency.record(Clock::nanos() - sent);
+        }
+
+        delete data;
+    }
+
+    double seconds = (Clock::now() - start) / 1000000.0;
+    ConnectionStats stats = channel.getConnectionStats();
+
+    cout << setw(10) << (pinned ? "pinned" : "unpinned")
+         << setw(6) << stats.ioThreadCpu
+         << setw(8) << stats.ioThreadConfig
+         << setw(12) << (unsigned long long)(options.messages / seconds)
+         << setw(10) << fixed << setprecision(2)
+         << latency.getPercentile(50) / 1000.0
+         << setw(10) << latency.getPercentile(99) / 1000.0
+         << setw(10) << latency.getPercentile(99.9) / 1000.0 << endl;
+
+    channel.close();
+
+    while (channel.isConnected() || channel.isClosing()) {
+        usleep(1000);
+    }
+
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.host = "127.0.0.1:7010";
+    options.messages = 50000;
+    options.cpus = "0";
+    options.node = -1;
+    options.priority = 0;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--messages") {
+            options.messages = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--cpus") {
+            options.cpus = value;
+        } else if (arg == "--node") {
+            options.node = atoi(value.c_str());
+        } else if (arg == "--priority") {
+            options.priority = atoi(value.c_str());
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    // The config column is the applied settings, see IoThread.
+    cout << setw(10) << "mode"
+         << setw(6) << "cpu"
+         << setw(8) << "config"
+         << setw(12) << "msgs/s"
+         << setw(10) << "p50 us"
+         << setw(10) << "p99 us"
+         << setw(10) << "p999 us" << endl;
+
+    bool ok = true;
+
+    try {
+        ok = runCase(options, false, 0) && ok;
+        ok = runCase(options, true, 1) && ok;
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
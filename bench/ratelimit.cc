@@ -0,0 +1,178 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <clock.h>
+#include <ratelimiter.h>
+
+/**
+ *  Rate limiter benchmark
+ *
+ *  Measures what the token buckets cost a writer, without a server: the
+ *  clocks they could be refilled from, a write with no limit, a write
+ *  within the limit and a writer paced by the limit, which sleeps as a
+ *  channel with RateLimiter::BLOCK does. The paced run shows how close
+ *  to the limit the writer gets.
+ *
+ *  Results are written as CSV, one line per benchmark:
+ *
+ *      benchmark,messages,ns_per_message,messages_per_second,limit
+ *
+ *  Usage: ratelimit [--messages N] [--rate N] [--size N] [--time MS]
+ */
+
+using namespace hydna;
+using namespace std;
+
+struct Options {
+    unsigned int messages;
+    unsigned long long rate;
+    unsigned int size;
+    unsigned int time;
+};
+
+static void printResult(string const &name,
+                        unsigned long long messages,
+                        unsigned long long nanos,
+                        unsigned long long limit) {
+    double perMessage = messages ? (double)nanos / messages : 0;
+
+    cout << name << ","
+         << messages << ","
+         << fixed << setprecision(1) << perMessage << ","
+         << (unsigned long long)(nanos ? messages * 1e9 / nanos : 0) << ","
+         << limit << endl;
+}
+
+static void runClocks(Options const &options) {
+    volatile unsigned long long sink = 0;
+    unsigned long long start;
+
+    start = Clock::nanos();
+    for (unsigned int i = 0; i < options.messages; i++) {
+        sink += Clock::now();
+    }
+    printResult("clock_now", options.messages, Clock::nanos() - start, 0);
+
+    start = Clock::nanos();
+    for (unsigned int i = 0; i < options.messages; i++) {
+        sink += Clock::coarse();
+    }
+    printResult("clock_coarse", options.messages, Clock::nanos() - start, 0);
+}
+
+static bool runTake(string const &name, Options const &options, unsigned long long rate) {
+    RateLimiter limiter;
+    unsigned long long waits = 0;
+
+    if (rate) {
+        limiter.setLimit(rate, 0);
+    }
+
+    unsigned long long start = Clock::nanos();
+
+    for (unsigned int i = 0; i < options.messages; i++) {
+        if (limiter.take(options.size) > 0) {
+            waits++;
+        }
+    }
+
+    printResult(name, options.messages, Clock::nanos() - start, rate);
+
+    if (waits > 0) {
+        cerr << name << " waited " << waits << " times" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool runPaced(Options const &options) {
+    RateLimiter limiter;
+    unsigned long long messages = 0;
+    unsigned long long wait;
+
+    limiter.setLimit(options.rate, 0);
+
+    // The burst is spent up front, so that only the paced rate is
+    // measured.
+    while (limiter.take(options.size) == 0) {
+    }
+
+    unsigned long long start = Clock::nanos();
+    unsigned long long end = start + options.time * 1000000ULL;
+    unsigned long long now;
+
+    while ((now = Clock::nanos()) < end) {
+        if ((wait = limiter.take(options.size)) > 0) {
+            usleep(wait);
+        } else {
+            messages++;
+        }
+    }
+
+    printResult("paced", messages, now - start, options.rate);
+
+    // Within a few percent of the limit.
+    double achieved = messages * 1e9 / (now - start);
+
+    if (achieved > options.rate * 1.05 || achieved < options.rate * 0.9) {
+        cerr << "Paced at " << (unsigned long long)achieved << " messages per second, the limit is " << options.rate << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.messages = 10000000;
+    options.rate = 100000;
+    options.size = 64;
+    options.time = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--messages") {
+            options.messages = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--rate") {
+            options.rate = strtoull(value.c_str(), NULL, 10);
+        } else if (arg == "--size") {
+            options.size = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--time") {
+            options.time = strtoul(value.c_str(), NULL, 10);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    if (options.rate == 0 || options.time == 0) {
+        cerr << "The rate and time must be at least 1" << endl;
+        return -1;
+    }
+
+    bool ok = true;
+
+    cout << "benchmark,messages,ns_per_message,messages_per_second,limit" << endl;
+
+    runClocks(options);
+    ok = runTake("unlimited", options, 0) && ok;
+
+    // High enough that the bucket never runs dry.
+    ok = runTake("within", options, 1000000000000ULL) && ok;
+    ok = runPaced(options) && ok;
+
+    return ok ? 0 : -1;
+}
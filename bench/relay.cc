@@ -0,0 +1,331 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <channel.h>
+#include <channelmode.h>
+#include <channeldata.h>
+#include <clock.h>
+#include <relay.h>
+
+/**
+ *  Shared-memory relay benchmark
+ *
+ *  Runs a number of worker processes that all read and write the same
+ *  channel. Each worker writes its messages and reads everything that is
+ *  written, first with a connection of its own and then through a relay
+ *  that keeps one connection in the parent process. With a connection
+ *  per worker, the server sends every message once per worker.
+ *
+ *  Intended to be run against bench/loopback-server, see `make run-relay`.
+ *
+ *  Usage: relay [--host HOST:PORT] [--workers N] [--messages N] [--size N]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const unsigned long long STALL_TIMEOUT = 30000000;
+
+struct Options {
+    string host;
+    unsigned int workers;
+    unsigned int messages;
+    unsigned int size;
+};
+
+struct Result {
+    unsigned long long elapsed;
+    unsigned long long received;
+};
+
+/**
+ *  Pipes that the parent and the workers use to start together.
+ */
+struct Barrier {
+    int up[2];
+    int ready[2];
+    int go[2];
+    int results[2];
+};
+
+static void readBytes(int fd, void* data, size_t size) {
+    char* at = (char*)data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, at, size);
+
+        if (n <= 0) {
+            exit(-1);
+        }
+
+        at += n;
+        size -= n;
+    }
+}
+
+static void writeByte(int fd) {
+    char c = 0;
+
+    if (write(fd, &c, 1) != 1) {
+        exit(-1);
+    }
+}
+
+static void waitForAll(int fd, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        char c;
+        readBytes(fd, &c, 1);
+    }
+}
+
+static void releaseAll(int fd, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        writeByte(fd);
+    }
+}
+
+static void sendResult(Barrier& barrier, unsigned long long start, unsigned long long received) {
+    Result result;
+
+    result.elapsed = Clock::now() - start;
+    result.received = received;
+
+    if (write(barrier.results[1], &result, sizeof(result)) != sizeof(result)) {
+        _exit(-1);
+    }
+}
+
+static void runDirectWorker(Options const &options, Barrier& barrier, string const &path) {
+    vector<char> payload(options.size, 'x');
+    unsigned long long expected = (unsigned long long)options.workers * options.messages;
+    unsigned long long received = 0;
+    Channel channel;
+    ChannelData* data;
+
+    channel.connect(options.host + path, ChannelMode::READWRITE);
+    channel.waitForOpen();
+
+    writeByte(barrier.ready[1]);
+    waitForAll(barrier.go[0], 1);
+
+    unsigned long long start = Clock::now();
+
+    for (unsigned int i = 0; i < options.messages || received < expected; i++) {
+        if (i < options.messages) {
+            channel.writeBytes(&payload[0], 0, payload.size());
+        } else {
+            usleep(100);
+        }
+
+        while ((data = channel.popData()) != NULL) {
+            received++;
+            delete data;
+        }
+
+        if (Clock::now() - start > STALL_TIMEOUT) {
+            break;
+        }
+    }
+
+    sendResult(barrier, start, received);
+}
+
+static void runRelayWorker(Options const &options, Barrier& barrier, string const &name, string const &path) {
+    vector<char> payload(options.size, 'x');
+    unsigned long long expected = (unsigned long long)options.workers * options.messages;
+    unsigned long long received = 0;
+    RelayMessage message;
+
+    // The relay is up once the parent releases the workers.
+    waitForAll(barrier.up[0], 1);
+
+    RelayClient client(name);
+    unsigned int ch = client.find(path);
+
+    writeByte(barrier.ready[1]);
+    waitForAll(barrier.go[0], 1);
+
+    unsigned long long start = Clock::now();
+
+    for (unsigned int i = 0; i < options.messages || received < expected; i++) {
+        bool more = i < options.messages;
+
+        if (more) {
+            client.write(ch, &payload[0], payload.size());
+        }
+
+        while (received < expected && client.next(message, more ? 0 : 100)) {
+            if (message.getType() == RelayMessage::DATA) {
+                received++;
+            }
+        }
+
+        if (Clock::now() - start > STALL_TIMEOUT) {
+            break;
+        }
+    }
+
+    sendResult(barrier, start, received);
+}
+
+static bool runCase(Options const &options, bool relayed, unsigned int id) {
+    stringstream name;
+    stringstream path;
+    Barrier barrier;
+    vector<pid_t> workers;
+
+    name << "bench-" << getpid();
+    path << "/relay-" << getpid() << "-" << id;
+
+    if (pipe(barrier.up) != 0 || pipe(barrier.ready) != 0 || pipe(barrier.go) != 0 || pipe(barrier.results) != 0) {
+        cerr << "Could not create pipes" << endl;
+        return false;
+    }
+
+    // The workers are forked before this process starts any threads.
+    for (unsigned int i = 0; i < options.workers; i++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            try {
+                if (relayed) {
+                    runRelayWorker(options, barrier, name.str(), path.str());
+                } else {
+                    runDirectWorker(options, barrier, path.str());
+                }
+            } catch (Error& e) {
+                cerr << "Worker caught exception: " << e.what() << endl;
+                _exit(-1);
+            }
+
+            _exit(0);
+        }
+
+        workers.push_back(pid);
+    }
+
+    Channel* channel = NULL;
+    Relay* relay = NULL;
+
+    if (relayed) {
+        channel = new Channel();
+        channel->connect(options.host + path.str(), ChannelMode::READWRITE);
+        channel->waitForOpen();
+
+        relay = new Relay(name.str());
+        relay->setStallTimeout(STALL_TIMEOUT / 1000);
+        relay->add(channel);
+
+        releaseAll(barrier.up[1], options.workers);
+    }
+
+    waitForAll(barrier.ready[0], options.workers);
+    releaseAll(barrier.go[1], options.workers);
+
+    unsigned long long expected = (unsigned long long)options.workers * options.messages;
+    unsigned long long slowest = 0;
+    bool ok = true;
+
+    for (unsigned int i = 0; i < options.workers; i++) {
+        Result result;
+        readBytes(barrier.results[0], &result, sizeof(result));
+
+        if (result.elapsed > slowest) {
+            slowest = result.elapsed;
+        }
+
+        ok = ok && result.received == expected;
+    }
+
+    for (unsigned int i = 0; i < workers.size(); i++) {
+        waitpid(workers[i], NULL, 0);
+    }
+
+    unsigned long long frames = relayed ? expected : expected * options.workers;
+    double seconds = slowest / 1000000.0;
+
+    cout << setw(8) << (relayed ? "relay" : "direct")
+         << setw(9) << options.workers
+         << setw(13) << (relayed ? 1 : options.workers)
+         << setw(14) << frames
+         << setw(10) << fixed << setprecision(1) << slowest / 1000.0
+         << setw(14) << (unsigned long long)(expected * options.workers / seconds)
+         << (ok ? "" : "  lost messages") << endl;
+
+    delete relay;
+    delete channel;
+
+    close(barrier.up[0]);
+    close(barrier.up[1]);
+    close(barrier.ready[0]);
+    close(barrier.ready[1]);
+    close(barrier.go[0]);
+    close(barrier.go[1]);
+    close(barrier.results[0]);
+    close(barrier.results[1]);
+
+    return ok;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.host = "127.0.0.1:7010";
+    options.workers = 16;
+    options.messages = 2000;
+    options.size = 64;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--workers") {
+            options.workers = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--messages") {
+            options.messages = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--size") {
+            options.size = strtoul(value.c_str(), NULL, 10);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    // Frames out is what the server sends, msgs/s what the workers
+    // receive in total.
+    cout << setw(8) << "mode"
+         << setw(9) << "workers"
+         << setw(13) << "connections"
+         << setw(14) << "frames out"
+         << setw(10) << "ms"
+         << setw(14) << "msgs/s" << endl;
+
+    bool ok = true;
+
+    try {
+        // Runs first, so that the workers of both are forked before the
+        // library has started any threads in this process.
+        ok = runCase(options, false, 0) && ok;
+        ok = runCase(options, true, 1) && ok;
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
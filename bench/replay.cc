@@ -0,0 +1,254 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <channel.h>
+#include <channeldata.h>
+#include <channelsignal.h>
+#include <frame.h>
+#include <clock.h>
+#include <capture.h>
+#include <replay.h>
+
+/**
+ *  Capture replay benchmark
+ *
+ *  Measures the receive path without a server, by replaying a capture
+ *  through Connection::processDataFrame() and friends as fast as
+ *  possible, and then how long the consumer takes to pop and free what
+ *  was queued. The capture is made up front from fixed frames, so that
+ *  runs are comparable, unless one recorded with FrameCapture is given.
+ *  A short paced capture is also replayed at its original speed, to show
+ *  how far behind the original timing the replay falls.
+ *
+ *  Results are written as CSV, one line per benchmark:
+ *
+ *      benchmark,frames,runs,ns_per_frame,frames_per_second,late_us
+ *
+ *  Usage: replay [--capture FILE] [--frames N] [--size N] [--channels N] [--runs N]
+ */
+
+using namespace hydna;
+using namespace std;
+
+// Time between the frames of the paced capture, in nanoseconds.
+static const unsigned long long PACE = 20000;
+static const unsigned int PACED_FRAMES = 10000;
+
+// Every this many frames a signal is captured instead of data.
+static const unsigned int SIGNAL_INTERVAL = 64;
+
+struct Options {
+    string capture;
+    unsigned int frames;
+    unsigned int size;
+    unsigned int channels;
+    unsigned int runs;
+};
+
+static void writeCapture(string const &path, Options const &options, unsigned int frames, unsigned long long pace) {
+    vector<char> frame(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET + options.size, 'x');
+    unsigned long long next = Clock::nanos();
+
+    FrameCapture::start(path);
+
+    for (unsigned int i = 0; i < frames; i++) {
+        int op = i % SIGNAL_INTERVAL == SIGNAL_INTERVAL - 1 ? Frame::SIGNAL : Frame::DATA;
+
+        Frame::writeHeader(&frame[0], 1 + i % options.channels, 0, op, 0, options.size);
+
+        if (pace) {
+            while (Clock::nanos() < next) {
+            }
+            next += pace;
+        }
+
+        FrameCapture::record(1, &frame[0], frame.size());
+    }
+
+    FrameCapture::stop();
+}
+
+static unsigned long long drain(vector<Channel*> const &channels) {
+    unsigned long long popped = 0;
+    ChannelData* data;
+    ChannelSignal* signal;
+
+    for (unsigned int i = 0; i < channels.size(); i++) {
+        while ((data = channels[i]->popData()) != NULL) {
+            delete data;
+            popped++;
+        }
+
+        while ((signal = channels[i]->popSignal()) != NULL) {
+            delete[] signal->getContent();
+            delete signal;
+            popped++;
+        }
+    }
+
+    return popped;
+}
+
+static void printResult(string const &name,
+                        unsigned long long frames,
+                        unsigned int runs,
+                        unsigned long long nanos,
+                        long long late) {
+    double perFrame = frames ? (double)nanos / frames : 0;
+
+    cout << name << ","
+         << frames / runs << ","
+         << runs << ","
+         << fixed << setprecision(1) << perFrame << ","
+         << (unsigned long long)(perFrame > 0 ? 1e9 / perFrame : 0) << ","
+         << late / 1000.0 << endl;
+}
+
+static bool runCase(string const &path, Options const &options) {
+    vector<Channel*> channels;
+    unsigned long long dispatchTime = 0;
+    unsigned long long consumeTime = 0;
+    unsigned long long dispatched = 0;
+    unsigned long long consumed = 0;
+
+    {
+        FrameReplay replay(path);
+        vector<unsigned int> ids = replay.getChannels();
+
+        for (unsigned int i = 0; i < ids.size(); i++) {
+            channels.push_back(new Channel());
+            replay.bind(channels.back(), ids[i]);
+        }
+
+        for (unsigned int run = 0; run < options.runs; run++) {
+            unsigned long long start = Clock::nanos();
+            dispatched += replay.run();
+            dispatchTime += Clock::nanos() - start;
+
+            start = Clock::nanos();
+            consumed += drain(channels);
+            consumeTime += Clock::nanos() - start;
+        }
+    }
+
+    // The replay has closed the channels.
+    for (unsigned int i = 0; i < channels.size(); i++) {
+        delete channels[i];
+    }
+
+    printResult("dispatch", dispatched, options.runs, dispatchTime, 0);
+    printResult("consume", consumed, options.runs, consumeTime, 0);
+
+    if (dispatched == 0 || dispatched != consumed) {
+        cerr << "Dispatched " << dispatched << " frames but consumed " << consumed << endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool runPaced(string const &path, Options const &options) {
+    vector<Channel*> channels;
+    unsigned long long dispatched;
+    unsigned long long elapsed;
+    unsigned long long duration;
+
+    writeCapture(path, options, PACED_FRAMES, PACE);
+
+    {
+        FrameReplay replay(path);
+
+        for (unsigned int i = 0; i < options.channels; i++) {
+            channels.push_back(new Channel());
+            replay.bind(channels.back(), 1 + i);
+        }
+
+        unsigned long long start = Clock::nanos();
+        dispatched = replay.run(1.0);
+        elapsed = Clock::nanos() - start;
+        duration = replay.getDuration();
+
+        drain(channels);
+    }
+
+    for (unsigned int i = 0; i < channels.size(); i++) {
+        delete channels[i];
+    }
+
+    unlink(path.c_str());
+
+    // Late is how much longer the replay took than the capture.
+    printResult("paced", dispatched, 1, elapsed, (long long)(elapsed - duration));
+
+    return dispatched == PACED_FRAMES;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.frames = 200000;
+    options.size = 64;
+    options.channels = 4;
+    options.runs = 5;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--capture") {
+            options.capture = value;
+        } else if (arg == "--frames") {
+            options.frames = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--size") {
+            options.size = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--channels") {
+            options.channels = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--runs") {
+            options.runs = strtoul(value.c_str(), NULL, 10);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    if (options.channels == 0 || options.runs == 0 || options.size == 0) {
+        cerr << "The channels, runs and size must be at least 1" << endl;
+        return -1;
+    }
+
+    stringstream path;
+    path << "/tmp/hydna-replay-" << getpid() << ".cap";
+
+    bool ok = true;
+
+    cout << "benchmark,frames,runs,ns_per_frame,frames_per_second,late_us" << endl;
+
+    try {
+        if (options.capture.empty()) {
+            writeCapture(path.str(), options, options.frames, 0);
+            ok = runCase(path.str(), options) && ok;
+            unlink(path.str().c_str());
+        } else {
+            ok = runCase(options.capture, options) && ok;
+        }
+
+        ok = runPaced(path.str(), options) && ok;
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
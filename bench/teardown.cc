@@ -0,0 +1,176 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <channel.h>
+#include <channelmode.h>
+#include <channellistener.h>
+#include <clock.h>
+
+/**
+ *  Connection teardown benchmark
+ *
+ *  Opens a number of channels on one connection, has the server drop the
+ *  connection and measures the time from the request to drop it until
+ *  every channel has been told that it was closed. Run for each channel
+ *  count in turn.
+ *
+ *  Intended to be run against bench/loopback-server started with
+ *  --drop-signal drop, see `make run-teardown`.
+ *
+ *  Usage: teardown [--host HOST:PORT] [--channels A,B,..]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const unsigned long long CLOSE_TIMEOUT = 60000000;
+
+/**
+ *  Counts closed channels, the listener is called on the I/O thread.
+ */
+class CloseCounter : public ChannelListener {
+public:
+    CloseCounter() : m_closed(0), m_last(0) {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~CloseCounter() {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    void onClose(Channel&, ChannelError const &) {
+        unsigned long long now = Clock::now();
+
+        pthread_mutex_lock(&m_mutex);
+        m_closed++;
+        m_last = now;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    unsigned int getClosed() {
+        pthread_mutex_lock(&m_mutex);
+        unsigned int result = m_closed;
+        pthread_mutex_unlock(&m_mutex);
+        return result;
+    }
+
+    unsigned long long getLast() {
+        pthread_mutex_lock(&m_mutex);
+        unsigned long long result = m_last;
+        pthread_mutex_unlock(&m_mutex);
+        return result;
+    }
+
+private:
+    pthread_mutex_t m_mutex;
+    unsigned int m_closed;
+    unsigned long long m_last;
+};
+
+static vector<unsigned int> parseList(string const &value) {
+    vector<unsigned int> result;
+    stringstream ss(value);
+    string item;
+
+    while (getline(ss, item, ',')) {
+        result.push_back(strtoul(item.c_str(), NULL, 10));
+    }
+
+    return result;
+}
+
+static bool runCase(string const &host, unsigned int count, unsigned int id) {
+    vector<Channel*> channels;
+    CloseCounter counter;
+
+    unsigned long long start = Clock::now();
+
+    for (unsigned int i = 0; i < count; i++) {
+        stringstream path;
+        path << host << "/teardown-" << getpid() << "-" << id << "-" << i;
+
+        Channel* channel = new Channel();
+        channel->setListener(&counter);
+        channel->connect(path.str(), ChannelMode::READWRITEEMIT);
+        channels.push_back(channel);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        channels[i]->waitForOpen();
+    }
+
+    unsigned long long opened = Clock::now();
+
+    // Includes one round trip to the server, which is small in
+    // comparison.
+    channels[0]->emitString("drop");
+
+    while (counter.getClosed() < count && Clock::now() - opened < CLOSE_TIMEOUT) {
+        usleep(1000);
+    }
+
+    bool ok = counter.getClosed() == count;
+    unsigned long long teardown = counter.getLast() - opened;
+
+    cout << setw(10) << count
+         << setw(12) << fixed << setprecision(1) << (opened - start) / 1000.0
+         << setw(14) << teardown / 1000.0
+         << setw(14) << setprecision(0) << teardown * 1000.0 / count
+         << (ok ? "" : "  timed out") << endl;
+
+    for (unsigned int i = 0; i < count; i++) {
+        delete channels[i];
+    }
+
+    return ok;
+}
+
+int main(int argc, const char* argv[]) {
+    string host = "127.0.0.1:7010";
+    vector<unsigned int> counts = parseList("1000,10000,100000");
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--host") {
+            host = value;
+        } else if (arg == "--channels") {
+            counts = parseList(value);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    cout << setw(10) << "channels"
+         << setw(12) << "open ms"
+         << setw(14) << "teardown ms"
+         << setw(14) << "ns/channel" << endl;
+
+    bool ok = true;
+
+    try {
+        for (unsigned int i = 0; i < counts.size(); i++) {
+            ok = runCase(host, counts[i], i) && ok;
+        }
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
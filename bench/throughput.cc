@@ -0,0 +1,312 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <channel.h>
+#include <channelmode.h>
+#include <channeldata.h>
+#include <clock.h>
+#include <histogram.h>
+
+/**
+ *  Throughput and latency benchmark
+ *
+ *  Sends timestamped messages on a set of channels and measures the time
+ *  until the server broadcasts them back. Every combination of payload
+ *  size, channel count and thread count is run in turn and reported as
+ *  messages per second, megabytes per second and latency percentiles.
+ *
+ *  With --batch 1 the channels batch messages, a batch is flushed each
+ *  time the window has been filled.
+ *
+ *  An "https://" host is connected with TLS, trusting the certificates in
+ *  --ca-file. Whether the kernel encrypts (kTLS) is printed before the
+ *  results.
+ *
+ *  Intended to be run against bench/loopback-server, see `make run` and
+ *  `make run-tls`.
+ *
+ *  Usage: throughput [--host HOST:PORT] [--messages N] [--window N]
+ *                    [--sizes A,B,..] [--channels A,B,..] [--threads A,B,..]
+ *                    [--batch 0|1] [--ca-file PEM]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static const unsigned long long STALL_TIMEOUT = 10000000;
+
+struct Options {
+    string host;
+    string caFile;
+    unsigned int messages;
+    unsigned int window;
+    bool batch;
+    vector<unsigned int> sizes;
+    vector<unsigned int> channels;
+    vector<unsigned int> threads;
+};
+
+struct Worker {
+    pthread_t thread;
+    vector<Channel*> channels;
+    unsigned int size;
+    unsigned int messages;
+    unsigned int window;
+    Histogram latency;
+    bool failed;
+};
+
+static vector<unsigned int> parseList(string const &value) {
+    vector<unsigned int> result;
+    stringstream ss(value);
+    string item;
+
+    while (getline(ss, item, ',')) {
+        result.push_back(strtoul(item.c_str(), NULL, 10));
+    }
+
+    return result;
+}
+
+static void* run(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    unsigned int count = worker->channels.size();
+    vector<unsigned int> sent(count, 0);
+    vector<unsigned int> received(count, 0);
+    vector<char> payload(worker->size, 'x');
+    unsigned int done = 0;
+    unsigned long long lastProgress = Clock::now();
+
+    worker->failed = false;
+
+    while (done < count) {
+        bool progress = false;
+
+        for (unsigned int i = 0; i < count; i++) {
+            Channel* channel = worker->channels[i];
+
+            while (sent[i] < worker->messages &&
+                   sent[i] - received[i] < worker->window) {
+                unsigned long long stamp = Clock::nanos();
+                memcpy(&payload[0], &stamp, sizeof(stamp));
+                channel->writeBytes(&payload[0], 0, worker->size);
+                sent[i]++;
+                progress = true;
+            }
+
+            channel->flush();
+
+            while (!channel->isDataEmpty()) {
+                ChannelData* data = channel->popData();
+
+                if (!data) {
+                    break;
+                }
+
+                unsigned long long stamp;
+                memcpy(&stamp, data->getContent(), sizeof(stamp));
+                worker->latency.record(Clock::nanos() - stamp);
+
+                delete data;
+
+                if (++received[i] == worker->messages) {
+                    done++;
+                }
+
+                progress = true;
+            }
+        }
+
+        if (progress) {
+            lastProgress = Clock::now();
+        } else if (Clock::now() - lastProgress > STALL_TIMEOUT) {
+            worker->failed = true;
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static bool runCase(Options const &options, unsigned int size,
+                    unsigned int channelCount, unsigned int threadCount,
+                    unsigned int id) {
+    vector<Channel*> channels;
+    vector<Worker*> workers;
+
+    for (unsigned int i = 0; i < channelCount; i++) {
+        stringstream path;
+        path << options.host << "/bench-" << getpid() << "-" << id << "-" << i;
+
+        Channel* channel = new Channel();
+        channel->setBatching(options.batch);
+        channel->setTlsVerify(true, options.caFile);
+        channel->connect(path.str(), ChannelMode::READWRITE);
+        channels.push_back(channel);
+    }
+
+    for (unsigned int i = 0; i < channelCount; i++) {
+        channels[i]->waitForOpen();
+    }
+
+    if (id == 0) {
+        ConnectionStats stats = channels[0]->getConnectionStats();
+
+        if (stats.tls) {
+            cout << "TLS, encrypting in "
+                 << (stats.kernelTlsSend ? "the kernel" : "user space")
+                 << ", decrypting in "
+                 << (stats.kernelTlsReceive ? "the kernel" : "user space") << endl;
+        }
+    }
+
+    for (unsigned int t = 0; t < threadCount; t++) {
+        Worker* worker = new Worker();
+        worker->size = size;
+        worker->messages = options.messages / channelCount;
+        worker->window = options.window;
+
+        for (unsigned int i = t; i < channelCount; i += threadCount) {
+            worker->channels.push_back(channels[i]);
+        }
+
+        workers.push_back(worker);
+    }
+
+    unsigned long long start = Clock::now();
+
+    for (unsigned int t = 0; t < threadCount; t++) {
+        pthread_create(&workers[t]->thread, NULL, run, workers[t]);
+    }
+
+    Histogram latency;
+    bool failed = false;
+
+    for (unsigned int t = 0; t < threadCount; t++) {
+        pthread_join(workers[t]->thread, NULL);
+        latency.add(workers[t]->latency);
+        failed = failed || workers[t]->failed;
+        delete workers[t];
+    }
+
+    unsigned long long elapsed = Clock::now() - start;
+    unsigned long long total = latency.getCount();
+    double seconds = elapsed / 1000000.0;
+
+    cout << setw(8) << size
+         << setw(10) << channelCount
+         << setw(9) << threadCount
+         << setw(12) << (unsigned long long)(total / seconds)
+         << setw(10) << fixed << setprecision(2)
+         << (total * size) / seconds / (1024 * 1024)
+         << setw(10) << latency.getPercentile(50) / 1000
+         << setw(10) << latency.getPercentile(99) / 1000
+         << setw(10) << latency.getPercentile(99.9) / 1000
+         << (failed ? "  stalled" : "") << endl;
+
+    for (unsigned int i = 0; i < channelCount; i++) {
+        channels[i]->close();
+    }
+
+    for (unsigned int i = 0; i < channelCount; i++) {
+        while (channels[i]->isConnected() || channels[i]->isClosing()) {
+            usleep(1000);
+        }
+
+        delete channels[i];
+    }
+
+    return !failed;
+}
+
+int main(int argc, const char* argv[]) {
+    Options options;
+    options.host = "127.0.0.1:7010";
+    options.messages = 100000;
+    options.window = 64;
+    options.batch = false;
+    options.sizes = parseList("16,128,1024,8192,32768");
+    options.channels = parseList("1,4,16");
+    options.threads = parseList("1,4");
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << arg << endl;
+            return -1;
+        }
+
+        string value = argv[++i];
+
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--messages") {
+            options.messages = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--window") {
+            options.window = strtoul(value.c_str(), NULL, 10);
+        } else if (arg == "--ca-file") {
+            options.caFile = value;
+        } else if (arg == "--batch") {
+            options.batch = value == "1";
+        } else if (arg == "--sizes") {
+            options.sizes = parseList(value);
+        } else if (arg == "--channels") {
+            options.channels = parseList(value);
+        } else if (arg == "--threads") {
+            options.threads = parseList(value);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    cout << setw(8) << "size"
+         << setw(10) << "channels"
+         << setw(9) << "threads"
+         << setw(12) << "msgs/s"
+         << setw(10) << "MB/s"
+         << setw(10) << "p50 us"
+         << setw(10) << "p99 us"
+         << setw(10) << "p999 us" << endl;
+
+    bool ok = true;
+    unsigned int id = 0;
+
+    try {
+        for (unsigned int s = 0; s < options.sizes.size(); s++) {
+            unsigned int size = options.sizes[s];
+
+            if (size < sizeof(unsigned long long)) {
+                size = sizeof(unsigned long long);
+            }
+
+            for (unsigned int c = 0; c < options.channels.size(); c++) {
+                for (unsigned int t = 0; t < options.threads.size(); t++) {
+                    if (options.threads[t] > options.channels[c]) {
+                        continue;
+                    }
+
+                    ok = runCase(options, size, options.channels[c],
+                                 options.threads[t], id++) && ok;
+                }
+            }
+        }
+    } catch (Error& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,65 @@
+#include <coroutine.h>
+
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ *  Coroutine example
+ *
+ *  Opens a number of channels from coroutines, sends "Hello World" on
+ *  each and waits for it to come back. The coroutines are resumed by the
+ *  I/O thread of the connection; the main thread only waits for them to
+ *  finish.
+ *
+ *  Usage: coroutine [URL] [CHANNELS]
+ */
+
+using namespace hydna;
+using namespace std;
+
+static atomic<int> remaining;
+
+static Detached hello(AsyncChannel& channel, string url) {
+    try {
+        co_await channel.open(url, ChannelMode::READWRITE);
+        co_await channel.send("Hello World C++20");
+
+        Message message = co_await channel.receive();
+        cout << url << ": " << message.view() << endl;
+
+        // Wait for the close to be confirmed, the channel must not be
+        // deleted before that.
+        channel.close();
+        co_await channel.receive();
+    } catch (exception& e) {
+        cout << url << ": " << e.what() << endl;
+    }
+
+    remaining--;
+}
+
+int main(int argc, const char* argv[]) {
+    string url = argc > 1 ? argv[1] : "public.hydna.net/hello";
+    int count = argc > 2 ? atoi(argv[2]) : 1;
+    vector<unique_ptr<AsyncChannel> > channels;
+
+    remaining = count;
+
+    for (int i = 0; i < count; i++) {
+        channels.push_back(unique_ptr<AsyncChannel>(new AsyncChannel()));
+        hello(*channels.back(), count > 1 ? url + "-" + to_string(i) : url);
+    }
+
+    while (remaining > 0) {
+        usleep(10000);
+    }
+
+    return 0;
+}
@@ -22,10 +22,7 @@ int main(int argc, const char* argv[]) {
         cout << "could not connect: "<< e.what() << endl;
     }
 
-    while(!channel.isConnected()) {
-        channel.checkForChannelError();
-        sleep(1);
-    }
+    channel.waitForOpen();
     
     try{
         for (;;) {
@@ -1,11 +1,13 @@
 #include <channel.h>
 #include <channelmode.h>
 #include <channeldata.h>
+#include <channelset.h>
  
 #include <stdexcept>
 #include <exception>
 
 #include <iostream>
+#include <vector>
 
 /**
  *  Multiple channels example
@@ -30,48 +32,39 @@ int main(int argc, const char* argv[]) {
         cout << "could not connect: "<< e.what() << endl;
     }
 
-    while(!channel.isConnected()) {
-        channel.checkForChannelError();
-        sleep(1);
-    }
+    channel.waitForOpen();
 
-    while(!channel2.isConnected()) {
-        channel2.checkForChannelError();
-        sleep(1);
-    }
+    channel2.waitForOpen();
 
     channel.writeString("Hello world from c++ channel /hello");
     channel2.writeString("Hello world from c++ channel /hello2");
     
+    // Waits on both channels at once, rather than polling each of them.
+    ChannelSet set;
+    vector<Channel*> ready;
+    int remaining = 2;
+
+    set.add(&channel);
+    set.add(&channel2);
+
     try{
-        for (;;) {
-            if (!channel.isDataEmpty()) {
-                ChannelData* data = channel.popData();
-                const char* payload = data->getContent();
+        while (remaining > 0 && set.wait(ready) > 0) {
+            for (unsigned int i = 0; i < ready.size(); i++) {
+                ChannelData* data;
 
-                for (int i=0; i < data->getSize(); i++) {
-                    cout << payload[i];
-                }
+                while ((data = ready[i]->popData()) != NULL) {
+                    const char* payload = data->getContent();
 
-                cout << endl;
-                break;
-            } else {
-                channel.checkForChannelError();
-            }
-        }
-        for (;;) {
-            if (!channel2.isDataEmpty()) {
-                ChannelData* data = channel2.popData();
-                const char* payload = data->getContent();
+                    for (int j=0; j < data->getSize(); j++) {
+                        cout << payload[j];
+                    }
 
-                for (int i=0; i < data->getSize(); i++) {
-                    cout << payload[i];
+                    cout << endl;
+                    delete data;
+                    remaining--;
                 }
 
-                cout << endl;
-                break;
-            } else {
-                channel2.checkForChannelError();
+                ready[i]->checkForChannelError();
             }
         }
     }catch (std::exception& e) {
@@ -23,10 +23,7 @@ int main(int argc, const char* argv[]) {
         cout << "could not connect: "<< e.what() << endl;
     }
 
-    while(!channel.isConnected()) {
-        channel.checkForChannelError();
-        sleep(1);
-    }
+    channel.waitForOpen();
 
     string message = channel.getMessage();
     if (message != "") {
@@ -4,12 +4,10 @@
 #include <iostream>
 #include <iomanip>
 
-#include <sys/time.h>
-#include <time.h>
-
 #include <channel.h>
 #include <channelmode.h>
 #include <channeldata.h>
+#include <clock.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,20 +21,9 @@ using namespace std;
 static const unsigned int NO_BROADCASTS = 100000;
 static const string CONTENT = "fjhksdffkhjfhjsdkahjkfsadjhksfjhfsdjhlasfhjlksadfhjldaljhksfadjhsfdahjsljhdfjlhksfadlfsjhadljhkfsadjlhkajhlksdfjhlljhsa";
 
-int getmicrosec() {
-    int result = 0;
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-
-    result += (tv.tv_sec - 0) * 1000000;
-    result += (tv.tv_usec - 0);
-
-    return result;
-}
-
 int main(int argc, const char* argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " {receive|send}" << endl;
+    if (argc != 2 && argc != 3) {
+        cerr << "Usage: " << argv[0] << " {receive|send} [url]" << endl;
         return -1;
     }
 
@@ -44,36 +31,34 @@ int main(int argc, const char* argv[]) {
     
     try { 
         string arg = string(argv[1]);
+        string url = argc == 3 ? argv[2] : "public.hydna.net/speed";
 
         Channel channel;
         try{
-            channel.connect("public.hydna.net/speed", ChannelMode::READWRITE);
+            channel.connect(url, ChannelMode::READWRITE);
         }catch (std::exception& e) {
             cout << "could not connect: "<< e.what() << endl;
         }
 
-        while(!channel.isConnected()) {
-            channel.checkForChannelError();
-            sleep(1);
-        }
+        channel.waitForOpen();
         
-        int time = 0;
+        unsigned long long time = 0;
 
         if (arg.compare("receive") == 0) {
-            cout << "Receiving from /hello" << endl;
+            cout << "Receiving from " << url << endl;
 
             for(;;) {
                 if (!channel.isDataEmpty()) {
                     channel.popData();
 
                     if (i == 0) {
-                        time = getmicrosec();
+                        time = Clock::now();
                     }
                 
                     ++i;
 
                     if (i == NO_BROADCASTS) {
-                        time = getmicrosec() - time;
+                        time = Clock::now() - time;
                         cout << endl << "Received " << NO_BROADCASTS << " frames" << endl;
                         cout << "Time: " << time/1000 << "ms" << endl;
                         i = 0;
@@ -83,15 +68,15 @@ int main(int argc, const char* argv[]) {
                 }
             }
         } else if (arg.compare("send") == 0) {
-            cout << "Sending " << NO_BROADCASTS << " frames to /cc" << endl;
+            cout << "Sending " << NO_BROADCASTS << " frames to " << url << endl;
 
-            time = getmicrosec();
+            time = Clock::now();
 
             for (i = 0; i < NO_BROADCASTS; i++) {
                 channel.writeString(CONTENT);
             }
 
-            time = getmicrosec() - time;
+            time = Clock::now() - time;
 
             cout << "Time: " << time/1000 << "ms" << endl;
 
@@ -105,7 +90,7 @@ int main(int argc, const char* argv[]) {
                 }
             }
         } else {
-            cerr << "Usage: " << argv[0] << " {receive|send}" << endl;
+            cerr << "Usage: " << argv[0] << " {receive|send} [url]" << endl;
             return -1;
         }
 
@@ -0,0 +1,35 @@
+#include <trace.h>
+
+#include <iostream>
+
+/**
+ *  Trace dump
+ *
+ *  Formats a binary trace file written by Trace::dump() as text, one
+ *  record per line, ordered by time.
+ *
+ *  Usage: trace-dump <file>
+ */
+
+using namespace hydna;
+using namespace std;
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <file>" << endl;
+        return -1;
+    }
+
+    TraceRecords records;
+
+    if (!Trace::read(argv[1], records)) {
+        cerr << "Could not read trace file " << argv[1] << endl;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < records.size(); i++) {
+        cout << Trace::format(records[i]) << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef HYDNA_BUFFER_H
+#define HYDNA_BUFFER_H
+
+#include <vector>
+#include <pthread.h>
+
+namespace hydna {
+
+    class BufferPool;
+
+    /**
+     *  A reference counted byte buffer. Several ChannelData instances may
+     *  point into the same buffer; it is returned to its pool, or freed,
+     *  when the last reference is released.
+     */
+    class Buffer {
+    public:
+        /**
+         *  Wraps memory allocated with new[]. The memory is deleted when
+         *  the last reference is released.
+         *
+         *  @param data The memory to take ownership of.
+         *  @param size The size of the memory.
+         *  @return A buffer with one reference.
+         */
+        static Buffer* adopt(char* data, unsigned int size);
+
+        char* getData() const;
+
+        /**
+         *  Returns the number of bytes in use, which is at most the
+         *  capacity.
+         *
+         *  @return The size.
+         */
+        unsigned int getSize() const;
+
+        void setSize(unsigned int size);
+
+        unsigned int getCapacity() const;
+
+        /**
+         *  Adds a reference.
+         */
+        void retain();
+
+        /**
+         *  Drops a reference, the buffer must not be used by the caller
+         *  afterwards.
+         */
+        void release();
+
+        friend class BufferPool;
+
+    private:
+        Buffer(BufferPool* pool, char* data, unsigned int capacity);
+        ~Buffer();
+
+        Buffer(Buffer const &);
+        Buffer& operator=(Buffer const &);
+
+        BufferPool* m_pool;
+        char* m_data;
+        unsigned int m_size;
+        unsigned int m_capacity;
+        volatile int m_refs;
+    };
+
+    /**
+     *  A pool of buffers in power of two size classes. Released buffers
+     *  are kept for reuse, up to MAX_FREE per class.
+     */
+    class BufferPool {
+    public:
+        static const unsigned int MIN_CLASS_BITS = 12;
+        static const unsigned int CLASS_COUNT = 16;
+        static const unsigned int MAX_FREE = 4;
+
+        BufferPool();
+        ~BufferPool();
+
+        /**
+         *  Returns a buffer with a capacity of at least size bytes. Sizes
+         *  larger than the largest size class are allocated exactly and
+         *  not pooled.
+         *
+         *  @param size The required capacity.
+         *  @return A buffer with one reference and a size of 0.
+         */
+        Buffer* acquire(unsigned int size);
+
+        /**
+         *  Returns the pool shared by all channels. It is never destroyed,
+         *  so buffers may outlive static destruction.
+         *
+         *  @return The shared pool.
+         */
+        static BufferPool& getShared();
+
+        friend class Buffer;
+
+    private:
+        static int classOf(unsigned int size);
+        static void createShared();
+
+        void recycle(Buffer* buffer);
+
+        std::vector<Buffer*> m_free[CLASS_COUNT];
+        pthread_mutex_t m_mutex;
+
+        static BufferPool* m_shared;
+        static pthread_once_t m_sharedOnce;
+    };
+}
+
+#endif
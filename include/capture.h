@@ -0,0 +1,128 @@
+#ifndef HYDNA_CAPTURE_H
+#define HYDNA_CAPTURE_H
+
+#include <string>
+#include <pthread.h>
+
+namespace hydna {
+
+    /**
+     *  The header at the start of a capture file.
+     */
+    struct CaptureHeader {
+        char magic[8];
+        unsigned int version;
+        unsigned int chunkSize;
+
+        // Clock::nanos() and the wall clock, in microseconds since the
+        // epoch, when the capture was started.
+        unsigned long long started;
+        unsigned long long startedWall;
+
+        char reserved[32];
+    };
+
+    /**
+     *  The header of a captured frame, followed by the frame as it was
+     *  received, length prefix included, and padded to 8 bytes. A record
+     *  never spans two chunks of the file.
+     */
+    struct CaptureRecord {
+        // Clock::nanos() when the frame was received.
+        unsigned long long time;
+
+        // The connection the frame was received on, or PAD if the rest of
+        // the chunk is unused.
+        unsigned int source;
+        unsigned int size;
+    };
+
+    /**
+     *  Records every frame received, on all connections, to an append-only
+     *  file that is written through memory mapped chunks:
+     *
+     *      FrameCapture::start("session.cap");
+     *      ...
+     *      FrameCapture::stop();
+     *
+     *  The frames are copied as they come off the wire, with the time they
+     *  were received, and can be fed back through the library with
+     *  FrameReplay. A capture that is not stopped, e.g. because the process
+     *  crashed, is readable up to the last frame written.
+     */
+    class FrameCapture {
+    public:
+        static const char MAGIC[8];
+        static const unsigned int VERSION = 1;
+
+        /** The size the file grows by, a multiple of the page size. */
+        static const unsigned int CHUNK_SIZE = 4 * 1024 * 1024;
+
+        static const unsigned int PAD = 0xFFFFFFFF;
+
+        /**
+         *  Checks if frames are being captured.
+         *
+         *  @return True if enabled.
+         */
+        static bool isEnabled() {
+            return m_enabled;
+        }
+
+        /**
+         *  Starts capturing to a file, stopping any capture in progress.
+         *
+         *  @param path The file, which is replaced if it exists.
+         *  @throw IOError if the file could not be created.
+         */
+        static void start(std::string const &path);
+
+        /**
+         *  Stops capturing and truncates the file to the frames written.
+         */
+        static void stop();
+
+        /**
+         *  Appends a frame to the capture. Called by the I/O threads, and
+         *  by anyone building a capture without a server. The capture is
+         *  stopped if the file can not be grown.
+         *
+         *  @param source The connection the frame was received on.
+         *  @param frame The encoded frame, starting with the length prefix.
+         *  @param size The size of the frame.
+         */
+        static void record(unsigned int source, const char* frame, unsigned int size);
+
+        /**
+         *  Returns the number of frames captured since the capture was
+         *  started.
+         *
+         *  @return The number of frames.
+         */
+        static unsigned long long getFrames();
+
+    private:
+        /**
+         *  Maps the next chunk of the file. m_mutex must be held.
+         *
+         *  @return False if the file could not be grown.
+         */
+        static bool nextChunk();
+
+        /**
+         *  Unmaps the file and truncates it. m_mutex must be held.
+         */
+        static void finish();
+
+        static volatile bool m_enabled;
+        static pthread_mutex_t m_mutex;
+
+        static int m_fd;
+        static char* m_chunk;
+        static unsigned long long m_chunkOffset;
+        static unsigned int m_used;
+        static unsigned long long m_frames;
+    };
+}
+
+#endif
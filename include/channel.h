@@ -1,6 +1,7 @@
 #ifndef HYDNA_CHANNEL_H
 #define HYDNA_CHANNEL_H
 
+#include <deque>
 #include <iostream>
 #include <streambuf>
 #include <pthread.h>
@@ -12,8 +13,17 @@
 #include "channelmode.h"
 #include "contenttype.h"
 #include "channelerror.h"
+#include "channellistener.h"
+#include "channelset.h"
+#include "histogram.h"
+#include "stats.h"
+#include "envelope.h"
+#include "codec.h"
+#include "spool.h"
+#include "ratelimiter.h"
 
 namespace hydna {
+    class Relay;
 
     /**
      *  This class is used as an interface to the library.
@@ -42,6 +52,418 @@ namespace hydna {
          *  @param value The new follow redirects status.
          */
         void setFollowRedirects(bool value);
+
+        /**
+         *  Checks if broken connections should be re-established.
+         *
+         *  @return The current auto reconnect status.
+         */
+        bool getAutoReconnect() const;
+
+        /**
+         *  Sets if broken connections should be re-established. When
+         *  enabled, a lost connection is reconnected with exponential
+         *  backoff and all open channels are re-opened. Channels stay
+         *  connected while reconnecting and writes are queued.
+         *
+         *  @param value The new auto reconnect status.
+         */
+        void setAutoReconnect(bool value);
+
+        /**
+         *  Sets the backoff used when reconnecting. The delay is doubled
+         *  for every failed attempt, up to maxDelay, and randomized between
+         *  half and all of the current delay.
+         *
+         *  @param initialDelay The delay, in milliseconds, before the first attempt.
+         *  @param maxDelay The max delay, in milliseconds, between attempts.
+         *  @param maxAttempts Attempts before giving up, 0 for no limit.
+         *  @throw RangeError if the initial delay is less than
+         *                    Connection::MIN_RECONNECT_DELAY or more than
+         *                    the max delay.
+         */
+        void setReconnectBackoff(unsigned int initialDelay,
+                                 unsigned int maxDelay,
+                                 unsigned int maxAttempts=0);
+
+        /**
+         *  Sets the max number of writes that are queued while reconnecting.
+         *
+         *  @param limit The max number of queued writes.
+         */
+        void setReconnectQueueLimit(unsigned int limit);
+
+        /**
+         *  Returns the reconnect statistics of the underlying connection.
+         *
+         *  @return The statistics.
+         */
+        ReconnectStats getReconnectStats() const;
+
+        /**
+         *  Sets the keepalive behaviour of connections. Keepalives are sent
+         *  every interval, and a connection that has not received anything
+         *  within the idle timeout is considered dead. Dead connections are
+         *  reconnected if auto reconnect is enabled, else destroyed.
+         *
+         *  @param interval The keepalive interval in milliseconds, 0 to disable.
+         *  @param idleTimeout The idle timeout in milliseconds, 0 to disable.
+         */
+        void setKeepalive(unsigned int interval, unsigned int idleTimeout=0);
+
+        /**
+         *  Returns the round-trip times, in microseconds, measured with
+         *  keepalives on the underlying connection. Only servers that echo
+         *  keepalives gives any samples.
+         *
+         *  @return A snapshot of the round-trip times.
+         */
+        Histogram getRoundTripTimes() const;
+
+        /**
+         *  Sets how the certificates of servers are verified on "https"
+         *  connections.
+         *
+         *  @param verify False to accept any certificate.
+         *  @param caFile A PEM file with trusted certificates, or an empty
+         *                string for the system default.
+         */
+        void setTlsVerify(bool verify, std::string const &caFile="");
+
+        /**
+         *  Sets if the keys of "https" connections are handed to the
+         *  kernel (kTLS) after the handshake, so that writes are encrypted
+         *  by the kernel without an extra copy. Connections fall back to
+         *  encrypting in user space if the kernel lacks support. Enabled
+         *  by default.
+         *
+         *  @param value True to use kernel TLS when available.
+         */
+        void setKernelTls(bool value);
+
+        /**
+         *  Sets the CPUs that the I/O threads of connections run on, e.g.
+         *  the CPUs next to the threads that consume the data. Applies to
+         *  connections created after the call.
+         *
+         *  @param cpus A list like "0-3,8", or an empty string for any CPU.
+         *  @throw RangeError if the list is malformed.
+         */
+        void setIoThreadCpus(std::string const &cpus);
+
+        /**
+         *  Sets the NUMA node that the I/O threads allocate their buffers
+         *  from. Without a CPU list, the threads also run on the CPUs of
+         *  the node. Applies to connections created after the call.
+         *
+         *  @param node The node, or -1 for no preference.
+         */
+        void setIoThreadNumaNode(int node);
+
+        /**
+         *  Runs the I/O threads with a real-time (SCHED_FIFO) priority.
+         *  This needs CAP_SYS_NICE or an rtprio limit; without it the
+         *  threads keep the normal scheduler, see
+         *  ConnectionStats::ioThreadConfig. Applies to connections created
+         *  after the call.
+         *
+         *  @param priority The priority, 1 to 99, or 0 for the normal
+         *                  scheduler.
+         *  @throw RangeError if the priority is out of range.
+         */
+        void setIoThreadPriority(int priority);
+
+        /**
+         *  Sets the memory budget of the library, shared by all
+         *  connections. While it is exceeded, connect() fails and
+         *  received messages are handled as set with setMemoryPolicy().
+         *
+         *  @param bytes The budget in bytes, 0 for none.
+         */
+        void setMemoryBudget(unsigned long long bytes);
+
+        /**
+         *  Returns the memory budget of the library.
+         *
+         *  @return The budget in bytes, 0 for none.
+         */
+        unsigned long long getMemoryBudget() const;
+
+        /**
+         *  Sets the memory budget of each connection, which is checked
+         *  along with the budget of the library. Applies to connections
+         *  created after the call.
+         *
+         *  @param bytes The budget in bytes, 0 for none.
+         */
+        void setConnectionMemoryBudget(unsigned long long bytes);
+
+        /**
+         *  Returns the memory budget of each connection.
+         *
+         *  @return The budget in bytes, 0 for none.
+         */
+        unsigned long long getConnectionMemoryBudget() const;
+
+        /**
+         *  Sets what a connection does with received messages while over
+         *  budget. With MemoryAccount::BACKPRESSURE, the default, the
+         *  connection is not read until messages are popped, which slows
+         *  the sender down through TCP flow control. With
+         *  MemoryAccount::SHED the messages are dropped.
+         *
+         *  @param policy The policy.
+         *  @throw RangeError if the policy is unknown.
+         */
+        void setMemoryPolicy(int policy);
+
+        /**
+         *  Returns what a connection does with received messages while
+         *  over budget.
+         *
+         *  @return The policy.
+         */
+        int getMemoryPolicy() const;
+
+        /**
+         *  Returns a snapshot of the memory held by the library as a
+         *  whole. The memory of the underlying connection is in
+         *  ConnectionStats::memory.
+         *
+         *  @return The statistics.
+         */
+        MemoryStats getMemoryStats() const;
+
+        /**
+         *  Checks if the payload envelope is enabled.
+         *
+         *  @return True if enabled.
+         */
+        bool getEnvelope() const;
+
+        /**
+         *  Enables the payload envelope on this channel. Messages are
+         *  prefixed with a two byte header, which allows messages larger
+         *  than Frame::PAYLOAD_MAX_LIMIT to be sent in fragments and
+         *  reassembled by the receiver. All clients on the channel should
+         *  enable the envelope, messages from those that do not are
+         *  delivered as they are and counted as ChannelStats::dataPlain.
+         *
+         *  setBatching(true) and setCompression() also enable the
+         *  envelope.
+         *
+         *  @param value True to enable the envelope.
+         */
+        void setEnvelope(bool value);
+
+        /**
+         *  Checks if batching is enabled.
+         *
+         *  @return True if enabled.
+         */
+        bool getBatching() const;
+
+        /**
+         *  Enables batching of small messages on this channel. Messages
+         *  written with writeBytes() are packed into one frame until the
+         *  frame is full, a message with another content type or priority
+         *  is written, the batch delay has passed, or flush() is called.
+         *  Receivers unpack them into separate ChannelData.
+         *
+         *  Batches are sent in the envelope, so enabling batching also
+         *  enables the envelope, as with setEnvelope(true), for the
+         *  messages this channel writes and receives. Disabling batching
+         *  leaves the envelope enabled.
+         *
+         *  @param value True to enable batching.
+         */
+        void setBatching(bool value);
+
+        /**
+         *  Returns the batch delay.
+         *
+         *  @return The delay in milliseconds.
+         */
+        unsigned int getBatchDelay() const;
+
+        /**
+         *  Sets the longest time that the first message of a batch waits
+         *  before the batch is sent, 10 ms by default. A batch that waits
+         *  when the channel is closed by the server is sent, or dropped,
+         *  right away.
+         *
+         *  @param value The delay in milliseconds, 0 to only send batches
+         *               when they are full or flushed.
+         */
+        void setBatchDelay(unsigned int value);
+
+        /**
+         *  Sends the messages that are waiting in the current batch.
+         */
+        void flush();
+
+        /**
+         *  Enables compression of outgoing messages on this channel.
+         *  Messages, and batches, smaller than the threshold or that do
+         *  not get smaller are sent uncompressed. Compressed messages are
+         *  decompressed by every hydna-cc client that has the envelope
+         *  enabled and the codec compiled in.
+         *
+         *  Compressed messages are sent in the envelope, so enabling
+         *  compression also enables the envelope, as with
+         *  setEnvelope(true), for the messages this channel writes and
+         *  receives. Disabling compression leaves the envelope enabled.
+         *
+         *  @param codec The codec, Codec::NONE to disable compression.
+         *  @param threshold The smallest size that is compressed.
+         */
+        void setCompression(unsigned char codec, unsigned int threshold=128);
+
+        /**
+         *  Sets a dictionary that is used both to compress and decompress
+         *  messages. Both peers must use the same dictionary; messages
+         *  compressed with another dictionary are dropped. Should be set
+         *  before the channel is connected.
+         *
+         *  @param dictionary Data that is typical for the messages.
+         */
+        void setDictionary(std::string const &dictionary);
+
+        /**
+         *  Sets the size of the largest message that will be reassembled
+         *  from fragments. Fragments of larger messages are dropped.
+         *
+         *  @param value The size in bytes.
+         */
+        void setMaxMessageSize(unsigned int value);
+
+        /**
+         *  Returns true if written data is delivered to this channel
+         *  locally.
+         *
+         *  @return True if enabled.
+         */
+        bool getLocalLoopback() const;
+
+        /**
+         *  Delivers data written on this channel to its own data queue
+         *  right away, on the writing thread, when the channel is open for
+         *  reading. The server still gets the data for other clients, and
+         *  the copy that it sends back is dropped, which relies on the
+         *  server sending writes back to the writer as it does when the
+         *  channel is readable. Signals are not looped back.
+         *
+         *  The copy is recognised by its content alone. If other clients
+         *  write the same content to the channel, their message may be
+         *  dropped in its place, so only enable the loopback when the
+         *  messages written on the channel are unique. A written message
+         *  is remembered for two seconds, after which its copy is
+         *  delivered again; ChannelStats::echoesExpired counts them.
+         *
+         *  @param value True to enable the loopback.
+         */
+        void setLocalLoopback(bool value);
+
+        /**
+         *  Returns the path of the spool file, or "" if data is not
+         *  spooled.
+         *
+         *  @return The path.
+         */
+        std::string getSpool() const;
+
+        /**
+         *  Keeps data that can not be sent in a journal file, instead of
+         *  failing the write: while the channel is opening, after its
+         *  connection was lost, and while reconnecting with a full
+         *  reconnect queue. The spooled frames are sent in order, several
+         *  per write, once the channel is open again, and later writes
+         *  wait behind them. Frames left in the file when the process
+         *  exits are sent by the next channel that spools to it.
+         *
+         *  Data is spooled once the channel has been connected for
+         *  writing. A frame may be sent twice if the connection is lost
+         *  while the spool is sent. Set the spool before writing.
+         *
+         *  @param path The file, or "" to stop spooling, which keeps the
+         *              unsent frames in the file.
+         *  @param capacity The max size of the spooled frames, in bytes.
+         *  @throw IOError if the file could not be opened.
+         */
+        void setSpool(std::string const &path, unsigned int capacity=Spool::DEFAULT_CAPACITY);
+
+        /**
+         *  Limits how fast messages are written on this channel, see
+         *  setRatePolicy() for what a write over the limit does. The
+         *  limit is checked before batching, compression and spooling, so
+         *  it counts messages as written by the caller.
+         *
+         *  @param messages Messages per second, 0 for no limit.
+         *  @param bytes Bytes per second, 0 for no limit.
+         *  @param burst How many milliseconds of messages at the limit
+         *               may be written at once, after the channel has
+         *               been idle.
+         */
+        void setRateLimit(unsigned long long messages,
+                          unsigned long long bytes,
+                          unsigned int burst=RateLimiter::DEFAULT_BURST);
+
+        /**
+         *  Limits how fast messages are written on each connection, by
+         *  all of its channels together. Applies to connections created
+         *  after the call. Each channel handles a write over the limit as
+         *  set with its setRatePolicy().
+         *
+         *  @param messages Messages per second, 0 for no limit.
+         *  @param bytes Bytes per second, 0 for no limit.
+         *  @param burst How many milliseconds of messages at the limit
+         *               may be written at once.
+         */
+        void setConnectionRateLimit(unsigned long long messages,
+                                    unsigned long long bytes,
+                                    unsigned int burst=RateLimiter::DEFAULT_BURST);
+
+        /**
+         *  Sets what a write over the rate limit of this channel, or of
+         *  its connection, does. With RateLimiter::BLOCK, the default,
+         *  writeBytes() sleeps until the limit allows the message. With
+         *  RateLimiter::QUEUE the message is copied and sent in order by a
+         *  shared timer thread, and later writes queue behind it; close()
+         *  waits up to RateLimiter::CLOSE_TIMEOUT for the queue to be
+         *  sent, and drops the rest. With RateLimiter::REJECT
+         *  writeBytes() throws an IOError.
+         *
+         *  Queued messages that can not be sent, e.g. since the channel
+         *  was closed by the server, are dropped.
+         *
+         *  @param policy The policy.
+         *  @param queueLimit The max number of messages queued, after
+         *                    which writes throw an IOError.
+         *  @throw RangeError if the policy is unknown.
+         */
+        void setRatePolicy(int policy, unsigned int queueLimit=RateLimiter::DEFAULT_QUEUE_LIMIT);
+
+        /**
+         *  Returns what a write over the rate limit does.
+         *
+         *  @return The policy.
+         */
+        int getRatePolicy() const;
+
+        /**
+         *  Returns a snapshot of the statistics of this channel.
+         *
+         *  @return The statistics.
+         */
+        ChannelStats getStats() const;
+
+        /**
+         *  Returns a snapshot of the statistics of the underlying
+         *  connection.
+         *
+         *  @return The statistics.
+         */
+        ConnectionStats getConnectionStats() const;
         
         /**
          *  Checks the connected state for this Channel instance.
@@ -108,9 +530,38 @@ namespace hydna {
                      unsigned int mode=ChannelMode::READ,
                      const char* token=NULL,
                      unsigned int tokenLength=0);
+
+        /**
+         *  Sets the time a channel has to be opened in, counted from
+         *  connect(). When it runs out the open is cancelled and the
+         *  channel fails with a ChannelError, as reported by waitForOpen()
+         *  and ChannelListener::onClose(). If the open request has already
+         *  been sent the channel stays closing until the server responds.
+         *
+         *  @param timeout The timeout in milliseconds, 0 for none.
+         */
+        void setOpenTimeout(unsigned int timeout);
+
+        /**
+         *  Returns the open timeout.
+         *
+         *  @return The timeout in milliseconds, 0 for none.
+         */
+        unsigned int getOpenTimeout() const;
+
+        /**
+         *  Blocks until the channel that is being connected is open,
+         *  without polling.
+         *
+         *  @throw ChannelError if the channel could not be opened, or
+         *         timed out, see setOpenTimeout().
+         */
+        void waitForOpen();
         
         /**
-         *  Sends data to the channel.
+         *  Sends data to the channel. If the envelope is enabled, data
+         *  that does not fit in one frame is sent as fragments; frames on
+         *  other channels may be interleaved with them.
          *
          *  @param data The data to write to the channel.
          *  @param offset Were to read from.
@@ -168,6 +619,26 @@ namespace hydna {
         void resolveSuccess(unsigned int ch, const char* path, int path_size, const char* token, int token_size);
 
 
+        /**
+         *  Sets a listener that is called when the channel is opened or
+         *  closed, and when data or signals are received. Set it before
+         *  connecting. The listener is not owned by the channel.
+         *
+         *  Waits for calls to the old listener on other threads to
+         *  return, so that it can be deleted once this returns. The
+         *  channel destructor waits the same way.
+         *
+         *  @param listener The listener, or NULL for none.
+         */
+        void setListener(ChannelListener* listener);
+
+        /**
+         *  Returns the listener of the channel.
+         *
+         *  @return The listener, or NULL if none is set.
+         */
+        ChannelListener* getListener() const;
+
         /**
          *  Checks if some error has occured in the channel
          *  and throws an exception if that is the case.
@@ -205,6 +676,11 @@ namespace hydna {
         bool isSignalEmpty();
 
         friend class Connection;
+        friend class DeadlineTimer;
+        friend class ListenerCall;
+        friend class ChannelSet;
+        friend class Relay;
+        friend class FrameReplay;
         
     private:
         /**
@@ -214,14 +690,280 @@ namespace hydna {
          *  @param respch The response channel.
          */
         void openSuccess(unsigned int respch, std::string const &message);
+
+        /**
+         *  Opens the channel for reading on a connection that has no
+         *  socket, for FrameReplay. The connection lists the channel as
+         *  open under ch.
+         *
+         *  @param connection The connection.
+         *  @param ch The channel id.
+         *  @throw Error if the channel is connected.
+         */
+        void openOffline(Connection* connection, unsigned int ch);
         
 
+        /**
+         *  Copies the listener, and counts it as being called until
+         *  releaseListener(). The connect, data or signal mutex must be
+         *  held.
+         *
+         *  @return The listener, or NULL if none is set.
+         */
+        ChannelListener* acquireListener();
+        void releaseListener();
+
+        /**
+         *  Waits until the listener is not called on any other thread.
+         */
+        void waitForListener();
+
+        /**
+         *  Called by the open timer when the open timeout has run out.
+         */
+        void openTimedOut();
+
         /**
          *  Internally destroy channel.
          *
          *  @param error The cause of the destroy.
          */
-        void destroy(ChannelError error);
+        void destroy(ChannelError const &error);
+
+        /**
+         *  Destroys the channel as part of the teardown of its connection.
+         *  Nothing is done if the channel is no longer attached to the
+         *  connection, and its reference to the connection is left for
+         *  the connection to drop, see Connection::destroy().
+         *
+         *  @param connection The connection that is torn down.
+         *  @param error The cause of the destroy.
+         *  @return True if the channel was attached to the connection.
+         */
+        bool detach(Connection* connection, ChannelError const &error);
+
+        /**
+         *  Implements destroy() and detach().
+         *
+         *  @param error The cause of the destroy.
+         *  @param owner The connection that is torn down, or NULL.
+         *  @return True if the channel was attached to a connection.
+         */
+        bool teardown(ChannelError const &error, Connection* owner);
+
+        /**
+         *  Handles a received data payload, unwrapping the envelope if it
+         *  is enabled. The payload is copied, it is only valid during the
+         *  call.
+         */
+        void receiveData(int priority, int ctype, const char* payload, int size);
+
+        /**
+         *  Handles a RAW or BATCH payload. Takes over the reference to the
+         *  buffer.
+         */
+        void receiveEnvelope(int priority, int ctype, Buffer* buffer);
+
+        /**
+         *  Decompresses a COMPRESSED payload into a RAW or BATCH payload.
+         *
+         *  @return The payload, or NULL if it could not be decompressed.
+         */
+        Buffer* decompress(const char* payload, unsigned int size);
+
+        /**
+         *  Writes a RAW or BATCH payload, compressing it if enabled.
+         *
+         *  @param kind The kind of the payload.
+         *  @param data The payload, without its kind byte.
+         *  @param length The length of the payload.
+         */
+        void writeEnvelope(unsigned int ctype,
+                           unsigned int priority,
+                           unsigned char kind,
+                           const char* data,
+                           unsigned int length);
+
+        /**
+         *  Adds every record of a BATCH payload to the data queue.
+         */
+        void unpackBatch(int priority, int ctype, Buffer* buffer);
+
+        /**
+         *  Writes a message that is within the rate limits, or that has
+         *  waited for them.
+         */
+        void sendBytes(const char* data,
+                       unsigned int length,
+                       unsigned int ctype,
+                       unsigned int priority);
+
+        /**
+         *  Applies the rate limits to a message about to be written, as
+         *  set with setRatePolicy().
+         *
+         *  @param connection The connection of the channel, if any.
+         *  @return True if the caller should send the message, false if
+         *          it was queued.
+         *  @throw IOError if the message was rejected.
+         */
+        bool throttle(Connection* connection,
+                      const char* data,
+                      unsigned int length,
+                      unsigned int ctype,
+                      unsigned int priority);
+
+        /**
+         *  Queues a message if it is over the rate limits, or if earlier
+         *  messages are queued.
+         *
+         *  @return True if the caller should send the message.
+         *  @throw IOError if the queue is full.
+         */
+        bool queuePaced(Connection* connection,
+                        const char* data,
+                        unsigned int length,
+                        unsigned int ctype,
+                        unsigned int priority);
+
+        /**
+         *  Takes the tokens for a message from the limiter of this channel
+         *  and from that of its connection.
+         *
+         *  @param limiter Set to the limiter that is over its limit.
+         *  @return 0 if taken, otherwise the time in microseconds to wait.
+         */
+        unsigned long long takeTokens(Connection* connection,
+                                      unsigned int length,
+                                      RateLimiter*& limiter);
+
+        /**
+         *  Called by the timer to send queued messages as the limits
+         *  allow.
+         */
+        void sendPaced();
+
+        /**
+         *  Drops the queued messages, but the one the pacer is sending.
+         *  m_pacedMutex must be held.
+         */
+        void dropPaced();
+
+        /**
+         *  Writes a frame on the connection of this channel.
+         */
+        void writeFrame(Frame& frame);
+
+        /**
+         *  Writes a frame on the connection of this channel straight from
+         *  the given buffers, see Connection::writeBytes().
+         */
+        void writeFrame(unsigned int ctype,
+                        unsigned int op,
+                        unsigned int flag,
+                        const char* prefix,
+                        unsigned int prefixLength,
+                        const char* data,
+                        unsigned int length);
+
+        /**
+         *  Sends the current batch. The batch mutex must be held. A batch
+         *  that can not be sent is dropped and counted.
+         */
+        void flushBatch();
+
+        /**
+         *  Adds a batch deadline to the timer, unless one is added
+         *  already. The batch mutex must be held.
+         *
+         *  @param deadline The deadline, see Clock::now().
+         */
+        void armBatchTimer(unsigned long long deadline);
+
+        /**
+         *  Called by the timer when a batch deadline has passed, or with 0
+         *  when the channel has been destroyed. Sends the batch if it is
+         *  due, otherwise adds a deadline for when it is.
+         *
+         *  @param deadline The deadline.
+         */
+        void batchTimedOut(unsigned long long deadline);
+
+        /**
+         *  Writes a data frame to the spool if the channel can not send
+         *  it, or if earlier frames are still spooled and can not be sent
+         *  first.
+         *
+         *  @param connection The connection of the channel, if any.
+         *  @param ch The channel id.
+         *  @param ready True if the channel is open and sending.
+         *  @return True if the frame was spooled, false if the caller
+         *          should send it.
+         *  @throw IOError if the spool is full.
+         */
+        bool spoolFrame(Connection* connection,
+                        unsigned int ch,
+                        bool ready,
+                        unsigned int ctype,
+                        unsigned int flag,
+                        const char* prefix,
+                        unsigned int prefixLength,
+                        const char* data,
+                        unsigned int length);
+
+        /**
+         *  Sends the spooled frames, if any, once the channel is open.
+         */
+        void flushSpool();
+
+        /**
+         *  Remembers a data frame that is about to be written, so that the
+         *  copy the server sends back can be dropped.
+         */
+        void expectEcho(const char* prefix,
+                        unsigned int prefixLength,
+                        const char* data,
+                        unsigned int length);
+
+        /**
+         *  Forgets a data frame remembered by expectEcho() that could not
+         *  be written.
+         */
+        void forgetEcho(const char* prefix,
+                        unsigned int prefixLength,
+                        const char* data,
+                        unsigned int length);
+
+        /**
+         *  Checks a received data frame against the frames written with
+         *  the loopback enabled, forgetting it if it is one of them.
+         *
+         *  @return True if the frame is a copy of one that was written.
+         */
+        bool isEcho(const char* payload, unsigned int size);
+
+        /**
+         *  Forgets the written frames whose copy has not come back in
+         *  time. m_dataMutex must be held.
+         *
+         *  @param now The time, see Clock::now().
+         */
+        void expireEchoes(unsigned long long now);
+
+        /**
+         *  Gives the written frames a new deadline, when they are sent
+         *  from the spool.
+         */
+        void renewEchoes();
+
+        /**
+         *  Delivers written data to this channel if the loopback is
+         *  enabled. Called once the data has been written.
+         */
+        void loopBack(const char* data,
+                      unsigned int length,
+                      unsigned int ctype,
+                      unsigned int priority);
 
         /**
          *  Add data to the data queue.
@@ -265,12 +1007,133 @@ namespace hydna {
         OpenRequest* m_openRequest;
         OpenRequest* m_resolveRequest;
 
+        // Guarded by m_compressMutex.
+        bool m_envelope;
+        unsigned int m_messageId;
+        Reassembler m_reassembler;
+
+        // Set under m_batchMutex, and checked again under it before a
+        // message is batched.
+        volatile bool m_batching;
+        ByteArray m_batch;
+        unsigned int m_batchCtype;
+        unsigned int m_batchPriority;
+        unsigned int m_batchCount;
+        unsigned int m_batchDelay;
+        unsigned long long m_batchStarted;
+        unsigned long long m_batchDeadline;
+        volatile bool m_batchTimerUsed;
+        unsigned long long m_batchDropped;
+
+        // Messages received without an envelope while it is enabled.
+        unsigned long long m_dataPlain;
+
+        Codec* m_compressor;
+        unsigned int m_compressionThreshold;
+        std::string m_dictionary;
+        unsigned int m_dictionaryId;
+        Codec* m_decompressors[Codec::CODEC_COUNT];
+        ByteArray m_compressed;
+
         ChannelDataQueue m_dataQueue;
         ChannelSignalQueue m_signalQueue;
 
+        unsigned long long m_connectStarted;
+        unsigned long long m_openLatency;
+
+        unsigned long long m_dataIn;
+        unsigned long long m_dataBytesIn;
+        unsigned long long m_signalsIn;
+        unsigned long long m_dataOut;
+        unsigned long long m_dataBytesOut;
+        unsigned long long m_signalsOut;
+        unsigned int m_dataQueueDepth;
+        unsigned int m_signalQueueDepth;
+
+        // Written with the connect, data and signal mutexes held. The
+        // calls in progress are guarded by m_listenerMutex.
+        ChannelListener* m_listener;
+        unsigned int m_listenerCalls;
+        pthread_mutex_t m_listenerMutex;
+        pthread_cond_t m_listenerCond;
+
+        unsigned int m_openTimeout;
+        unsigned long long m_openDeadline;
+        bool m_openTimerUsed;
+        bool m_timedOut;
+        bool m_timeoutReported;
+
+        // Guarded by m_dataMutex and m_signalMutex, m_setReady by the
+        // mutex of the set.
+        ChannelSet* m_set;
+        bool m_setReady;
+
+        // Where queued messages are charged, the account of the
+        // connection while attached. Guarded by m_dataMutex and
+        // m_signalMutex, the byte counts by their queue's mutex.
+        MemoryAccount* m_memory;
+        unsigned long long m_dataQueueBytes;
+        unsigned long long m_signalQueueBytes;
+
+        // Written frames whose copy from the server is yet to be
+        // dropped, oldest first. Guarded by m_dataMutex.
+        struct Echo {
+            unsigned int size;
+            char head[16];
+            unsigned long long hash;
+            unsigned long long expires;
+        };
+
+        static Echo echoOf(const char* prefix,
+                           unsigned int prefixLength,
+                           const char* data,
+                           unsigned int length);
+
+        bool m_loopback;
+        std::deque<Echo> m_echoes;
+        volatile unsigned int m_echoCount;
+        unsigned long long m_dataLooped;
+        unsigned long long m_echoesDropped;
+
+        // Guarded by m_dataMutex.
+        unsigned long long m_echoesExpired;
+
+        // The relay that received messages are published to instead of
+        // being queued. Guarded by m_dataMutex and m_signalMutex.
+        Relay* m_relay;
+        unsigned int m_relayIndex;
+
+        // Guarded by m_spoolMutex.
+        Spool* m_spool;
+        unsigned long long m_dataSpooled;
+
         mutable pthread_mutex_t m_dataMutex;
         mutable pthread_mutex_t m_signalMutex;
         mutable pthread_mutex_t m_connectMutex;
+        mutable pthread_mutex_t m_batchMutex;
+        mutable pthread_mutex_t m_compressMutex;
+        mutable pthread_mutex_t m_spoolMutex;
+        pthread_cond_t m_openCond;
+
+        // Messages written over the rate limit with RateLimiter::QUEUE,
+        // oldest first. The front is only removed by the pacer once it
+        // has been sent. Guarded by m_pacedMutex.
+        struct PacedWrite {
+            ChannelData* data;
+            unsigned long long queued;
+            bool connectionLimit;
+        };
+
+        RateLimiter m_rateLimiter;
+        int m_ratePolicy;
+        unsigned int m_rateQueueLimit;
+        std::deque<PacedWrite> m_paced;
+        volatile unsigned int m_pacedCount;
+        bool m_pacerUsed;
+        bool m_pacing;
+        bool m_pacedSending;
+        mutable pthread_mutex_t m_pacedMutex;
+        pthread_cond_t m_pacedCond;
     };
 
     typedef std::map<unsigned int, Channel*> ChannelMap;
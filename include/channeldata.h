@@ -3,12 +3,40 @@
 
 #include <iostream>
 #include <queue>
+#include <cstddef>
+
+#include "buffer.h"
 
 namespace hydna {
   
+  /**
+   *  Data received on a channel. The instance owns its content, which is
+   *  freed when the instance is deleted.
+   */
   class ChannelData {
   public:
+    /**
+     *  Takes ownership of content allocated with new[].
+     */
     ChannelData(int priority, const char* content, int size, int ctype);
+
+    /**
+     *  Takes over one reference to a buffer that content points into.
+     */
+    ChannelData(int priority, Buffer* buffer, const char* content, int size, int ctype);
+
+    /**
+     *  Creates an instance with a copy of the content, which is stored
+     *  in the same allocation as the instance.
+     *
+     *  @return The instance, to be deleted as any other.
+     */
+    static ChannelData* copy(int priority, const char* content, int size, int ctype);
+
+    ~ChannelData();
+
+    static void* operator new(std::size_t size);
+    static void operator delete(void* ptr);
     
     /**
      *  Returns the data associated with this ChannelData instance.
@@ -28,6 +56,13 @@ namespace hydna {
     
     bool isBinaryContent() const;
 
+    /**
+     *  Returns the content type, see ContentType.
+     *
+     *  @return The content type.
+     */
+    int getContentType() const;
+
     /**
      *  Returns the size of the content.
      *
@@ -36,11 +71,19 @@ namespace hydna {
     int getSize() const;
 
   private:
+    ChannelData(ChannelData const &);
+    ChannelData& operator=(ChannelData const &);
+
+    static void* operator new(std::size_t size, unsigned int extra);
+    static void operator delete(void* ptr, unsigned int extra);
+
     int m_priority;
     const char* m_content;
     int m_size;
     int m_ctype;
     bool m_binary;
+    Buffer* m_buffer;
+    bool m_inline;
 
   };
 
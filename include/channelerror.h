@@ -41,7 +41,7 @@ namespace hydna {
         
         virtual ~ChannelError() throw() {}
 
-        unsigned int getCode() {
+        unsigned int getCode() const {
             return m_code;
         }
 
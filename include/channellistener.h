@@ -0,0 +1,57 @@
+#ifndef HYDNA_CHANNELLISTENER_H
+#define HYDNA_CHANNELLISTENER_H
+
+#include "channelerror.h"
+
+namespace hydna {
+
+    class Channel;
+
+    /**
+     *  Receives the events of a channel as they happen, instead of having
+     *  to poll isConnected() and the data and signal queues. See
+     *  Channel::setListener().
+     *
+     *  The methods are called on the thread that caused the event, which
+     *  for everything but a close() is the I/O thread of the connection.
+     *  They should return quickly, since no frames are read meanwhile. The
+     *  data and signals are still added to the queues of the channel
+     *  before the listener is called.
+     */
+    class ChannelListener {
+    public:
+        virtual ~ChannelListener();
+
+        /**
+         *  Called when the channel has been opened.
+         *
+         *  @param channel The channel.
+         */
+        virtual void onOpen(Channel& channel);
+
+        /**
+         *  Called when data has been added to the data queue.
+         *
+         *  @param channel The channel.
+         */
+        virtual void onData(Channel& channel);
+
+        /**
+         *  Called when a signal has been added to the signal queue.
+         *
+         *  @param channel The channel.
+         */
+        virtual void onSignal(Channel& channel);
+
+        /**
+         *  Called when the channel has been closed, or could not be
+         *  opened. The channel may be connected again from this call.
+         *
+         *  @param channel The channel.
+         *  @param error The cause, with code 0 if closed normally.
+         */
+        virtual void onClose(Channel& channel, ChannelError const &error);
+    };
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef HYDNA_CHANNELSET_H
+#define HYDNA_CHANNELSET_H
+
+#include <set>
+#include <vector>
+#include <pthread.h>
+
+namespace hydna {
+    class Channel;
+
+    /**
+     *  A set of channels that one consumer thread waits on, instead of
+     *  polling every channel in turn:
+     *
+     *      set.add(&channel);
+     *      set.add(&channel2);
+     *
+     *      while (set.wait(ready) > 0) {
+     *          for (i = 0; i < ready.size(); i++) {
+     *              // pop data and signals off ready[i]
+     *          }
+     *      }
+     *
+     *  Channels are put on a ready list by the I/O thread as data or
+     *  signals are received, or when they are closed, so a wait costs the
+     *  same no matter how many channels are in the set.
+     *
+     *  A channel is reported once for everything received up to the wait
+     *  that returns it, so all data and signals should be popped off it
+     *  before waiting again. Anything received after that wait reports it
+     *  again.
+     */
+    class ChannelSet {
+    public:
+        ChannelSet();
+
+        /**
+         *  Removes all channels from the set.
+         */
+        ~ChannelSet();
+
+        /**
+         *  Adds a channel to the set. A channel that already has data or
+         *  signals queued is ready right away. A channel is removed from
+         *  its set when it is deleted.
+         *
+         *  @param channel The channel.
+         *  @throw Error if the channel is in another set.
+         */
+        void add(Channel* channel);
+
+        /**
+         *  Removes a channel from the set. It is no longer returned by
+         *  wait(), even if it was ready.
+         *
+         *  @param channel The channel.
+         */
+        void remove(Channel* channel);
+
+        /**
+         *  Returns the number of channels in the set.
+         *
+         *  @return The number of channels.
+         */
+        unsigned int size() const;
+
+        /**
+         *  Waits until some channels have received data or signals, or
+         *  have been closed.
+         *
+         *  @param ready Set to the ready channels.
+         *  @param timeout The max time to wait, in milliseconds, or -1 to
+         *                 wait until a channel is ready.
+         *  @return The number of ready channels, 0 if the wait timed out
+         *          or the set is empty.
+         */
+        unsigned int wait(std::vector<Channel*>& ready, int timeout=-1);
+
+    private:
+        friend class Channel;
+
+        ChannelSet(ChannelSet const &);
+        ChannelSet& operator=(ChannelSet const &);
+
+        /**
+         *  Puts a channel on the ready list, unless it is already there.
+         *  Called with the data or signal mutex of the channel held.
+         */
+        void markReady(Channel* channel);
+
+        /**
+         *  Unlinks a channel that is in the set. The mutex must be held.
+         */
+        void unlink(Channel* channel);
+
+        std::set<Channel*> m_channels;
+        std::vector<Channel*> m_ready;
+        mutable pthread_mutex_t m_mutex;
+        pthread_cond_t m_readyCond;
+    };
+}
+
+#endif
@@ -35,6 +35,13 @@ namespace hydna {
     
     bool isBinaryContent() const;
 
+    /**
+     *  Returns the content type, see ContentType.
+     *
+     *  @return The content type.
+     */
+    int getContentType() const;
+
   private:
     int m_type;
     const char* m_content;
@@ -0,0 +1,42 @@
+#ifndef HYDNA_CLOCK_H
+#define HYDNA_CLOCK_H
+
+namespace hydna {
+
+    /**
+     *  Monotonic time source used for timeouts and latency measurements.
+     */
+    class Clock {
+    public:
+        /**
+         *  Returns the current monotonic time.
+         *
+         *  @return The time in microseconds.
+         */
+        static unsigned long long now();
+
+        /**
+         *  Returns the current monotonic time with nanosecond resolution.
+         *
+         *  @return The time in nanoseconds.
+         */
+        static unsigned long long nanos();
+
+        /**
+         *  Returns the monotonic time as of the last timer tick, a few
+         *  milliseconds at most, which is cheaper to read than now().
+         *
+         *  @return The time in microseconds.
+         */
+        static unsigned long long coarse();
+
+        /**
+         *  Returns how often the time returned by coarse() changes.
+         *
+         *  @return The resolution in microseconds.
+         */
+        static unsigned long long coarseResolution();
+    };
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef HYDNA_CODEC_H
+#define HYDNA_CODEC_H
+
+#include <string>
+
+namespace hydna {
+
+    /**
+     *  A payload compression codec. Codecs are compiled in with the
+     *  WITH_ZLIB, WITH_ZSTD and WITH_LZ4 make variables; use isAvailable()
+     *  to check which ones are present.
+     *
+     *  A codec instance keeps its compression state between calls and
+     *  must not be used by several threads at once.
+     */
+    class Codec {
+    public:
+        // Codec ids, as sent in the envelope.
+        static const unsigned char NONE = 0x00;
+        static const unsigned char ZLIB = 0x01;
+        static const unsigned char ZSTD = 0x02;
+        static const unsigned char LZ4 = 0x03;
+
+        static const unsigned char CODEC_COUNT = 0x04;
+
+        /**
+         *  Creates a codec.
+         *
+         *  @param id The codec id.
+         *  @return The codec, or NULL if it is not compiled in.
+         */
+        static Codec* create(unsigned char id);
+
+        /**
+         *  Checks if a codec is compiled in.
+         *
+         *  @param id The codec id.
+         *  @return True if available.
+         */
+        static bool isAvailable(unsigned char id);
+
+        /**
+         *  Returns the name of a codec.
+         *
+         *  @param id The codec id.
+         *  @return The name.
+         */
+        static const char* getName(unsigned char id);
+
+        /**
+         *  Returns the id of a dictionary, which is sent with every
+         *  compressed payload so that peers with another dictionary can
+         *  detect the mismatch. An empty dictionary has id 0.
+         *
+         *  @param dictionary The dictionary.
+         *  @return The id.
+         */
+        static unsigned int dictionaryId(std::string const &dictionary);
+
+        virtual ~Codec();
+
+        virtual unsigned char getId() const = 0;
+
+        /**
+         *  Sets a dictionary of data typical for the messages, which
+         *  improves the ratio for small messages. Both peers must use the
+         *  same dictionary.
+         *
+         *  @param dictionary The dictionary.
+         */
+        virtual void setDictionary(std::string const &dictionary) = 0;
+
+        /**
+         *  Compresses data.
+         *
+         *  @param in The data to compress.
+         *  @param size The size of the data.
+         *  @param out The destination.
+         *  @param capacity The size of the destination.
+         *  @return The compressed size, or 0 if it did not fit.
+         */
+        virtual unsigned int compress(const char* in,
+                                      unsigned int size,
+                                      char* out,
+                                      unsigned int capacity) = 0;
+
+        /**
+         *  Decompresses data.
+         *
+         *  @param in The compressed data.
+         *  @param size The size of the compressed data.
+         *  @param out The destination.
+         *  @param outSize The exact size of the decompressed data.
+         *  @return False if the data is corrupt.
+         */
+        virtual bool decompress(const char* in,
+                                unsigned int size,
+                                char* out,
+                                unsigned int outSize) = 0;
+    };
+}
+
+#endif
@@ -4,46 +4,83 @@
 #include <iostream>
 #include <streambuf>
 #include <map>
+#include <vector>
 #include <unistd.h>
 #include <string.h>
 
 #include "openrequest.h"
 #include "channelerror.h"
+#include "frame.h"
+#include "histogram.h"
+#include "stats.h"
+#include "tlssession.h"
+#include "endpoint.h"
+#include "memoryaccount.h"
+#include "ratelimiter.h"
 
 #define TAKE_N_BITS_FROM(b, p, n) ((b) >> (p)) & ((1 << (n)) - 1);
 
 namespace hydna {
     class Frame;
     class Channel;
+    struct FrameView;
 
     typedef std::map<unsigned int, Channel*> ChannelMap;
 
+    /**
+     *  Reconnect statistics for a connection.
+     */
+    struct ReconnectStats {
+        /** Number of connect attempts made while reconnecting. */
+        unsigned int attempts;
+
+        /** Number of successful reconnects. */
+        unsigned int reconnects;
+
+        /** Number of channels that was re-opened after a reconnect. */
+        unsigned int replayedOpens;
+
+        /** Number of writes dropped because the reconnect queue was full. */
+        unsigned int droppedFrames;
+
+        /** Time, in microseconds, the last reconnect took. */
+        unsigned long long lastReconnectTime;
+    };
+
 
     /**
      *  This class is used internally by the Channel class.
      *  A user of the library should not create an instance of this class.
      */
     class Connection {
+    public:
+        // Why a write failed, see writeBytes().
+        static const int WRITE_QUEUE_FULL = 1;
+        static const int WRITE_OVER_BUDGET = 2;
+        static const int WRITE_NOT_READY = 3;
+        static const int WRITE_DESTROYED = 4;
 
-        typedef std::map<std::string, Connection*> ConnectionMap;
+        /** The least delay, in milliseconds, between reconnect attempts. */
+        static const unsigned int MIN_RECONNECT_DELAY = 10;
 
-    public:
         /**
-         *  Return an available connection or create a new one.
+         *  Return an available connection or create a new one. Finding an
+         *  available connection is one hash lookup and does not allocate.
          *
-         *  @param host The host associated with the connection.
-         *  @param port The port associated with the connection.
+         *  @param url The URL, its host, port, auth and protocol select
+         *             the connection.
          *  @return The connection.
          */
-        static Connection* getConnection(std::string const &host, unsigned short port, std::string const &auth);
+        static Connection* getConnection(URL const &url);
 
         /**
          *  Initializes a new Channel instance.
          *
          *  @param host The host the connection should connect to.
          *  @param port The port the connection should connect to.
+         *  @param secure True to connect with TLS.
          */
-        Connection(std::string const &host, unsigned short port, std::string const &auth);
+        Connection(std::string const &host, unsigned short port, std::string const &auth, bool secure=false);
 
         ~Connection();
         
@@ -98,13 +135,122 @@ namespace hydna {
          *  Writes a frame to the connection.
          *
          *  @param frame The frame to be sent.
+         *  @param failure Set to WRITE_QUEUE_FULL or one of the others if
+         *                 the frame was not sent, unless NULL.
+         *  @return True if the frame was sent.
+         */
+        bool writeBytes(Frame& frame, int* failure=NULL);
+
+        /**
+         *  Writes a frame straight from the buffers of the caller, without
+         *  copying them into a Frame. The header, prefix and payload are
+         *  gathered into one write. A Frame is only built if the write has
+         *  to be queued while reconnecting.
+         *
+         *  @param ch The channel.
+         *  @param ctype The content type.
+         *  @param op The opcode.
+         *  @param flag The flag, or priority of data frames.
+         *  @param prefix Bytes sent before the payload, e.g. an envelope header.
+         *  @param prefixLength The size of the prefix.
+         *  @param payload The payload.
+         *  @param length The size of the payload.
+         *  @param failure Set to why the frame was not sent, unless NULL.
          *  @return True if the frame was sent.
          */
-        bool writeBytes(Frame& frame);
+        bool writeBytes(unsigned int ch,
+                        unsigned int ctype,
+                        unsigned int op,
+                        unsigned int flag,
+                        const char* prefix,
+                        unsigned int prefixLength,
+                        const char* payload,
+                        unsigned int length,
+                        int* failure=NULL);
+
+        /**
+         *  Writes data frames that are already encoded, back to back, in
+         *  one write. Nothing is queued while reconnecting, and a failed
+         *  write is left to the listening thread to recover from.
+         *
+         *  @param parts The frames.
+         *  @param count The number of parts, at most MAX_WRITE_PARTS.
+         *  @param frames The number of frames, for the statistics.
+         *  @return True if the frames was sent.
+         */
+        bool writeEncoded(const struct iovec* parts, int count, unsigned int frames);
+
+        /**
+         *  Returns the reconnect statistics of the connection.
+         *
+         *  @return The statistics.
+         */
+        ReconnectStats getReconnectStats();
+
+        /**
+         *  Returns the round-trip times, in microseconds, sampled from
+         *  echoed keepalives.
+         *
+         *  @return A snapshot of the round-trip times.
+         */
+        Histogram getRoundTripTimes();
+
+        /**
+         *  Returns a snapshot of the connection statistics. Never waits
+         *  for locks held by the listening thread.
+         *
+         *  @return The statistics.
+         */
+        ConnectionStats getStats();
+
+        /**
+         *  Returns the memory account of the connection, which the
+         *  channels charge their queued messages to.
+         *
+         *  @return The account.
+         */
+        MemoryAccount& getMemory();
+
+        /**
+         *  Returns the rate limit shared by the channels of the
+         *  connection, see Channel::setConnectionRateLimit().
+         *
+         *  @return The limiter.
+         */
+        RateLimiter& getRateLimiter();
         
         static bool m_followRedirects;
 
+        static bool m_autoReconnect;
+        static unsigned int m_reconnectInitialDelay;
+        static unsigned int m_reconnectMaxDelay;
+        static unsigned int m_reconnectMaxAttempts;
+        static unsigned int m_reconnectQueueLimit;
+
+        static unsigned int m_keepaliveInterval;
+        static unsigned int m_idleTimeout;
+
+        static bool m_tlsVerify;
+        static std::string m_tlsCaFile;
+        static bool m_kernelTls;
+
+        // Guarded by m_ioSettingsMutex, they are read by every new I/O
+        // thread.
+        static std::vector<unsigned int> m_ioCpus;
+        static int m_ioNumaNode;
+        static int m_ioPriority;
+        static pthread_mutex_t m_ioSettingsMutex;
+
+        static int m_memoryPolicy;
+        static unsigned long long m_connectionMemoryBudget;
+
+        static unsigned long long m_connectionMessageRate;
+        static unsigned long long m_connectionByteRate;
+        static unsigned int m_connectionRateBurst;
+
     private:
+        friend class FrameReplay;
+
         /**
          *  Check if there are any more references to the connection.
          */
@@ -115,8 +261,130 @@ namespace hydna {
          *
          *  @param host The host to connect to.
          *  @param port The port to connect to.
+         *  @param secure True to connect with TLS.
+         */
+        void connectConnection(std::string const &host, int port, std::string const &auth, bool secure);
+
+        /**
+         *  Handle a failure while connecting. Destroys the connection
+         *  unless a reconnect is in progress.
+         *
+         *  @param error The cause of the failure.
          */
-        void connectConnection(std::string const &host, int port, std::string const &auth);
+        void connectFailed(ChannelError const &error);
+
+        /**
+         *  Write a request frame to the connection and mark the request
+         *  as sent. Requests are not written while reconnecting, they are
+         *  replayed once the connection is re-established.
+         *
+         *  @param request The request to send.
+         *  @return True if the request was sent.
+         */
+        bool sendRequest(OpenRequest* request);
+
+        /**
+         *  Close the socket and end the TLS session, if any.
+         */
+        void closeSocket();
+
+        /**
+         *  Read from the socket, through the TLS session if there is one.
+         *
+         *  @param buffer The buffer to read to.
+         *  @param size The max number of bytes to read.
+         *  @return The number of bytes read, 0 on end of stream, -1 on error.
+         */
+        int socketRead(char* buffer, int size);
+
+        /**
+         *  Write to the socket, through the TLS session if there is one.
+         *
+         *  @param parts The buffers to write, in order.
+         *  @param count The number of buffers.
+         *  @return The number of bytes written, -1 on error.
+         */
+        int socketWrite(const struct iovec* parts, int count);
+
+        /**
+         *  Write a frame, or queue it while reconnecting, and count it in
+         *  the statistics.
+         *
+         *  @param parts The encoded frame, starting with the header.
+         *  @param count The number of parts, at most MAX_WRITE_PARTS.
+         *  @param failure Set to why the frame was not sent, unless NULL.
+         *  @return True if the frame was sent or queued.
+         */
+        bool writeFrame(const struct iovec* parts, int count, int* failure);
+
+        /**
+         *  Write raw bytes to the socket.
+         *
+         *  @param data The data to write.
+         *  @param size The number of bytes to write.
+         *  @return True if all bytes was written.
+         */
+        bool writeData(const char* data, int size);
+
+        /**
+         *  Write raw bytes gathered from several buffers to the socket.
+         *
+         *  @param parts The buffers to write, in order.
+         *  @param count The number of buffers, at most MAX_WRITE_PARTS.
+         *  @return True if all bytes was written. False on error, and
+         *          without writing if there are more buffers than
+         *          MAX_WRITE_PARTS.
+         */
+        bool writeData(const struct iovec* parts, int count);
+
+        /**
+         *  Read from the socket. Sends keepalives while waiting for data
+         *  and fails with ETIMEDOUT if nothing is received within the
+         *  idle timeout.
+         *
+         *  @param buffer The buffer to read to.
+         *  @param size The max number of bytes to read.
+         *  @return The number of bytes read, 0 on end of stream, -1 on error.
+         */
+        int readData(char* buffer, int size);
+
+        /**
+         *  Send a keepalive frame.
+         */
+        void sendKeepalive();
+
+        /**
+         *  Pauses reading while the memory budget is exceeded, if the
+         *  memory policy is MemoryAccount::BACKPRESSURE. Keepalives are
+         *  still sent while paused.
+         */
+        void waitForMemory();
+
+        /**
+         *  Returns true if a received message should be dropped because
+         *  the memory budget is exceeded, and counts it.
+         */
+        bool shedMessage(unsigned int ch);
+
+        /**
+         *  Queue a frame until the connection is re-established.
+         *  Requires the write lock.
+         */
+        void queueReconnectFrame(const struct iovec* parts, int count);
+
+        /**
+         *  Delete the frames queued while reconnecting. Requires the write
+         *  lock.
+         */
+        void clearReconnectQueue();
+
+        /**
+         *  Count an outgoing frame in the statistics.
+         *
+         *  @param data The frame.
+         *  @param size The size of the frame.
+         */
+        void countFrameOut(const char* data, int size);
 
         /**
          *  Send HTTP upgrade request.
@@ -133,6 +401,37 @@ namespace hydna {
          */
         void receiveHandler();
 
+        /**
+         *  Counts a decoded frame and hands it to the handler of its
+         *  opcode. Called for received frames and by FrameReplay.
+         *
+         *  @param frame The frame, which is only valid during the call.
+         */
+        void dispatchFrame(FrameView const &frame);
+
+        /**
+         *  Handle a broken connection. Reconnects if auto reconnect is
+         *  enabled, else the connection is destroyed.
+         *
+         *  @param error The cause of the failure.
+         *  @return True if the connection was re-established.
+         */
+        bool recover(ChannelError const &error);
+
+        /**
+         *  Re-establish the connection with exponential backoff and
+         *  replay all open channels.
+         *
+         *  @return True if the connection was re-established.
+         */
+        bool reconnect();
+
+        /**
+         *  Resend pending requests, re-open all open channels and
+         *  flush writes queued while reconnecting.
+         */
+        void replayChannels();
+
         /**
          *  Process an open frame.
          *
@@ -151,7 +450,8 @@ namespace hydna {
          *
          *  @param ch The channel that should receive the data.
          *  @param priority The priority of the data.
-         *  @param payload The content of the data.
+         *  @param payload The content of the data, which is not owned and
+         *                 is only valid during the call.
          *  @param size The size of the content.
          */
         void processDataFrame(unsigned int ch,
@@ -164,12 +464,14 @@ namespace hydna {
          *  Process a signal frame.
          *
          *  @param channel The channel that should receive the signal.
+         *  @param ch The id of the channel.
          *  @param flag The flag of the signal.
          *  @param payload The content of the signal.
          *  @param size The size of the content.
          *  @return False is something went wrong.
          */
         bool processSignalFrame(Channel* channel,
+                            unsigned int ch,
                             int ctype,
                             int flag,
                             const char* payload,
@@ -202,6 +504,31 @@ namespace hydna {
                             int flag, 
                             const char *payload, 
                             int size);
+
+        /**
+         *  Process the response of an open request replayed after a
+         *  reconnect.
+         *
+         *  @param request The replayed request.
+         *  @param ch The channel of the response.
+         *  @param errcode The error code of the open frame.
+         *  @param payload The content of the open frame.
+         *  @param size The size of the content.
+         */
+        void processReplayedOpenFrame(OpenRequest* request,
+                            unsigned int ch,
+                            int errcode,
+                            const char* payload,
+                            int size);
+
+        /**
+         *  Removes an answered open request and sends the first request
+         *  that waited for the same channel, if any.
+         *
+         *  @param ch The channel of the request.
+         *  @param request The answered request, which is deleted.
+         */
+        void advanceOpenQueue(unsigned int ch, OpenRequest* request);
             
         
         /**
@@ -209,27 +536,35 @@ namespace hydna {
          *
          *  @error The cause of the destroy.
          */
-        void destroy(ChannelError error);
+        void destroy(ChannelError const &error);
 
 
         static const unsigned int MAX_REDIRECT_ATTEMPTS = 5;
 
+        // Milliseconds between checks while reading is paused.
+        static const unsigned int MEMORY_WAIT_SLICE = 100;
+
         static const int HANDSHAKE_SIZE = 9;
         static const int HANDSHAKE_RESP_SIZE = 5;
 
-        static ConnectionMap m_availableConnections;
+        static const int READ_BUFFER_SIZE = 0x10000;
+        static const int MAX_WRITE_PARTS = 4;
+
+        // Available connections, chained per bucket by endpoint hash.
+        static const unsigned int CONNECTION_BUCKETS = 64;
+
+        static Connection* m_availableConnections[CONNECTION_BUCKETS];
         static pthread_mutex_t m_connectionMutex;
 
         pthread_mutex_t m_channelRefMutex;
         pthread_mutex_t m_destroyingMutex;
         pthread_mutex_t m_closingMutex;
         pthread_mutex_t m_openChannelsMutex;
-        pthread_mutex_t m_openWaitMutex;
         pthread_mutex_t m_pendingMutex;
         pthread_mutex_t m_resolveMutex; // new
-        pthread_mutex_t m_resolveWaitMutex; // new
         pthread_mutex_t m_resolveChannelsMutex; // new
         pthread_mutex_t m_listeningMutex;
+        pthread_mutex_t m_writeMutex;
 
         bool m_connecting;
         bool m_connected;
@@ -238,22 +573,57 @@ namespace hydna {
         bool m_destroying;
         bool m_closing;
         bool m_listening;
+        bool m_reconnecting;
 
         std::string m_host;
         unsigned short m_port;
         std::string m_auth;
+        bool m_secure;
+        Endpoint m_endpoint;
+        Connection* m_nextAvailable;
         int m_connectionFDS;
+        TlsSession* m_tls;
+        unsigned int m_kernelTlsGauge;
         unsigned int m_attempt;
+        unsigned int m_seed;
 
         OpenRequestMap m_pendingOpenRequests;
         OpenRequestPathMap m_pendingResolveRequests; // new for the resolve step
         ChannelMap m_openChannels;
-        OpenRequestQueueMap m_openWaitQueue;
-        OpenRequestQueuePathMap m_resolveWaitQueue; // resolve que
+        FrameQueue m_reconnectQueue;
+        ReconnectStats m_reconnectStats;
+
+        unsigned long long m_lastReceived;
+        unsigned long long m_lastKeepalive;
+        unsigned long long m_keepaliveSent;
+        Histogram m_roundTripTimes;
+
+        Counter m_framesIn[ConnectionStats::OP_COUNT];
+        Counter m_bytesIn[ConnectionStats::OP_COUNT];
+        Counter m_framesOut[ConnectionStats::OP_COUNT];
+        Counter m_bytesOut[ConnectionStats::OP_COUNT];
+        Histogram m_resolveLatency;
+        Histogram m_openLatency;
+        Histogram m_writeLatency;
+        unsigned int m_openChannelsGauge;
+        unsigned int m_pendingResolvesGauge;
+        unsigned int m_pendingOpensGauge;
+        unsigned int m_reconnectQueueGauge;
+        int m_ioThreadCpu;
+        unsigned int m_ioThreadConfig;
+
+        // Tells the connections apart in a frame capture.
+        unsigned int m_captureSource;
         
         int m_channelRefCount;
         
         pthread_t listeningThread;
+        bool m_hasListener;
+        bool m_listenerExited;
+        bool m_deleteOnExit;
+
+        MemoryAccount m_memory;
+        RateLimiter m_rateLimiter;
 
         /**
          * The method that is called in the new thread.
@@ -265,8 +635,6 @@ namespace hydna {
         static void* listen(void *ptr);
     };
 
-    typedef std::map<std::string, Connection*> ConnectionMap;
-
     /**
      * A struct with args that 
      * the new thread is using.
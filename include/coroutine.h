@@ -0,0 +1,366 @@
+#ifndef HYDNA_COROUTINE_H
+#define HYDNA_COROUTINE_H
+
+#include "message.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace hydna {
+
+    /**
+     *  Resumes a suspended coroutine, e.g. by posting it to an event loop.
+     */
+    typedef std::function<void(std::coroutine_handle<>)> Scheduler;
+
+    /**
+     *  A channel that is used from C++20 coroutines:
+     *
+     *      co_await channel.open("localhost:7010/hello");
+     *      co_await channel.send("Hello World");
+     *      Message message = co_await channel.receive();
+     *
+     *  A suspended coroutine is resumed by the I/O thread of the connection
+     *  as soon as the channel is opened or data is received, or handed to
+     *  the scheduler if one is given. Nothing is polled, so one thread can
+     *  serve any number of channels. A coroutine that is resumed on the I/O
+     *  thread holds up reading until it suspends again.
+     *
+     *  Only one coroutine at a time may wait for data on a channel. Sends
+     *  never suspend, they write the frame from the calling thread just
+     *  like Channel::writeBytes().
+     *
+     *  The library itself is C++98, this header is only available when
+     *  compiling with C++20 or later.
+     */
+    class AsyncChannel : private ChannelListener {
+    public:
+        class OpenAwaiter {
+        public:
+            explicit OpenAwaiter(AsyncChannel& channel) : m_channel(channel) {
+            }
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::lock_guard<std::mutex> lock(m_channel.m_mutex);
+
+                if (m_channel.m_opened || m_channel.m_closed) {
+                    return false;
+                }
+
+                m_channel.m_opening = handle;
+                return true;
+            }
+
+            /**
+             *  @throw ChannelError if the channel could not be opened.
+             */
+            void await_resume() {
+                std::lock_guard<std::mutex> lock(m_channel.m_mutex);
+
+                if (!m_channel.m_opened) {
+                    m_channel.throwClosed("The channel was closed before it was opened");
+                }
+            }
+
+        private:
+            AsyncChannel& m_channel;
+        };
+
+        class ReceiveAwaiter {
+        public:
+            explicit ReceiveAwaiter(AsyncChannel& channel) : m_channel(channel) {
+            }
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::lock_guard<std::mutex> lock(m_channel.m_mutex);
+
+                m_message = Message(m_channel.m_channel.popData());
+
+                if (m_message || m_channel.m_closed) {
+                    return false;
+                }
+
+                m_handle = handle;
+                m_channel.m_receiving = this;
+                return true;
+            }
+
+            /**
+             *  @return The message, which is empty if the channel was
+             *          closed normally.
+             *  @throw ChannelError if the channel was closed because of an
+             *         error.
+             */
+            Message await_resume() {
+                if (!m_message) {
+                    std::lock_guard<std::mutex> lock(m_channel.m_mutex);
+
+                    if (m_channel.m_error.getCode() != 0) {
+                        throw m_channel.m_error;
+                    }
+                }
+
+                return std::move(m_message);
+            }
+
+        private:
+            friend class AsyncChannel;
+
+            AsyncChannel& m_channel;
+            std::coroutine_handle<> m_handle;
+            Message m_message;
+        };
+
+        class SendAwaiter {
+        public:
+            SendAwaiter(AsyncChannel& channel,
+                        const char* data,
+                        std::size_t length,
+                        unsigned int ctype,
+                        unsigned int priority)
+                : m_channel(channel), m_data(data), m_length(length),
+                  m_ctype(ctype), m_priority(priority) {
+            }
+
+            bool await_ready() const noexcept {
+                return true;
+            }
+
+            void await_suspend(std::coroutine_handle<>) noexcept {
+            }
+
+            void await_resume() {
+                m_channel.m_channel.writeBytes(m_data, 0, m_length, m_ctype, m_priority);
+            }
+
+        private:
+            AsyncChannel& m_channel;
+            const char* m_data;
+            std::size_t m_length;
+            unsigned int m_ctype;
+            unsigned int m_priority;
+        };
+
+        /**
+         *  @param scheduler Resumes coroutines when given, otherwise they
+         *                   are resumed directly on the I/O thread.
+         */
+        explicit AsyncChannel(Scheduler scheduler=Scheduler())
+            : m_scheduler(std::move(scheduler)), m_opened(false), m_closed(false),
+              m_error("", 0x0), m_receiving(nullptr) {
+            m_channel.setListener(this);
+        }
+
+        AsyncChannel(AsyncChannel const &) = delete;
+        AsyncChannel& operator=(AsyncChannel const &) = delete;
+
+        ~AsyncChannel() {
+            m_channel.setListener(nullptr);
+            m_channel.close();
+        }
+
+        /**
+         *  Returns the underlying channel, e.g. to change its settings
+         *  before it is opened.
+         */
+        Channel& channel() noexcept {
+            return m_channel;
+        }
+
+        /**
+         *  Starts to open the channel, see Channel::connect(). The returned
+         *  awaiter completes when the channel is open.
+         */
+        OpenAwaiter open(std::string const &expr,
+                         unsigned int mode=ChannelMode::READWRITE,
+                         std::string_view token=std::string_view()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_opened = false;
+                m_closed = false;
+                m_error = ChannelError("", 0x0);
+            }
+
+            m_channel.connect(expr, mode, token.empty() ? nullptr : token.data(), token.size());
+            return OpenAwaiter(*this);
+        }
+
+        /**
+         *  Waits for the next message on the channel.
+         */
+        ReceiveAwaiter receive() {
+            return ReceiveAwaiter(*this);
+        }
+
+        /**
+         *  Sends a message. The data is not copied and must stay valid
+         *  until the awaiter is awaited.
+         */
+        SendAwaiter send(std::string_view data,
+                         unsigned int ctype=ContentType::UTF8,
+                         unsigned int priority=0) {
+            return SendAwaiter(*this, data.data(), data.size(), ctype, priority);
+        }
+
+        SendAwaiter send(std::span<const char> data,
+                         unsigned int ctype=ContentType::BINARY,
+                         unsigned int priority=0) {
+            return SendAwaiter(*this, data.data(), data.size(), ctype, priority);
+        }
+
+        SendAwaiter send(std::string const &data,
+                         unsigned int ctype=ContentType::UTF8,
+                         unsigned int priority=0) {
+            return send(std::string_view(data), ctype, priority);
+        }
+
+        SendAwaiter send(const char* data,
+                         unsigned int ctype=ContentType::UTF8,
+                         unsigned int priority=0) {
+            return send(std::string_view(data), ctype, priority);
+        }
+
+        /**
+         *  Closes the channel. A coroutine waiting for data is resumed
+         *  with an empty message once the close is confirmed.
+         */
+        void close() {
+            m_channel.close();
+        }
+
+    private:
+        void onOpen(Channel&) override {
+            std::coroutine_handle<> handle;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_opened = true;
+                handle = std::exchange(m_opening, nullptr);
+            }
+
+            resume(handle);
+        }
+
+        void onData(Channel&) override {
+            ReceiveAwaiter* receiving;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                if (!m_receiving) {
+                    return;
+                }
+
+                Message message(m_channel.popData());
+
+                if (!message) {
+                    return;
+                }
+
+                receiving = std::exchange(m_receiving, nullptr);
+                receiving->m_message = std::move(message);
+            }
+
+            resume(receiving->m_handle);
+        }
+
+        void onClose(Channel&, ChannelError const &error) override {
+            std::coroutine_handle<> opening;
+            ReceiveAwaiter* receiving;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_closed = true;
+                m_error = error;
+                opening = std::exchange(m_opening, nullptr);
+                receiving = std::exchange(m_receiving, nullptr);
+            }
+
+            resume(opening);
+
+            if (receiving) {
+                resume(receiving->m_handle);
+            }
+        }
+
+        void resume(std::coroutine_handle<> handle) {
+            if (!handle) {
+                return;
+            }
+
+            if (m_scheduler) {
+                m_scheduler(handle);
+            } else {
+                handle.resume();
+            }
+        }
+
+        /**
+         *  Throws the error that closed the channel. The mutex must be
+         *  held.
+         */
+        void throwClosed(const char* message) {
+            if (m_error.getCode() != 0) {
+                throw m_error;
+            }
+
+            throw ChannelError(message);
+        }
+
+        Channel m_channel;
+        Scheduler m_scheduler;
+        std::mutex m_mutex;
+        bool m_opened;
+        bool m_closed;
+        ChannelError m_error;
+        std::coroutine_handle<> m_opening;
+        ReceiveAwaiter* m_receiving;
+    };
+
+    /**
+     *  A coroutine that starts when called and is not awaited by anyone;
+     *  it destroys itself when it finishes.
+     */
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() noexcept {
+                return Detached();
+            }
+
+            std::suspend_never initial_suspend() noexcept {
+                return std::suspend_never();
+            }
+
+            std::suspend_never final_suspend() noexcept {
+                return std::suspend_never();
+            }
+
+            void return_void() noexcept {
+            }
+
+            void unhandled_exception() noexcept {
+                std::terminate();
+            }
+        };
+    };
+}
+
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef HYDNA_DEADLINETIMER_H
+#define HYDNA_DEADLINETIMER_H
+
+#include <map>
+#include <pthread.h>
+
+namespace hydna {
+    class Channel;
+
+    /**
+     *  Wakes channels up at their deadlines: to time out an open, see
+     *  Channel::setOpenTimeout(), to send messages queued by the rate
+     *  limit, see Channel::setRatePolicy(), and to send batches that have
+     *  waited for long enough, see Channel::setBatchDelay(). The
+     *  deadlines are kept by one thread, which is started the first time
+     *  a deadline is added.
+     *
+     *  This class is used internally by the Channel class.
+     */
+    class DeadlineTimer {
+    public:
+        // What a deadline is for, and what is called when it passes.
+        static const int OPEN = 0;   // Channel::openTimedOut()
+        static const int PACED = 1;  // Channel::sendPaced()
+        static const int BATCH = 2;  // Channel::batchTimedOut()
+
+        /**
+         *  Returns the timer shared by all channels. It is never
+         *  destroyed.
+         *
+         *  @return The shared timer.
+         */
+        static DeadlineTimer& getShared();
+
+        /**
+         *  Calls the channel on the timer thread once the deadline has
+         *  passed, unless the deadline is removed before.
+         *
+         *  @param channel The channel.
+         *  @param kind What the deadline is for, e.g. OPEN.
+         *  @param deadline The deadline, see Clock::now().
+         *  @return False if the timer thread could not be started, in
+         *          which case nothing is added.
+         */
+        bool add(Channel* channel, int kind, unsigned long long deadline);
+
+        /**
+         *  Removes a deadline.
+         *
+         *  @param channel The channel.
+         *  @param kind What the deadline is for.
+         *  @param deadline The deadline that was added.
+         */
+        void remove(Channel* channel, int kind, unsigned long long deadline);
+
+        /**
+         *  Removes every deadline of a channel, and waits for the channel
+         *  to be done if it is being called right now, e.g. before it is
+         *  deleted.
+         *
+         *  @param channel The channel.
+         */
+        void removeChannel(Channel* channel);
+
+        /**
+         *  Checks if the calling thread is the timer thread.
+         *
+         *  @return True if called back by the timer.
+         */
+        bool isTimerThread();
+
+    private:
+        struct Wakeup {
+            Channel* channel;
+            int kind;
+        };
+
+        typedef std::multimap<unsigned long long, Wakeup> DeadlineMap;
+
+        DeadlineTimer();
+        DeadlineTimer(DeadlineTimer const &);
+        DeadlineTimer& operator=(DeadlineTimer const &);
+
+        static void createShared();
+        static void* run(void* ptr);
+
+        void runTimer();
+
+        /**
+         *  Calls the channel of a deadline that has passed.
+         */
+        static void fire(Wakeup const &wakeup, unsigned long long deadline);
+
+        DeadlineMap m_deadlines;
+        Channel* m_firing;
+        bool m_started;
+        pthread_t m_thread;
+        pthread_mutex_t m_mutex;
+        pthread_cond_t m_changed;
+        pthread_cond_t m_fired;
+
+        static DeadlineTimer* m_shared;
+        static pthread_once_t m_sharedOnce;
+    };
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef HYDNA_ENDPOINT_H
+#define HYDNA_ENDPOINT_H
+
+#include <string>
+
+#include "url.h"
+
+namespace hydna {
+
+    /**
+     *  The host, port, auth and transport that identify a connection.
+     *  Each connection builds its endpoint once, hash included, so that
+     *  the connection for a URL is found without building a key.
+     *
+     *  This class is used internally by the Connection class.
+     */
+    class Endpoint {
+    public:
+        Endpoint(std::string const &host, unsigned short port, std::string const &auth, bool secure);
+
+        /**
+         *  Hashes the endpoint of a URL, the same way as the endpoint of
+         *  a connection is hashed.
+         *
+         *  @param url The URL.
+         *  @return The hash.
+         */
+        static unsigned int hash(URL const &url);
+
+        /**
+         *  Returns true if the endpoint is the one of a URL.
+         *
+         *  @param url The URL.
+         *  @param hash The hash of the URL, see hash().
+         *  @return True if they match.
+         */
+        bool matches(URL const &url, unsigned int hash) const;
+
+        std::string const &getHost() const;
+        unsigned short getPort() const;
+        std::string const &getAuth() const;
+        bool isSecure() const;
+        unsigned int getHash() const;
+
+    private:
+        static unsigned int hash(const char* host,
+                                 size_t hostSize,
+                                 unsigned short port,
+                                 const char* auth,
+                                 size_t authSize,
+                                 bool secure);
+
+        std::string m_host;
+        unsigned short m_port;
+        std::string m_auth;
+        bool m_secure;
+        unsigned int m_hash;
+    };
+}
+
+#endif
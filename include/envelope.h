@@ -0,0 +1,223 @@
+#ifndef HYDNA_ENVELOPE_H
+#define HYDNA_ENVELOPE_H
+
+#include <map>
+
+#include "frame.h"
+#include "buffer.h"
+#include "memoryaccount.h"
+
+namespace hydna {
+
+    /**
+     *  The header of a COMPRESSED payload.
+     */
+    struct CompressedHeader {
+        unsigned char codec;
+        unsigned char kind;
+        unsigned int dictionaryId;
+        unsigned int size;
+    };
+
+    /**
+     *  The payload envelope used between hydna-cc clients that have
+     *  enabled it with Channel::setEnvelope(). Every DATA payload starts
+     *  with the MAGIC byte, which is never the first byte of UTF-8 text
+     *  and also tells the version of the envelope, and a kind byte that
+     *  tells how the rest of the payload is encoded. A payload that does
+     *  not start with them is not in an envelope.
+     *
+     *  A FRAGMENT payload continues with a 12 byte header, the message id,
+     *  the total size of the message and the offset of the fragment, all
+     *  in network byte order.
+     *
+     *  A BATCH payload continues with a sequence of records, each one a
+     *  two byte length in network byte order followed by the message.
+     *
+     *  A COMPRESSED payload continues with the codec, the kind of the
+     *  compressed payload (RAW or BATCH), the id of the dictionary (four
+     *  bytes) and the decompressed size (two bytes), followed by the
+     *  compressed payload without its header.
+     */
+    class Envelope {
+    public:
+        /** Version 1 of the envelope. */
+        static const unsigned char MAGIC = 0xC1;
+
+        // Kinds
+        static const unsigned char RAW = 0x00;
+        static const unsigned char FRAGMENT = 0x01;
+        static const unsigned char BATCH = 0x02;
+        static const unsigned char COMPRESSED = 0x03;
+
+        static const unsigned int HEADER_SIZE = 2;
+        static const unsigned int FRAGMENT_HEADER_SIZE = HEADER_SIZE + 12;
+
+        /** The largest message that fits in a single RAW frame. */
+        static const unsigned int RAW_MAX_SIZE = Frame::PAYLOAD_MAX_LIMIT - HEADER_SIZE;
+
+        /** The largest number of message bytes carried by a fragment. */
+        static const unsigned int FRAGMENT_MAX_SIZE = Frame::PAYLOAD_MAX_LIMIT - FRAGMENT_HEADER_SIZE;
+
+        static const unsigned int BATCH_RECORD_HEADER_SIZE = 2;
+
+        /** Messages larger than this are never batched. */
+        static const unsigned int BATCH_RECORD_MAX_SIZE = 1024;
+
+        /** How long a batch waits by default, in milliseconds. */
+        static const unsigned int DEFAULT_BATCH_DELAY = 10;
+
+        static const unsigned int COMPRESSED_HEADER_SIZE = HEADER_SIZE + 8;
+
+        /**
+         *  Writes the header that every payload starts with.
+         *
+         *  @param header The destination, HEADER_SIZE bytes.
+         *  @param kind The kind of the payload.
+         */
+        static void writeHeader(char* header, unsigned char kind);
+
+        /**
+         *  Checks if a payload is in an envelope.
+         *
+         *  @param payload The payload.
+         *  @param size The size of the payload.
+         *  @return True if it starts with MAGIC and a known kind.
+         */
+        static bool isEnvelope(const char* payload, unsigned int size);
+
+        /**
+         *  Returns the kind of a payload that is in an envelope.
+         */
+        static unsigned char getKind(const char* payload) {
+            return (unsigned char)payload[1];
+        }
+
+        /**
+         *  Writes a fragment header.
+         *
+         *  @param header The destination, FRAGMENT_HEADER_SIZE bytes.
+         *  @param id The message id.
+         *  @param total The total size of the message.
+         *  @param offset The offset of the fragment within the message.
+         */
+        static void writeFragmentHeader(char* header,
+                                        unsigned int id,
+                                        unsigned int total,
+                                        unsigned int offset);
+
+        /**
+         *  Reads a fragment header.
+         *
+         *  @return False if the payload is too short.
+         */
+        static bool readFragmentHeader(const char* payload,
+                                       unsigned int size,
+                                       unsigned int& id,
+                                       unsigned int& total,
+                                       unsigned int& offset);
+
+        /**
+         *  Writes a compressed header.
+         *
+         *  @param header The destination, COMPRESSED_HEADER_SIZE bytes.
+         *  @param compressed The header values.
+         */
+        static void writeCompressedHeader(char* header, CompressedHeader const &compressed);
+
+        /**
+         *  Reads a compressed header.
+         *
+         *  @return False if the payload is too short.
+         */
+        static bool readCompressedHeader(const char* payload,
+                                         unsigned int size,
+                                         CompressedHeader& compressed);
+    };
+
+    /**
+     *  Reassembles fragmented messages into contiguous pooled buffers.
+     *  Fragments of a message must arrive in order, fragments of different
+     *  messages may be interleaved.
+     */
+    class Reassembler {
+    public:
+        static const unsigned int DEFAULT_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+        /**
+         *  The number of messages that may be in progress at once. The
+         *  oldest is dropped to make room for a new one.
+         */
+        static const unsigned int MAX_PENDING = 16;
+
+        Reassembler();
+        ~Reassembler();
+
+        /**
+         *  Sets the size of the largest message that is accepted. Larger
+         *  messages are dropped.
+         *
+         *  @param value The size in bytes.
+         */
+        void setMaxMessageSize(unsigned int value);
+
+        unsigned int getMaxMessageSize() const;
+
+        /**
+         *  Sets the account that the messages in progress are charged to,
+         *  and moves the bytes charged so far to it.
+         *
+         *  @param memory The account.
+         */
+        void setMemory(MemoryAccount* memory);
+
+        /**
+         *  Adds a FRAGMENT payload, including its envelope header.
+         *
+         *  @param payload The payload.
+         *  @param size The size of the payload.
+         *  @return The completed message, with one reference that is
+         *          passed to the caller, or NULL.
+         */
+        Buffer* add(const char* payload, unsigned int size);
+
+        /**
+         *  Returns the number of fragments that has been dropped, either
+         *  because they were malformed, out of order or too large.
+         *
+         *  @return The number of dropped fragments.
+         */
+        unsigned long long getDropped() const;
+
+        /**
+         *  Drops all messages in progress.
+         */
+        void clear();
+
+    private:
+        struct Pending {
+            Buffer* buffer;
+            unsigned int total;
+            unsigned long long started;
+        };
+
+        typedef std::map<unsigned int, Pending> PendingMap;
+
+        Reassembler(Reassembler const &);
+        Reassembler& operator=(Reassembler const &);
+
+        /**
+         *  Drops a message in progress.
+         */
+        void drop(PendingMap::iterator it);
+
+        PendingMap m_pending;
+        MemoryAccount* m_memory;
+        unsigned long long m_bytes;
+        unsigned int m_maxMessageSize;
+        unsigned long long m_dropped;
+        unsigned long long m_started;
+    };
+}
+
+#endif
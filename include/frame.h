@@ -3,6 +3,9 @@
 
 #include <iostream>
 #include <vector>
+#include <queue>
+
+#include <sys/uio.h>
 
 typedef std::vector<char> ByteArray;
 
@@ -50,6 +53,40 @@ namespace hydna {
                 const char* payload=NULL,
                 unsigned int offset=0,
                 unsigned int length=0);
+
+        /**
+         *  Creates a frame whose payload is a prefix followed by a slice of
+         *  the data, without first joining them.
+         */
+        Frame(unsigned int ch,
+                unsigned int ctype,
+                unsigned int op,
+                unsigned int flag,
+                const char* prefix,
+                unsigned int prefixLength,
+                const char* payload,
+                unsigned int offset,
+                unsigned int length);
+
+        /**
+         *  Creates a frame from an encoded frame that is split in parts,
+         *  as written by Connection::writeBytes().
+         */
+        Frame(const struct iovec* parts, int count);
+
+        /**
+         *  Encodes the header of a frame, including the length prefix,
+         *  so that the payload can be written from where it is.
+         *
+         *  @param header The destination, of HEADER_SIZE + LENGTH_OFFSET bytes.
+         *  @param length The size of the payload.
+         */
+        static void writeHeader(char* header,
+                                unsigned int ch,
+                                unsigned int ctype,
+                                unsigned int op,
+                                unsigned int flag,
+                                unsigned int length);
         
         void writeByte(char value);
         void writeBytes(const char* value, int offset, int length);
@@ -68,6 +105,8 @@ namespace hydna {
         char* m_token;
 
     };
+
+    typedef std::queue<Frame*> FrameQueue;
 }
 
 #endif
@@ -0,0 +1,100 @@
+#ifndef HYDNA_FRAMEPARSER_H
+#define HYDNA_FRAMEPARSER_H
+
+#include <iostream>
+
+#include "frame.h"
+
+namespace hydna {
+
+    /**
+     *  A decoded frame. The payload points into the data that was fed to
+     *  the parser, or into the parser itself if the frame was split across
+     *  several calls to feed(), and is only valid until the next call to
+     *  FrameParser::next() or FrameParser::feed(). The encoded frame, length
+     *  prefix included, lies right before the payload.
+     */
+    struct FrameView {
+        unsigned int ch;
+        int ctype;
+        int op;
+        int flag;
+        const char* payload;
+        unsigned int size;
+    };
+
+    /**
+     *  Incremental frame decoder that is independent of the socket. Bytes
+     *  are fed in spans of any size and frames are returned as views,
+     *  without allocating. Frames may be split at any byte boundary, in
+     *  which case the partial frame is copied into a buffer owned by the
+     *  parser.
+     *
+     *      parser.feed(data, size);
+     *
+     *      while (parser.next(frame)) {
+     *          ...
+     *      }
+     */
+    class FrameParser {
+    public:
+        /** The largest encoded frame, including the length prefix. */
+        static const unsigned int FRAME_MAX_SIZE = 0xFFFF + Frame::LENGTH_OFFSET;
+
+        FrameParser();
+
+        /**
+         *  Sets the bytes to parse. Any bytes left over from the previous
+         *  span are kept by the parser and prepended to this one.
+         *
+         *  @param data The bytes.
+         *  @param size The number of bytes.
+         */
+        void feed(const char* data, unsigned int size);
+
+        /**
+         *  Decodes the next complete frame.
+         *
+         *  @param frame The decoded frame.
+         *  @return True if a frame was decoded, false if more bytes are
+         *          needed or the stream is corrupt.
+         */
+        bool next(FrameView& frame);
+
+        /**
+         *  Checks if an invalid frame header was encountered. No more
+         *  frames are returned until the parser is reset.
+         *
+         *  @return True if the stream is corrupt.
+         */
+        bool isCorrupt() const;
+
+        /**
+         *  Returns the number of bytes of a partial frame that the parser
+         *  is holding on to.
+         *
+         *  @return The number of buffered bytes.
+         */
+        unsigned int getBuffered() const;
+
+        /**
+         *  Discards all buffered bytes and clears the corrupt state.
+         */
+        void reset();
+
+    private:
+        static unsigned int frameSize(const char* header);
+        static void decode(const char* data, FrameView& frame);
+
+        bool buffer(unsigned int size);
+
+        const char* m_data;
+        unsigned int m_size;
+        unsigned int m_buffered;
+        bool m_corrupt;
+
+        char m_buffer[FRAME_MAX_SIZE];
+    };
+}
+
+#endif
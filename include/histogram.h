@@ -0,0 +1,71 @@
+#ifndef HYDNA_HISTOGRAM_H
+#define HYDNA_HISTOGRAM_H
+
+namespace hydna {
+
+    /**
+     *  A log-linear histogram in the style of HdrHistogram. Values below
+     *  64 are counted exactly, larger values with a relative error of at
+     *  most 1/32.
+     *
+     *  Recording is lock-free and may be done from any thread. Copying a
+     *  histogram gives a snapshot of it.
+     */
+    class Histogram {
+    public:
+        static const int SUB_BUCKET_BITS = 5;
+        static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+        static const int BUCKET_COUNT = 34 * SUB_BUCKET_COUNT;
+
+        Histogram();
+
+        /**
+         *  Records a value. Values that are too large to be tracked are
+         *  counted in the last bucket.
+         *
+         *  @param value The value to record.
+         */
+        void record(unsigned long long value);
+
+        /**
+         *  Removes all recorded values.
+         */
+        void reset();
+
+        /**
+         *  Merges the values of another histogram into this one.
+         *
+         *  @param other The histogram to merge.
+         */
+        void add(Histogram const &other);
+
+        unsigned long long getCount() const;
+
+        unsigned long long getMin() const;
+
+        unsigned long long getMax() const;
+
+        double getMean() const;
+
+        /**
+         *  Returns the value at the given percentile.
+         *
+         *  @param percentile The percentile, between 0 and 100.
+         *  @return The value, or 0 if nothing has been recorded.
+         */
+        unsigned long long getPercentile(double percentile) const;
+
+    private:
+        static int indexOf(unsigned long long value);
+
+        static unsigned long long valueAt(int index);
+
+        unsigned long long m_counts[BUCKET_COUNT];
+        unsigned long long m_count;
+        unsigned long long m_total;
+        unsigned long long m_min;
+        unsigned long long m_max;
+    };
+}
+
+#endif
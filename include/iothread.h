@@ -0,0 +1,71 @@
+#ifndef HYDNA_IOTHREAD_H
+#define HYDNA_IOTHREAD_H
+
+#include <string>
+#include <vector>
+
+namespace hydna {
+
+    /**
+     *  Names and places the threads started by the library. The settings
+     *  of the I/O threads are set with Channel::setIoThreadCpus(),
+     *  Channel::setIoThreadNumaNode() and Channel::setIoThreadPriority(),
+     *  and applied by each I/O thread as it starts.
+     *
+     *  This class is used internally by the Connection class.
+     */
+    class IoThread {
+    public:
+        // Settings that were applied, see configure().
+        static const unsigned int PINNED = 0x01;
+        static const unsigned int NUMA_BOUND = 0x02;
+        static const unsigned int REALTIME = 0x04;
+
+        /**
+         *  Parses a list of CPUs in the format of taskset and sysfs,
+         *  e.g. "0-3,8,10-11".
+         *
+         *  @param list The list.
+         *  @return The CPUs, in order.
+         *  @throw RangeError if the list is malformed.
+         */
+        static std::vector<unsigned int> parseCpuList(std::string const &list);
+
+        /**
+         *  Returns the CPUs of a NUMA node.
+         *
+         *  @param node The node.
+         *  @return The CPUs, empty if the node is unknown.
+         */
+        static std::vector<unsigned int> getNodeCpus(int node);
+
+        /**
+         *  Names the calling thread, so that it shows up in top and perf.
+         *  Names are cut to 15 characters.
+         *
+         *  @param name The name.
+         */
+        static void setName(std::string const &name);
+
+        /**
+         *  Configures the calling thread. Memory that the thread touches
+         *  after the call, e.g. its buffers and the unused part of its
+         *  stack, is placed on the node. The stack is mapped, and its top
+         *  pages touched, before the thread starts, and those pages are
+         *  not moved. Settings that cannot be applied, e.g. a real-time
+         *  priority without the privilege, are skipped.
+         *
+         *  @param cpus The CPUs to run on, empty for any. When empty and a
+         *              node is given, the CPUs of the node.
+         *  @param node The NUMA node to allocate memory from, -1 for any.
+         *  @param priority The SCHED_FIFO priority, 0 for the normal
+         *                  scheduler.
+         *  @return The settings that were applied.
+         */
+        static unsigned int configure(std::vector<unsigned int> const &cpus,
+                                      int node,
+                                      int priority);
+    };
+}
+
+#endif
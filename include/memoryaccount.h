@@ -0,0 +1,118 @@
+#ifndef HYDNA_MEMORYACCOUNT_H
+#define HYDNA_MEMORYACCOUNT_H
+
+#include <pthread.h>
+
+#include "stats.h"
+
+namespace hydna {
+
+    /**
+     *  Counts the bytes held by the library, by category. Each connection
+     *  has an account and charges to it are also charged to the global
+     *  account of the library. An account may have a budget, see
+     *  Channel::setMemoryBudget() and Channel::setConnectionMemoryBudget().
+     *
+     *  This class is used internally by the Channel and Connection
+     *  classes.
+     */
+    class MemoryAccount {
+    public:
+        // Categories, see MemoryStats.
+        static const int DATA = 0;
+        static const int SIGNALS = 1;
+        static const int REQUESTS = 2;
+        static const int RECONNECT_QUEUE = 3;
+        static const int CHANNELS = 4;
+        static const int REASSEMBLY = 5;
+
+        // What a connection does with received messages over budget.
+        static const int BACKPRESSURE = 0;
+        static const int SHED = 1;
+
+        /**
+         *  Initializes a new account.
+         *
+         *  @param parent The account that is charged as well, if any.
+         */
+        MemoryAccount(MemoryAccount* parent=NULL);
+
+        /**
+         *  Returns the account of the library as a whole. It is never
+         *  destroyed.
+         *
+         *  @return The global account.
+         */
+        static MemoryAccount& getGlobal();
+
+        void charge(int category, unsigned long long bytes);
+        void release(int category, unsigned long long bytes);
+
+        /**
+         *  Charges bytes already charged to the parent to this account as
+         *  well. Used when a channel with queued messages joins a
+         *  connection.
+         */
+        void attach(int category, unsigned long long bytes);
+
+        /**
+         *  Releases bytes from this account only, they stay charged to
+         *  the parent. Used when a channel with queued messages leaves its
+         *  connection.
+         */
+        void detach(int category, unsigned long long bytes);
+
+        unsigned long long getTotal() const;
+
+        /**
+         *  Returns the bytes of one category.
+         */
+        unsigned long long getBytes(int category) const;
+
+        /**
+         *  Sets the budget.
+         *
+         *  @param budget The budget in bytes, 0 for none.
+         */
+        void setBudget(unsigned long long budget);
+        unsigned long long getBudget() const;
+
+        /**
+         *  Returns true if the account, or its parent, is over budget.
+         */
+        bool isOverBudget() const;
+
+        void countPause();
+        void countShed();
+
+        /**
+         *  Waits until bytes are released from any account, or until the
+         *  timeout.
+         *
+         *  @param timeout The max time to wait, in milliseconds.
+         */
+        static void waitForRelease(unsigned int timeout);
+
+        MemoryStats getStats() const;
+
+    private:
+        MemoryAccount(MemoryAccount const &);
+        MemoryAccount& operator=(MemoryAccount const &);
+
+        static void createGlobal();
+
+        MemoryAccount* m_parent;
+        volatile long long m_bytes[MemoryStats::CATEGORY_COUNT];
+        volatile unsigned long long m_budget;
+        volatile unsigned long long m_pauses;
+        volatile unsigned long long m_shed;
+
+        static MemoryAccount* m_global;
+        static pthread_once_t m_globalOnce;
+        static pthread_mutex_t m_releaseMutex;
+        static pthread_cond_t m_releaseCond;
+        static volatile int m_waiters;
+    };
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef HYDNA_MESSAGE_H
+#define HYDNA_MESSAGE_H
+
+#include "channel.h"
+
+#if __cplusplus >= 201103L
+
+#include <cstddef>
+#include <utility>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace hydna {
+
+    /**
+     *  Data received on a channel, with unique ownership of the underlying
+     *  ChannelData. The data is released when the message goes out of
+     *  scope; pooled content is returned to its pool. Messages can be
+     *  moved but not copied.
+     *
+     *  The library itself is C++98, this header is only available when
+     *  compiling with C++11 or later.
+     */
+    class Message {
+    public:
+        Message() noexcept : m_data(nullptr) {
+        }
+
+        /**
+         *  Takes ownership of data returned by Channel::popData().
+         */
+        explicit Message(ChannelData* data) noexcept : m_data(data) {
+        }
+
+        Message(Message&& other) noexcept : m_data(other.m_data) {
+            other.m_data = nullptr;
+        }
+
+        Message& operator=(Message&& other) noexcept {
+            if (this != &other) {
+                delete m_data;
+                m_data = other.m_data;
+                other.m_data = nullptr;
+            }
+
+            return *this;
+        }
+
+        Message(Message const &) = delete;
+        Message& operator=(Message const &) = delete;
+
+        ~Message() {
+            delete m_data;
+        }
+
+        /**
+         *  Checks if the message holds any data.
+         */
+        explicit operator bool() const noexcept {
+            return m_data != nullptr;
+        }
+
+        const char* data() const noexcept {
+            return m_data ? m_data->getContent() : nullptr;
+        }
+
+        std::size_t size() const noexcept {
+            return m_data ? m_data->getSize() : 0;
+        }
+
+        int priority() const noexcept {
+            return m_data ? m_data->getPriority() : 0;
+        }
+
+        bool isUtf8() const noexcept {
+            return m_data && m_data->isUtf8Content();
+        }
+
+#if __cplusplus >= 201703L
+        /**
+         *  Returns a view of the content, valid while the message lives.
+         */
+        std::string_view view() const noexcept {
+            return std::string_view(data(), size());
+        }
+#endif
+
+#if __cplusplus >= 202002L
+        std::span<const char> bytes() const noexcept {
+            return std::span<const char>(data(), size());
+        }
+#endif
+
+        /**
+         *  Gives up ownership of the data, which must then be deleted by
+         *  the caller.
+         */
+        ChannelData* release() noexcept {
+            ChannelData* data = m_data;
+            m_data = nullptr;
+            return data;
+        }
+
+    private:
+        ChannelData* m_data;
+    };
+
+    /**
+     *  Pops the next data in the data queue of a channel.
+     *
+     *  @param channel The channel.
+     *  @return The message, which is empty if the queue was empty.
+     */
+    inline Message receive(Channel& channel) {
+        return Message(channel.popData());
+    }
+
+#if __cplusplus >= 201703L
+    /**
+     *  Sends a message without copying it into an intermediate buffer;
+     *  the frame header and the data are written with one gather write.
+     *
+     *  @param channel The channel to write to.
+     *  @param data The data to send.
+     *  @param ctype The content type.
+     *  @param priority The priority of the data.
+     */
+    inline void write(Channel& channel,
+                      std::string_view data,
+                      unsigned int ctype=ContentType::UTF8,
+                      unsigned int priority=0) {
+        channel.writeBytes(data.data(), 0, data.size(), ctype, priority);
+    }
+#endif
+
+#if __cplusplus >= 202002L
+    inline void write(Channel& channel,
+                      std::span<const char> data,
+                      unsigned int ctype=ContentType::BINARY,
+                      unsigned int priority=0) {
+        channel.writeBytes(data.data(), 0, data.size(), ctype, priority);
+    }
+
+    // Strings would otherwise be ambiguous between the overloads above.
+    inline void write(Channel& channel,
+                      std::string const &data,
+                      unsigned int ctype=ContentType::UTF8,
+                      unsigned int priority=0) {
+        write(channel, std::string_view(data), ctype, priority);
+    }
+
+    inline void write(Channel& channel,
+                      const char* data,
+                      unsigned int ctype=ContentType::UTF8,
+                      unsigned int priority=0) {
+        write(channel, std::string_view(data), ctype, priority);
+    }
+#endif
+}
+
+#endif
+
+#endif
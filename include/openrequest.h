@@ -3,11 +3,12 @@
 
 #include <iostream>
 #include <map>
-#include <queue>
+#include <vector>
 
 namespace hydna {
     class Frame;
     class Channel;
+    class MemoryAccount;
     
     /**
      *  This class is used internally by both the Channel and the Connection class.
@@ -36,10 +37,75 @@ namespace hydna {
 
         bool isSent() const;
         void setSent(bool value);
+
+        /**
+         *  Replayed requests re-open an already open channel after a
+         *  reconnect.
+         */
+        bool isReplay() const;
+        void setReplay(bool value);
+
+        /**
+         *  Returns the time the request was created.
+         *
+         *  @return The monotonic time in microseconds.
+         */
+        unsigned long long getCreated() const;
         
         const char* getPath();
         const char* getToken();
-        
+
+        /**
+         *  Requests for a channel, or for a path when resolving, that is
+         *  already requested wait behind the pending request in a list
+         *  linked through the requests themselves, so queueing does not
+         *  allocate and a waiting request is unlinked in constant time.
+         *  The list is guarded by the lock of the map that holds the
+         *  pending request.
+         *
+         *  @param request The request to append, not in any list.
+         */
+        void addWaiting(OpenRequest* request);
+
+        /**
+         *  Returns true if the request waits behind a pending request.
+         */
+        bool isWaiting() const;
+
+        /**
+         *  Unlinks a waiting request from its list.
+         *
+         *  @param pending The pending request that heads the list.
+         */
+        void unlinkWaiting(OpenRequest* pending);
+
+        /**
+         *  Unlinks the first request waiting on this one, which takes
+         *  over the rest of the list.
+         *
+         *  @return The request, NULL if none is waiting.
+         */
+        OpenRequest* promoteWaiting();
+
+        /**
+         *  Unlinks every request waiting on this one.
+         *
+         *  @param requests The vector to append the requests to, in order.
+         */
+        void takeWaiting(std::vector<OpenRequest*>& requests);
+
+        /**
+         *  Charges the request to a memory account until it is deleted or
+         *  uncharged.
+         *
+         *  @param account The account of the connection.
+         */
+        void charge(MemoryAccount* account);
+
+        /**
+         *  Releases the charge, if any.
+         */
+        void uncharge();
         
     private:
         Channel* m_channel;
@@ -51,6 +117,14 @@ namespace hydna {
         int m_token_size;
         Frame* m_frame;
         bool m_sent;
+        bool m_replay;
+        unsigned long long m_created;
+
+        OpenRequest* m_prev;
+        OpenRequest* m_next;
+        OpenRequest* m_last;
+
+        MemoryAccount* m_memory;
     };
     
 
@@ -59,12 +133,6 @@ namespace hydna {
     
     // map openrequest to path
     typedef std::map<std::string, OpenRequest*> OpenRequestPathMap;
-    
-    typedef std::queue<OpenRequest*> OpenRequestQueue;
-    
-    typedef std::map<unsigned int, OpenRequestQueue*> OpenRequestQueueMap;
-    
-    typedef std::map<std::string, OpenRequestQueue*> OpenRequestQueuePathMap;
 }
 
 #endif
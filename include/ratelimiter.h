@@ -0,0 +1,132 @@
+#ifndef HYDNA_RATELIMITER_H
+#define HYDNA_RATELIMITER_H
+
+#include <pthread.h>
+
+#include "stats.h"
+
+namespace hydna {
+
+    /**
+     *  Token buckets that limit the messages, and the bytes, written per
+     *  second. Each channel has a limiter, and so does each connection,
+     *  see Channel::setRateLimit() and Channel::setConnectionRateLimit().
+     *
+     *  The buckets hold a burst of tokens and are refilled from
+     *  Clock::coarse() for every message. A message larger than the burst
+     *  is let through once the bucket is full, and the bucket is left in
+     *  debt for it.
+     *
+     *  This class is used internally by the Channel and Connection
+     *  classes.
+     */
+    class RateLimiter {
+    public:
+        // What a write over the limit does, see Channel::setRatePolicy().
+        static const int BLOCK = 0;
+        static const int QUEUE = 1;
+        static const int REJECT = 2;
+
+        /** The burst, in milliseconds of messages at the limit. */
+        static const unsigned int DEFAULT_BURST = 100;
+
+        /** The max number of messages a channel queues. */
+        static const unsigned int DEFAULT_QUEUE_LIMIT = 1024;
+
+        /**
+         *  How long Channel::close() waits for queued messages to be
+         *  sent, in milliseconds. The rest are dropped.
+         */
+        static const unsigned int CLOSE_TIMEOUT = 1000;
+
+        RateLimiter();
+        ~RateLimiter();
+
+        /**
+         *  Sets the limits. The buckets start full.
+         *
+         *  @param messages Messages per second, 0 for no limit.
+         *  @param bytes Bytes per second, 0 for no limit.
+         *  @param burst How many milliseconds of messages at the limit
+         *               may be written at once.
+         */
+        void setLimit(unsigned long long messages,
+                      unsigned long long bytes,
+                      unsigned int burst=DEFAULT_BURST);
+
+        /**
+         *  Checks if there is a limit, without locking.
+         *
+         *  @return True if limited.
+         */
+        bool isLimited() const { return m_limited; }
+
+        /**
+         *  Takes the tokens for a message, if the limits allow it to be
+         *  written now.
+         *
+         *  @param bytes The size of the message.
+         *  @return 0 if the tokens were taken, otherwise the time in
+         *          microseconds until they can be, and nothing is taken.
+         */
+        unsigned long long take(unsigned int bytes);
+
+        /**
+         *  Gives back the tokens taken for a message that was not
+         *  written after all.
+         *
+         *  @param bytes The size of the message.
+         */
+        void refund(unsigned int bytes);
+
+        /**
+         *  Counts a message that was over the limit.
+         *
+         *  @param time The time it waited, in microseconds.
+         */
+        void countThrottled(unsigned long long time);
+        void countRejected();
+        void countDropped(unsigned long long messages);
+
+        RateStats getStats() const;
+
+    private:
+        RateLimiter(RateLimiter const &);
+        RateLimiter& operator=(RateLimiter const &);
+
+        /**
+         *  A bucket, in tokens. A message takes one message token and a
+         *  token per byte.
+         */
+        struct Bucket {
+            double rate;
+            double capacity;
+            double tokens;
+        };
+
+        /**
+         *  Returns the time until a bucket has the tokens, 0 if it has.
+         */
+        static unsigned long long waitFor(Bucket const &bucket, double cost);
+
+        /**
+         *  Adds the tokens for the time since the last refill.
+         */
+        static void refill(Bucket& bucket, unsigned long long elapsed);
+
+        Bucket m_messages;
+        Bucket m_bytes;
+        unsigned long long m_refilled;
+        unsigned long long m_tick;
+
+        volatile bool m_limited;
+        volatile unsigned long long m_throttled;
+        volatile unsigned long long m_throttledTime;
+        volatile unsigned long long m_rejected;
+        volatile unsigned long long m_dropped;
+
+        mutable pthread_mutex_t m_mutex;
+    };
+}
+
+#endif
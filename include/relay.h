@@ -0,0 +1,375 @@
+#ifndef HYDNA_RELAY_H
+#define HYDNA_RELAY_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "contenttype.h"
+
+namespace hydna {
+    class Channel;
+    struct RelayShared;
+
+    /**
+     *  A message read from a relay. The content points into the shared
+     *  memory of the relay and stays valid until the next call to
+     *  RelayClient::next().
+     */
+    class RelayMessage {
+    public:
+        static const int DATA = 0;
+        static const int SIGNAL = 1;
+
+        // The channel was closed, the content is the reason.
+        static const int CLOSE = 2;
+
+        RelayMessage();
+
+        /**
+         *  Returns the channel the message was received on, as returned
+         *  by RelayClient::find().
+         *
+         *  @return The index of the channel.
+         */
+        unsigned int getChannel() const;
+
+        /**
+         *  Returns the kind of message, DATA, SIGNAL or CLOSE.
+         *
+         *  @return The kind.
+         */
+        int getType() const;
+
+        /**
+         *  Returns the priority of data, or the type of a signal.
+         *
+         *  @return The priority or type.
+         */
+        int getFlag() const;
+
+        const char* getContent() const;
+
+        unsigned int getSize() const;
+
+        bool isUtf8Content() const;
+
+        bool isBinaryContent() const;
+
+    private:
+        friend class RelayClient;
+
+        unsigned int m_channel;
+        int m_type;
+        int m_flag;
+        unsigned int m_ctype;
+        const char* m_content;
+        unsigned int m_size;
+    };
+
+    /**
+     *  Shares channels of this process with other processes on the host,
+     *  so that they need no connection of their own:
+     *
+     *      Relay relay("workers");
+     *      relay.add(&channel);
+     *
+     *  Everything received on the channel is published to a ring in
+     *  shared memory, which RelayClient instances in other processes read
+     *  without copying, instead of being queued on the channel. Data and
+     *  signals written through a RelayClient are sent on the channel by a
+     *  thread of the relay.
+     *
+     *  The relay waits for the slowest consumer when the ring is full,
+     *  which holds up the I/O thread of the channel. A consumer that has
+     *  not made room within the stall timeout is dropped, and one whose
+     *  process has exited is dropped right away.
+     */
+    class Relay {
+    public:
+        static const unsigned int DEFAULT_CAPACITY = 4 * 1024 * 1024;
+        static const unsigned int DEFAULT_STALL_TIMEOUT = 1000;
+        static const unsigned int MAX_CHANNELS = 64;
+        static const unsigned int MAX_CONSUMERS = 64;
+        static const unsigned int MAX_PATH = 256;
+
+        /**
+         *  Creates the shared memory of the relay, replacing that of an
+         *  earlier relay with the same name whose process has exited.
+         *
+         *  @param name The name that clients open the relay by.
+         *  @param capacity The size of the ring for received messages,
+         *                  rounded up to a power of two. Writes go through
+         *                  a ring of a quarter of the size.
+         *  @throw IOError if the shared memory could not be created, or a
+         *         running relay has the same name.
+         */
+        Relay(std::string const &name, unsigned int capacity=DEFAULT_CAPACITY);
+
+        /**
+         *  Removes all channels and the shared memory. Clients see the
+         *  relay as closed.
+         */
+        ~Relay();
+
+        /**
+         *  Relays a channel under its path. The channel must be
+         *  connected. A channel is removed from its relay when it is
+         *  deleted.
+         *
+         *  @param channel The channel.
+         *  @return The index clients find the channel by.
+         *  @throw Error if the channel is not connected, is in another
+         *         relay, or the relay is full.
+         */
+        unsigned int add(Channel* channel);
+
+        /**
+         *  Stops relaying a channel. Messages received after this are
+         *  queued on the channel again.
+         *
+         *  @param channel The channel.
+         */
+        void remove(Channel* channel);
+
+        /**
+         *  Sets how long a full ring waits for the slowest consumer before
+         *  that consumer is dropped.
+         *
+         *  @param timeout The timeout in milliseconds.
+         */
+        void setStallTimeout(unsigned int timeout);
+
+        /**
+         *  Returns the number of messages published to the ring.
+         *
+         *  @return The number of messages.
+         */
+        unsigned long long getPublished() const;
+
+        /**
+         *  Returns the number of messages that could not be relayed,
+         *  because they did not fit in a ring or could not be sent.
+         *
+         *  @return The number of messages.
+         */
+        unsigned long long getDropped() const;
+
+        /**
+         *  Returns the number of times that the ring of messages written
+         *  by clients was found corrupt. The messages from the corrupt one
+         *  up to the last written are skipped.
+         *
+         *  @return The number of times.
+         */
+        unsigned long long getCorrupted() const;
+
+        /**
+         *  Returns the number of attached clients.
+         *
+         *  @return The number of clients.
+         */
+        unsigned int getConsumers() const;
+
+    private:
+        friend class Channel;
+
+        Relay(Relay const &);
+        Relay& operator=(Relay const &);
+
+        /**
+         *  Publishes a message to the ring, waiting for room if it is
+         *  full. Called on the I/O thread of the channel with its data or
+         *  signal mutex held, or with the relay pinned.
+         */
+        void publish(unsigned int index,
+                     int type,
+                     int flag,
+                     unsigned int ctype,
+                     const char* content,
+                     unsigned int size);
+
+        /**
+         *  Keeps the relay from being deleted until unpin() is called.
+         *  The data mutex of a channel in the relay must be held.
+         */
+        void pin();
+        void unpin();
+
+        /**
+         *  Unlinks a channel that is in the relay. m_mutex and the data
+         *  and signal mutexes of the channel must be held.
+         */
+        void unlink(Channel* channel);
+
+        /**
+         *  Drops consumers whose process has exited, and when stalled is
+         *  set those that are still before the given position. The shared
+         *  mutex must be held.
+         *
+         *  @param head The position the next message is written at.
+         *  @param position The position the consumers need to be past.
+         *  @param stalled True if the wait for them has timed out.
+         *  @return The position of the slowest remaining consumer, head if
+         *          there is none.
+         */
+        unsigned long long reapConsumers(unsigned long long head,
+                                         unsigned long long position,
+                                         bool stalled);
+
+        static void* run(void* ptr);
+
+        /**
+         *  Sends the messages that clients write, until the relay is
+         *  deleted.
+         */
+        void runForward();
+
+        /**
+         *  Sends one message written by a client on its channel.
+         */
+        void forward(unsigned int index,
+                     int type,
+                     int flag,
+                     unsigned int ctype,
+                     const char* content,
+                     unsigned int size);
+
+        std::string m_name;
+        RelayShared* m_shared;
+        char* m_ring;
+        char* m_upRing;
+        size_t m_mappedSize;
+
+        std::vector<Channel*> m_channels;
+        mutable pthread_mutex_t m_mutex;
+        pthread_mutex_t m_publishMutex;
+
+        // The channel being sent on by the forward thread and the number
+        // of pins, guarded by m_mutex. The pins are taken without it.
+        Channel* m_forwarding;
+        volatile unsigned int m_pins;
+        pthread_cond_t m_pinCond;
+
+        // The position up to which the ring can be written without
+        // looking at the consumers. Guarded by m_publishMutex.
+        unsigned long long m_limit;
+        unsigned int m_stallTimeout;
+
+        unsigned long long m_published;
+        unsigned long long m_dropped;
+        unsigned long long m_corrupted;
+
+        pthread_t m_forwardThread;
+        volatile bool m_stopping;
+    };
+
+    /**
+     *  Reads and writes the channels of a Relay in another process:
+     *
+     *      RelayClient client("workers");
+     *      unsigned int ch = client.find("/hello");
+     *      RelayMessage message;
+     *
+     *      while (client.next(message)) {
+     *          if (message.getChannel() == ch) ...
+     *      }
+     *
+     *  A client sees the messages received after it was created. It is
+     *  used from one thread at a time.
+     */
+    class RelayClient {
+    public:
+        /**
+         *  Attaches to a relay.
+         *
+         *  @param name The name of the relay.
+         *  @throw IOError if there is no such relay.
+         *  @throw Error if the relay has no room for another client.
+         */
+        RelayClient(std::string const &name);
+
+        /**
+         *  Detaches from the relay.
+         */
+        ~RelayClient();
+
+        /**
+         *  Finds a relayed channel by its path.
+         *
+         *  @param path The path of the channel, e.g. "/hello".
+         *  @return The index of the channel.
+         *  @throw Error if the channel is not relayed.
+         */
+        unsigned int find(std::string const &path) const;
+
+        /**
+         *  Reads the next message, releasing the previous one.
+         *
+         *  @param message Set to the message.
+         *  @param timeout The max time to wait, in milliseconds, or -1 to
+         *                 wait until a message is published.
+         *  @return False if the wait timed out.
+         *  @throw Error if the relay was closed or dropped this client.
+         */
+        bool next(RelayMessage& message, int timeout=-1);
+
+        /**
+         *  Sends data on a relayed channel, waiting for room in the ring
+         *  of the relay if it is full.
+         *
+         *  @param channel The index of the channel.
+         *  @param data The data.
+         *  @param length The length of the data.
+         *  @param ctype The content type.
+         *  @param priority The priority of the data.
+         *  @throw RangeError if the data does not fit in the ring.
+         *  @throw Error if the relay was closed.
+         */
+        void write(unsigned int channel,
+                   const char* data,
+                   unsigned int length,
+                   unsigned int ctype=ContentType::BINARY,
+                   unsigned int priority=0);
+
+        /**
+         *  Emits a signal on a relayed channel, see write().
+         *
+         *  @param channel The index of the channel.
+         *  @param data The signal.
+         *  @param length The length of the signal.
+         *  @param ctype The content type.
+         */
+        void emit(unsigned int channel,
+                  const char* data,
+                  unsigned int length,
+                  unsigned int ctype=ContentType::BINARY);
+
+    private:
+        RelayClient(RelayClient const &);
+        RelayClient& operator=(RelayClient const &);
+
+        void send(unsigned int channel,
+                  int type,
+                  int flag,
+                  unsigned int ctype,
+                  const char* data,
+                  unsigned int length);
+
+        /**
+         *  Throws if the relay was closed or dropped this client.
+         */
+        void checkAttached() const;
+
+        RelayShared* m_shared;
+        char* m_ring;
+        char* m_upRing;
+        size_t m_mappedSize;
+        unsigned int m_slot;
+
+        // Where the message after the one last returned starts.
+        unsigned long long m_next;
+    };
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef HYDNA_REPLAY_H
+#define HYDNA_REPLAY_H
+
+#include <string>
+#include <vector>
+
+namespace hydna {
+    class Channel;
+    class Connection;
+
+    /**
+     *  Feeds a capture written by FrameCapture through the same decode and
+     *  dispatch path as frames received from a server, without a socket:
+     *
+     *      FrameReplay replay("session.cap");
+     *      replay.bind(&channel, 1);
+     *      replay.run();
+     *
+     *  Channels are bound to the channel ids of the capture and are then
+     *  open for reading, as if the server had allowed them. Data and
+     *  signal frames for bound channels are dispatched on the thread that
+     *  calls run(), which stands in for the I/O thread. Other frames, e.g.
+     *  open responses and keepalives, are skipped.
+     *
+     *  The bound channels are closed when the replay is deleted, and must
+     *  not be deleted before that.
+     */
+    class FrameReplay {
+    public:
+        /** Replays frames from every connection of the capture. */
+        static const int ALL_SOURCES = -1;
+
+        /**
+         *  Maps a capture.
+         *
+         *  @param path The capture file.
+         *  @throw IOError if the file could not be read or is not a capture.
+         */
+        FrameReplay(std::string const &path);
+
+        /**
+         *  Closes the bound channels and unmaps the capture.
+         */
+        ~FrameReplay();
+
+        /**
+         *  Opens a channel for reading under a channel id of the capture.
+         *
+         *  @param channel The channel, which must not be connected.
+         *  @param ch The channel id.
+         *  @throw Error if the channel is connected or the id is bound.
+         */
+        void bind(Channel* channel, unsigned int ch);
+
+        /**
+         *  Replays only the frames received on one connection. Channel ids
+         *  are only unique within a connection.
+         *
+         *  @param source The connection, as numbered in the capture, or
+         *                ALL_SOURCES.
+         */
+        void setSource(int source);
+
+        /**
+         *  Dispatches the frames of the capture, from the start. May be
+         *  called again to replay the capture once more.
+         *
+         *  @param speed 0 to dispatch the frames as fast as possible, 1 to
+         *               keep the time between them as captured, 2 for twice
+         *               as fast, and so on.
+         *  @return The number of frames dispatched.
+         */
+        unsigned long long run(double speed=0);
+
+        /**
+         *  Returns the channel ids that data or signals were captured on,
+         *  for the selected source.
+         *
+         *  @return The channel ids, in order.
+         */
+        std::vector<unsigned int> getChannels() const;
+
+        /**
+         *  Returns the number of frames in the capture.
+         *
+         *  @return The number of frames.
+         */
+        unsigned long long getFrames() const;
+
+        /**
+         *  Returns the time from the first frame to the last, as captured.
+         *
+         *  @return The time in nanoseconds.
+         */
+        unsigned long long getDuration() const;
+
+        /**
+         *  Returns the number of frames that the last run skipped.
+         *
+         *  @return The number of frames.
+         */
+        unsigned long long getSkipped() const;
+
+    private:
+        FrameReplay(FrameReplay const &);
+        FrameReplay& operator=(FrameReplay const &);
+
+        /**
+         *  Finds the first record at or after an offset, skipping the
+         *  padding at the end of chunks.
+         *
+         *  @param offset The offset to look from, set to that of the record.
+         *  @return False at the end of the capture.
+         */
+        bool seek(size_t& offset) const;
+
+        char* m_data;
+        size_t m_size;
+        unsigned int m_chunkSize;
+
+        unsigned long long m_frames;
+        unsigned long long m_duration;
+
+        int m_source;
+        Connection* m_connection;
+        unsigned long long m_skipped;
+    };
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef HYDNA_SPOOL_H
+#define HYDNA_SPOOL_H
+
+#include <string>
+#include <sys/uio.h>
+
+namespace hydna {
+    class Connection;
+
+    /**
+     *  The header at the start of a spool file. The ring of frames starts
+     *  at the next page.
+     */
+    struct SpoolHeader {
+        char magic[8];
+        unsigned int version;
+        unsigned int capacity;
+
+        // Positions in the ring, which only grow. Head is the first frame
+        // not yet sent and tail where the next frame is appended.
+        unsigned long long head;
+        unsigned long long tail;
+        unsigned long long frames;
+    };
+
+    /**
+     *  A journal of encoded data frames, kept in a memory mapped file, that
+     *  a channel writes to while it can not send. The frames are sent in
+     *  order, several per write, once the channel is open again. Frames
+     *  that were not sent are still in the file when it is opened by a
+     *  later process.
+     *
+     *  A spool is not thread safe, the channel serializes access to it.
+     */
+    class Spool {
+    public:
+        static const char MAGIC[8];
+        static const unsigned int VERSION = 1;
+
+        static const unsigned int DEFAULT_CAPACITY = 16 * 1024 * 1024;
+
+        /** The most bytes sent in one write when flushing. */
+        static const unsigned int BATCH_SIZE = 0x10000;
+
+        /**
+         *  Opens a spool file, creating it if needed. The frames of an
+         *  existing spool are kept, along with its capacity.
+         *
+         *  @param path The file.
+         *  @param capacity The max number of bytes of frames, rounded up
+         *                  to a power of two.
+         *  @throw IOError if the file could not be opened or mapped.
+         */
+        Spool(std::string const &path, unsigned int capacity=DEFAULT_CAPACITY);
+
+        /**
+         *  Unmaps the file, which keeps the frames that were not sent.
+         */
+        ~Spool();
+
+        /**
+         *  Appends an encoded frame.
+         *
+         *  @param parts The frame, starting with the length prefix.
+         *  @param count The number of parts.
+         *  @return False if there is no room for the frame.
+         */
+        bool append(const struct iovec* parts, int count);
+
+        /**
+         *  Sends the frames in order, as a channel with the given id. The
+         *  frames from one with an impossible length on are discarded.
+         *
+         *  @param connection The connection to send on.
+         *  @param ch The channel id, which may differ from the one the
+         *            frames were spooled with.
+         *  @return True if the spool is empty.
+         */
+        bool flush(Connection* connection, unsigned int ch);
+
+        /**
+         *  Checks if all frames has been sent.
+         *
+         *  @return True if empty.
+         */
+        bool isEmpty() const;
+
+        /**
+         *  Returns the number of frames waiting to be sent.
+         *
+         *  @return The number of frames.
+         */
+        unsigned long long getFrames() const;
+
+        /**
+         *  Returns the number of bytes waiting to be sent.
+         *
+         *  @return The number of bytes.
+         */
+        unsigned long long getBytes() const;
+
+        /**
+         *  Returns the path of the file.
+         *
+         *  @return The path.
+         */
+        std::string const &getPath() const;
+
+    private:
+        Spool(Spool const &);
+        Spool& operator=(Spool const &);
+
+        /**
+         *  Returns the byte at a position of the ring.
+         */
+        unsigned char byteAt(unsigned long long position) const;
+
+        /**
+         *  Copies bytes into the ring at a position, wrapping around.
+         */
+        void copyIn(unsigned long long position, const char* data, size_t size);
+
+        std::string m_path;
+        SpoolHeader* m_header;
+        char* m_ring;
+        size_t m_mappedSize;
+        unsigned long long m_mask;
+    };
+}
+
+#endif
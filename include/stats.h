@@ -0,0 +1,231 @@
+#ifndef HYDNA_STATS_H
+#define HYDNA_STATS_H
+
+#include <iostream>
+#include <string>
+
+#include "histogram.h"
+
+namespace hydna {
+
+    /**
+     *  A lock-free counter that is striped over several cache lines, so
+     *  that threads incrementing it concurrently do not contend.
+     */
+    class Counter {
+    public:
+        static const int STRIPE_COUNT = 8;
+
+        Counter();
+
+        /**
+         *  Adds a value to the stripe of the calling thread.
+         *
+         *  @param value The value to add.
+         */
+        void add(unsigned long long value=1);
+
+        /**
+         *  Returns the sum of all stripes.
+         *
+         *  @return The value of the counter.
+         */
+        unsigned long long get() const;
+
+    private:
+        struct Stripe {
+            unsigned long long value;
+            char padding[64 - sizeof(unsigned long long)];
+        };
+
+        Stripe m_stripes[STRIPE_COUNT];
+    };
+
+    /**
+     *  A snapshot of the memory held by the library, or by one of its
+     *  connections.
+     */
+    class MemoryStats {
+    public:
+        /** Number of categories, indexed by MemoryAccount::DATA and so on. */
+        static const int CATEGORY_COUNT = 6;
+
+        MemoryStats();
+
+        /**
+         *  Bytes by category: received messages not yet popped, signals
+         *  not yet popped, open requests, writes queued while
+         *  reconnecting, channels and fragmented messages being
+         *  reassembled.
+         */
+        unsigned long long bytes[CATEGORY_COUNT];
+
+        unsigned long long total;
+
+        /** The budget in bytes, 0 for none. */
+        unsigned long long budget;
+
+        /** Times reading was paused because the budget was exceeded. */
+        unsigned long long pauses;
+
+        /** Messages dropped or channels refused because the budget was exceeded. */
+        unsigned long long shed;
+
+        std::string toText() const;
+
+        std::string toJSON() const;
+    };
+
+    /**
+     *  A snapshot of an outbound rate limit, of a channel or of a
+     *  connection, see Channel::setRateLimit().
+     */
+    class RateStats {
+    public:
+        RateStats();
+
+        /** The limits per second, 0 for none. */
+        unsigned long long messageLimit;
+        unsigned long long byteLimit;
+
+        /** Messages that were over the limit when written. */
+        unsigned long long throttled;
+
+        /** Time, in microseconds, that throttled messages waited. */
+        unsigned long long throttledTime;
+
+        /** Messages that were rejected, or dropped from the queue. */
+        unsigned long long rejected;
+        unsigned long long dropped;
+
+        /** Messages queued until the limit allows them to be sent. */
+        unsigned int queue;
+
+        std::string toText() const;
+        std::string toJSON() const;
+    };
+
+    /**
+     *  A snapshot of the statistics of a connection.
+     */
+    class ConnectionStats {
+    public:
+        /** Number of opcodes, indexed by Frame::KEEPALIVE - Frame::RESOLVE. */
+        static const int OP_COUNT = 5;
+
+        ConnectionStats();
+
+        unsigned long long framesIn[OP_COUNT];
+        unsigned long long bytesIn[OP_COUNT];
+        unsigned long long framesOut[OP_COUNT];
+        unsigned long long bytesOut[OP_COUNT];
+
+        /** Writes that was dropped instead of sent. */
+        unsigned long long drops;
+
+        unsigned long long reconnects;
+        unsigned long long reconnectAttempts;
+
+        unsigned int openChannels;
+        unsigned int pendingResolves;
+        unsigned int pendingOpens;
+        unsigned int reconnectQueue;
+
+        /** True for "https" connections. */
+        bool tls;
+
+        /** True if TLS records are encrypted or decrypted by the kernel. */
+        bool kernelTlsSend;
+        bool kernelTlsReceive;
+
+        /** The CPU the I/O thread started on, -1 if unknown. */
+        int ioThreadCpu;
+
+        /** The I/O thread settings that were applied, see IoThread. */
+        unsigned int ioThreadConfig;
+
+        /** Memory held for the connection and its channels. */
+        MemoryStats memory;
+
+        /** The rate limit shared by the channels of the connection. */
+        RateStats rate;
+
+        /** Latencies in microseconds. */
+        Histogram resolveLatency;
+        Histogram openLatency;
+        Histogram writeLatency;
+        Histogram roundTripTimes;
+
+        /**
+         *  Formats the statistics as "name value" lines.
+         *
+         *  @return The formatted statistics.
+         */
+        std::string toText() const;
+
+        /**
+         *  Formats the statistics as a JSON object.
+         *
+         *  @return The formatted statistics.
+         */
+        std::string toJSON() const;
+    };
+
+    /**
+     *  A snapshot of the statistics of a channel.
+     */
+    class ChannelStats {
+    public:
+        ChannelStats();
+
+        unsigned long long dataIn;
+        unsigned long long dataBytesIn;
+        unsigned long long signalsIn;
+        unsigned long long dataOut;
+        unsigned long long dataBytesOut;
+        unsigned long long signalsOut;
+
+        unsigned int dataQueue;
+        unsigned int signalQueue;
+
+        /** Time, in microseconds, from connect() until the channel was open. */
+        unsigned long long openLatency;
+
+        /** Messages delivered to this channel as they were written, see
+            Channel::setLocalLoopback(). */
+        unsigned long long dataLooped;
+
+        /** Frames dropped because they were the server's copy of a
+            message that had been delivered locally. */
+        unsigned long long echoesDropped;
+
+        /** Messages delivered locally whose copy did not come back from
+            the server in time, and was forgotten. Either the copy is
+            delivered again when it does come, or a message from another
+            client was dropped in its place. */
+        unsigned long long echoesExpired;
+
+        /** Data frames written to the spool, see Channel::setSpool(). */
+        unsigned long long dataSpooled;
+
+        /** Data frames in the spool that are yet to be sent. */
+        unsigned long long spoolQueue;
+
+        /** Batched messages that were dropped because their batch could
+            not be sent, see Channel::setBatching(). */
+        unsigned long long batchDropped;
+
+        /** Messages received without an envelope while it is enabled,
+            which were delivered as they are, see Channel::setEnvelope(). */
+        unsigned long long dataPlain;
+
+        /** The rate limit of this channel. */
+        RateStats rate;
+
+        std::string toText() const;
+
+        std::string toJSON() const;
+    };
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef HYDNA_TLSSESSION_H
+#define HYDNA_TLSSESSION_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+namespace hydna {
+
+    /**
+     *  A TLS session on a connected socket, used by connections to
+     *  "https" URLs. TLS is compiled in with the WITH_TLS make variable;
+     *  use isAvailable() to check for it.
+     *
+     *  After the handshake the session keys are handed to the kernel
+     *  (kTLS) when the kernel and OpenSSL supports it. Writes then go
+     *  straight to the socket and are encrypted by the kernel, without an
+     *  extra copy in user space. Otherwise OpenSSL encrypts in user space.
+     *
+     *  One thread may read while another writes.
+     */
+    class TlsSession {
+    public:
+        // Directions handled by the kernel, see getKernelOffload().
+        static const unsigned int KERNEL_SEND = 0x01;
+        static const unsigned int KERNEL_RECEIVE = 0x02;
+
+        /**
+         *  Checks if TLS is compiled in.
+         *
+         *  @return True if available.
+         */
+        static bool isAvailable();
+
+        /**
+         *  Initializes a session on a connected socket. The socket is
+         *  not closed by the session.
+         *
+         *  @param fd The socket.
+         */
+        TlsSession(int fd);
+
+        ~TlsSession();
+
+        /**
+         *  Performs the TLS handshake.
+         *
+         *  @param host The host name, used for SNI and to verify the
+         *              certificate of the server.
+         *  @param verify False to accept any certificate.
+         *  @param caFile A PEM file with trusted certificates, or an empty
+         *                string for the system default.
+         *  @param kernel False to never hand the keys to the kernel.
+         *  @return True if the handshake succeeded, see getError().
+         */
+        bool handshake(std::string const &host,
+                       bool verify,
+                       std::string const &caFile,
+                       bool kernel);
+
+        /**
+         *  Returns the cause of a failed handshake.
+         *
+         *  @return The error message.
+         */
+        std::string getError() const;
+
+        /**
+         *  Returns the directions in which records are encrypted or
+         *  decrypted by the kernel rather than by OpenSSL.
+         *
+         *  @return A combination of KERNEL_SEND and KERNEL_RECEIVE.
+         */
+        unsigned int getKernelOffload() const;
+
+        /**
+         *  Checks if decrypted bytes are buffered by the session, in which
+         *  case a read does not block even if the socket is not readable.
+         *
+         *  @return True if there are buffered bytes.
+         */
+        bool hasPending();
+
+        /**
+         *  Reads decrypted bytes.
+         *
+         *  @param buffer The buffer to read to.
+         *  @param size The max number of bytes to read.
+         *  @return The number of bytes read, 0 on end of stream, -1 on error.
+         */
+        int read(char* buffer, int size);
+
+        /**
+         *  Writes bytes gathered from several buffers, which are encrypted
+         *  by the kernel or by OpenSSL. Only one thread may write at a
+         *  time.
+         *
+         *  @param parts The buffers.
+         *  @param count The number of buffers.
+         *  @return The number of bytes written, -1 on error.
+         */
+        int write(const struct iovec* parts, int count);
+
+    private:
+        TlsSession(TlsSession const &);
+        TlsSession& operator=(TlsSession const &);
+
+        bool wait(int error);
+
+        int m_fd;
+        unsigned int m_kernelOffload;
+        std::string m_error;
+        struct ssl_ctx_st* m_context;
+        struct ssl_st* m_ssl;
+        pthread_mutex_t m_mutex;
+        std::vector<char> m_gather;
+    };
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef HYDNA_TRACE_H
+#define HYDNA_TRACE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/**
+ *  Records a trace event if tracing is enabled. Costs a single load and
+ *  branch when tracing is disabled.
+ */
+#define HYDNA_TRACE(event, ch, arg0, arg1) \
+    do { \
+        if (hydna::Trace::isEnabled()) { \
+            hydna::Trace::record((event), (ch), (arg0), (arg1)); \
+        } \
+    } while (0)
+
+namespace hydna {
+
+    /**
+     *  A fixed-size trace record. The sequence number is the position of
+     *  the record in its ring plus one, and 0 while the record is being
+     *  written.
+     */
+    struct TraceRecord {
+        unsigned long long seq;
+        unsigned long long time;
+        unsigned int ch;
+        unsigned short event;
+        unsigned short thread;
+        unsigned long long arg0;
+        unsigned long long arg1;
+    };
+
+    typedef std::vector<TraceRecord> TraceRecords;
+
+    /**
+     *  Binary trace log. Every thread records into its own lock-free ring
+     *  of fixed-size records, the oldest records are overwritten when the
+     *  ring is full. The rings are dumped to a file and formatted offline.
+     *
+     *  A ring is freed when its thread exits, so only the records of
+     *  running threads are dumped.
+     */
+    class Trace {
+    public:
+        // Events
+        static const unsigned short FRAME_IN = 1;       // arg0: op, arg1: size
+        static const unsigned short FRAME_OUT = 2;      // arg0: op, arg1: size
+        static const unsigned short RESOLVE_REQUEST = 3;
+        static const unsigned short OPEN_REQUEST = 4;
+        static const unsigned short REQUEST_QUEUED = 5;
+        static const unsigned short OPEN_ALLOWED = 6;   // arg0: response channel
+        static const unsigned short OPEN_DENIED = 7;    // arg0: error code
+        static const unsigned short CHANNEL_ALLOC = 8;  // arg0: ref count
+        static const unsigned short CHANNEL_DEALLOC = 9;
+        static const unsigned short CHANNEL_CLOSE = 10;
+        static const unsigned short KEEPALIVE_SENT = 11;
+        static const unsigned short KEEPALIVE_RTT = 12; // arg0: rtt in microseconds
+        static const unsigned short IDLE_TIMEOUT = 13;
+        static const unsigned short RECONNECT = 14;     // arg0: attempt
+        static const unsigned short RECONNECTED = 15;   // arg0: replayed opens
+        static const unsigned short DESTROY = 16;
+        static const unsigned short OPEN_TIMEOUT = 17;  // arg0: timeout in milliseconds
+        static const unsigned short IO_THREAD = 18;     // arg0: applied settings, arg1: cpu
+        static const unsigned short MEMORY_PAUSE = 19;  // arg0: bytes in use
+        static const unsigned short MEMORY_SHED = 20;   // arg0: bytes in use
+
+        /** Number of records kept per thread, must be a power of two. */
+        static const unsigned int RING_SIZE = 8192;
+
+        /**
+         *  Checks if tracing is enabled.
+         *
+         *  @return True if enabled.
+         */
+        static bool isEnabled() {
+            return m_enabled;
+        }
+
+        /**
+         *  Enables or disables tracing at runtime.
+         *
+         *  @param value True to enable tracing.
+         */
+        static void setEnabled(bool value);
+
+        /**
+         *  Appends a record to the ring of the calling thread.
+         */
+        static void record(unsigned short event,
+                           unsigned int ch,
+                           unsigned long long arg0,
+                           unsigned long long arg1);
+
+        /**
+         *  Writes the records of all threads to a file.
+         *
+         *  @param path The file to write to.
+         *  @return True on success.
+         */
+        static bool dump(std::string const &path);
+
+        /**
+         *  Reads the records of a file written by dump(), sorted by time.
+         *  Fails if the file holds fewer records than its header says.
+         *
+         *  @param path The file to read.
+         *  @param records The records that was read.
+         *  @return True on success.
+         */
+        static bool read(std::string const &path, TraceRecords& records);
+
+        /**
+         *  Formats a record as a line of text.
+         *
+         *  @param record The record.
+         *  @return The formatted record.
+         */
+        static std::string format(TraceRecord const &record);
+
+        /**
+         *  Returns the name of an event.
+         *
+         *  @param event The event.
+         *  @return The name.
+         */
+        static const char* eventName(unsigned short event);
+
+    private:
+        struct Ring {
+            Ring* next;
+            unsigned short thread;
+            volatile unsigned long long head;
+            TraceRecord records[RING_SIZE];
+        };
+
+        static Ring* threadRing();
+        static void createKey();
+        static void releaseRing(void* ring);
+
+        static volatile bool m_enabled;
+        static Ring* m_rings;
+        static pthread_mutex_t m_ringsMutex;
+        static pthread_key_t m_ringKey;
+        static pthread_once_t m_ringKeyOnce;
+    };
+}
+
+#endif
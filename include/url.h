@@ -1,21 +1,66 @@
 #ifndef HYDNA_URLPARSER_H
 #define HYDNA_URLPARSER_H
 
-#include <iostream>
-#include <streambuf>
-#include <pthread.h>
-
-#include "connection.h"
-#include "openrequest.h"
-#include "channeldata.h"
-#include "channelsignal.h"
-#include "channelmode.h"
-#include "channelerror.h"
+#include <string>
+#include <stddef.h>
 
 namespace hydna {
 
+    /**
+     *  A part of a parsed URL. The part points into the parsed string and
+     *  does not own it.
+     */
+    class URLPart {
+    public:
+        URLPart();
+        URLPart(const char* data, size_t size);
+
+        const char* getData() const;
+        size_t getSize() const;
+        bool isEmpty() const;
+
+        /**
+         *  Copies the part.
+         *
+         *  @return The part as a string.
+         */
+        std::string toString() const;
+
+        /**
+         *  Compares the part with a string.
+         *
+         *  @param text A null-terminated string.
+         *  @return True if they are equal.
+         */
+        bool equals(const char* text) const;
+
+        /**
+         *  Compares the part with a string, ignoring the case of ASCII
+         *  letters.
+         *
+         *  @param text A null-terminated string.
+         *  @return True if they are equal.
+         */
+        bool equalsIgnoreCase(const char* text) const;
+
+        /**
+         *  Compares the part with a string.
+         *
+         *  @param text The string.
+         *  @return True if they are equal.
+         */
+        bool equals(std::string const &text) const;
+
+    private:
+        const char* m_data;
+        size_t m_size;
+    };
+
     /**
      *  This class is used as to parese URLs within the library.
+     *
+     *  Parsing does not allocate, the parts of the URL point into the
+     *  parsed string, which must outlive the URL.
      */
     class URL {
     public:
@@ -30,20 +75,53 @@ namespace hydna {
          */
         static URL parse(std::string const &expr);
 
+        /**
+         * Parse the string and return a new URL object.
+         *
+         * @param expr The String to be parsed.
+         * @param size The size of the string.
+         * @return The URL object.
+         */
+        static URL parse(const char* expr, size_t size);
+
         unsigned short getPort() const;
 
-        std::string getPath() const;
-        
-        std::string getHost() const;
+        URLPart getPath() const;
+
+        URLPart getHost() const;
+
+        URLPart getToken() const;
+
+        URLPart getAuth() const;
+
+        /**
+         *  Returns the protocol, "http" if the URL has none. The case is
+         *  kept as in the URL.
+         */
+        URLPart getProtocol() const;
+
+        /**
+         *  Returns true if the protocol is "https".
+         */
+        bool isSecure() const;
+
+        /**
+         *  Returns true if the protocol is "http" or "https".
+         */
+        bool isSupported() const;
+
+        /**
+         *  Returns true if the URL could not be parsed.
+         */
+        bool hasError() const;
 
-        std::string getToken() const;
-        
-        std::string getAuth() const;
-        
-        std::string getProtocol() const;
-        
+        /**
+         *  Returns a description of the parse error.
+         *
+         *  @return The description, empty if none.
+         */
         std::string getError() const;
-        
+
     private:
         /**
          *  Initializes a new URL instance.
@@ -51,14 +129,16 @@ namespace hydna {
         URL();
 
         unsigned short m_port;
-        std::string m_path;
-        std::string m_host;
-        std::string m_token;
-        std::string m_auth;
-        std::string m_protocol;
-        std::string m_error;
+        URLPart m_path;
+        URLPart m_host;
+        URLPart m_token;
+        URLPart m_auth;
+        URLPart m_protocol;
+
+        // The port that could not be read, if any.
+        URLPart m_badPort;
+        bool m_error;
     };
 }
 
 #endif
-
@@ -0,0 +1,127 @@
+#include "buffer.h"
+
+namespace hydna {
+
+    BufferPool* BufferPool::m_shared = NULL;
+    pthread_once_t BufferPool::m_sharedOnce = PTHREAD_ONCE_INIT;
+
+    Buffer::Buffer(BufferPool* pool, char* data, unsigned int capacity)
+        : m_pool(pool), m_data(data), m_size(0), m_capacity(capacity), m_refs(1)
+    {
+    }
+
+    Buffer::~Buffer() {
+        delete[] m_data;
+    }
+
+    Buffer* Buffer::adopt(char* data, unsigned int size) {
+        Buffer* buffer = new Buffer(NULL, data, size);
+        buffer->m_size = size;
+        return buffer;
+    }
+
+    char* Buffer::getData() const {
+        return m_data;
+    }
+
+    unsigned int Buffer::getSize() const {
+        return m_size;
+    }
+
+    void Buffer::setSize(unsigned int size) {
+        m_size = size;
+    }
+
+    unsigned int Buffer::getCapacity() const {
+        return m_capacity;
+    }
+
+    void Buffer::retain() {
+        __sync_fetch_and_add(&m_refs, 1);
+    }
+
+    void Buffer::release() {
+        if (__sync_sub_and_fetch(&m_refs, 1) != 0) {
+            return;
+        }
+
+        if (m_pool) {
+            m_pool->recycle(this);
+        } else {
+            delete this;
+        }
+    }
+
+    BufferPool::BufferPool() {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    BufferPool::~BufferPool() {
+        for (unsigned int i = 0; i < CLASS_COUNT; i++) {
+            for (unsigned int j = 0; j < m_free[i].size(); j++) {
+                delete m_free[i][j];
+            }
+        }
+
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    Buffer* BufferPool::acquire(unsigned int size) {
+        int index = classOf(size);
+
+        if (index < 0) {
+            return new Buffer(NULL, new char[size], size);
+        }
+
+        pthread_mutex_lock(&m_mutex);
+
+        if (!m_free[index].empty()) {
+            Buffer* buffer = m_free[index].back();
+            m_free[index].pop_back();
+            pthread_mutex_unlock(&m_mutex);
+
+            buffer->m_size = 0;
+            buffer->m_refs = 1;
+            return buffer;
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+
+        unsigned int capacity = 1u << (index + MIN_CLASS_BITS);
+        return new Buffer(this, new char[capacity], capacity);
+    }
+
+    BufferPool& BufferPool::getShared() {
+        pthread_once(&m_sharedOnce, createShared);
+        return *m_shared;
+    }
+
+    int BufferPool::classOf(unsigned int size) {
+        for (unsigned int i = 0; i < CLASS_COUNT; i++) {
+            if (size <= (1u << (i + MIN_CLASS_BITS))) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    void BufferPool::createShared() {
+        m_shared = new BufferPool();
+    }
+
+    void BufferPool::recycle(Buffer* buffer) {
+        int index = classOf(buffer->m_capacity);
+
+        pthread_mutex_lock(&m_mutex);
+
+        if (m_free[index].size() < MAX_FREE) {
+            m_free[index].push_back(buffer);
+            buffer = NULL;
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+
+        delete buffer;
+    }
+}
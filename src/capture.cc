@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "capture.h"
+#include "clock.h"
+#include "ioerror.h"
+
+#ifdef HYDNADEBUG
+#include "debughelper.h"
+#endif
+
+namespace hydna {
+    using namespace std;
+
+    const char FrameCapture::MAGIC[8] = { 'H', 'Y', 'D', 'N', 'A', 'C', 'A', 'P' };
+
+    static unsigned int recordSize(unsigned int size) {
+        return sizeof(CaptureRecord) + ((size + 7) & ~7U);
+    }
+
+    void FrameCapture::start(string const &path) {
+        struct timeval tv;
+        CaptureHeader* header;
+
+        pthread_mutex_lock(&m_mutex);
+        if (m_fd != -1) {
+            finish();
+        }
+
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (m_fd == -1) {
+            pthread_mutex_unlock(&m_mutex);
+            throw IOError("Could not create the capture file " + path);
+        }
+
+        m_chunk = NULL;
+        m_chunkOffset = 0;
+        m_used = 0;
+        m_frames = 0;
+
+        if (!nextChunk()) {
+            finish();
+            pthread_mutex_unlock(&m_mutex);
+            throw IOError("Could not map the capture file " + path);
+        }
+
+        gettimeofday(&tv, 0);
+
+        header = (CaptureHeader*)m_chunk;
+        memcpy(header->magic, MAGIC, sizeof(header->magic));
+        header->version = VERSION;
+        header->chunkSize = CHUNK_SIZE;
+        header->started = Clock::nanos();
+        header->startedWall = tv.tv_sec * 1000000ULL + tv.tv_usec;
+
+        m_used = sizeof(CaptureHeader);
+        m_enabled = true;
+        pthread_mutex_unlock(&m_mutex);
+
+#ifdef HYDNADEBUG
+        debugPrint("FrameCapture", 0, "Capturing to " + path);
+#endif
+    }
+
+    void FrameCapture::stop() {
+        pthread_mutex_lock(&m_mutex);
+        if (m_fd != -1) {
+            finish();
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void FrameCapture::record(unsigned int source, const char* frame, unsigned int size) {
+        unsigned long long time;
+        unsigned int needed = recordSize(size);
+        CaptureRecord* record;
+
+        if (needed > CHUNK_SIZE - sizeof(CaptureHeader)) {
+            return;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        if (!m_chunk) {
+            // Stopped since the caller looked.
+            pthread_mutex_unlock(&m_mutex);
+            return;
+        }
+
+        // Taken under the lock, so that the records of the I/O threads
+        // are in the order of their times.
+        time = Clock::nanos();
+
+        if (m_used + needed > CHUNK_SIZE && !nextChunk()) {
+#ifdef HYDNADEBUG
+            debugPrint("FrameCapture", 0, "Could not grow the capture file, stopping");
+#endif
+            finish();
+            pthread_mutex_unlock(&m_mutex);
+            return;
+        }
+
+        record = (CaptureRecord*)(m_chunk + m_used);
+        record->time = time;
+        record->source = source;
+        record->size = size;
+        memcpy(record + 1, frame, size);
+
+        m_used += needed;
+        m_frames++;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    unsigned long long FrameCapture::getFrames() {
+        pthread_mutex_lock(&m_mutex);
+        unsigned long long frames = m_frames;
+        pthread_mutex_unlock(&m_mutex);
+
+        return frames;
+    }
+
+    bool FrameCapture::nextChunk() {
+        void* chunk;
+
+        if (m_chunk) {
+            // The reader skips to the next chunk when it finds a pad, or
+            // when there is no room left for one.
+            if (m_used + sizeof(CaptureRecord) <= CHUNK_SIZE) {
+                CaptureRecord* pad = (CaptureRecord*)(m_chunk + m_used);
+                pad->time = 0;
+                pad->source = PAD;
+                pad->size = 0;
+            }
+
+            munmap(m_chunk, CHUNK_SIZE);
+            m_chunk = NULL;
+            m_chunkOffset += CHUNK_SIZE;
+            m_used = 0;
+        }
+
+        if (ftruncate(m_fd, m_chunkOffset + CHUNK_SIZE) != 0) {
+            return false;
+        }
+
+        chunk = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, m_chunkOffset);
+
+        if (chunk == MAP_FAILED) {
+            return false;
+        }
+
+        m_chunk = (char*)chunk;
+        return true;
+    }
+
+    void FrameCapture::finish() {
+        m_enabled = false;
+
+        if (m_chunk) {
+            munmap(m_chunk, CHUNK_SIZE);
+            m_chunk = NULL;
+        }
+
+        if (ftruncate(m_fd, m_chunkOffset + m_used) != 0) {
+#ifdef HYDNADEBUG
+            debugPrint("FrameCapture", 0, "Could not truncate the capture file");
+#endif
+        }
+
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    volatile bool FrameCapture::m_enabled = false;
+    pthread_mutex_t FrameCapture::m_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    int FrameCapture::m_fd = -1;
+    char* FrameCapture::m_chunk = NULL;
+    unsigned long long FrameCapture::m_chunkOffset = 0;
+    unsigned int FrameCapture::m_used = 0;
+    unsigned long long FrameCapture::m_frames = 0;
+}
@@ -1,6 +1,10 @@
 #include <pthread.h>
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
 
 #include "channel.h"
 #include "frame.h"
@@ -9,34 +13,241 @@
 #include "channelsignal.h"
 #include "channelmode.h"
 #include "url.h"
+#include "clock.h"
+#include "trace.h"
 
 #include "error.h"
 #include "ioerror.h"
 #include "rangeerror.h"
 #include "channelerror.h"
-
-#ifdef HYDNADEBUG
-#include "debughelper.h"
-#endif
+#include "deadlinetimer.h"
+#include "iothread.h"
+#include "relay.h"
 
 namespace hydna {
     
     using namespace std;
 
+    // The number of written frames that are remembered until the server
+    // sends them back, see Channel::setLocalLoopback().
+    static const unsigned int MAX_ECHOES = 65536;
+
+    // How long a written frame is remembered, in milliseconds. A copy that
+    // comes back later is delivered again.
+    static const unsigned int ECHO_TIMEOUT = 2000;
+
+    static ChannelError openTimeoutError() {
+        return ChannelError("The channel could not be opened in time");
+    }
+
+    /**
+     *  Describes why Connection::writeBytes() did not send a frame.
+     */
+    static IOError writeError(int failure) {
+        switch (failure) {
+        case Connection::WRITE_QUEUE_FULL:
+            return IOError("Reconnect queue is full");
+        case Connection::WRITE_OVER_BUDGET:
+            return IOError("The memory budget is exceeded");
+        case Connection::WRITE_DESTROYED:
+            return IOError("The connection was closed");
+        default:
+            return IOError("The connection is not ready");
+        }
+    }
+
+    /**
+     *  Hashes the part of a frame payload that follows the bytes kept in
+     *  Channel::Echo::head.
+     */
+    static unsigned long long hashPayload(const char* data, unsigned int length) {
+        unsigned long long hash = 14695981039346656037ULL;
+        unsigned long long word;
+
+        for (; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+            memcpy(&word, data, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ULL;
+            hash ^= hash >> 29;
+        }
+
+        for (; length > 0; data++, length--) {
+            hash = (hash ^ (unsigned char)*data) * 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    class ListenerCall;
+
+    static __thread ListenerCall* currentCall = NULL;
+
+    /**
+     *  Counts a call to the listener of a channel until it returns, or
+     *  throws. The calls of a thread are kept as a stack, so that a
+     *  channel that is deleted, or gets a new listener, from its own
+     *  listener does not wait for itself.
+     */
+    class ListenerCall {
+    public:
+        ListenerCall(Channel* channel) : m_channel(channel), m_outer(currentCall) {
+            currentCall = this;
+        }
+
+        ~ListenerCall() {
+            currentCall = m_outer;
+
+            // NULL if the channel was deleted during the call.
+            if (m_channel) {
+                m_channel->releaseListener();
+            }
+        }
+
+        /**
+         *  Returns the number of calls to the listener of a channel that
+         *  the calling thread is in.
+         */
+        static unsigned int count(Channel* channel) {
+            unsigned int result = 0;
+
+            for (ListenerCall* call = currentCall; call; call = call->m_outer) {
+                if (call->m_channel == channel) {
+                    result++;
+                }
+            }
+
+            return result;
+        }
+
+        /**
+         *  Forgets a channel that is deleted during calls to its listener.
+         */
+        static void forget(Channel* channel) {
+            for (ListenerCall* call = currentCall; call; call = call->m_outer) {
+                if (call->m_channel == channel) {
+                    call->m_channel = NULL;
+                }
+            }
+        }
+
+    private:
+        Channel* m_channel;
+        ListenerCall* m_outer;
+    };
+
     Channel::Channel() : m_ch(0), m_message(""), m_connection(NULL), m_connected(false), m_closing(false), m_pendingClose(NULL),
-                       m_readable(false), m_writable(false), m_emitable(false), m_error("", 0x0), m_openRequest(NULL)
+                       m_readable(false), m_writable(false), m_emitable(false), m_error("", 0x0),
+                       m_mode(0), m_openRequest(NULL), m_resolveRequest(NULL),
+                       m_envelope(false), m_batching(false), m_batchCtype(0), m_batchPriority(0), m_batchCount(0),
+                       m_batchDelay(Envelope::DEFAULT_BATCH_DELAY), m_batchStarted(0), m_batchDeadline(0), m_batchTimerUsed(false), m_batchDropped(0), m_dataPlain(0),
+                       m_compressor(NULL), m_compressionThreshold(0), m_dictionaryId(0), m_connectStarted(0), m_openLatency(0), m_dataIn(0), m_dataBytesIn(0), m_signalsIn(0),
+                       m_dataOut(0), m_dataBytesOut(0), m_signalsOut(0), m_dataQueueDepth(0), m_signalQueueDepth(0),
+                       m_listener(NULL), m_listenerCalls(0), m_openTimeout(0), m_openDeadline(0), m_openTimerUsed(false), m_timedOut(false),
+                       m_timeoutReported(false), m_set(NULL), m_setReady(false),
+                       m_memory(&MemoryAccount::getGlobal()), m_dataQueueBytes(0), m_signalQueueBytes(0),
+                       m_loopback(false), m_echoCount(0), m_dataLooped(0), m_echoesDropped(0), m_echoesExpired(0),
+                       m_relay(NULL), m_relayIndex(0), m_spool(NULL), m_dataSpooled(0),
+                       m_ratePolicy(RateLimiter::BLOCK), m_rateQueueLimit(RateLimiter::DEFAULT_QUEUE_LIMIT),
+                       m_pacedCount(0), m_pacerUsed(false), m_pacing(true), m_pacedSending(false)
     {
+        pthread_condattr_t attr;
+
+        // The wait for queued messages in close() is in Clock::now()
+        // time, which is monotonic.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
         pthread_mutex_init(&m_dataMutex, NULL);
         pthread_mutex_init(&m_signalMutex, NULL);
         pthread_mutex_init(&m_connectMutex, NULL);
+        pthread_mutex_init(&m_batchMutex, NULL);
+        pthread_mutex_init(&m_compressMutex, NULL);
+        pthread_mutex_init(&m_spoolMutex, NULL);
+        pthread_cond_init(&m_openCond, NULL);
+        pthread_mutex_init(&m_pacedMutex, NULL);
+        pthread_cond_init(&m_pacedCond, &attr);
+        pthread_mutex_init(&m_listenerMutex, NULL);
+        pthread_cond_init(&m_listenerCond, NULL);
+
+        pthread_condattr_destroy(&attr);
+
+        for (unsigned int i = 0; i < Codec::CODEC_COUNT; i++) {
+            m_decompressors[i] = NULL;
+        }
         
         m_resolved = false;
+        m_reassembler.setMemory(m_memory);
+
+        // Message ids only need to be unique among the senders on a
+        // channel, start at a random-ish point.
+        m_messageId = (unsigned int)(Clock::now() * 2654435761u) ^ (unsigned int)(size_t)this;
     }
 
     Channel::~Channel() {
+        pthread_mutex_lock(&m_dataMutex);
+        ChannelSet* set = m_set;
+        Relay* relay = m_relay;
+        pthread_mutex_unlock(&m_dataMutex);
+
+        if (set) {
+            set->remove(this);
+        }
+
+        if (relay) {
+            relay->remove(this);
+        }
+
+        // The pacer may be sending, and would wake the channel again.
+        pthread_mutex_lock(&m_pacedMutex);
+        bool pacerUsed = m_pacerUsed;
+        m_pacing = false;
+        pthread_mutex_unlock(&m_pacedMutex);
+
+        // The open deadline is cleared as soon as it fires, but
+        // openTimedOut() may still be running on the timer thread.
+        if (m_openTimerUsed || pacerUsed || m_batchTimerUsed) {
+            DeadlineTimer::getShared().removeChannel(this);
+        }
+
+        // After the timers, which may call the listener too.
+        waitForListener();
+        ListenerCall::forget(this);
+
+        while (!m_paced.empty()) {
+            delete m_paced.front().data;
+            m_paced.pop_front();
+        }
+
+        while (!m_dataQueue.empty()) {
+            delete m_dataQueue.front();
+            m_dataQueue.pop();
+        }
+
+        while (!m_signalQueue.empty()) {
+            delete m_signalQueue.front();
+            m_signalQueue.pop();
+        }
+
+        m_memory->release(MemoryAccount::DATA, m_dataQueueBytes);
+        m_memory->release(MemoryAccount::SIGNALS, m_signalQueueBytes);
+
         pthread_mutex_destroy(&m_dataMutex);
         pthread_mutex_destroy(&m_signalMutex);
         pthread_mutex_destroy(&m_connectMutex);
+        pthread_mutex_destroy(&m_batchMutex);
+        pthread_mutex_destroy(&m_compressMutex);
+        pthread_mutex_destroy(&m_spoolMutex);
+        pthread_cond_destroy(&m_openCond);
+        pthread_mutex_destroy(&m_pacedMutex);
+        pthread_cond_destroy(&m_pacedCond);
+        pthread_mutex_destroy(&m_listenerMutex);
+        pthread_cond_destroy(&m_listenerCond);
+
+        delete m_compressor;
+        delete m_spool;
+
+        for (unsigned int i = 0; i < Codec::CODEC_COUNT; i++) {
+            delete m_decompressors[i];
+        }
     }
 
     bool Channel::getFollowRedirects() const
@@ -48,6 +259,379 @@ namespace hydna {
     {
         Connection::m_followRedirects = value;
     }
+
+    bool Channel::getAutoReconnect() const
+    {
+        return Connection::m_autoReconnect;
+    }
+
+    void Channel::setAutoReconnect(bool value)
+    {
+        Connection::m_autoReconnect = value;
+    }
+
+    void Channel::setReconnectBackoff(unsigned int initialDelay,
+                                      unsigned int maxDelay,
+                                      unsigned int maxAttempts)
+    {
+        if (initialDelay < Connection::MIN_RECONNECT_DELAY) {
+            throw RangeError("Initial delay must be at least 10 ms");
+        }
+
+        if (initialDelay > maxDelay) {
+            throw RangeError("Initial delay must not exceed the max delay");
+        }
+
+        Connection::m_reconnectInitialDelay = initialDelay;
+        Connection::m_reconnectMaxDelay = maxDelay;
+        Connection::m_reconnectMaxAttempts = maxAttempts;
+    }
+
+    void Channel::setReconnectQueueLimit(unsigned int limit)
+    {
+        Connection::m_reconnectQueueLimit = limit;
+    }
+
+    void Channel::setKeepalive(unsigned int interval, unsigned int idleTimeout)
+    {
+        Connection::m_keepaliveInterval = interval;
+        Connection::m_idleTimeout = idleTimeout;
+    }
+
+    void Channel::setTlsVerify(bool verify, string const &caFile)
+    {
+        Connection::m_tlsVerify = verify;
+        Connection::m_tlsCaFile = caFile;
+    }
+
+    void Channel::setKernelTls(bool value)
+    {
+        Connection::m_kernelTls = value;
+    }
+
+    void Channel::setIoThreadCpus(string const &cpus)
+    {
+        vector<unsigned int> list = IoThread::parseCpuList(cpus);
+
+        pthread_mutex_lock(&Connection::m_ioSettingsMutex);
+        Connection::m_ioCpus = list;
+        pthread_mutex_unlock(&Connection::m_ioSettingsMutex);
+    }
+
+    void Channel::setIoThreadNumaNode(int node)
+    {
+        pthread_mutex_lock(&Connection::m_ioSettingsMutex);
+        Connection::m_ioNumaNode = node < 0 ? -1 : node;
+        pthread_mutex_unlock(&Connection::m_ioSettingsMutex);
+    }
+
+    void Channel::setIoThreadPriority(int priority)
+    {
+        if (priority < 0 || priority > 99) {
+            throw RangeError("Priority must be between 0 - 99");
+        }
+
+        pthread_mutex_lock(&Connection::m_ioSettingsMutex);
+        Connection::m_ioPriority = priority;
+        pthread_mutex_unlock(&Connection::m_ioSettingsMutex);
+    }
+
+    void Channel::setMemoryBudget(unsigned long long bytes)
+    {
+        MemoryAccount::getGlobal().setBudget(bytes);
+    }
+
+    unsigned long long Channel::getMemoryBudget() const
+    {
+        return MemoryAccount::getGlobal().getBudget();
+    }
+
+    void Channel::setConnectionMemoryBudget(unsigned long long bytes)
+    {
+        Connection::m_connectionMemoryBudget = bytes;
+    }
+
+    unsigned long long Channel::getConnectionMemoryBudget() const
+    {
+        return Connection::m_connectionMemoryBudget;
+    }
+
+    void Channel::setMemoryPolicy(int policy)
+    {
+        if (policy != MemoryAccount::BACKPRESSURE && policy != MemoryAccount::SHED) {
+            throw RangeError("Unknown memory policy");
+        }
+
+        Connection::m_memoryPolicy = policy;
+    }
+
+    int Channel::getMemoryPolicy() const
+    {
+        return Connection::m_memoryPolicy;
+    }
+
+    MemoryStats Channel::getMemoryStats() const
+    {
+        return MemoryAccount::getGlobal().getStats();
+    }
+
+    Histogram Channel::getRoundTripTimes() const
+    {
+        Histogram result;
+
+        pthread_mutex_lock(&m_connectMutex);
+        if (m_connection) {
+            result = m_connection->getRoundTripTimes();
+        }
+        pthread_mutex_unlock(&m_connectMutex);
+
+        return result;
+    }
+
+    bool Channel::getEnvelope() const
+    {
+        pthread_mutex_lock(&m_compressMutex);
+        bool envelope = m_envelope;
+        pthread_mutex_unlock(&m_compressMutex);
+
+        return envelope;
+    }
+
+    void Channel::setEnvelope(bool value)
+    {
+        pthread_mutex_lock(&m_compressMutex);
+        m_envelope = value;
+        pthread_mutex_unlock(&m_compressMutex);
+    }
+
+    bool Channel::getBatching() const
+    {
+        return m_batching;
+    }
+
+    void Channel::setBatching(bool value)
+    {
+        pthread_mutex_lock(&m_batchMutex);
+
+        m_batching = value;
+
+        if (value) {
+            pthread_mutex_lock(&m_compressMutex);
+            m_envelope = true;
+            pthread_mutex_unlock(&m_compressMutex);
+        } else {
+            try {
+                flushBatch();
+            } catch (...) {
+                pthread_mutex_unlock(&m_batchMutex);
+                throw;
+            }
+        }
+
+        pthread_mutex_unlock(&m_batchMutex);
+    }
+
+    unsigned int Channel::getBatchDelay() const
+    {
+        return m_batchDelay;
+    }
+
+    void Channel::setBatchDelay(unsigned int value)
+    {
+        pthread_mutex_lock(&m_batchMutex);
+        m_batchDelay = value;
+        pthread_mutex_unlock(&m_batchMutex);
+    }
+
+    void Channel::flush()
+    {
+        pthread_mutex_lock(&m_batchMutex);
+
+        try {
+            flushBatch();
+        } catch (...) {
+            pthread_mutex_unlock(&m_batchMutex);
+            throw;
+        }
+
+        pthread_mutex_unlock(&m_batchMutex);
+    }
+
+    void Channel::setCompression(unsigned char codec, unsigned int threshold)
+    {
+        if (codec != Codec::NONE && !Codec::isAvailable(codec)) {
+            throw Error("Compression codec " + string(Codec::getName(codec)) + " is not available");
+        }
+
+        pthread_mutex_lock(&m_compressMutex);
+
+        delete m_compressor;
+        m_compressor = NULL;
+        m_compressionThreshold = threshold;
+
+        if (codec != Codec::NONE) {
+            m_compressor = Codec::create(codec);
+            m_compressor->setDictionary(m_dictionary);
+            m_compressed.resize(Frame::PAYLOAD_MAX_LIMIT);
+
+            // Compressed messages are sent in the envelope, see
+            // setEnvelope().
+            m_envelope = true;
+        }
+
+        pthread_mutex_unlock(&m_compressMutex);
+    }
+
+    void Channel::setDictionary(string const &dictionary)
+    {
+        pthread_mutex_lock(&m_compressMutex);
+
+        m_dictionary = dictionary;
+        m_dictionaryId = Codec::dictionaryId(dictionary);
+
+        if (m_compressor) {
+            m_compressor->setDictionary(dictionary);
+        }
+
+        for (unsigned int i = 0; i < Codec::CODEC_COUNT; i++) {
+            if (m_decompressors[i]) {
+                m_decompressors[i]->setDictionary(dictionary);
+            }
+        }
+
+        pthread_mutex_unlock(&m_compressMutex);
+    }
+
+    void Channel::setMaxMessageSize(unsigned int value)
+    {
+        pthread_mutex_lock(&m_dataMutex);
+        m_reassembler.setMaxMessageSize(value);
+        pthread_mutex_unlock(&m_dataMutex);
+    }
+
+    bool Channel::getLocalLoopback() const
+    {
+        return m_loopback;
+    }
+
+    void Channel::setLocalLoopback(bool value)
+    {
+        m_loopback = value;
+    }
+
+    string Channel::getSpool() const
+    {
+        pthread_mutex_lock(&m_spoolMutex);
+        string path = m_spool ? m_spool->getPath() : "";
+        pthread_mutex_unlock(&m_spoolMutex);
+
+        return path;
+    }
+
+    void Channel::setSpool(string const &path, unsigned int capacity)
+    {
+        Spool* spool = path.empty() ? NULL : new Spool(path, capacity);
+
+        pthread_mutex_lock(&m_spoolMutex);
+        delete m_spool;
+        m_spool = spool;
+        pthread_mutex_unlock(&m_spoolMutex);
+    }
+
+    void Channel::setRateLimit(unsigned long long messages,
+                               unsigned long long bytes,
+                               unsigned int burst)
+    {
+        m_rateLimiter.setLimit(messages, bytes, burst);
+    }
+
+    void Channel::setConnectionRateLimit(unsigned long long messages,
+                                         unsigned long long bytes,
+                                         unsigned int burst)
+    {
+        Connection::m_connectionMessageRate = messages;
+        Connection::m_connectionByteRate = bytes;
+        Connection::m_connectionRateBurst = burst;
+    }
+
+    void Channel::setRatePolicy(int policy, unsigned int queueLimit)
+    {
+        if (policy != RateLimiter::BLOCK && policy != RateLimiter::QUEUE &&
+            policy != RateLimiter::REJECT) {
+            throw RangeError("Unknown rate policy");
+        }
+
+        pthread_mutex_lock(&m_pacedMutex);
+        m_ratePolicy = policy;
+        m_rateQueueLimit = queueLimit;
+        pthread_mutex_unlock(&m_pacedMutex);
+    }
+
+    int Channel::getRatePolicy() const
+    {
+        return m_ratePolicy;
+    }
+
+    ChannelStats Channel::getStats() const
+    {
+        ChannelStats stats;
+
+        stats.dataIn = m_dataIn;
+        stats.dataBytesIn = m_dataBytesIn;
+        stats.signalsIn = m_signalsIn;
+        stats.dataOut = m_dataOut;
+        stats.dataBytesOut = m_dataBytesOut;
+        stats.signalsOut = m_signalsOut;
+        stats.dataQueue = m_dataQueueDepth;
+        stats.signalQueue = m_signalQueueDepth;
+        stats.openLatency = m_openLatency;
+        stats.dataLooped = m_dataLooped;
+        stats.echoesDropped = m_echoesDropped;
+
+        pthread_mutex_lock(&m_dataMutex);
+        stats.echoesExpired = m_echoesExpired;
+        pthread_mutex_unlock(&m_dataMutex);
+        stats.dataSpooled = m_dataSpooled;
+        stats.batchDropped = m_batchDropped;
+        stats.dataPlain = m_dataPlain;
+
+        pthread_mutex_lock(&m_spoolMutex);
+        stats.spoolQueue = m_spool ? m_spool->getFrames() : 0;
+        pthread_mutex_unlock(&m_spoolMutex);
+
+        stats.rate = m_rateLimiter.getStats();
+        stats.rate.queue = m_pacedCount;
+
+        return stats;
+    }
+
+    ConnectionStats Channel::getConnectionStats() const
+    {
+        ConnectionStats result;
+
+        pthread_mutex_lock(&m_connectMutex);
+        if (m_connection) {
+            result = m_connection->getStats();
+        }
+        pthread_mutex_unlock(&m_connectMutex);
+
+        return result;
+    }
+
+    ReconnectStats Channel::getReconnectStats() const
+    {
+        ReconnectStats result;
+
+        pthread_mutex_lock(&m_connectMutex);
+        if (m_connection) {
+            result = m_connection->getReconnectStats();
+        } else {
+            memset(&result, 0, sizeof(result));
+        }
+        pthread_mutex_unlock(&m_connectMutex);
+
+        return result;
+    }
     
     bool Channel::isConnected() const {
         pthread_mutex_lock(&m_connectMutex);
@@ -125,48 +709,148 @@ namespace hydna {
 
         URL url = URL::parse(expr);
 
-        if (url.getProtocol() != "http") {
-            if (url.getProtocol() == "https") {
-                throw Error("The protocol HTTPS is not supported");
-            } else {
-                throw Error("Unknown protocol, " + url.getProtocol());
+        if (url.isSecure()) {
+            if (!TlsSession::isAvailable()) {
+                throw Error("The protocol HTTPS is not supported, the library is compiled without TLS");
             }
+        } else if (!url.isSupported()) {
+            throw Error("Unknown protocol, " + url.getProtocol().toString());
         }
 
-        if (url.getError() != "") {
+        if (url.hasError()) {
             throw Error(url.getError()); 
         }
 
-        m_path = "/" + url.getPath();
+        m_path = "/";
+        m_path.append(url.getPath().getData(), url.getPath().getSize());
         
         if (m_path.length() == 0 || (m_path.length() == 1 && m_path[0] != '/')) {
             m_path = "/";
         }
 
-        m_token = url.getToken();
+        // Keep a copy of the token, it is needed to re-open the
+        // channel after a reconnect.
+        if (token) {
+            m_token = string(token, tokenLength);
+        } else {
+            m_token = url.getToken().toString();
+        }
+
+        if (MemoryAccount::getGlobal().isOverBudget()) {
+            MemoryAccount::getGlobal().countShed();
+            throw Error("The memory budget is exceeded");
+        }
 
         m_ch = Frame::RESOLVE_CHANNEL;
-        m_connection = Connection::getConnection(url.getHost(), url.getPort(), url.getAuth());
+        m_connectStarted = Clock::now();
+        m_connection = Connection::getConnection(url);
       
         // Ref count
         m_connection->allocChannel();
 
+        // Messages still queued from an earlier connect move along.
+        pthread_mutex_lock(&m_dataMutex);
+        pthread_mutex_lock(&m_signalMutex);
+        m_memory = &m_connection->getMemory();
+        m_memory->attach(MemoryAccount::DATA, m_dataQueueBytes);
+        m_memory->attach(MemoryAccount::SIGNALS, m_signalQueueBytes);
+        m_reassembler.setMemory(m_memory);
+        pthread_mutex_unlock(&m_signalMutex);
+        pthread_mutex_unlock(&m_dataMutex);
+
         frame = new Frame(Frame::RESOLVE_CHANNEL, ContentType::UTF8, Frame::RESOLVE, 0, m_path.c_str(), 0, m_path.length());
         
-        if (token || m_token == "") {
-            request = new OpenRequest(this, m_ch, m_path.c_str(), m_path.length(), token, tokenLength, frame);
-        } else {
-            request = new OpenRequest(this, m_ch, m_path.c_str(), m_path.length(), m_token.c_str(), m_token.length(), frame);
-        }
+        request = new OpenRequest(this, m_ch, m_path.c_str(), m_path.length(), m_token.c_str(), m_token.length(), frame);
 
         m_error = ChannelError("", 0x0);
+
+        // Set before the request is sent, the answer may be handled by
+        // the I/O thread before requestResolve() returns.
+        pthread_mutex_lock(&m_connectMutex);
+        m_resolveRequest = request;
+        pthread_mutex_unlock(&m_connectMutex);
       
         if (!m_connection->requestResolve(request)) {
+            pthread_mutex_lock(&m_connectMutex);
+            m_resolveRequest = NULL;
+            pthread_mutex_unlock(&m_connectMutex);
+
             checkForChannelError();
             throw Error("Channel already open");
         }
 
-        m_resolveRequest = request;
+        if (m_openTimeout) {
+            pthread_mutex_lock(&m_connectMutex);
+            if (m_connection && !m_connected) {
+                m_openDeadline = m_connectStarted + m_openTimeout * 1000ULL;
+                m_openTimerUsed = true;
+                DeadlineTimer::getShared().add(this, DeadlineTimer::OPEN, m_openDeadline);
+            }
+            pthread_mutex_unlock(&m_connectMutex);
+        }
+    }
+
+    void Channel::setOpenTimeout(unsigned int timeout) {
+        m_openTimeout = timeout;
+    }
+
+    unsigned int Channel::getOpenTimeout() const {
+        return m_openTimeout;
+    }
+
+    void Channel::waitForOpen() {
+        pthread_mutex_lock(&m_connectMutex);
+
+        while (m_connection && !m_connected && !m_timeoutReported) {
+            pthread_cond_wait(&m_openCond, &m_connectMutex);
+        }
+
+        bool opened = m_connected && !m_timeoutReported;
+        ChannelError error = m_error;
+
+        pthread_mutex_unlock(&m_connectMutex);
+
+        if (!opened) {
+            if (error.getCode() != 0x0) {
+                throw error;
+            }
+
+            throw ChannelError("The channel was closed before it was opened");
+        }
+    }
+
+    void Channel::openTimedOut() {
+        pthread_mutex_lock(&m_connectMutex);
+        if (m_connected || !m_connection || m_closing) {
+            pthread_mutex_unlock(&m_connectMutex);
+            return;
+        }
+
+        m_openDeadline = 0;
+        m_timedOut = true;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        HYDNA_TRACE(Trace::OPEN_TIMEOUT, m_ch, m_openTimeout, 0);
+
+        // Cancels the open request if it is not sent yet, in which case
+        // the channel is destroyed right away.
+        close();
+
+        pthread_mutex_lock(&m_connectMutex);
+        bool report = m_timedOut && m_connection;
+        ChannelListener* listener = report ? acquireListener() : NULL;
+
+        if (report) {
+            m_timeoutReported = true;
+            m_error = openTimeoutError();
+            pthread_cond_broadcast(&m_openCond);
+        }
+        pthread_mutex_unlock(&m_connectMutex);
+
+        if (listener) {
+            ListenerCall call(this);
+            listener->onClose(*this, openTimeoutError());
+        }
     }
     
     void Channel::resolveSuccess(unsigned int ch, const char* path, int path_size, const char* token, int token_size) {
@@ -194,6 +878,7 @@ namespace hydna {
         }
         
         m_openRequest = request;
+        m_resolveRequest = NULL;
         
         m_resolved = true;
         
@@ -206,36 +891,708 @@ namespace hydna {
                             unsigned int priority
                             )
     {
-        bool result;
-        
         pthread_mutex_lock(&m_connectMutex);
-        if (!m_connected || !m_connection) {
-            pthread_mutex_unlock(&m_connectMutex);
+        Connection* connection = m_connection;
+        bool connected = m_connected && m_connection;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        // With a spool, writes are taken while not connected, once the
+        // channel has been connected for writing.
+        if (!connected && !(m_spool && (m_mode & ChannelMode::WRITE) == ChannelMode::WRITE)) {
             checkForChannelError();
             throw IOError("Channel is not connected");
         }
-        pthread_mutex_unlock(&m_connectMutex);
 
-        if (!m_writable) {
-            throw Error("Channel is not writable");
+        if (connected && !m_writable) {
+            throw Error("Channel is not writable");
+        }
+      
+        if (priority > 3) {
+            throw RangeError("Priority must be between 0 - 3");
+        }
+
+        if (throttle(connection, data + offset, length, ctype, priority)) {
+            sendBytes(data + offset, length, ctype, priority);
+        }
+    }
+
+    void Channel::sendBytes(const char* data,
+                            unsigned int length,
+                            unsigned int ctype,
+                            unsigned int priority)
+    {
+        if (m_batching) {
+            pthread_mutex_lock(&m_batchMutex);
+
+            try {
+                if (!m_batch.empty() &&
+                    (ctype != m_batchCtype || priority != m_batchPriority ||
+                     length > Envelope::BATCH_RECORD_MAX_SIZE ||
+                     m_batch.size() + Envelope::BATCH_RECORD_HEADER_SIZE + length > Frame::PAYLOAD_MAX_LIMIT)) {
+                    flushBatch();
+                }
+
+                // Batching may have been disabled meanwhile.
+                if (m_batching && length <= Envelope::BATCH_RECORD_MAX_SIZE) {
+                    unsigned short size = htons(length);
+
+                    if (m_batch.empty()) {
+                        m_batch.reserve(Frame::PAYLOAD_MAX_LIMIT);
+                        m_batch.resize(Envelope::HEADER_SIZE);
+                        Envelope::writeHeader(&m_batch[0], Envelope::BATCH);
+                        m_batchCtype = ctype;
+                        m_batchPriority = priority;
+
+                        if (m_batchDelay > 0) {
+                            m_batchStarted = Clock::now();
+                            armBatchTimer(m_batchStarted + m_batchDelay * 1000ULL);
+                        }
+                    }
+
+                    m_batch.insert(m_batch.end(), (char*)&size, (char*)&size + sizeof(size));
+                    m_batch.insert(m_batch.end(), data, data + length);
+                    m_batchCount++;
+
+                    pthread_mutex_unlock(&m_batchMutex);
+
+                    __sync_fetch_and_add(&m_dataOut, 1);
+                    __sync_fetch_and_add(&m_dataBytesOut, length);
+
+                    // A batch that cannot be sent later is counted as
+                    // dropped, see flushBatch().
+                    loopBack(data, length, ctype, priority);
+                    return;
+                }
+            } catch (...) {
+                pthread_mutex_unlock(&m_batchMutex);
+                throw;
+            }
+
+            // Too large to batch. The batch has been flushed, so ordering
+            // is kept.
+            pthread_mutex_unlock(&m_batchMutex);
+        }
+
+        pthread_mutex_lock(&m_compressMutex);
+        bool envelope = m_envelope;
+        pthread_mutex_unlock(&m_compressMutex);
+
+        if (!envelope) {
+            writeFrame(ctype, Frame::DATA, priority, NULL, 0, data, length);
+        } else if (length <= Envelope::RAW_MAX_SIZE) {
+            writeEnvelope(ctype, priority, Envelope::RAW, data, length);
+        } else {
+            // Each fragment is written on its own, so that frames on other
+            // channels are not held up by a large message.
+            unsigned int id = __sync_fetch_and_add(&m_messageId, 1);
+            char header[Envelope::FRAGMENT_HEADER_SIZE];
+            unsigned int n;
+
+            for (unsigned int sent = 0; sent < length; sent += n) {
+                n = min(length - sent, (unsigned int)Envelope::FRAGMENT_MAX_SIZE);
+
+                Envelope::writeFragmentHeader(header, id, length, sent);
+                writeFrame(ctype, Frame::DATA, priority, header, sizeof(header), data + sent, n);
+            }
+        }
+
+        __sync_fetch_and_add(&m_dataOut, 1);
+        __sync_fetch_and_add(&m_dataBytesOut, length);
+
+        // Local readers only get what was written.
+        loopBack(data, length, ctype, priority);
+    }
+
+    bool Channel::throttle(Connection* connection,
+                           const char* data,
+                           unsigned int length,
+                           unsigned int ctype,
+                           unsigned int priority)
+    {
+        if (!m_rateLimiter.isLimited() && m_pacedCount == 0 &&
+            !(connection && connection->getRateLimiter().isLimited())) {
+            return true;
+        }
+
+        // Writes wait behind queued messages whatever the policy, so that
+        // they are sent in order.
+        if (m_ratePolicy == RateLimiter::QUEUE || m_pacedCount > 0) {
+            return queuePaced(connection, data, length, ctype, priority);
+        }
+
+        RateLimiter* limiter = NULL;
+        unsigned long long started = 0;
+        unsigned long long wait;
+
+        while ((wait = takeTokens(connection, length, limiter)) > 0) {
+            if (m_ratePolicy == RateLimiter::REJECT) {
+                limiter->countRejected();
+                throw IOError("The rate limit is exceeded");
+            }
+
+            if (!started) {
+                started = Clock::now();
+            }
+
+            usleep(wait);
+        }
+
+        if (started) {
+            limiter->countThrottled(Clock::now() - started);
+        }
+
+        return true;
+    }
+
+    bool Channel::queuePaced(Connection* connection,
+                             const char* data,
+                             unsigned int length,
+                             unsigned int ctype,
+                             unsigned int priority)
+    {
+        unsigned long long wait = 0;
+        bool connectionLimit;
+
+        pthread_mutex_lock(&m_pacedMutex);
+
+        if (m_paced.empty()) {
+            RateLimiter* limiter;
+
+            wait = takeTokens(connection, length, limiter);
+
+            if (wait == 0) {
+                pthread_mutex_unlock(&m_pacedMutex);
+                return true;
+            }
+
+            connectionLimit = limiter != &m_rateLimiter;
+        } else {
+            connectionLimit = m_paced.back().connectionLimit;
+        }
+
+        if (m_paced.size() >= m_rateQueueLimit) {
+            pthread_mutex_unlock(&m_pacedMutex);
+            m_rateLimiter.countRejected();
+            throw IOError("The rate limit queue is full");
+        }
+
+        PacedWrite paced;
+        paced.data = ChannelData::copy(priority, data, length, ctype);
+        paced.queued = Clock::now();
+        paced.connectionLimit = connectionLimit;
+
+        m_paced.push_back(paced);
+        m_pacedCount = m_paced.size();
+
+        // Otherwise the pacer is already waiting, or sending.
+        if (m_paced.size() == 1) {
+            m_pacerUsed = true;
+
+            if (!DeadlineTimer::getShared().add(this, DeadlineTimer::PACED, paced.queued + wait)) {
+                delete paced.data;
+                m_paced.pop_back();
+                m_pacedCount = 0;
+
+                pthread_mutex_unlock(&m_pacedMutex);
+                throw IOError("Could not create a new thread for the rate limit queue");
+            }
+        }
+
+        pthread_mutex_unlock(&m_pacedMutex);
+        return false;
+    }
+
+    unsigned long long Channel::takeTokens(Connection* connection,
+                                           unsigned int length,
+                                           RateLimiter*& limiter)
+    {
+        unsigned long long wait = m_rateLimiter.take(length);
+
+        if (wait > 0) {
+            limiter = &m_rateLimiter;
+            return wait;
+        }
+
+        if (connection && (wait = connection->getRateLimiter().take(length)) > 0) {
+            m_rateLimiter.refund(length);
+            limiter = &connection->getRateLimiter();
+        }
+
+        return wait;
+    }
+
+    void Channel::sendPaced() {
+        pthread_mutex_lock(&m_connectMutex);
+        Connection* connection = m_connection;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        pthread_mutex_lock(&m_pacedMutex);
+
+        while (m_pacing && !m_paced.empty()) {
+            PacedWrite paced = m_paced.front();
+            RateLimiter* limiter;
+            unsigned long long wait = takeTokens(connection, paced.data->getSize(), limiter);
+            bool sent = true;
+
+            if (wait > 0) {
+                // Always added, this is the timer thread.
+                DeadlineTimer::getShared().add(this, DeadlineTimer::PACED, Clock::now() + wait);
+                break;
+            }
+
+            m_pacedSending = true;
+            pthread_mutex_unlock(&m_pacedMutex);
+
+            if (paced.connectionLimit && connection) {
+                connection->getRateLimiter().countThrottled(Clock::now() - paced.queued);
+            } else {
+                m_rateLimiter.countThrottled(Clock::now() - paced.queued);
+            }
+
+            try {
+                sendBytes(paced.data->getContent(), paced.data->getSize(),
+                          paced.data->getContentType(), paced.data->getPriority());
+            } catch (Error& e) {
+                sent = false;
+            }
+
+            pthread_mutex_lock(&m_pacedMutex);
+            m_pacedSending = false;
+
+            delete paced.data;
+            m_paced.pop_front();
+
+            // The rest would fail the same way.
+            if (!sent) {
+                m_rateLimiter.countDropped(1);
+                dropPaced();
+            }
+
+            m_pacedCount = m_paced.size();
+        }
+
+        bool pacing = m_pacing;
+
+        if (m_paced.empty()) {
+            pthread_cond_broadcast(&m_pacedCond);
+        }
+
+        pthread_mutex_unlock(&m_pacedMutex);
+
+        // Batched messages go out with each round of the pacer.
+        if (m_batching && pacing) {
+            try {
+                flush();
+            } catch (Error& e) {
+                // The batch is dropped, as the queue would have been.
+            }
+        }
+    }
+
+    void Channel::dropPaced() {
+        unsigned int keep = m_pacedSending ? 1 : 0;
+
+        if (m_paced.size() > keep) {
+            m_rateLimiter.countDropped(m_paced.size() - keep);
+        }
+
+        while (m_paced.size() > keep) {
+            delete m_paced.back().data;
+            m_paced.pop_back();
+        }
+
+        m_pacedCount = m_paced.size();
+    }
+
+    void Channel::loopBack(const char* data,
+                           unsigned int length,
+                           unsigned int ctype,
+                           unsigned int priority)
+    {
+        if (!m_loopback || !m_readable) {
+            return;
+        }
+
+        __sync_fetch_and_add(&m_dataLooped, 1);
+        addData(ChannelData::copy(priority, data, length, ctype));
+    }
+
+    Channel::Echo Channel::echoOf(const char* prefix,
+                                  unsigned int prefixLength,
+                                  const char* data,
+                                  unsigned int length)
+    {
+        Echo echo;
+        unsigned int head = min(prefixLength + length, (unsigned int)sizeof(echo.head));
+
+        // Envelope headers are shorter than the head, so the rest of the
+        // payload is contiguous on both ends.
+        echo.size = prefixLength + length;
+        memcpy(echo.head, prefix, prefixLength);
+        memcpy(echo.head + prefixLength, data, head - prefixLength);
+        echo.hash = hashPayload(data + head - prefixLength, length - (head - prefixLength));
+
+        return echo;
+    }
+
+    void Channel::expectEcho(const char* prefix,
+                             unsigned int prefixLength,
+                             const char* data,
+                             unsigned int length)
+    {
+        Echo echo = echoOf(prefix, prefixLength, data, length);
+        unsigned long long now = Clock::now();
+
+        echo.expires = now + ECHO_TIMEOUT * 1000ULL;
+
+        pthread_mutex_lock(&m_dataMutex);
+
+        expireEchoes(now);
+
+        if (m_echoes.size() >= MAX_ECHOES) {
+            m_echoes.pop_front();
+            m_echoesExpired++;
+        }
+
+        m_echoes.push_back(echo);
+        m_echoCount = m_echoes.size();
+
+        pthread_mutex_unlock(&m_dataMutex);
+    }
+
+    void Channel::forgetEcho(const char* prefix,
+                             unsigned int prefixLength,
+                             const char* data,
+                             unsigned int length)
+    {
+        Echo echo = echoOf(prefix, prefixLength, data, length);
+        unsigned int head = min(echo.size, (unsigned int)sizeof(echo.head));
+
+        pthread_mutex_lock(&m_dataMutex);
+
+        // Equal frames are interchangeable, the latest is most likely
+        // the one.
+        for (deque<Echo>::iterator it = m_echoes.end(); it != m_echoes.begin(); ) {
+            --it;
+
+            if (it->size == echo.size && it->hash == echo.hash && memcmp(it->head, echo.head, head) == 0) {
+                m_echoes.erase(it);
+                m_echoCount = m_echoes.size();
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&m_dataMutex);
+    }
+
+    void Channel::expireEchoes(unsigned long long now) {
+        // Frames are remembered in the order they were written, and the
+        // deadlines only grow.
+        while (!m_echoes.empty() && m_echoes.front().expires <= now) {
+            m_echoes.pop_front();
+            m_echoesExpired++;
+        }
+
+        m_echoCount = m_echoes.size();
+    }
+
+    void Channel::renewEchoes() {
+        unsigned long long expires = Clock::now() + ECHO_TIMEOUT * 1000ULL;
+
+        pthread_mutex_lock(&m_dataMutex);
+
+        for (deque<Echo>::iterator it = m_echoes.begin(); it != m_echoes.end(); ++it) {
+            it->expires = expires;
+        }
+
+        pthread_mutex_unlock(&m_dataMutex);
+    }
+
+    bool Channel::isEcho(const char* payload, unsigned int size) {
+        unsigned int head = min(size, (unsigned int)sizeof(m_echoes.front().head));
+        unsigned long long hash = hashPayload(payload + head, size - head);
+        unsigned long long now = Clock::now();
+        bool found = false;
+
+        pthread_mutex_lock(&m_dataMutex);
+
+        expireEchoes(now);
+
+        // Copies come back in the order they were written, unless writers
+        // on several threads raced, so the match is nearly always first.
+        for (deque<Echo>::iterator it = m_echoes.begin(); it != m_echoes.end(); ++it) {
+            if (it->size == size && it->hash == hash && memcmp(it->head, payload, head) == 0) {
+                m_echoes.erase(it);
+                m_echoCount = m_echoes.size();
+                found = true;
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&m_dataMutex);
+
+        if (found) {
+            __sync_fetch_and_add(&m_echoesDropped, 1);
+        }
+
+        return found;
+    }
+    
+    void Channel::writeFrame(Frame& frame) {
+        pthread_mutex_lock(&m_connectMutex);
+        Connection* connection = m_connection;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        if (!connection) {
+            checkForChannelError();
+            throw IOError("Channel is not connected");
+        }
+
+        int failure = 0;
+
+        if (!connection->writeBytes(frame, &failure)) {
+            checkForChannelError();
+            throw writeError(failure);
+        }
+    }
+
+    void Channel::writeFrame(unsigned int ctype,
+                             unsigned int op,
+                             unsigned int flag,
+                             const char* prefix,
+                             unsigned int prefixLength,
+                             const char* data,
+                             unsigned int length)
+    {
+        pthread_mutex_lock(&m_connectMutex);
+        Connection* connection = m_connection;
+        unsigned int ch = m_ch;
+        bool connected = m_connected;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        bool spooled = op == Frame::DATA && m_spool;
+
+        // Remembered before writing, the copy may come back before
+        // writeBytes() returns. A spooled frame comes back once the spool
+        // is flushed.
+        bool echo = op == Frame::DATA && m_loopback && m_readable;
+
+        if (echo) {
+            expectEcho(prefix, prefixLength, data, length);
+        }
+
+        int failure = 0;
+
+        try {
+            if (spooled && spoolFrame(connection, ch, connected, ctype, flag, prefix, prefixLength, data, length)) {
+                return;
+            }
+
+            if (connection && connection->writeBytes(ch, ctype, op, flag, prefix, prefixLength, data, length, &failure)) {
+                return;
+            }
+
+            if (connection && spooled && spoolFrame(connection, ch, false, ctype, flag, prefix, prefixLength, data, length)) {
+                return;
+            }
+        } catch (...) {
+            if (echo) {
+                forgetEcho(prefix, prefixLength, data, length);
+            }
+
+            throw;
+        }
+
+        if (echo) {
+            forgetEcho(prefix, prefixLength, data, length);
+        }
+
+        checkForChannelError();
+
+        if (!connection) {
+            throw IOError("Channel is not connected");
+        }
+
+        throw writeError(failure);
+    }
+
+    bool Channel::spoolFrame(Connection* connection,
+                             unsigned int ch,
+                             bool ready,
+                             unsigned int ctype,
+                             unsigned int flag,
+                             const char* prefix,
+                             unsigned int prefixLength,
+                             const char* data,
+                             unsigned int length)
+    {
+        char header[Frame::HEADER_SIZE + Frame::LENGTH_OFFSET];
+        struct iovec parts[3];
+
+        pthread_mutex_lock(&m_spoolMutex);
+
+        if (!m_spool || (ready && connection && m_spool->flush(connection, ch))) {
+            pthread_mutex_unlock(&m_spoolMutex);
+            return false;
         }
-      
-        if (priority > 3) {
-            throw RangeError("Priority must be between 0 - 3");
+
+        // The channel id is filled in when the frame is sent.
+        try {
+            Frame::writeHeader(header, ch, ctype, Frame::DATA, flag, prefixLength + length);
+        } catch (...) {
+            pthread_mutex_unlock(&m_spoolMutex);
+            throw;
         }
-        
-        Frame frame(m_ch, ctype, Frame::DATA, priority, data, offset, length);
-      
+
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(header);
+        parts[1].iov_base = (void*)prefix;
+        parts[1].iov_len = prefixLength;
+        parts[2].iov_base = (void*)data;
+        parts[2].iov_len = length;
+
+        if (!m_spool->append(parts, 3)) {
+            pthread_mutex_unlock(&m_spoolMutex);
+            throw IOError("The spool is full");
+        }
+
+        pthread_mutex_unlock(&m_spoolMutex);
+
+        __sync_fetch_and_add(&m_dataSpooled, 1);
+        return true;
+    }
+
+    void Channel::flushSpool() {
         pthread_mutex_lock(&m_connectMutex);
         Connection* connection = m_connection;
+        unsigned int ch = m_ch;
+        bool connected = m_connected;
         pthread_mutex_unlock(&m_connectMutex);
-        result = connection->writeBytes(frame);
 
-        if (!result) {
-            checkForChannelError();
+        if (!connected || !connection) {
+            return;
         }
+
+        // The copies of spooled frames come back once they are sent.
+        renewEchoes();
+
+        pthread_mutex_lock(&m_spoolMutex);
+        if (m_spool) {
+            m_spool->flush(connection, ch);
+        }
+        pthread_mutex_unlock(&m_spoolMutex);
     }
-    
+
+    void Channel::flushBatch() {
+        if (m_batch.empty()) {
+            return;
+        }
+
+        unsigned int count = m_batchCount;
+
+        // The timer is left armed, see batchTimedOut().
+        m_batchCount = 0;
+
+        try {
+            writeEnvelope(m_batchCtype, m_batchPriority, Envelope::BATCH,
+                          &m_batch[Envelope::HEADER_SIZE], m_batch.size() - Envelope::HEADER_SIZE);
+        } catch (...) {
+            m_batch.clear();
+            __sync_fetch_and_add(&m_batchDropped, count);
+            throw;
+        }
+
+        m_batch.clear();
+    }
+
+    void Channel::armBatchTimer(unsigned long long deadline) {
+        // A channel has at most one deadline, which is moved forward when
+        // it fires rather than for every batch.
+        if (m_batchDeadline) {
+            return;
+        }
+
+        m_batchTimerUsed = true;
+
+        // Without a timer thread a batch waits until it is full or flushed.
+        if (DeadlineTimer::getShared().add(this, DeadlineTimer::BATCH, deadline)) {
+            m_batchDeadline = deadline;
+        }
+    }
+
+    void Channel::batchTimedOut(unsigned long long deadline) {
+        pthread_mutex_lock(&m_batchMutex);
+
+        if (deadline == m_batchDeadline) {
+            m_batchDeadline = 0;
+        }
+
+        unsigned long long due = m_batchStarted + m_batchDelay * 1000ULL;
+
+        if (m_batch.empty() || (deadline && m_batchDelay == 0)) {
+            // Sent already, or the delay was disabled.
+        } else if (deadline == 0 || due <= Clock::now()) {
+            try {
+                flushBatch();
+            } catch (Error& e) {
+                // Counted as dropped, there is no writer to report it to.
+            }
+        } else {
+            armBatchTimer(due);
+        }
+
+        pthread_mutex_unlock(&m_batchMutex);
+    }
+
+    void Channel::writeEnvelope(unsigned int ctype,
+                                unsigned int priority,
+                                unsigned char kind,
+                                const char* data,
+                                unsigned int length)
+    {
+        if (m_compressor && length >= m_compressionThreshold) {
+            pthread_mutex_lock(&m_compressMutex);
+
+            char* out = &m_compressed[0];
+            unsigned int n = 0;
+
+            if (m_compressor) {
+                n = m_compressor->compress(data, length,
+                                           out + Envelope::COMPRESSED_HEADER_SIZE,
+                                           m_compressed.size() - Envelope::COMPRESSED_HEADER_SIZE);
+            }
+
+            if (n > 0 && n < length) {
+                CompressedHeader header;
+                header.codec = m_compressor->getId();
+                header.kind = kind;
+                header.dictionaryId = m_dictionaryId;
+                header.size = length;
+
+                Envelope::writeCompressedHeader(out, header);
+
+                // The buffer is shared by all writers on the channel, so it
+                // is held until the frame has been written.
+                try {
+                    writeFrame(ctype, Frame::DATA, priority, NULL, 0, out, n + Envelope::COMPRESSED_HEADER_SIZE);
+                } catch (...) {
+                    pthread_mutex_unlock(&m_compressMutex);
+                    throw;
+                }
+
+                pthread_mutex_unlock(&m_compressMutex);
+                return;
+            }
+
+            pthread_mutex_unlock(&m_compressMutex);
+        }
+
+        char header[Envelope::HEADER_SIZE];
+
+        Envelope::writeHeader(header, kind);
+        writeFrame(ctype, Frame::DATA, priority, header, sizeof(header), data, length);
+    }
+
     void Channel::writeString(string const &value, unsigned int priority) {
         
         writeBytes(value.data(), 0, value.length(), ContentType::UTF8, priority);
@@ -246,8 +1603,6 @@ namespace hydna {
                             unsigned int offset,
                             unsigned int length)
     {
-        bool result;
-
         pthread_mutex_lock(&m_connectMutex);
         if (!m_connected || !m_connection) {
             pthread_mutex_unlock(&m_connectMutex);
@@ -260,16 +1615,9 @@ namespace hydna {
             throw Error("You do not have permission to send signals");
         }
         
-        Frame frame(m_ch, ctype, Frame::SIGNAL, Frame::SIG_EMIT,
-                            data, offset, length);
+        writeFrame(ctype, Frame::SIGNAL, Frame::SIG_EMIT, NULL, 0, data ? data + offset : NULL, data ? length : 0);
 
-        pthread_mutex_lock(&m_connectMutex);
-        Connection* connection = m_connection;
-        pthread_mutex_unlock(&m_connectMutex);
-        result = connection->writeBytes(frame);
-
-        if (!result)
-            checkForChannelError();
+        __sync_fetch_and_add(&m_signalsOut, 1);
     }
 
     void Channel::emitString(string const &value) {
@@ -279,6 +1627,36 @@ namespace hydna {
     void Channel::close() {
         Frame* frame;
 
+        // Messages queued by the rate limit are sent first. Those that are
+        // not sent in time are dropped, and so are all of them on the
+        // timer thread, which would have to send them.
+        pthread_mutex_lock(&m_pacedMutex);
+        if (!m_paced.empty()) {
+            bool timer = DeadlineTimer::getShared().isTimerThread();
+            unsigned long long deadline = Clock::now() + RateLimiter::CLOSE_TIMEOUT * 1000ULL;
+            struct timespec ts;
+
+            ts.tv_sec = deadline / 1000000ULL;
+            ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+
+            while (!timer && !m_paced.empty()) {
+                if (pthread_cond_timedwait(&m_pacedCond, &m_pacedMutex, &ts) != 0) {
+                    break;
+                }
+            }
+
+            dropPaced();
+        }
+        pthread_mutex_unlock(&m_pacedMutex);
+
+        if (m_batching) {
+            try {
+                flush();
+            } catch (Error& e) {
+                // The channel is closed anyway.
+            }
+        }
+
         pthread_mutex_lock(&m_connectMutex);
         if (!m_connection || m_closing) {
             pthread_mutex_unlock(&m_connectMutex);
@@ -305,7 +1683,7 @@ namespace hydna {
         
         frame = new Frame(m_ch, ContentType::UTF8, Frame::SIGNAL, Frame::SIG_END);
       
-        if (m_openRequest) {
+        if (m_openRequest || m_resolveRequest) {
             // Open request is not responded to yet. Wait to send ENDSIG until
             // we get an OPENRESP.
             
@@ -315,9 +1693,7 @@ namespace hydna {
             pthread_mutex_unlock(&m_connectMutex);
 
             try {
-#ifdef HYDNADEBUG
-                debugPrint("Channel", m_ch, "Sending close signal");
-#endif
+                HYDNA_TRACE(Trace::CHANNEL_CLOSE, m_ch, 0, 0);
                 pthread_mutex_lock(&m_connectMutex);
                 Connection* connection = m_connection;
                 pthread_mutex_unlock(&m_connectMutex);
@@ -331,15 +1707,55 @@ namespace hydna {
         }
     }
     
+    void Channel::openOffline(Connection* connection, unsigned int ch) {
+        pthread_mutex_lock(&m_connectMutex);
+        if (m_connection) {
+            pthread_mutex_unlock(&m_connectMutex);
+            throw Error("Already connected");
+        }
+
+        m_mode = ChannelMode::READ;
+        m_readable = true;
+        m_writable = false;
+        m_emitable = false;
+        m_ch = ch;
+        m_connectStarted = Clock::now();
+        m_error = ChannelError("", 0x0);
+        m_connection = connection;
+        pthread_mutex_unlock(&m_connectMutex);
+
+        connection->allocChannel();
+
+        pthread_mutex_lock(&m_dataMutex);
+        pthread_mutex_lock(&m_signalMutex);
+        m_memory = &connection->getMemory();
+        m_memory->attach(MemoryAccount::DATA, m_dataQueueBytes);
+        m_memory->attach(MemoryAccount::SIGNALS, m_signalQueueBytes);
+        m_reassembler.setMemory(m_memory);
+        pthread_mutex_unlock(&m_signalMutex);
+        pthread_mutex_unlock(&m_dataMutex);
+
+        openSuccess(ch, "");
+    }
+
     void Channel::openSuccess(unsigned int respch, std::string const &message) {
         pthread_mutex_lock(&m_connectMutex);
         unsigned int origch = m_ch;
+        unsigned long long deadline = m_openDeadline;
         Frame* frame;
 
         m_openRequest = NULL;
         m_ch = respch;
         m_connected = true;
         m_message = message;
+        m_openLatency = Clock::now() - m_connectStarted;
+        m_openDeadline = 0;
+
+        pthread_cond_broadcast(&m_openCond);
+
+        if (deadline) {
+            DeadlineTimer::getShared().remove(this, DeadlineTimer::OPEN, deadline);
+        }
       
         if (m_pendingClose) {
             frame = m_pendingClose;
@@ -354,9 +1770,7 @@ namespace hydna {
             }
 
             try {
-#ifdef HYDNADEBUG
-                debugPrint("Channel", m_ch, "Sending close signal");
-#endif
+                HYDNA_TRACE(Trace::CHANNEL_CLOSE, m_ch, 0, 0);
                 pthread_mutex_lock(&m_connectMutex);
                 Connection* connection = m_connection;
                 pthread_mutex_unlock(&m_connectMutex);
@@ -371,7 +1785,71 @@ namespace hydna {
             }
         } else {
             pthread_mutex_unlock(&m_connectMutex);
+
+            // Before anything written from the listener.
+            if (m_spool) {
+                flushSpool();
+            }
+
+            pthread_mutex_lock(&m_connectMutex);
+            ChannelListener* listener = acquireListener();
+            pthread_mutex_unlock(&m_connectMutex);
+
+            if (listener) {
+                ListenerCall call(this);
+                listener->onOpen(*this);
+            }
+        }
+    }
+
+    void Channel::setListener(ChannelListener* listener) {
+        pthread_mutex_lock(&m_connectMutex);
+        pthread_mutex_lock(&m_dataMutex);
+        pthread_mutex_lock(&m_signalMutex);
+        m_listener = listener;
+        pthread_mutex_unlock(&m_signalMutex);
+        pthread_mutex_unlock(&m_dataMutex);
+        pthread_mutex_unlock(&m_connectMutex);
+
+        // The old listener may still be being called.
+        waitForListener();
+    }
+
+    ChannelListener* Channel::getListener() const {
+        pthread_mutex_lock(&m_connectMutex);
+        ChannelListener* result = m_listener;
+        pthread_mutex_unlock(&m_connectMutex);
+        return result;
+    }
+
+    ChannelListener* Channel::acquireListener() {
+        ChannelListener* listener = m_listener;
+
+        if (listener) {
+            pthread_mutex_lock(&m_listenerMutex);
+            m_listenerCalls++;
+            pthread_mutex_unlock(&m_listenerMutex);
+        }
+
+        return listener;
+    }
+
+    void Channel::releaseListener() {
+        pthread_mutex_lock(&m_listenerMutex);
+        if (--m_listenerCalls == 0) {
+            pthread_cond_broadcast(&m_listenerCond);
+        }
+        pthread_mutex_unlock(&m_listenerMutex);
+    }
+
+    void Channel::waitForListener() {
+        unsigned int own = ListenerCall::count(this);
+
+        pthread_mutex_lock(&m_listenerMutex);
+        while (m_listenerCalls > own) {
+            pthread_cond_wait(&m_listenerCond, &m_listenerMutex);
         }
+        pthread_mutex_unlock(&m_listenerMutex);
     }
 
     void Channel::checkForChannelError() {
@@ -384,11 +1862,31 @@ namespace hydna {
         }
     }
 
-    void Channel::destroy(ChannelError error) {
+    void Channel::destroy(ChannelError const &error) {
+        teardown(error, NULL);
+    }
+
+    bool Channel::detach(Connection* connection, ChannelError const &error) {
+        return teardown(error, connection);
+    }
+
+    bool Channel::teardown(ChannelError const &error, Connection* owner) {
         pthread_mutex_lock(&m_connectMutex);
+
+        // E.g. listed both as open and as re-opening.
+        if (owner && m_connection != owner) {
+            pthread_mutex_unlock(&m_connectMutex);
+            return false;
+        }
+
         Connection* connection = m_connection;
         bool connected = m_connected;
         unsigned int ch = m_ch;
+        unsigned long long deadline = m_openDeadline;
+        bool reported = m_timeoutReported;
+        ChannelError cause = m_timedOut ? openTimeoutError() : error;
+
+        HYDNA_TRACE(Trace::DESTROY, ch, error.getCode(), 1);
 
         m_ch = 0;
         m_connected = false;
@@ -397,32 +1895,289 @@ namespace hydna {
         m_pendingClose = NULL;
         m_closing = false;
         m_openRequest = NULL;
+        m_resolveRequest = NULL;
+        m_resolved = false;
         m_connection = NULL;
+        m_openDeadline = 0;
+        m_timedOut = false;
+        m_timeoutReported = false;
       
-        if (connection) {
+        if (connection && !owner) {
             connection->deallocChannel(connected ? ch : 0);
         }
 
-        m_error = error;
+        m_error = cause;
+
+        pthread_cond_broadcast(&m_openCond);
+
+        // Done while the state is locked, since the channel may be deleted
+        // as soon as it is seen as closed. Nothing but the listener is
+        // called after that.
+        pthread_mutex_lock(&m_dataMutex);
+        m_reassembler.clear();
+        m_echoes.clear();
+        m_echoCount = 0;
+
+        if (m_set) {
+            m_set->markReady(this);
+        }
+
+        // A waiting batch is sent, or dropped, on the timer thread
+        // since the batch mutex is taken before the connect mutex.
+        if (m_batching) {
+            m_batchTimerUsed = true;
+            DeadlineTimer::getShared().add(this, DeadlineTimer::BATCH, 0);
+        }
+
+        // Published once the locks are released, the pin keeps the relay
+        // from being deleted meanwhile.
+        Relay* relay = m_relay;
+        unsigned int relayIndex = m_relayIndex;
+
+        if (relay) {
+            relay->pin();
+        }
+
+        // The queued messages are popped after the connection is gone.
+        if (connection) {
+            pthread_mutex_lock(&m_signalMutex);
+            m_memory->detach(MemoryAccount::DATA, m_dataQueueBytes);
+            m_memory->detach(MemoryAccount::SIGNALS, m_signalQueueBytes);
+            m_memory = &MemoryAccount::getGlobal();
+            m_reassembler.setMemory(m_memory);
+            pthread_mutex_unlock(&m_signalMutex);
+        }
+        pthread_mutex_unlock(&m_dataMutex);
+
+        // A timeout is reported when it happens, see openTimedOut().
+        ChannelListener* listener = reported ? NULL : acquireListener();
 
         pthread_mutex_unlock(&m_connectMutex);
+
+        if (deadline) {
+            DeadlineTimer::getShared().remove(this, DeadlineTimer::OPEN, deadline);
+        }
+
+        if (relay) {
+            string reason = cause.what();
+            relay->publish(relayIndex, RelayMessage::CLOSE, 0, ContentType::UTF8, reason.data(), reason.size());
+            relay->unpin();
+        }
+
+        if (listener) {
+            ListenerCall call(this);
+            listener->onClose(*this, cause);
+        }
+
+        return connection != NULL;
     }
     
+    void Channel::receiveData(int priority, int ctype, const char* payload, int size) {
+        Buffer* buffer;
+
+        // Already delivered when it was written.
+        if (m_echoCount > 0 && isEcho(payload, size)) {
+            return;
+        }
+
+        pthread_mutex_lock(&m_compressMutex);
+        bool envelope = m_envelope;
+        pthread_mutex_unlock(&m_compressMutex);
+
+        if (!envelope) {
+            addData(ChannelData::copy(priority, payload, size, ctype));
+            return;
+        }
+
+        if (!Envelope::isEnvelope(payload, size)) {
+            // From a client that does not use the envelope, delivered as
+            // it is.
+            __sync_fetch_and_add(&m_dataPlain, 1);
+            addData(ChannelData::copy(priority, payload, size, ctype));
+            return;
+        }
+
+        switch (Envelope::getKind(payload)) {
+
+            case Envelope::RAW:
+                addData(ChannelData::copy(priority, payload + Envelope::HEADER_SIZE, size - Envelope::HEADER_SIZE, ctype));
+                break;
+
+            case Envelope::FRAGMENT:
+                pthread_mutex_lock(&m_dataMutex);
+                buffer = m_reassembler.add(payload, size);
+                pthread_mutex_unlock(&m_dataMutex);
+
+                if (buffer) {
+                    addData(new ChannelData(priority, buffer, buffer->getData(), buffer->getSize(), ctype));
+                }
+                break;
+
+            case Envelope::COMPRESSED:
+                buffer = decompress(payload, size);
+
+                if (buffer) {
+                    receiveEnvelope(priority, ctype, buffer);
+                }
+                break;
+
+            case Envelope::BATCH:
+                // Batched records point into one shared, pooled buffer.
+                buffer = BufferPool::getShared().acquire(size);
+                memcpy(buffer->getData(), payload, size);
+                buffer->setSize(size);
+
+                receiveEnvelope(priority, ctype, buffer);
+                break;
+        }
+    }
+
+    void Channel::receiveEnvelope(int priority, int ctype, Buffer* buffer) {
+        const char* data = buffer->getData();
+
+        switch (Envelope::getKind(data)) {
+
+            case Envelope::RAW:
+                addData(new ChannelData(priority, buffer, data + Envelope::HEADER_SIZE, buffer->getSize() - Envelope::HEADER_SIZE, ctype));
+                break;
+
+            case Envelope::BATCH:
+                unpackBatch(priority, ctype, buffer);
+                buffer->release();
+                break;
+
+            default:
+                // A compressed payload in a compressed payload.
+                buffer->release();
+                break;
+        }
+    }
+
+    Buffer* Channel::decompress(const char* payload, unsigned int size) {
+        CompressedHeader header;
+
+        if (!Envelope::readCompressedHeader(payload, size, header) ||
+            header.codec >= Codec::CODEC_COUNT ||
+            (header.kind != Envelope::RAW && header.kind != Envelope::BATCH)) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&m_compressMutex);
+
+        Codec* codec = m_decompressors[header.codec];
+
+        if (header.dictionaryId != m_dictionaryId) {
+            pthread_mutex_unlock(&m_compressMutex);
+            return NULL;
+        }
+
+        if (!codec && (codec = Codec::create(header.codec))) {
+            codec->setDictionary(m_dictionary);
+            m_decompressors[header.codec] = codec;
+        }
+
+        pthread_mutex_unlock(&m_compressMutex);
+
+        if (!codec) {
+            return NULL;
+        }
+
+        // Decompressors are only used by the listening thread.
+        Buffer* buffer = BufferPool::getShared().acquire(header.size + Envelope::HEADER_SIZE);
+        char* data = buffer->getData();
+
+        Envelope::writeHeader(data, header.kind);
+
+        if (!codec->decompress(payload + Envelope::COMPRESSED_HEADER_SIZE,
+                               size - Envelope::COMPRESSED_HEADER_SIZE,
+                               data + Envelope::HEADER_SIZE, header.size)) {
+            buffer->release();
+            return NULL;
+        }
+
+        buffer->setSize(header.size + Envelope::HEADER_SIZE);
+        return buffer;
+    }
+
+    void Channel::unpackBatch(int priority, int ctype, Buffer* buffer) {
+        const char* data = buffer->getData();
+        unsigned int offset = Envelope::HEADER_SIZE;
+        unsigned short length;
+
+        while (offset + Envelope::BATCH_RECORD_HEADER_SIZE <= buffer->getSize()) {
+            memcpy(&length, data + offset, sizeof(length));
+            length = ntohs(length);
+            offset += Envelope::BATCH_RECORD_HEADER_SIZE;
+
+            if (length > buffer->getSize() - offset) {
+                // Truncated record, drop the rest of the batch.
+                break;
+            }
+
+            buffer->retain();
+            addData(new ChannelData(priority, buffer, data + offset, length, ctype));
+            offset += length;
+        }
+    }
+
     void Channel::addData(ChannelData* data) {
+        // The data may be popped and deleted as soon as it is queued.
+        unsigned int size = data->getSize();
+
         pthread_mutex_lock(&m_dataMutex);
 
+        // Relayed data is published instead, to be read in other
+        // processes.
+        if (m_relay) {
+            m_relay->publish(m_relayIndex, RelayMessage::DATA, data->getPriority(),
+                             data->getContentType(),
+                             data->getContent(), size);
+            pthread_mutex_unlock(&m_dataMutex);
+
+            __sync_fetch_and_add(&m_dataIn, 1);
+            __sync_fetch_and_add(&m_dataBytesIn, size);
+            delete data;
+            return;
+        }
+
         m_dataQueue.push(data);
+        m_dataQueueBytes += sizeof(ChannelData) + size;
+        m_memory->charge(MemoryAccount::DATA, sizeof(ChannelData) + size);
+
+        if (m_set) {
+            m_set->markReady(this);
+        }
+
+        ChannelListener* listener = acquireListener();
 
         pthread_mutex_unlock(&m_dataMutex);
+
+        __sync_fetch_and_add(&m_dataIn, 1);
+        __sync_fetch_and_add(&m_dataBytesIn, size);
+        __sync_fetch_and_add(&m_dataQueueDepth, 1);
+
+        if (listener) {
+            ListenerCall call(this);
+            listener->onData(*this);
+        }
     }
 
     ChannelData* Channel::popData() {
         pthread_mutex_lock(&m_dataMutex);
 
+        if (m_dataQueue.empty()) {
+            pthread_mutex_unlock(&m_dataMutex);
+            return NULL;
+        }
+
         ChannelData* data = m_dataQueue.front();
         m_dataQueue.pop();
+        m_dataQueueBytes -= sizeof(ChannelData) + data->getSize();
+        m_memory->release(MemoryAccount::DATA, sizeof(ChannelData) + data->getSize());
 
         pthread_mutex_unlock(&m_dataMutex);
+
+        __sync_fetch_and_sub(&m_dataQueueDepth, 1);
         
         return data;
     }
@@ -435,20 +2190,59 @@ namespace hydna {
     }
 
     void Channel::addSignal(ChannelSignal* signal) {
+        unsigned int size = signal->getSize();
+
         pthread_mutex_lock(&m_signalMutex);
 
+        if (m_relay) {
+            m_relay->publish(m_relayIndex, RelayMessage::SIGNAL, signal->getType(),
+                             signal->getContentType(),
+                             signal->getContent(), size);
+            pthread_mutex_unlock(&m_signalMutex);
+
+            __sync_fetch_and_add(&m_signalsIn, 1);
+            delete[] signal->getContent();
+            delete signal;
+            return;
+        }
+
         m_signalQueue.push(signal);
+        m_signalQueueBytes += sizeof(ChannelSignal) + size;
+        m_memory->charge(MemoryAccount::SIGNALS, sizeof(ChannelSignal) + size);
+
+        if (m_set) {
+            m_set->markReady(this);
+        }
+
+        ChannelListener* listener = acquireListener();
         
         pthread_mutex_unlock(&m_signalMutex);
+
+        __sync_fetch_and_add(&m_signalsIn, 1);
+        __sync_fetch_and_add(&m_signalQueueDepth, 1);
+
+        if (listener) {
+            ListenerCall call(this);
+            listener->onSignal(*this);
+        }
     }
 
     ChannelSignal* Channel::popSignal() {
         pthread_mutex_lock(&m_signalMutex);
+
+        if (m_signalQueue.empty()) {
+            pthread_mutex_unlock(&m_signalMutex);
+            return NULL;
+        }
         
         ChannelSignal* data = m_signalQueue.front();
         m_signalQueue.pop();
+        m_signalQueueBytes -= sizeof(ChannelSignal) + data->getSize();
+        m_memory->release(MemoryAccount::SIGNALS, sizeof(ChannelSignal) + data->getSize());
 
         pthread_mutex_unlock(&m_signalMutex);
+
+        __sync_fetch_and_sub(&m_signalQueueDepth, 1);
         
         return data;
     }
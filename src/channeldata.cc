@@ -1,4 +1,5 @@
 #include <sstream>
+#include <string.h>
 
 #include "channeldata.h"
 #include "contenttype.h"
@@ -6,11 +7,51 @@
 namespace hydna {
     using namespace std;
    
-    ChannelData::ChannelData(int priority, const char* content, int size, int ctype) : m_priority(priority), m_content(content), m_size(size), m_ctype(ctype) {
+    ChannelData::ChannelData(int priority, const char* content, int size, int ctype) : m_priority(priority), m_content(content), m_size(size), m_ctype(ctype), m_buffer(NULL), m_inline(false) {
         
         m_binary = (ctype == (int)ContentType::BINARY) ? false : true;
     }
 
+    ChannelData::ChannelData(int priority, Buffer* buffer, const char* content, int size, int ctype) : m_priority(priority), m_content(content), m_size(size), m_ctype(ctype), m_buffer(buffer), m_inline(false) {
+
+        m_binary = (ctype == (int)ContentType::BINARY) ? false : true;
+    }
+
+    ChannelData* ChannelData::copy(int priority, const char* content, int size, int ctype) {
+        ChannelData* data = new (size) ChannelData(priority, (const char*)NULL, size, ctype);
+        char* inlined = reinterpret_cast<char*>(data + 1);
+
+        memcpy(inlined, content, size);
+        data->m_content = inlined;
+        data->m_inline = true;
+
+        return data;
+    }
+
+    ChannelData::~ChannelData() {
+        if (m_buffer) {
+            m_buffer->release();
+        } else if (!m_inline) {
+            delete[] m_content;
+        }
+    }
+
+    void* ChannelData::operator new(size_t size) {
+        return ::operator new(size);
+    }
+
+    void* ChannelData::operator new(size_t size, unsigned int extra) {
+        return ::operator new(size + extra);
+    }
+
+    void ChannelData::operator delete(void* ptr) {
+        ::operator delete(ptr);
+    }
+
+    void ChannelData::operator delete(void* ptr, unsigned int) {
+        ::operator delete(ptr);
+    }
+
     int ChannelData::getPriority() const {
         return m_priority;
     }
@@ -23,6 +64,10 @@ namespace hydna {
         return m_binary;
     }
 
+    int ChannelData::getContentType() const {
+        return m_ctype;
+    }
+
     const char* ChannelData::getContent() const {
         return m_content;
     }
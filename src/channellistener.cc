@@ -0,0 +1,19 @@
+#include "channellistener.h"
+
+namespace hydna {
+
+    ChannelListener::~ChannelListener() {
+    }
+
+    void ChannelListener::onOpen(Channel&) {
+    }
+
+    void ChannelListener::onData(Channel&) {
+    }
+
+    void ChannelListener::onSignal(Channel&) {
+    }
+
+    void ChannelListener::onClose(Channel&, ChannelError const &) {
+    }
+}
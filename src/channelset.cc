@@ -0,0 +1,150 @@
+#include <algorithm>
+
+#include <time.h>
+
+#include "channelset.h"
+#include "channel.h"
+#include "clock.h"
+#include "error.h"
+
+namespace hydna {
+    using namespace std;
+
+    ChannelSet::ChannelSet() {
+        pthread_condattr_t attr;
+
+        // Timeouts are in Clock::now() time, which is monotonic.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_readyCond, &attr);
+
+        pthread_condattr_destroy(&attr);
+    }
+
+    ChannelSet::~ChannelSet() {
+        pthread_mutex_lock(&m_mutex);
+        vector<Channel*> channels(m_channels.begin(), m_channels.end());
+        pthread_mutex_unlock(&m_mutex);
+
+        for (unsigned int i = 0; i < channels.size(); i++) {
+            remove(channels[i]);
+        }
+
+        pthread_mutex_destroy(&m_mutex);
+        pthread_cond_destroy(&m_readyCond);
+    }
+
+    void ChannelSet::add(Channel* channel) {
+        pthread_mutex_lock(&channel->m_dataMutex);
+        pthread_mutex_lock(&channel->m_signalMutex);
+        pthread_mutex_lock(&m_mutex);
+
+        if (channel->m_set && channel->m_set != this) {
+            pthread_mutex_unlock(&m_mutex);
+            pthread_mutex_unlock(&channel->m_signalMutex);
+            pthread_mutex_unlock(&channel->m_dataMutex);
+            throw Error("The channel is in another set");
+        }
+
+        if (!channel->m_set) {
+            channel->m_set = this;
+            m_channels.insert(channel);
+
+            if (!channel->m_dataQueue.empty() || !channel->m_signalQueue.empty()) {
+                channel->m_setReady = true;
+                m_ready.push_back(channel);
+                pthread_cond_signal(&m_readyCond);
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+        pthread_mutex_unlock(&channel->m_signalMutex);
+        pthread_mutex_unlock(&channel->m_dataMutex);
+    }
+
+    void ChannelSet::remove(Channel* channel) {
+        pthread_mutex_lock(&channel->m_dataMutex);
+        pthread_mutex_lock(&channel->m_signalMutex);
+        pthread_mutex_lock(&m_mutex);
+
+        if (channel->m_set == this) {
+            unlink(channel);
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+        pthread_mutex_unlock(&channel->m_signalMutex);
+        pthread_mutex_unlock(&channel->m_dataMutex);
+    }
+
+    void ChannelSet::unlink(Channel* channel) {
+        if (channel->m_setReady) {
+            m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), channel), m_ready.end());
+            channel->m_setReady = false;
+        }
+
+        m_channels.erase(channel);
+        channel->m_set = NULL;
+    }
+
+    unsigned int ChannelSet::size() const {
+        pthread_mutex_lock(&m_mutex);
+        unsigned int result = m_channels.size();
+        pthread_mutex_unlock(&m_mutex);
+        return result;
+    }
+
+    unsigned int ChannelSet::wait(vector<Channel*>& ready, int timeout) {
+        unsigned long long deadline = 0;
+
+        if (timeout > 0) {
+            deadline = Clock::now() + timeout * 1000ULL;
+        }
+
+        ready.clear();
+
+        pthread_mutex_lock(&m_mutex);
+
+        while (m_ready.empty() && !m_channels.empty() && timeout != 0) {
+            if (timeout < 0) {
+                pthread_cond_wait(&m_readyCond, &m_mutex);
+            } else {
+                struct timespec ts;
+                ts.tv_sec = deadline / 1000000ULL;
+                ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+
+                if (pthread_cond_timedwait(&m_readyCond, &m_mutex, &ts) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Swapping keeps the capacity of both lists, so waiting does not
+        // allocate once they have grown.
+        ready.swap(m_ready);
+
+        for (unsigned int i = 0; i < ready.size(); i++) {
+            ready[i]->m_setReady = false;
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+
+        return ready.size();
+    }
+
+    void ChannelSet::markReady(Channel* channel) {
+        pthread_mutex_lock(&m_mutex);
+
+        if (!channel->m_setReady) {
+            channel->m_setReady = true;
+            m_ready.push_back(channel);
+
+            if (m_ready.size() == 1) {
+                pthread_cond_signal(&m_readyCond);
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+}
@@ -22,6 +22,10 @@ namespace hydna {
         return m_binary;
     }
 
+    int ChannelSignal::getContentType() const {
+        return m_ctype;
+    }
+
     const char* ChannelSignal::getContent() const {
         return m_content;
     }
@@ -0,0 +1,43 @@
+#include <time.h>
+
+#include "clock.h"
+
+namespace hydna {
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    static const clockid_t COARSE_CLOCK = CLOCK_MONOTONIC_COARSE;
+#else
+    static const clockid_t COARSE_CLOCK = CLOCK_MONOTONIC;
+#endif
+
+    unsigned long long Clock::now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+
+    unsigned long long Clock::nanos() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    unsigned long long Clock::coarse() {
+        struct timespec ts;
+        clock_gettime(COARSE_CLOCK, &ts);
+
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+
+    unsigned long long Clock::coarseResolution() {
+        struct timespec ts;
+
+        if (clock_getres(COARSE_CLOCK, &ts) != 0) {
+            return 1;
+        }
+
+        return ts.tv_sec * 1000000ULL + (ts.tv_nsec + 999) / 1000;
+    }
+}
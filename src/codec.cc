@@ -0,0 +1,292 @@
+#include <string>
+
+#ifdef HYDNA_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HYDNA_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HYDNA_WITH_LZ4
+#include <lz4.h>
+#endif
+
+#include "codec.h"
+
+namespace hydna {
+    using namespace std;
+
+#ifdef HYDNA_WITH_ZLIB
+    /**
+     *  Raw deflate, without the zlib header and checksum. The streams are
+     *  kept and reset between messages, since initializing them is costly.
+     */
+    class ZlibCodec : public Codec {
+    public:
+        static const int LEVEL = 1;
+
+        ZlibCodec() : m_deflateReady(false), m_inflateReady(false) {
+        }
+
+        ~ZlibCodec() {
+            if (m_deflateReady) {
+                deflateEnd(&m_deflate);
+            }
+
+            if (m_inflateReady) {
+                inflateEnd(&m_inflate);
+            }
+        }
+
+        unsigned char getId() const {
+            return ZLIB;
+        }
+
+        void setDictionary(string const &dictionary) {
+            m_dictionary = dictionary;
+        }
+
+        unsigned int compress(const char* in, unsigned int size, char* out, unsigned int capacity) {
+            if (!m_deflateReady) {
+                m_deflate.zalloc = Z_NULL;
+                m_deflate.zfree = Z_NULL;
+                m_deflate.opaque = Z_NULL;
+
+                if (deflateInit2(&m_deflate, LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                    return 0;
+                }
+
+                m_deflateReady = true;
+            } else {
+                deflateReset(&m_deflate);
+            }
+
+            if (!m_dictionary.empty()) {
+                deflateSetDictionary(&m_deflate, (const Bytef*)m_dictionary.data(), m_dictionary.size());
+            }
+
+            m_deflate.next_in = (Bytef*)in;
+            m_deflate.avail_in = size;
+            m_deflate.next_out = (Bytef*)out;
+            m_deflate.avail_out = capacity;
+
+            if (deflate(&m_deflate, Z_FINISH) != Z_STREAM_END) {
+                return 0;
+            }
+
+            return m_deflate.total_out;
+        }
+
+        bool decompress(const char* in, unsigned int size, char* out, unsigned int outSize) {
+            if (!m_inflateReady) {
+                m_inflate.zalloc = Z_NULL;
+                m_inflate.zfree = Z_NULL;
+                m_inflate.opaque = Z_NULL;
+                m_inflate.next_in = Z_NULL;
+                m_inflate.avail_in = 0;
+
+                if (inflateInit2(&m_inflate, -15) != Z_OK) {
+                    return false;
+                }
+
+                m_inflateReady = true;
+            } else {
+                inflateReset(&m_inflate);
+            }
+
+            if (!m_dictionary.empty()) {
+                inflateSetDictionary(&m_inflate, (const Bytef*)m_dictionary.data(), m_dictionary.size());
+            }
+
+            m_inflate.next_in = (Bytef*)in;
+            m_inflate.avail_in = size;
+            m_inflate.next_out = (Bytef*)out;
+            m_inflate.avail_out = outSize;
+
+            return inflate(&m_inflate, Z_FINISH) == Z_STREAM_END &&
+                   m_inflate.total_out == outSize;
+        }
+
+    private:
+        z_stream m_deflate;
+        z_stream m_inflate;
+        bool m_deflateReady;
+        bool m_inflateReady;
+        string m_dictionary;
+    };
+#endif
+
+#ifdef HYDNA_WITH_ZSTD
+    class ZstdCodec : public Codec {
+    public:
+        static const int LEVEL = 3;
+
+        ZstdCodec() : m_cctx(ZSTD_createCCtx()), m_dctx(ZSTD_createDCtx()) {
+        }
+
+        ~ZstdCodec() {
+            ZSTD_freeCCtx(m_cctx);
+            ZSTD_freeDCtx(m_dctx);
+        }
+
+        unsigned char getId() const {
+            return ZSTD;
+        }
+
+        void setDictionary(string const &dictionary) {
+            m_dictionary = dictionary;
+        }
+
+        unsigned int compress(const char* in, unsigned int size, char* out, unsigned int capacity) {
+            size_t result;
+
+            if (m_dictionary.empty()) {
+                result = ZSTD_compressCCtx(m_cctx, out, capacity, in, size, LEVEL);
+            } else {
+                result = ZSTD_compress_usingDict(m_cctx, out, capacity, in, size,
+                                                 m_dictionary.data(), m_dictionary.size(), LEVEL);
+            }
+
+            return ZSTD_isError(result) ? 0 : result;
+        }
+
+        bool decompress(const char* in, unsigned int size, char* out, unsigned int outSize) {
+            size_t result;
+
+            if (m_dictionary.empty()) {
+                result = ZSTD_decompressDCtx(m_dctx, out, outSize, in, size);
+            } else {
+                result = ZSTD_decompress_usingDict(m_dctx, out, outSize, in, size,
+                                                   m_dictionary.data(), m_dictionary.size());
+            }
+
+            return !ZSTD_isError(result) && result == outSize;
+        }
+
+    private:
+        ZSTD_CCtx* m_cctx;
+        ZSTD_DCtx* m_dctx;
+        string m_dictionary;
+    };
+#endif
+
+#ifdef HYDNA_WITH_LZ4
+    class Lz4Codec : public Codec {
+    public:
+        Lz4Codec() : m_stream(LZ4_createStream()) {
+        }
+
+        ~Lz4Codec() {
+            LZ4_freeStream(m_stream);
+        }
+
+        unsigned char getId() const {
+            return LZ4;
+        }
+
+        void setDictionary(string const &dictionary) {
+            m_dictionary = dictionary;
+        }
+
+        unsigned int compress(const char* in, unsigned int size, char* out, unsigned int capacity) {
+            if (m_dictionary.empty()) {
+                return LZ4_compress_default(in, out, size, capacity);
+            }
+
+            LZ4_resetStream(m_stream);
+            LZ4_loadDict(m_stream, m_dictionary.data(), m_dictionary.size());
+
+            return LZ4_compress_fast_continue(m_stream, in, out, size, capacity, 1);
+        }
+
+        bool decompress(const char* in, unsigned int size, char* out, unsigned int outSize) {
+            int result;
+
+            if (m_dictionary.empty()) {
+                result = LZ4_decompress_safe(in, out, size, outSize);
+            } else {
+                result = LZ4_decompress_safe_usingDict(in, out, size, outSize,
+                                                       m_dictionary.data(), m_dictionary.size());
+            }
+
+            return result == (int)outSize;
+        }
+
+    private:
+        LZ4_stream_t* m_stream;
+        string m_dictionary;
+    };
+#endif
+
+    Codec::~Codec() {
+    }
+
+    Codec* Codec::create(unsigned char id) {
+        switch (id) {
+#ifdef HYDNA_WITH_ZLIB
+            case ZLIB:
+                return new ZlibCodec();
+#endif
+#ifdef HYDNA_WITH_ZSTD
+            case ZSTD:
+                return new ZstdCodec();
+#endif
+#ifdef HYDNA_WITH_LZ4
+            case LZ4:
+                return new Lz4Codec();
+#endif
+            default:
+                return NULL;
+        }
+    }
+
+    bool Codec::isAvailable(unsigned char id) {
+        switch (id) {
+#ifdef HYDNA_WITH_ZLIB
+            case ZLIB:
+                return true;
+#endif
+#ifdef HYDNA_WITH_ZSTD
+            case ZSTD:
+                return true;
+#endif
+#ifdef HYDNA_WITH_LZ4
+            case LZ4:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    const char* Codec::getName(unsigned char id) {
+        switch (id) {
+            case NONE:
+                return "none";
+            case ZLIB:
+                return "zlib";
+            case ZSTD:
+                return "zstd";
+            case LZ4:
+                return "lz4";
+            default:
+                return "unknown";
+        }
+    }
+
+    unsigned int Codec::dictionaryId(string const &dictionary) {
+        unsigned int hash = 2166136261u;
+
+        if (dictionary.empty()) {
+            return 0;
+        }
+
+        for (size_t i = 0; i < dictionary.size(); i++) {
+            hash ^= (unsigned char)dictionary[i];
+            hash *= 16777619u;
+        }
+
+        return hash == 0 ? 1 : hash;
+    }
+}
@@ -2,23 +2,35 @@
 #include <sstream>
 #include <string>
 #include <algorithm>
+#include <vector>
 
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include "connection.h"
 #include "frame.h"
+#include "frameparser.h"
 #include "openrequest.h"
 #include "channel.h"
 #include "channeldata.h"
 #include "channelerror.h"
 #include "channelsignal.h"
 #include "url.h"
+#include "clock.h"
+#include "trace.h"
+#include "iothread.h"
+#include "capture.h"
 
 #ifdef HYDNADEBUG
 #include "debughelper.h"
@@ -27,66 +39,108 @@
 namespace hydna {
     using namespace std;
 
-    Connection* Connection::getConnection(string const &host, unsigned short port, string const &auth) {
+    static unsigned int connectionCount = 0;
+
+    Connection* Connection::getConnection(URL const &url) {
+        unsigned int hash = Endpoint::hash(url);
+        Connection** bucket = &m_availableConnections[hash % CONNECTION_BUCKETS];
         Connection* connection;
-        string ports;
-        stringstream out;
-        out << port;
-        ports = out.str();
-        
-        string key = host + ports + auth;
       
         pthread_mutex_lock(&m_connectionMutex);
-        if (m_availableConnections[key]) {
-            connection = m_availableConnections[key];
-        } else {
-            connection = new Connection(host, port, auth);
-            m_availableConnections[key] = connection;
+        connection = *bucket;
+
+        while (connection && !connection->m_endpoint.matches(url, hash)) {
+            connection = connection->m_nextAvailable;
+        }
+
+        if (!connection) {
+            connection = new Connection(url.getHost().toString(), url.getPort(),
+                                        url.getAuth().toString(), url.isSecure());
+            connection->m_nextAvailable = *bucket;
+            *bucket = connection;
         }
         pthread_mutex_unlock(&m_connectionMutex);
 
         return connection;
     }
 
-    Connection::Connection(string const &host, unsigned short port, string const &auth) :
+    Connection::Connection(string const &host, unsigned short port, string const &auth, bool secure) :
                                                 m_connecting(false),
                                                 m_connected(false),
                                                 m_handshaked(false),
                                                 m_destroying(false),
                                                 m_closing(false),
                                                 m_listening(false),
+                                                m_reconnecting(false),
                                                 m_host(host),
                                                 m_port(port),
                                                 m_auth(auth),
+                                                m_secure(secure),
+                                                m_endpoint(host, port, auth, secure),
+                                                m_nextAvailable(NULL),
+                                                m_connectionFDS(-1),
+                                                m_tls(NULL),
+                                                m_kernelTlsGauge(0),
                                                 m_attempt(0),
-                                                m_channelRefCount(0)
+                                                m_lastReceived(0),
+                                                m_lastKeepalive(0),
+                                                m_keepaliveSent(0),
+                                                m_openChannelsGauge(0),
+                                                m_pendingResolvesGauge(0),
+                                                m_pendingOpensGauge(0),
+                                                m_reconnectQueueGauge(0),
+                                                m_ioThreadCpu(-1),
+                                                m_ioThreadConfig(0),
+                                                m_captureSource(__sync_add_and_fetch(&connectionCount, 1)),
+                                                m_channelRefCount(0),
+                                                m_hasListener(false),
+                                                m_listenerExited(false),
+                                                m_deleteOnExit(false),
+                                                m_memory(&MemoryAccount::getGlobal())
     {
-        pthread_mutex_init(&m_connectionMutex, NULL);
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        m_seed = tv.tv_sec ^ tv.tv_usec;
+
+        memset(&m_reconnectStats, 0, sizeof(m_reconnectStats));
+
+        m_memory.setBudget(m_connectionMemoryBudget);
+
+        if (m_connectionMessageRate || m_connectionByteRate) {
+            m_rateLimiter.setLimit(m_connectionMessageRate, m_connectionByteRate, m_connectionRateBurst);
+        }
+
         pthread_mutex_init(&m_channelRefMutex, NULL);
         pthread_mutex_init(&m_destroyingMutex, NULL);
         pthread_mutex_init(&m_closingMutex, NULL);
         pthread_mutex_init(&m_openChannelsMutex, NULL);
-        pthread_mutex_init(&m_openWaitMutex, NULL);
         pthread_mutex_init(&m_pendingMutex, NULL);
         pthread_mutex_init(&m_listeningMutex, NULL);
+        pthread_mutex_init(&m_writeMutex, NULL);
         
         pthread_mutex_init(&m_resolveMutex, NULL);
-        pthread_mutex_init(&m_resolveWaitMutex, NULL);
         pthread_mutex_init(&m_resolveChannelsMutex, NULL);
     }
 
     Connection::~Connection() {
-        pthread_mutex_destroy(&m_connectionMutex);
+        // A reply to a frame, e.g. the end of the last channel, may cause
+        // the connection to be deleted while the writer still holds the
+        // write lock.
+        pthread_mutex_lock(&m_writeMutex);
+        clearReconnectQueue();
+        pthread_mutex_unlock(&m_writeMutex);
+
+        closeSocket();
+
         pthread_mutex_destroy(&m_channelRefMutex);
         pthread_mutex_destroy(&m_destroyingMutex);
         pthread_mutex_destroy(&m_closingMutex);
         pthread_mutex_destroy(&m_openChannelsMutex);
-        pthread_mutex_destroy(&m_openWaitMutex);
         pthread_mutex_destroy(&m_pendingMutex);
         pthread_mutex_destroy(&m_listeningMutex);
+        pthread_mutex_destroy(&m_writeMutex);
         
         pthread_mutex_destroy(&m_resolveMutex);
-        pthread_mutex_destroy(&m_resolveWaitMutex);
         pthread_mutex_destroy(&m_resolveChannelsMutex);
     }
     
@@ -97,19 +151,15 @@ namespace hydna {
     void Connection::allocChannel() {
         pthread_mutex_lock(&m_channelRefMutex);
         m_channelRefCount++;
+        HYDNA_TRACE(Trace::CHANNEL_ALLOC, 0, m_channelRefCount, 0);
         pthread_mutex_unlock(&m_channelRefMutex);
-#ifdef HYDNADEBUG
-        ostringstream oss;
-        oss << m_channelRefCount;
-    
-        debugPrint("Connection", 0, "Allocating a new channel, channel ref count is " + oss.str());
-#endif
+
+        m_memory.charge(MemoryAccount::CHANNELS, sizeof(Channel));
     }
     
     void Connection::deallocChannel(unsigned int ch) {  
-#ifdef HYDNADEBUG
-        debugPrint("Connection", ch, "Deallocating a channel");
-#endif
+        HYDNA_TRACE(Trace::CHANNEL_DEALLOC, ch, 0, 0);
+
         pthread_mutex_lock(&m_destroyingMutex);
         pthread_mutex_lock(&m_closingMutex);
         if (!m_destroying && !m_closing) {
@@ -118,12 +168,6 @@ namespace hydna {
 
             pthread_mutex_lock(&m_openChannelsMutex);
             m_openChannels.erase(ch);
-#ifdef HYDNADEBUG
-            ostringstream oss;
-            oss << m_openChannels.size();
-
-            debugPrint("Connection", ch, "Size of openSteams is now " + oss.str());
-#endif
             pthread_mutex_unlock(&m_openChannelsMutex);
         } else  {
             pthread_mutex_unlock(&m_closingMutex);
@@ -134,6 +178,8 @@ namespace hydna {
         --m_channelRefCount;
         pthread_mutex_unlock(&m_channelRefMutex);
 
+        m_memory.release(MemoryAccount::CHANNELS, sizeof(Channel));
+
         checkRefCount();
     }
 
@@ -163,53 +209,34 @@ namespace hydna {
     bool Connection::requestResolve(OpenRequest* request) {
         
         string path(request->getPath(), request->getPathSize());
+        OpenRequestPathMap::iterator pending;
         
-        OpenRequestQueue* queue;
-        
-#ifdef HYDNADEBUG
-        debugPrint("Connection", 0, "A channel is trying to send a new resolve request");
-#endif      
+        HYDNA_TRACE(Trace::RESOLVE_REQUEST, 0, 0, 0);
+
+        request->charge(&m_memory);
         
         //pthread_mutex_unlock(&m_resolveChannelsMutex);
 
         pthread_mutex_lock(&m_resolveMutex);
-        if (m_pendingResolveRequests.count(path) > 0) {
+        pending = m_pendingResolveRequests.find(path);
+        if (pending != m_pendingResolveRequests.end()) {
+            pending->second->addWaiting(request);
             pthread_mutex_unlock(&m_resolveMutex);
 
-#ifdef HYDNADEBUG
-            debugPrint("Connection", 0, "A resolve request is waiting to be sent, queue up the new open request");
-#endif
-            
-            pthread_mutex_lock(&m_resolveWaitMutex);
-            queue = m_resolveWaitQueue[path];
-        
-            if (!queue) {
-                m_resolveWaitQueue[path] = queue = new OpenRequestQueue();
-            } 
-        
-            queue->push(request);
-            pthread_mutex_unlock(&m_resolveWaitMutex);
+            HYDNA_TRACE(Trace::REQUEST_QUEUED, 0, Frame::RESOLVE, 0);
         } else if (!m_handshaked) {
-#ifdef HYDNADEBUG
-            debugPrint("Connection", 0, "No connection, queue up the new resolve request");
-#endif
             m_pendingResolveRequests[path] = request;
             pthread_mutex_unlock(&m_resolveMutex);
             
             if (!m_connecting) {
                 m_connecting = true;
-                connectConnection(m_host, m_port, m_auth);
+                connectConnection(m_host, m_port, m_auth, m_secure);
             }
         } else {
             m_pendingResolveRequests[path] = request;
             pthread_mutex_unlock(&m_resolveMutex);
 
-#ifdef HYDNADEBUG
-            debugPrint("Connection", 0, "Already connected, sending the new resolve request");
-#endif
-
-            writeBytes(request->getFrame());
-            request->setSent(true);
+            sendRequest(request);
         }
       
         return m_connected;
@@ -217,61 +244,41 @@ namespace hydna {
 
     bool Connection::requestOpen(OpenRequest* request) {
         unsigned int chcomp = request->getChannelId();
-        OpenRequestQueue* queue;
+        OpenRequestMap::iterator pending;
 
-#ifdef HYDNADEBUG
-        debugPrint("Connection", chcomp, "A channel is trying to send a new open request");
-#endif
+        HYDNA_TRACE(Trace::OPEN_REQUEST, chcomp, 0, 0);
+
+        request->charge(&m_memory);
 
         pthread_mutex_lock(&m_openChannelsMutex);
         if (m_openChannels.count(chcomp) > 0) {
             pthread_mutex_unlock(&m_openChannelsMutex);
-#ifdef HYDNADEBUG
-            debugPrint("Connection", chcomp, "The channel was already open, cancel the open request");
-#endif
+            HYDNA_TRACE(Trace::OPEN_DENIED, chcomp, 0, 0);
             delete request;
             return false;
         }
         pthread_mutex_unlock(&m_openChannelsMutex);
 
         pthread_mutex_lock(&m_pendingMutex);
-        if (m_pendingOpenRequests.count(chcomp) > 0) {
+        pending = m_pendingOpenRequests.find(chcomp);
+        if (pending != m_pendingOpenRequests.end()) {
+            pending->second->addWaiting(request);
             pthread_mutex_unlock(&m_pendingMutex);
 
-#ifdef HYDNADEBUG
-            debugPrint("Connection", chcomp, "A open request is waiting to be sent, queue up the new open request");
-#endif
-            
-            pthread_mutex_lock(&m_openWaitMutex);
-            queue = m_openWaitQueue[chcomp];
-        
-            if (!queue) {
-                m_openWaitQueue[chcomp] = queue = new OpenRequestQueue();
-            } 
-        
-            queue->push(request);
-            pthread_mutex_unlock(&m_openWaitMutex);
+            HYDNA_TRACE(Trace::REQUEST_QUEUED, chcomp, Frame::OPEN, 0);
         } else if (!m_handshaked) {
-#ifdef HYDNADEBUG
-            debugPrint("Connection", chcomp, "No connection, queue up the new open request");
-#endif
             m_pendingOpenRequests[chcomp] = request;
             pthread_mutex_unlock(&m_pendingMutex);
             
             if (!m_connecting) {
                 m_connecting = true;
-                connectConnection(m_host, m_port, m_auth);
+                connectConnection(m_host, m_port, m_auth, m_secure);
             }
         } else {
             m_pendingOpenRequests[chcomp] = request;
             pthread_mutex_unlock(&m_pendingMutex);
 
-#ifdef HYDNADEBUG
-            debugPrint("Connection", chcomp, "Already connected, sending the new open request");
-#endif
-
-            writeBytes(request->getFrame());
-            request->setSent(true);
+            sendRequest(request);
         }
       
         return m_connected;
@@ -279,68 +286,44 @@ namespace hydna {
     
     bool Connection::cancelOpen(OpenRequest* request) {
         unsigned int channelcomp = request->getChannelId();
-        OpenRequestQueue* queue = NULL;
-        OpenRequestQueue  tmp;
+        OpenRequestMap::iterator pending;
         bool found = false;
       
-        if (request->isSent()) {
-            return false;
-        }
-      
-        pthread_mutex_lock(&m_openWaitMutex);
-        if (m_openWaitQueue.count(channelcomp) > 0) {
-            queue = m_openWaitQueue[channelcomp];
-        }
         pthread_mutex_lock(&m_pendingMutex);
-        if (m_pendingOpenRequests.count(channelcomp) > 0) {
-            delete m_pendingOpenRequests[channelcomp];
-            m_pendingOpenRequests.erase(channelcomp);
-        
-            if (queue && queue->size() > 0) {
-                m_pendingOpenRequests[channelcomp] = queue->front();
-                queue->pop();
-            }
+        pending = m_pendingOpenRequests.find(channelcomp);
+        if (pending != m_pendingOpenRequests.end() && !request->isSent()) {
+            if (pending->second == request) {
+                OpenRequest* next = request->promoteWaiting();
+
+                if (next) {
+                    pending->second = next;
+                } else {
+                    m_pendingOpenRequests.erase(pending);
+                }
 
-            pthread_mutex_unlock(&m_pendingMutex);
-            pthread_mutex_unlock(&m_openWaitMutex);
-            return true;
-        }
-        pthread_mutex_unlock(&m_pendingMutex);
-      
-        // Should not happen...
-        if (!queue) {
-            pthread_mutex_unlock(&m_openWaitMutex);
-            return false;
-        }
-      
-        while (!queue->empty() && !found) {
-            OpenRequest* r = queue->front();
-            queue->pop();
-            
-            if (r == request) {
-                delete r;
                 found = true;
-            } else {
-                tmp.push(r);
+            } else if (request->isWaiting()) {
+                request->unlinkWaiting(pending->second);
+                found = true;
             }
         }
+        pthread_mutex_unlock(&m_pendingMutex);
 
-        while(!tmp.empty()) {
-            OpenRequest* r = tmp.front();
-            tmp.pop();
-            queue->push(r);
+        if (found) {
+            delete request;
         }
-        pthread_mutex_unlock(&m_openWaitMutex);
       
         return found;
     }
 
-    void Connection::connectConnection(string const &host, int port, string const &auth) {
+    void Connection::connectConnection(string const &host, int port, string const &auth, bool secure) {
         struct hostent     *he;
         struct sockaddr_in server;
 
         ++m_attempt;
 
+        closeSocket();
+
 #ifdef HYDNADEBUG
         ostringstream oss;
         oss << m_attempt;
@@ -349,12 +332,12 @@ namespace hydna {
 #endif
 
         if ((m_connectionFDS = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
-            destroy(ChannelError("Connection could not be created"));
+            connectFailed(ChannelError("Connection could not be created"));
         } else {
             m_connected = true;
 
             if ((he = gethostbyname(host.c_str())) == NULL) {
-                destroy(ChannelError("The host \"" + host + "\" could not be resolved"));
+                connectFailed(ChannelError("The host \"" + host + "\" could not be resolved"));
             } else {
                 int flag = 1;
                 if (setsockopt(m_connectionFDS, IPPROTO_TCP,
@@ -371,23 +354,47 @@ namespace hydna {
                     ostringstream oss;
                     oss << port;
 
-                    destroy(ChannelError("Could not connect to the host \"" + host + "\" on the port " + oss.str()));
-                } else {
+                    connectFailed(ChannelError("Could not connect to the host \"" + host + "\" on the port " + oss.str()));
+                    return;
+                }
+
+                if (secure) {
+                    m_tls = new TlsSession(m_connectionFDS);
+
+                    if (!m_tls->handshake(host, m_tlsVerify, m_tlsCaFile, m_kernelTls)) {
+                        connectFailed(ChannelError("Could not establish TLS with the host \"" + host + "\": " + m_tls->getError()));
+                        return;
+                    }
+
+                    m_kernelTlsGauge = m_tls->getKernelOffload();
+
 #ifdef HYDNADEBUG
-                    debugPrint("Connection", 0, "Connected, sending HTTP upgrade request");
+                    debugPrint("Connection", 0, m_kernelTlsGauge & TlsSession::KERNEL_SEND ?
+                               "TLS established, encrypting in the kernel" :
+                               "TLS established, encrypting in user space");
 #endif
-                    connectHandler(auth);
                 }
+
+#ifdef HYDNADEBUG
+                debugPrint("Connection", 0, "Connected, sending HTTP upgrade request");
+#endif
+                connectHandler(auth);
             }
         }
     }
     
-    void Connection::connectHandler(string const &auth) {
-        const char *data;
-        unsigned int length;
-        int n = -1;
-        unsigned int offset = 0;
+    void Connection::connectFailed(ChannelError const &error) {
+        if (m_reconnecting) {
+#ifdef HYDNADEBUG
+            debugPrint("Connection", 0, "Reconnect attempt failed: " + string(error.what()));
+#endif
+            return;
+        }
+
+        destroy(error);
+    }
 
+    void Connection::connectHandler(string const &auth) {
         string request = "GET /" + auth + " HTTP/1.1\r\n"
                          "Connection: upgrade\r\n"
                          "Upgrade: winksock/1\r\n"
@@ -403,16 +410,8 @@ namespace hydna {
         // End of upgrade request
         request += "\r\n\r\n";
 
-        data = request.data();
-        length = request.size();
-
-        while(offset < length && n != 0) {
-            n = write(m_connectionFDS, data + offset, length - offset);
-            offset += n;
-        }
-
-        if (n <= 0) {
-            destroy(ChannelError("Could not send upgrade request"));
+        if (!writeData(request.data(), request.size())) {
+            connectFailed(ChannelError("Could not send upgrade request"));
         } else {
             handshakeHandler();
         }
@@ -435,7 +434,10 @@ namespace hydna {
             char c = ' ';
 
             while(c != lf) {
-                read(m_connectionFDS, &c, 1);
+                if (socketRead(&c, 1) <= 0) {
+                    connectFailed(ChannelError("Could not read the upgrade response"));
+                    return;
+                }
 
                 if (c != lf && c != cr) {
                     line.append(1, c);
@@ -459,7 +461,8 @@ namespace hydna {
                             istringstream iss(line.substr(pos1 + 1, pos2 - (pos1 + 1)));
 
                             if ((iss >> code).fail()) {
-                                destroy(ChannelError("Could not read the status from the response \"" + line + "\""));
+                                connectFailed(ChannelError("Could not read the status from the response \"" + line + "\""));
+                                return;
                             }
                         }
                     }
@@ -474,12 +477,12 @@ namespace hydna {
                         case 303:
                         case 304:
                             if (!m_followRedirects) {
-                                destroy(ChannelError("Bad handshake (HTTP-redirection disabled)"));
+                                connectFailed(ChannelError("Bad handshake (HTTP-redirection disabled)"));
                                 return;
                             }
 
                             if (m_attempt > MAX_REDIRECT_ATTEMPTS) {
-                                destroy(ChannelError("Bad handshake (Too many redirect attempts)"));
+                                connectFailed(ChannelError("Bad handshake (Too many redirect attempts)"));
                                 return;
                             }
 
@@ -489,7 +492,7 @@ namespace hydna {
                             ostringstream oss;
                             oss << code;
 
-                            destroy(ChannelError("Server responded with bad HTTP response code, " + oss.str()));
+                            connectFailed(ChannelError("Server responded with bad HTTP response code, " + oss.str()));
                             return;
                     }
 
@@ -508,7 +511,7 @@ namespace hydna {
                         if (pos != string::npos) {
                             string header = line.substr(9);
                             if (header != "winksock/1") {
-                                destroy(ChannelError("Bad protocol version: " + header));
+                                connectFailed(ChannelError("Bad protocol version: " + header));
                                 return;
                             }
                         }
@@ -518,7 +521,7 @@ namespace hydna {
         }
 
         if (gotRedirect) {
-            m_connected = false;
+            closeSocket();
 
 #ifdef HYDNADEBUG
         debugPrint("Connection", 0, "Redirected to location: " + location);
@@ -526,19 +529,17 @@ namespace hydna {
 
             URL url = URL::parse(location);
 
-            if (url.getProtocol() != "http") {
-                if (url.getProtocol() == "https") {
-                    destroy(ChannelError("The protocol HTTPS is not supported"));
-                } else {
-                    destroy(ChannelError("Unknown protocol, " + url.getProtocol()));
-                }
+            if (!url.isSupported()) {
+                connectFailed(ChannelError("Unknown protocol, " + url.getProtocol().toString()));
+                return;
             }
 
-            if (url.getError() != "") {
-                destroy(ChannelError(url.getError()));
+            if (url.hasError()) {
+                connectFailed(ChannelError(url.getError()));
+                return;
             }
 
-            connectConnection(url.getHost(), url.getPort(), url.getPath());
+            connectConnection(url.getHost().toString(), url.getPort(), url.getPath().toString(), url.isSecure());
             return;
         }
 
@@ -549,20 +550,24 @@ namespace hydna {
         debugPrint("Connection", 0, "Handshake done on connection");
 #endif
 
+        if (m_reconnecting) {
+            // Pending requests and open channels are replayed by
+            // reconnect() on the listening thread.
+            return;
+        }
+
         OpenRequestPathMap::iterator it;
         OpenRequest* request;
         
         for (it = m_pendingResolveRequests.begin(); it != m_pendingResolveRequests.end(); it++) {
             request = it->second;
-            writeBytes(request->getFrame());
+            sendRequest(request);
             
 #ifdef HYDNADEBUG
         debugPrint("Connection", 0, "Writing bytes for request");
 #endif
 
             if (m_connected) {
-                request->setSent(true);
-                
                 // we need to send resolve request first
 #ifdef HYDNADEBUG
                 debugPrint("Connection", request->getChannelId(), "Resolve request sent");
@@ -583,6 +588,10 @@ namespace hydna {
             destroy(ChannelError("Could not create a new thread for frame listening"));
             return;
         }
+
+        pthread_mutex_lock(&m_listeningMutex);
+        m_hasListener = true;
+        pthread_mutex_unlock(&m_listeningMutex);
     }
 
     void* Connection::listen(void *ptr) {
@@ -591,239 +600,607 @@ namespace hydna {
         Connection* extConnection = args->extConnection;
         delete args;
 
+        pthread_detach(pthread_self());
+
+        ostringstream name;
+        name << "hydna-io:" << extConnection->m_port;
+        IoThread::setName(name.str());
+
+        // Before the receive buffers are touched, so that they are
+        // allocated on the chosen node.
+        pthread_mutex_lock(&m_ioSettingsMutex);
+        vector<unsigned int> cpus = m_ioCpus;
+        int node = m_ioNumaNode;
+        int priority = m_ioPriority;
+        pthread_mutex_unlock(&m_ioSettingsMutex);
+
+        extConnection->m_ioThreadConfig = IoThread::configure(cpus, node, priority);
+#ifdef __linux__
+        extConnection->m_ioThreadCpu = sched_getcpu();
+#endif
+
+        HYDNA_TRACE(Trace::IO_THREAD, 0, extConnection->m_ioThreadConfig, extConnection->m_ioThreadCpu);
+
         extConnection->receiveHandler();
+
+        // A connection destroyed while listening is deleted here, once
+        // nothing on this thread refers to it anymore.
+        pthread_mutex_lock(&extConnection->m_listeningMutex);
+        extConnection->m_listenerExited = true;
+        bool deleteConnection = extConnection->m_deleteOnExit;
+        pthread_mutex_unlock(&extConnection->m_listeningMutex);
+
+        if (deleteConnection) {
+            delete extConnection;
+        }
+
         pthread_exit(NULL);
     }
 
     void Connection::receiveHandler() {
-        unsigned int size;
-        unsigned int headerSize = Frame::HEADER_SIZE;
-        unsigned int ch;
-        int op;
-        int flag;
-        int ctype;
-
-        char header[headerSize];
-        char* payload;
-
-        unsigned int offset = 0;
-        int n = 1;
+        char buffer[READ_BUFFER_SIZE];
+        FrameParser parser;
+        FrameView frame;
+        int n;
 
         pthread_mutex_lock(&m_listeningMutex);
         m_listening = true;
         pthread_mutex_unlock(&m_listeningMutex);
 
+        m_lastReceived = Clock::now();
+
         for (;;) {
-            while(offset < headerSize + Frame::LENGTH_OFFSET && n > 0) {
-                n = read(m_connectionFDS, header + offset, headerSize + Frame::LENGTH_OFFSET - offset);
-                offset += n;
-            }
+            waitForMemory();
+
+            n = readData(buffer, READ_BUFFER_SIZE);
 
             if (n <= 0) {
-                pthread_mutex_lock(&m_listeningMutex);
-                if (m_listening) {
-                    pthread_mutex_unlock(&m_listeningMutex);
-                    destroy(ChannelError("Could not read from the connection"));
-                } else {
-                    pthread_mutex_unlock(&m_listeningMutex);
+                if (recover(ChannelError(n < 0 && errno == ETIMEDOUT ? "Connection timed out" : "Could not read from the connection"))) {
+                    parser.reset();
+                    continue;
                 }
                 break;
             }
 
-            size = ntohs(*(unsigned short*)&header[0]);
-            payload = new char[size - headerSize];
+            parser.feed(buffer, n);
 
-            while(offset < size + Frame::LENGTH_OFFSET && n > 0) {
-                n = read(m_connectionFDS, payload + offset - (headerSize + Frame::LENGTH_OFFSET), (size + Frame::LENGTH_OFFSET) - offset);
-                offset += n;
+            while (parser.next(frame)) {
+                if (FrameCapture::isEnabled()) {
+                    // The parser decodes the frame where it lies, right
+                    // after its header.
+                    FrameCapture::record(m_captureSource,
+                                         frame.payload - Frame::HEADER_SIZE - Frame::LENGTH_OFFSET,
+                                         frame.size + Frame::HEADER_SIZE + Frame::LENGTH_OFFSET);
+                }
+
+                dispatchFrame(frame);
             }
 
-            if (n <= 0) {
-                pthread_mutex_lock(&m_listeningMutex);
-                if (m_listening) {
-                    pthread_mutex_unlock(&m_listeningMutex);
-                    destroy(ChannelError("Could not read from the connection DATA"));
-                } else {
-                    pthread_mutex_unlock(&m_listeningMutex);
+            if (parser.isCorrupt()) {
+                if (recover(ChannelError("Received an invalid frame"))) {
+                    parser.reset();
+                    continue;
                 }
                 break;
             }
-            
-            ch = ntohl(*(unsigned int*)&header[2]);
-            
-            ctype = header[6] >> Frame::CTYPE_BITPOS;
-            op = (header[6] >> Frame::OP_BITPOS) & Frame::OP_BITMASK;
-            flag = header[6] & 7;
-            
-#ifdef HYDNADEBUG
-            ostringstream oss;
-            oss << op;  
-            debugPrint("Connection", ch, "Received a response with op code: "+oss.str());
-#endif
-            switch (op) {
-                
-                case Frame::KEEPALIVE:
-#ifdef HYDNADEBUG
-                    debugPrint("Connection", ch, "Received heartbeat");
-#endif                
-                    break;
-
-                case Frame::OPEN:
-#ifdef HYDNADEBUG
-                    debugPrint("Connection", ch, "Received open response");
-#endif
-                    processOpenFrame(ch, flag, payload, size - headerSize);
-                    break;
-
-                case Frame::DATA:
-#ifdef HYDNADEBUG
-                    debugPrint("Connection", ch, "Received data");
-#endif
-                    processDataFrame(ch, ctype, flag, payload, size - headerSize);
-                    break;
-
-                case Frame::SIGNAL:
-#ifdef HYDNADEBUG
-                    debugPrint("Connection", ch, "Received signal");
-#endif
-                    processSignalFrame(ch, ctype, flag, payload, size - headerSize);
-                    break;
-                
-                case Frame::RESOLVE:
-                
-#ifdef HYDNADEBUG
-                    debugPrint("Connection", ch, "Received resolve");
-#endif
-                    
-                    processResolveFrame(ch, flag, payload, size - headerSize);
-                    break;
-            }
-
-            offset = 0;
-            n = 1;
         }
 #ifdef HYDNADEBUG
         debugPrint("Connection", 0, "Listening thread exited");
 #endif
     }
-    
-    void Connection::processResolveFrame(unsigned int ch,
-                                    int flag,
-                                    const char* payload,
-                                    int size){
 
-        
-        if (flag != Frame::OPEN_ALLOW) {
-            destroy(ChannelError("Unable to resolve path"));
-            return;
-        }
-        
-        string path = "";
-        
-        if (payload && size > 0) {
-            path = string(payload, size);
-        }
-        
-        OpenRequest* request = NULL;
-        Channel* channel;
-        
-        pthread_mutex_lock(&m_resolveMutex);
-        if (m_pendingResolveRequests.count(path) > 0) {
-            request = m_pendingResolveRequests[path];
+    void Connection::dispatchFrame(FrameView const &frame) {
+        unsigned int size = frame.size + Frame::HEADER_SIZE + Frame::LENGTH_OFFSET;
+        char* payload;
+
+        if (frame.op < ConnectionStats::OP_COUNT) {
+            m_framesIn[frame.op].add();
+            m_bytesIn[frame.op].add(size);
         }
-        pthread_mutex_unlock(&m_resolveMutex);
 
-        if (!request) {
-            destroy(ChannelError("The server sent an invalid resolve frame"));
+        HYDNA_TRACE(Trace::FRAME_IN, frame.ch, frame.op, size);
+
+        if (frame.op == Frame::KEEPALIVE) {
+            if (m_keepaliveSent) {
+                unsigned long long rtt = Clock::now() - m_keepaliveSent;
+
+                HYDNA_TRACE(Trace::KEEPALIVE_RTT, 0, rtt, 0);
+                m_roundTripTimes.record(rtt);
+                m_keepaliveSent = 0;
+            }
             return;
         }
-        
-        channel = request->getChannel();
-        
-        if (strcmp(path.c_str(), request->getPath()) != 0) {
-            channel->destroy(ChannelError("Server sent wrong path"));
+
+        if (frame.op == Frame::DATA) {
+            // Copied straight from the read buffer by the channel.
+            processDataFrame(frame.ch, frame.ctype, frame.flag, frame.payload, frame.size);
             return;
         }
-        
-        channel->resolveSuccess(ch, request->getPath(), request->getPathSize(), request->getToken(), request->getTokenSize());
-        
-    }
 
-    void Connection::processOpenFrame(unsigned int ch,
-                                       int errcode,
-                                       const char* payload,
-                                       int size) {
-        OpenRequest* request = NULL;
-        Channel* channel;
-        unsigned int respch = 0;
-        string message = "";
-        
-        pthread_mutex_lock(&m_pendingMutex);
-        if (m_pendingOpenRequests.count(ch) > 0) {
-            request = m_pendingOpenRequests[ch];
-        }
-        pthread_mutex_unlock(&m_pendingMutex);
+        // The other frame handlers take ownership of the payload.
+        payload = new char[frame.size];
+        memcpy(payload, frame.payload, frame.size);
 
-        if (!request) {
-            destroy(ChannelError("The server sent an invalid open frame"));
-            return;
+        switch (frame.op) {
+
+            case Frame::OPEN:
+                processOpenFrame(frame.ch, frame.flag, payload, frame.size);
+                break;
+
+            case Frame::SIGNAL:
+                processSignalFrame(frame.ch, frame.ctype, frame.flag, payload, frame.size);
+                break;
+
+            case Frame::RESOLVE:
+                processResolveFrame(frame.ch, frame.flag, payload, frame.size);
+                break;
+
+            default:
+                delete[] payload;
+                break;
         }
+    }
 
-        channel = request->getChannel();
+    int Connection::readData(char* buffer, int size) {
+        int n;
 
-        if (errcode == Frame::OPEN_ALLOW) {
-            respch = ch;
+        while (m_keepaliveInterval || m_idleTimeout) {
+            unsigned long long now = Clock::now();
+            unsigned long long deadline = ~0ULL;
+            struct pollfd pfd;
+            int timeout;
 
-            if (payload && size > 0) {
-                message = string(payload, size);
+            // Decrypted bytes may already be buffered by the TLS session.
+            if (m_tls && m_tls->hasPending()) {
+                break;
             }
-        
-        } else if (errcode == Frame::OPEN_REDIRECT) {
-            if (!payload || size < 4) {
-                destroy(ChannelError("Expected redirect channel from the server"));
-                return;
+
+            if (m_keepaliveInterval) {
+                if (now >= m_lastKeepalive + m_keepaliveInterval * 1000ULL) {
+                    sendKeepalive();
+                    now = m_lastKeepalive;
+                }
+
+                deadline = m_lastKeepalive + m_keepaliveInterval * 1000ULL;
             }
 
-            respch = ntohl(*(unsigned int*)&payload[0]);
+            if (m_idleTimeout) {
+                if (now >= m_lastReceived + m_idleTimeout * 1000ULL) {
+                    HYDNA_TRACE(Trace::IDLE_TIMEOUT, 0, now - m_lastReceived, 0);
+                    errno = ETIMEDOUT;
+                    return -1;
+                }
 
-#ifdef HYDNADEBUG
-            ostringstream oss;
-            oss << ch;
+                if (m_lastReceived + m_idleTimeout * 1000ULL < deadline) {
+                    deadline = m_lastReceived + m_idleTimeout * 1000ULL;
+                }
+            }
 
-            ostringstream oss2;
-            oss2 << respch;
+            pfd.fd = m_connectionFDS;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
 
-            debugPrint("Connection", ch, "Redirected from " + oss.str());
-            debugPrint("Connection", respch, "             to " + oss2.str());
-#endif
+            // Round up, so that we don't wake up just before the deadline.
+            timeout = (deadline - now) / 1000 >= 0x7FFFFFFF ? 0x7FFFFFFF : (int)((deadline - now + 999) / 1000);
 
-            if (payload && size > 4) {
-                message = string(payload + 4, size - 4);
+            n = poll(&pfd, 1, timeout);
+
+            if (n > 0) {
+                break;
             }
-        } else {
-            pthread_mutex_lock(&m_pendingMutex);
-            delete m_pendingOpenRequests[ch];
-            m_pendingOpenRequests.erase(ch);
-            pthread_mutex_unlock(&m_pendingMutex);
 
-            string m = "";
-            if (payload && size > 0) {
-                m = string(payload, size);
+            if (n < 0 && errno != EINTR) {
+                return -1;
             }
+        }
 
-#ifdef HYDNADEBUG
-            ostringstream oss;
-            oss << errcode;
-            debugPrint("Connection", ch, "The server rejected the open request, error code " + oss.str());
-            debugPrint("Connection", ch, "The server rejected the open request, error message " + m);
-#endif
+        n = socketRead(buffer, size);
 
-            ChannelError error = ChannelError::fromOpenError(errcode, m);
+        if (n > 0 && m_idleTimeout) {
+            m_lastReceived = Clock::now();
+        }
+
+        return n;
+    }
+
+    void Connection::sendKeepalive() {
+        Frame frame(0, ContentType::UTF8, Frame::KEEPALIVE, 0);
+
+        m_lastKeepalive = Clock::now();
+
+        pthread_mutex_lock(&m_writeMutex);
+        if (m_handshaked && !m_reconnecting) {
+            HYDNA_TRACE(Trace::KEEPALIVE_SENT, 0, 0, 0);
+            // Only the latest keepalive is timed, so that a lost echo does
+            // not skew the round-trip times.
+            m_keepaliveSent = m_lastKeepalive;
+
+            if (writeData(frame.getData(), frame.getSize())) {
+                countFrameOut(frame.getData(), frame.getSize());
+            } else {
+                // The next read fails and takes care of the broken connection.
+                shutdown(m_connectionFDS, SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&m_writeMutex);
+    }
+
+    void Connection::waitForMemory() {
+        MemoryAccount& global = MemoryAccount::getGlobal();
+
+        if (m_memoryPolicy != MemoryAccount::BACKPRESSURE || !m_memory.isOverBudget()) {
+            return;
+        }
+
+        unsigned long long started = Clock::now();
+
+        HYDNA_TRACE(Trace::MEMORY_PAUSE, 0, m_memory.getTotal(), 0);
+        m_memory.countPause();
+
+        // Pausing only helps while there are received messages for the
+        // application to pop.
+        while (m_memory.isOverBudget() &&
+               global.getBytes(MemoryAccount::DATA) + global.getBytes(MemoryAccount::SIGNALS) > 0) {
+            pthread_mutex_lock(&m_destroyingMutex);
+            bool destroying = m_destroying;
+            pthread_mutex_unlock(&m_destroyingMutex);
+
+            if (destroying) {
+                break;
+            }
+
+            MemoryAccount::waitForRelease(MEMORY_WAIT_SLICE);
+
+            if (m_keepaliveInterval && Clock::now() >= m_lastKeepalive + m_keepaliveInterval * 1000ULL) {
+                sendKeepalive();
+            }
+        }
+
+        // The connection was not idle while it was not read.
+        m_lastReceived += Clock::now() - started;
+    }
+
+    bool Connection::shedMessage(unsigned int ch) {
+        if (m_memoryPolicy != MemoryAccount::SHED || !m_memory.isOverBudget()) {
+            return false;
+        }
+
+        HYDNA_TRACE(Trace::MEMORY_SHED, ch, m_memory.getTotal(), 0);
+        m_memory.countShed();
+        return true;
+    }
+
+    bool Connection::recover(ChannelError const &error) {
+        pthread_mutex_lock(&m_listeningMutex);
+        bool listening = m_listening;
+        pthread_mutex_unlock(&m_listeningMutex);
+
+        if (!listening) {
+            return false;
+        }
+
+        if (m_autoReconnect && reconnect()) {
+            return true;
+        }
+
+        destroy(error);
+        return false;
+    }
+
+    bool Connection::reconnect() {
+        unsigned long long started = Clock::now();
+        unsigned int delay = max(m_reconnectInitialDelay, (unsigned int)MIN_RECONNECT_DELAY);
+        unsigned int attempt = 0;
+
+        pthread_mutex_lock(&m_writeMutex);
+        m_reconnecting = true;
+        m_handshaked = false;
+        pthread_mutex_unlock(&m_writeMutex);
+
+        closeSocket();
+
+        while (m_reconnectMaxAttempts == 0 || attempt < m_reconnectMaxAttempts) {
+            ++attempt;
+
+            // Sleep for a random time between half and all of the current
+            // backoff delay, to avoid reconnecting all clients at once.
+            if (delay > 0) {
+                usleep((delay / 2 + rand_r(&m_seed) % (delay / 2 + 1)) * 1000);
+            }
+
+            pthread_mutex_lock(&m_listeningMutex);
+            if (!m_listening) {
+                pthread_mutex_unlock(&m_listeningMutex);
+                break;
+            }
+            pthread_mutex_unlock(&m_listeningMutex);
+
+            HYDNA_TRACE(Trace::RECONNECT, 0, attempt, delay);
+
+            pthread_mutex_lock(&m_writeMutex);
+            ++m_reconnectStats.attempts;
+            pthread_mutex_unlock(&m_writeMutex);
+
+            m_attempt = 0;
+            connectConnection(m_host, m_port, m_auth, m_secure);
+
+            if (m_handshaked) {
+                replayChannels();
+
+                if (!m_reconnecting) {
+                    m_lastReceived = Clock::now();
+                    m_keepaliveSent = 0;
+
+                    pthread_mutex_lock(&m_writeMutex);
+                    ++m_reconnectStats.reconnects;
+                    m_reconnectStats.lastReconnectTime = m_lastReceived - started;
+                    pthread_mutex_unlock(&m_writeMutex);
+
+#ifdef HYDNADEBUG
+                    debugPrint("Connection", 0, "Reconnected, open channels replayed");
+#endif
+                    return true;
+                }
+            }
+
+            closeSocket();
+            m_handshaked = false;
+
+            delay = delay * 2 > m_reconnectMaxDelay ? m_reconnectMaxDelay : delay * 2;
+        }
+
+        pthread_mutex_lock(&m_writeMutex);
+        m_reconnecting = false;
+        clearReconnectQueue();
+        pthread_mutex_unlock(&m_writeMutex);
+
+        return false;
+    }
+
+    void Connection::replayChannels() {
+        ByteArray batch;
+        Frame* frame;
+        unsigned int replayed = 0;
+
+        OpenRequestPathMap::iterator resolving;
+        OpenRequestMap::iterator pending;
+        ChannelMap::iterator openchannels;
+
+        // Requests that was in flight when the connection was lost.
+        pthread_mutex_lock(&m_resolveMutex);
+        resolving = m_pendingResolveRequests.begin();
+        for (; resolving != m_pendingResolveRequests.end(); resolving++) {
+            frame = &resolving->second->getFrame();
+            batch.insert(batch.end(), frame->getData(), frame->getData() + frame->getSize());
+            countFrameOut(frame->getData(), frame->getSize());
+            resolving->second->setSent(true);
+        }
+        pthread_mutex_unlock(&m_resolveMutex);
+
+        pthread_mutex_lock(&m_pendingMutex);
+        pending = m_pendingOpenRequests.begin();
+        for (; pending != m_pendingOpenRequests.end(); pending++) {
+            frame = &pending->second->getFrame();
+            batch.insert(batch.end(), frame->getData(), frame->getData() + frame->getSize());
+            countFrameOut(frame->getData(), frame->getSize());
+            pending->second->setSent(true);
+        }
+        pthread_mutex_unlock(&m_pendingMutex);
+
+        // Pipeline a resolve and an open for every open channel, the
+        // channels keep their id as long as the path resolves to it.
+        pthread_mutex_lock(&m_openChannelsMutex);
+        openchannels = m_openChannels.begin();
+        for (; openchannels != m_openChannels.end(); openchannels++) {
+            unsigned int ch = openchannels->first;
+            Channel* channel = openchannels->second;
+            const char* path = channel->m_path.c_str();
+            int pathSize = channel->m_path.length();
+            const char* token = channel->m_token.c_str();
+            int tokenSize = channel->m_token.length();
+            OpenRequest* request;
+
+            pthread_mutex_lock(&m_resolveMutex);
+            if (m_pendingResolveRequests.count(channel->m_path) == 0) {
+                frame = new Frame(Frame::RESOLVE_CHANNEL, ContentType::UTF8, Frame::RESOLVE, 0, path, 0, pathSize);
+                request = new OpenRequest(channel, ch, path, pathSize, token, tokenSize, frame);
+                request->setReplay(true);
+                request->setSent(true);
+                request->charge(&m_memory);
+                m_pendingResolveRequests[channel->m_path] = request;
+                batch.insert(batch.end(), frame->getData(), frame->getData() + frame->getSize());
+                countFrameOut(frame->getData(), frame->getSize());
+            }
+            pthread_mutex_unlock(&m_resolveMutex);
+
+            pthread_mutex_lock(&m_pendingMutex);
+            if (m_pendingOpenRequests.count(ch) == 0) {
+                frame = new Frame(ch, ContentType::UTF8, Frame::OPEN, channel->m_mode, token, 0, tokenSize);
+                request = new OpenRequest(channel, ch, path, pathSize, token, tokenSize, frame);
+                request->setReplay(true);
+                request->setSent(true);
+                request->charge(&m_memory);
+                m_pendingOpenRequests[ch] = request;
+                batch.insert(batch.end(), frame->getData(), frame->getData() + frame->getSize());
+                countFrameOut(frame->getData(), frame->getSize());
+                ++replayed;
+            }
+            pthread_mutex_unlock(&m_pendingMutex);
+        }
+        pthread_mutex_unlock(&m_openChannelsMutex);
+
+        HYDNA_TRACE(Trace::RECONNECTED, 0, replayed, batch.size());
+
+        // Writes queued while reconnecting goes out right after the open
+        // requests, in the order they were made.
+        pthread_mutex_lock(&m_writeMutex);
+        for (unsigned int i = 0; i < m_reconnectQueue.size(); i++) {
+            frame = m_reconnectQueue.front();
+            batch.insert(batch.end(), frame->getData(), frame->getData() + frame->getSize());
+            countFrameOut(frame->getData(), frame->getSize());
+            m_reconnectQueue.pop();
+            m_reconnectQueue.push(frame);
+        }
+
+        if (batch.size() == 0 || writeData(&batch[0], batch.size())) {
+            clearReconnectQueue();
+
+            m_reconnecting = false;
+        }
+        pthread_mutex_unlock(&m_writeMutex);
+    }
+    
+    void Connection::processResolveFrame(unsigned int ch,
+                                    int flag,
+                                    const char* payload,
+                                    int size){
+
+        
+        if (flag != Frame::OPEN_ALLOW) {
+            destroy(ChannelError("Unable to resolve path"));
+            return;
+        }
+        
+        string path = "";
+        
+        if (payload && size > 0) {
+            path = string(payload, size);
+        }
+        
+        OpenRequest* request = NULL;
+        OpenRequestPathMap::iterator pending;
+        vector<OpenRequest*> waiting;
+        Channel* channel;
+        
+        pthread_mutex_lock(&m_resolveMutex);
+        pending = m_pendingResolveRequests.find(path);
+        if (pending != m_pendingResolveRequests.end()) {
+            request = pending->second;
+            request->takeWaiting(waiting);
+            m_pendingResolveRequests.erase(pending);
+        }
+        pthread_mutex_unlock(&m_resolveMutex);
+
+        if (!request) {
+            destroy(ChannelError("The server sent an invalid resolve frame"));
+            return;
+        }
+        
+        channel = request->getChannel();
+
+        if (!request->isReplay()) {
+            m_resolveLatency.record(Clock::now() - request->getCreated());
+        }
+
+        if (request->isReplay()) {
+            // The open request for the channel is already pipelined, just
+            // make sure that the path still resolves to the same channel.
+            if (ch != request->getChannelId()) {
+                pthread_mutex_lock(&m_openChannelsMutex);
+                if (m_openChannels.count(request->getChannelId()) > 0 &&
+                    m_openChannels[request->getChannelId()] == channel) {
+                    m_openChannels.erase(request->getChannelId());
+                } else {
+                    channel = NULL;
+                }
+                pthread_mutex_unlock(&m_openChannelsMutex);
+
+                if (channel) {
+                    channel->destroy(ChannelError("Path resolved to another channel after reconnect"));
+                }
+            }
+
+            delete request;
+        } else if (strcmp(path.c_str(), request->getPath()) != 0) {
+            channel->destroy(ChannelError("Server sent wrong path"));
+        } else {
+            try {
+                channel->resolveSuccess(ch, request->getPath(), request->getPathSize(), request->getToken(), request->getTokenSize());
+            } catch (Error&) {
+                channel->destroy(ChannelError("Channel already open"));
+            }
+
+            delete request;
+        }
+
+        // Requests for the same path that was waiting on this resolve,
+        // also when it was replayed.
+        for (unsigned int i = 0; i < waiting.size(); i++) {
+            request = waiting[i];
+
+            try {
+                request->getChannel()->resolveSuccess(ch, request->getPath(), request->getPathSize(), request->getToken(), request->getTokenSize());
+            } catch (Error&) {
+                request->getChannel()->destroy(ChannelError("Channel already open"));
+            }
+
+            delete request;
+        }
+    }
+
+    void Connection::processOpenFrame(unsigned int ch,
+                                       int errcode,
+                                       const char* payload,
+                                       int size) {
+        OpenRequest* request = NULL;
+        Channel* channel;
+        unsigned int respch = 0;
+        string message = "";
+        
+        pthread_mutex_lock(&m_pendingMutex);
+        if (m_pendingOpenRequests.count(ch) > 0) {
+            request = m_pendingOpenRequests[ch];
+        }
+        pthread_mutex_unlock(&m_pendingMutex);
+
+        if (!request) {
+            destroy(ChannelError("The server sent an invalid open frame"));
+            return;
+        }
+
+        if (request->isReplay()) {
+            processReplayedOpenFrame(request, ch, errcode, payload, size);
+            return;
+        }
+
+        channel = request->getChannel();
+
+        if (errcode == Frame::OPEN_ALLOW) {
+            respch = ch;
+
+            if (payload && size > 0) {
+                message = string(payload, size);
+            }
+        
+        } else if (errcode == Frame::OPEN_REDIRECT) {
+            if (!payload || size < 4) {
+                destroy(ChannelError("Expected redirect channel from the server"));
+                return;
+            }
+
+            respch = ntohl(*(unsigned int*)&payload[0]);
+
+            if (payload && size > 4) {
+                message = string(payload + 4, size - 4);
+            }
+        } else {
+            advanceOpenQueue(ch, request);
+
+            string m = "";
+            if (payload && size > 0) {
+                m = string(payload, size);
+            }
+
+            HYDNA_TRACE(Trace::OPEN_DENIED, ch, errcode, 0);
+
+            ChannelError error = ChannelError::fromOpenError(errcode, m);
             channel->destroy(error);
             return;
         }
 
 
+        m_openLatency.record(Clock::now() - request->getCreated());
+
         pthread_mutex_lock(&m_openChannelsMutex);
         if (m_openChannels.count(respch) > 0) {
             pthread_mutex_unlock(&m_openChannelsMutex);
@@ -832,59 +1209,102 @@ namespace hydna {
         }
 
         m_openChannels[respch] = channel;
-#ifdef HYDNADEBUG
-        ostringstream oss;
-        oss << m_openChannels.size();
-
-        debugPrint("Connection", respch, "A new channel was added");
-        debugPrint("Connection", respch, "The size of openChannels is now " + oss.str());
-#endif
         pthread_mutex_unlock(&m_openChannelsMutex);
 
+        HYDNA_TRACE(Trace::OPEN_ALLOWED, ch, respch, 0);
+
         channel->openSuccess(respch, message);
 
-        pthread_mutex_lock(&m_openWaitMutex);
+        if (respch != ch) {
+            // The channel requested is still free, the next request for
+            // it is sent.
+            advanceOpenQueue(ch, request);
+            return;
+        }
+
+        // Every request waiting for the channel is denied, now that it
+        // is open.
+        vector<OpenRequest*> waiting;
+        ChannelError error("Channel already open");
+
         pthread_mutex_lock(&m_pendingMutex);
-        if (m_openWaitQueue.count(ch) > 0) {
-            OpenRequestQueue* queue = m_openWaitQueue[ch];
-            
-            if (queue)
-            {
-                // Destroy all pending request IF response wasn't a 
-                // redirected channel.
-                if (respch == ch) {
-                    delete m_pendingOpenRequests[ch];
-                    m_pendingOpenRequests.erase(ch);
-
-                    ChannelError error("Channel already open");
-
-                    while (!queue->empty()) {
-                        request = queue->front();
-                        queue->pop();
-                        request->getChannel()->destroy(error);
-                    }
+        request->takeWaiting(waiting);
+        m_pendingOpenRequests.erase(ch);
+        pthread_mutex_unlock(&m_pendingMutex);
+
+        delete request;
+
+        for (unsigned int i = 0; i < waiting.size(); i++) {
+            waiting[i]->getChannel()->destroy(error);
+            delete waiting[i];
+        }
+    }
+
+    void Connection::advanceOpenQueue(unsigned int ch, OpenRequest* request) {
+        OpenRequest* next;
+
+        pthread_mutex_lock(&m_pendingMutex);
+        next = request->promoteWaiting();
+
+        if (next) {
+            // Keeps the request from being cancelled until it is written.
+            next->setSent(true);
+            m_pendingOpenRequests[ch] = next;
+        } else {
+            m_pendingOpenRequests.erase(ch);
+        }
+        pthread_mutex_unlock(&m_pendingMutex);
+
+        delete request;
+
+        if (next) {
+            sendRequest(next);
+        }
+    }
+
+    void Connection::processReplayedOpenFrame(OpenRequest* request,
+                                              unsigned int ch,
+                                              int errcode,
+                                              const char* payload,
+                                              int size) {
+        Channel* channel = request->getChannel();
+        bool open = false;
+
+        advanceOpenQueue(ch, request);
+
+        pthread_mutex_lock(&m_openChannelsMutex);
+        open = m_openChannels.count(ch) > 0 && m_openChannels[ch] == channel;
+
+        if (open && errcode != Frame::OPEN_ALLOW) {
+            m_openChannels.erase(ch);
+        }
+        pthread_mutex_unlock(&m_openChannelsMutex);
+
+        if (!open) {
+            // Channel was closed or destroyed while reconnecting.
+            return;
+        }
 
-                    return;
-                }
+        if (errcode == Frame::OPEN_ALLOW) {
+            pthread_mutex_lock(&m_writeMutex);
+            ++m_reconnectStats.replayedOpens;
+            pthread_mutex_unlock(&m_writeMutex);
 
-                request = queue->front();
-                queue->pop();
-                m_pendingOpenRequests[ch] = request;
+            // Writes spooled while reconnecting.
+            channel->flushSpool();
+            return;
+        }
 
-                if (queue->empty()) {
-                    delete m_openWaitQueue[ch];
-                    m_openWaitQueue.erase(ch);
-                }
+        string m = "";
+        if (payload && size > 0) {
+            m = string(payload, size);
+        }
 
-                writeBytes(request->getFrame());
-                request->setSent(true);
-            }
+        if (errcode == Frame::OPEN_REDIRECT) {
+            channel->destroy(ChannelError("Channel was redirected after reconnect"));
         } else {
-            delete m_pendingOpenRequests[ch];
-            m_pendingOpenRequests.erase(ch);
+            channel->destroy(ChannelError::fromOpenError(errcode, m));
         }
-        pthread_mutex_unlock(&m_pendingMutex);
-        pthread_mutex_unlock(&m_openWaitMutex);
     }
 
     void Connection::processDataFrame(unsigned int ch,
@@ -893,7 +1313,6 @@ namespace hydna {
                                 const char* payload,
                                 int size) {
         Channel* channel = NULL;
-        ChannelData* data;
         
         pthread_mutex_lock(&m_openChannelsMutex);
         if (m_openChannels.count(ch) > 0)
@@ -910,12 +1329,16 @@ namespace hydna {
             return;
         }
 
-        data = new ChannelData(priority, payload, size, ctype);
-        channel->addData(data);
+        if (shedMessage(ch)) {
+            return;
+        }
+
+        channel->receiveData(priority, ctype, payload, size);
     }
 
 
     bool Connection::processSignalFrame(Channel* channel,
+                                    unsigned int ch,
                                     int ctype,
                                     int flag,
                                     const char* payload,
@@ -941,6 +1364,11 @@ namespace hydna {
         if (!channel)
             return false;
 
+        if (shedMessage(ch)) {
+            delete[] payload;
+            return true;
+        }
+
         signal = new ChannelSignal(flag, payload, size, ctype);
         channel->addSignal(signal);
         return true;
@@ -977,7 +1405,7 @@ namespace hydna {
                     pthread_mutex_unlock(&m_closingMutex);
                 }
 
-                if (processSignalFrame(it->second, ctype, flag, payloadCopy, size)) {
+                if (processSignalFrame(it->second, it->first, ctype, flag, payloadCopy, size)) {
                     ++it;
                 } else {
                     m_openChannels.erase(it++);
@@ -1018,121 +1446,74 @@ namespace hydna {
                 return;
             }
 
-            processSignalFrame(channel, ctype, flag, payload, size);
+            processSignalFrame(channel, ch, ctype, flag, payload, size);
         }
     }
 
-    void Connection::destroy(ChannelError error) {
+    void Connection::destroy(ChannelError const &error) {
         pthread_mutex_lock(&m_destroyingMutex);
         m_destroying = true;
         pthread_mutex_unlock(&m_destroyingMutex);
 
-        OpenRequestMap::iterator pending;
-        OpenRequestQueueMap::iterator waitqueue;
-        
-        OpenRequestPathMap::iterator resolving;
-        OpenRequestQueuePathMap::iterator resolvewaitqueue;
-        
-        ChannelMap::iterator openchannels;
+        // Every map is swapped out under its lock in constant time, then
+        // walked with no lock held. Requests and channels that arrive
+        // meanwhile see empty maps.
+        OpenRequestPathMap resolving;
+        OpenRequestMap pending;
+        vector<OpenRequest*> waiting;
+        ChannelMap open;
+
+        HYDNA_TRACE(Trace::DESTROY, 0, error.getCode(), 0);
 
 #ifdef HYDNADEBUG
         debugPrint("Connection", 0, "Destroying connection because: " + string(error.what()));
 #endif
-        
+
         pthread_mutex_lock(&m_resolveMutex);
-#ifdef HYDNADEBUG
-        ostringstream oss;
-        oss << m_pendingResolveRequests.size();
-        debugPrint("Connection", 0, "Destroying pendingResolveRequests of size " + oss.str());
-#endif
-        resolving = m_pendingResolveRequests.begin();
-        for (; resolving != m_pendingResolveRequests.end(); resolving++) {
-#ifdef HYDNADEBUG
-            
-        debugPrint("Connection", 0, "Destroying channel "+ resolving->first);
-#endif
-            resolving->second->getChannel()->destroy(error);
-        }
-        
-        m_pendingResolveRequests.clear();
+        resolving.swap(m_pendingResolveRequests);
         pthread_mutex_unlock(&m_resolveMutex);
-        
-        //
-        
-        pthread_mutex_lock(&m_resolveWaitMutex);
-#ifdef HYDNADEBUG
-        ostringstream oss2;
-        oss2 << m_resolveWaitQueue.size();
-        debugPrint("Connection", 0, "Destroying waitQueue of size " + oss2.str());
-#endif
-        resolvewaitqueue = m_resolveWaitQueue.begin();
-        for (; resolvewaitqueue != m_resolveWaitQueue.end(); resolvewaitqueue++) {
-            OpenRequestQueue* queue = resolvewaitqueue->second;
 
-            while(!queue->empty()) {
-                queue->front()->getChannel()->destroy(error);
-                queue->pop();
-            }
-        }
-        m_resolveWaitQueue.clear();
-        pthread_mutex_unlock(&m_resolveWaitMutex);
-        
-        //
-        
         pthread_mutex_lock(&m_pendingMutex);
+        pending.swap(m_pendingOpenRequests);
+        pthread_mutex_unlock(&m_pendingMutex);
+
+        pthread_mutex_lock(&m_openChannelsMutex);
+        open.swap(m_openChannels);
+        pthread_mutex_unlock(&m_openChannelsMutex);
+
 #ifdef HYDNADEBUG
-        ostringstream oss3;
-        oss3 << m_pendingOpenRequests.size();
-        debugPrint("Connection", 0, "Destroying pendingOpenRequests of size " + oss3.str());
+        ostringstream oss;
+        oss << resolving.size() << " resolving, " << pending.size() << " opening, "
+            << open.size() << " open";
+        debugPrint("Connection", 0, "Destroying channels, " + oss.str());
 #endif
-        
-        if(m_pendingOpenRequests.size() > 0){
-            pending = m_pendingOpenRequests.begin();
-        
-            for (; pending != m_pendingOpenRequests.end(); pending++) {
-#ifdef HYDNADEBUG
-        debugPrint("Connection", 0, "Destroying channel " + pending->first);
-#endif      
-                pending->second->getChannel()->destroy(error);
-            }
+
+        // Channels are destroyed once the locks are released, so that
+        // their listeners may open channels again.
+        vector<Channel*> destroyed;
+
+        destroyed.reserve(resolving.size() + pending.size() + open.size());
+
+        // The requests waiting behind a pending request are only
+        // reachable through it once the maps are swapped out. All of
+        // them are deleted once their channels are detached.
+        for (OpenRequestPathMap::iterator it = resolving.begin(); it != resolving.end(); ++it) {
+            destroyed.push_back(it->second->getChannel());
+            it->second->takeWaiting(waiting);
         }
-        m_pendingOpenRequests.clear();
 
-        pthread_mutex_unlock(&m_pendingMutex);
+        for (OpenRequestMap::iterator it = pending.begin(); it != pending.end(); ++it) {
+            destroyed.push_back(it->second->getChannel());
+            it->second->takeWaiting(waiting);
+        }
 
-        pthread_mutex_lock(&m_openWaitMutex);
-#ifdef HYDNADEBUG
-        ostringstream oss4;
-        oss4 << m_openWaitQueue.size();
-        debugPrint("Connection", 0, "Destroying waitQueue of size " + oss4.str());
-#endif
-        waitqueue = m_openWaitQueue.begin();
-        for (; waitqueue != m_openWaitQueue.end(); waitqueue++) {
-            OpenRequestQueue* queue = waitqueue->second;
+        for (unsigned int i = 0; i < waiting.size(); i++) {
+            destroyed.push_back(waiting[i]->getChannel());
+        }
 
-            while(!queue->empty()) {
-                queue->front()->getChannel()->destroy(error);
-                queue->pop();
-            }
+        for (ChannelMap::iterator it = open.begin(); it != open.end(); ++it) {
+            destroyed.push_back(it->second);
         }
-        m_openWaitQueue.clear();
-        pthread_mutex_unlock(&m_openWaitMutex);
-        
-        pthread_mutex_lock(&m_openChannelsMutex);
-#ifdef HYDNADEBUG
-        ostringstream oss5;
-        oss5 << m_openChannels.size();
-        debugPrint("Connection", 0, "Destroying openChannels of size " + oss5.str());
-#endif
-        openchannels = m_openChannels.begin();
-        for (; openchannels != m_openChannels.end(); openchannels++) {
-#ifdef HYDNADEBUG
-            debugPrint("Connection", openchannels->first, "Destroying channel");
-#endif
-            openchannels->second->destroy(error);
-        }				
-        m_openChannels.clear();
-        pthread_mutex_unlock(&m_openChannelsMutex);
 
         if (m_connected) {
 #ifdef HYDNADEBUG
@@ -1141,57 +1522,504 @@ namespace hydna {
             pthread_mutex_lock(&m_listeningMutex);
             m_listening = false;
             pthread_mutex_unlock(&m_listeningMutex);
-            close(m_connectionFDS);
+
+            // Wakes up the listening thread. The socket is closed by the
+            // destructor, so that the descriptor is not reused while the
+            // listening thread may still read from it.
+            shutdown(m_connectionFDS, SHUT_RDWR);
             m_connected = false;
             m_handshaked = false;
         }
         
-        string ports;
-        stringstream out;
-        out << m_port;
-        ports = out.str();
-        
-        string key = m_host + ports + m_auth;
+        // Only the first destroy finds the connection in its bucket.
+        Connection** link = &m_availableConnections[m_endpoint.getHash() % CONNECTION_BUCKETS];
+        bool registered = false;
 
         pthread_mutex_lock(&m_connectionMutex);
-        if (m_availableConnections[key]) {
-            delete m_availableConnections[key];
-            m_availableConnections.erase(key);
+        while (*link && *link != this) {
+            link = &(*link)->m_nextAvailable;
+        }
+
+        if (*link) {
+            *link = m_nextAvailable;
+            m_nextAvailable = NULL;
+            registered = true;
         }
         pthread_mutex_unlock(&m_connectionMutex);
 
+        // The channels do not call back into the connection, their
+        // references are dropped at once instead.
+        int detached = 0;
+
+        for (size_t i = 0; i < destroyed.size(); i++) {
+            if (destroyed[i]->detach(this, error)) {
+                detached++;
+            }
+        }
+
+        // The channels have let go of their requests. A request that is
+        // being sent is done with once the write lock is released, and
+        // later sends see that the connection is destroying.
+        pthread_mutex_lock(&m_writeMutex);
+        pthread_mutex_unlock(&m_writeMutex);
+
+        for (OpenRequestPathMap::iterator it = resolving.begin(); it != resolving.end(); ++it) {
+            delete it->second;
+        }
+
+        for (OpenRequestMap::iterator it = pending.begin(); it != pending.end(); ++it) {
+            delete it->second;
+        }
+
+        for (unsigned int i = 0; i < waiting.size(); i++) {
+            delete waiting[i];
+        }
+
+        pthread_mutex_lock(&m_channelRefMutex);
+        m_channelRefCount -= detached;
+        pthread_mutex_unlock(&m_channelRefMutex);
+
+        m_memory.release(MemoryAccount::CHANNELS, detached * sizeof(Channel));
+
 #ifdef HYDNADEBUG
         debugPrint("Connection", 0, "Destroying connection done");
 #endif
         
-        pthread_mutex_unlock(&m_destroyingMutex);
+        pthread_mutex_lock(&m_destroyingMutex);
         m_destroying = false;
         pthread_mutex_unlock(&m_destroyingMutex);
+
+        if (registered) {
+            // The listening thread may still be unwinding, possibly from
+            // this very call. If so it deletes the connection on exit.
+            pthread_mutex_lock(&m_listeningMutex);
+            m_deleteOnExit = m_hasListener && !m_listenerExited;
+            bool deferred = m_deleteOnExit;
+            pthread_mutex_unlock(&m_listeningMutex);
+
+            if (!deferred) {
+                delete this;
+            }
+        }
     }
 
-    bool Connection::writeBytes(Frame& frame) {
-        if (m_handshaked) {
-            int n = -1;
-            int size = frame.getSize();
-            char* data = frame.getData();
-            int offset = 0;
-            
-            while(offset < size && n != 0) {
-                n = write(m_connectionFDS, data + offset, size - offset);
-                offset += n;
+    bool Connection::writeBytes(Frame& frame, int* failure) {
+        struct iovec part;
+
+        part.iov_base = frame.getData();
+        part.iov_len = frame.getSize();
+
+        return writeFrame(&part, 1, failure);
+    }
+
+    bool Connection::writeBytes(unsigned int ch,
+                                unsigned int ctype,
+                                unsigned int op,
+                                unsigned int flag,
+                                const char* prefix,
+                                unsigned int prefixLength,
+                                const char* payload,
+                                unsigned int length,
+                                int* failure)
+    {
+        char header[Frame::HEADER_SIZE + Frame::LENGTH_OFFSET];
+        struct iovec parts[3];
+        int count = 1;
+
+        Frame::writeHeader(header, ch, ctype, op, flag, prefixLength + length);
+
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(header);
+
+        if (prefixLength > 0) {
+            parts[count].iov_base = (char*)prefix;
+            parts[count].iov_len = prefixLength;
+            count++;
+        }
+
+        if (length > 0) {
+            parts[count].iov_base = (char*)payload;
+            parts[count].iov_len = length;
+            count++;
+        }
+
+        return writeFrame(parts, count, failure);
+    }
+
+    void Connection::queueReconnectFrame(const struct iovec* parts, int count) {
+        Frame* frame = new Frame(parts, count);
+
+        m_memory.charge(MemoryAccount::RECONNECT_QUEUE, sizeof(Frame) + frame->getSize());
+        m_reconnectQueue.push(frame);
+    }
+
+    void Connection::clearReconnectQueue() {
+        while (!m_reconnectQueue.empty()) {
+            Frame* frame = m_reconnectQueue.front();
+
+            m_memory.release(MemoryAccount::RECONNECT_QUEUE, sizeof(Frame) + frame->getSize());
+            m_reconnectQueue.pop();
+            delete frame;
+        }
+    }
+
+    bool Connection::writeFrame(const struct iovec* parts, int count, int* failure) {
+        unsigned long long started = Clock::now();
+        unsigned int size = 0;
+        int cause = 0;
+        bool result;
+
+        for (int i = 0; i < count; i++) {
+            size += parts[i].iov_len;
+        }
+
+        pthread_mutex_lock(&m_writeMutex);
+        if (m_reconnecting) {
+            // Queue the frame until the channels has been replayed, unless
+            // the queue is full or memory is over budget.
+            if (m_reconnectQueue.size() >= m_reconnectQueueLimit) {
+                cause = WRITE_QUEUE_FULL;
+            } else if (m_memory.isOverBudget()) {
+                cause = WRITE_OVER_BUDGET;
+            } else {
+                queueReconnectFrame(parts, count);
             }
 
+            if (cause) {
+                ++m_reconnectStats.droppedFrames;
+            }
+
+            pthread_mutex_unlock(&m_writeMutex);
+
+            if (cause && failure) {
+                *failure = cause;
+            }
+
+            return cause == 0;
+        }
+
+        if (!m_handshaked) {
+            pthread_mutex_unlock(&m_writeMutex);
+
+            if (failure) {
+                pthread_mutex_lock(&m_destroyingMutex);
+                *failure = m_destroying ? WRITE_DESTROYED : WRITE_NOT_READY;
+                pthread_mutex_unlock(&m_destroyingMutex);
+            }
+
+            return false;
+        }
+
+        result = writeData(parts, count);
+
+        if (result) {
+            countFrameOut((const char*)parts[0].iov_base, size);
+        } else if (m_autoReconnect) {
+            // Wake up the listening thread, it takes care of reconnecting.
+            m_reconnecting = true;
+            queueReconnectFrame(parts, count);
+            shutdown(m_connectionFDS, SHUT_RDWR);
+            result = true;
+        }
+
+        m_writeLatency.record(Clock::now() - started);
+        pthread_mutex_unlock(&m_writeMutex);
+
+        if (!result) {
+            destroy(ChannelError("Could not write to the connection"));
+
+            if (failure) {
+                *failure = WRITE_DESTROYED;
+            }
+        }
+
+        return result;
+    }
+
+    bool Connection::writeEncoded(const struct iovec* parts, int count, unsigned int frames) {
+        unsigned long long started = Clock::now();
+        unsigned int size = 0;
+        bool result;
+
+        for (int i = 0; i < count; i++) {
+            size += parts[i].iov_len;
+        }
+
+        pthread_mutex_lock(&m_writeMutex);
+        if (m_reconnecting || !m_handshaked) {
+            pthread_mutex_unlock(&m_writeMutex);
+            return false;
+        }
+
+        result = writeData(parts, count);
+
+        if (result) {
+            m_framesOut[Frame::DATA].add(frames);
+            m_bytesOut[Frame::DATA].add(size);
+            HYDNA_TRACE(Trace::FRAME_OUT, 0, Frame::DATA, size);
+        } else {
+            // The caller may hold locks that the channels take when the
+            // connection is destroyed. The listening thread is woken up
+            // instead, and recovers or destroys the connection.
+            m_reconnecting = m_autoReconnect;
+            shutdown(m_connectionFDS, SHUT_RDWR);
+        }
+
+        m_writeLatency.record(Clock::now() - started);
+        pthread_mutex_unlock(&m_writeMutex);
+
+        return result;
+    }
+
+    bool Connection::sendRequest(OpenRequest* request) {
+        bool result;
+
+        pthread_mutex_lock(&m_writeMutex);
+        if (m_reconnecting || !m_handshaked) {
+            pthread_mutex_unlock(&m_writeMutex);
+            return false;
+        }
+
+        // The request may have been deleted by destroy() already.
+        pthread_mutex_lock(&m_destroyingMutex);
+        bool destroying = m_destroying;
+        pthread_mutex_unlock(&m_destroyingMutex);
+
+        if (destroying) {
+            pthread_mutex_unlock(&m_writeMutex);
+            return false;
+        }
+
+        Frame& frame = request->getFrame();
+        int size = frame.getSize();
+
+        // The reply may be handled, and the request deleted, by the
+        // listening thread as soon as the frame is on the wire, so the
+        // request is not touched after the write unless it failed. Only
+        // the header is needed to count the frame.
+        char header[Frame::LENGTH_OFFSET + Frame::HEADER_SIZE];
+        memcpy(header, frame.getData(), sizeof(header));
+
+        request->setSent(true);
+
+        result = writeData(frame.getData(), size);
+
+        if (result) {
+            countFrameOut(header, size);
+        } else {
+            request->setSent(false);
+        }
+
+        if (!result && m_autoReconnect) {
+            m_reconnecting = true;
+            shutdown(m_connectionFDS, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&m_writeMutex);
+
+        if (!result && !m_autoReconnect) {
+            destroy(ChannelError("Could not write to the connection"));
+        }
+
+        return result;
+    }
+
+    void Connection::closeSocket() {
+        delete m_tls;
+        m_tls = NULL;
+
+        if (m_connectionFDS != -1) {
+            close(m_connectionFDS);
+            m_connectionFDS = -1;
+        }
+
+        m_connected = false;
+    }
+
+    int Connection::socketRead(char* buffer, int size) {
+        if (m_tls) {
+            return m_tls->read(buffer, size);
+        }
+
+        return read(m_connectionFDS, buffer, size);
+    }
+
+    int Connection::socketWrite(const struct iovec* parts, int count) {
+        if (m_tls) {
+            return m_tls->write(parts, count);
+        }
+
+#ifdef MSG_NOSIGNAL
+        struct msghdr message;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = (struct iovec*)parts;
+        message.msg_iovlen = count;
+
+        return sendmsg(m_connectionFDS, &message, MSG_NOSIGNAL);
+#else
+        return writev(m_connectionFDS, parts, count);
+#endif
+    }
+
+    bool Connection::writeData(const char* data, int size) {
+        struct iovec part;
+
+        part.iov_base = (char*)data;
+        part.iov_len = size;
+
+        return writeData(&part, 1);
+    }
+
+    bool Connection::writeData(const struct iovec* parts, int count) {
+        struct iovec remaining[MAX_WRITE_PARTS];
+        struct iovec* next = remaining;
+        int n;
+
+        if (count > MAX_WRITE_PARTS) {
+#ifdef HYDNADEBUG
+            debugPrint("Connection", 0, "Too many parts to write");
+#endif
+            return false;
+        }
+
+        memcpy(remaining, parts, count * sizeof(struct iovec));
+
+        while (count > 0) {
+            n = socketWrite(next, count);
+
             if (n <= 0) {
-                destroy(ChannelError("Could not write to the connection"));
                 return false;
             }
-            return true;
+
+            // Skip the parts that was written and advance into the
+            // first one that was not.
+            while (count > 0 && (size_t)n >= next->iov_len) {
+                n -= next->iov_len;
+                ++next;
+                --count;
+            }
+
+            if (count > 0) {
+                next->iov_base = (char*)next->iov_base + n;
+                next->iov_len -= n;
+            }
         }
-        return false;
+
+        return true;
+    }
+
+    Histogram Connection::getRoundTripTimes() {
+        return m_roundTripTimes;
+    }
+
+    void Connection::countFrameOut(const char* data, int size) {
+        int op = (data[Frame::LENGTH_OFFSET + 4] >> Frame::OP_BITPOS) & Frame::OP_BITMASK;
+
+        if (op < ConnectionStats::OP_COUNT) {
+            m_framesOut[op].add();
+            m_bytesOut[op].add(size);
+        }
+
+        HYDNA_TRACE(Trace::FRAME_OUT, ntohl(*(unsigned int*)&data[Frame::LENGTH_OFFSET]), op, size);
+    }
+
+    MemoryAccount& Connection::getMemory() {
+        return m_memory;
+    }
+
+    RateLimiter& Connection::getRateLimiter() {
+        return m_rateLimiter;
+    }
+
+    ConnectionStats Connection::getStats() {
+        ConnectionStats stats;
+
+        for (int i = 0; i < ConnectionStats::OP_COUNT; i++) {
+            stats.framesIn[i] = m_framesIn[i].get();
+            stats.bytesIn[i] = m_bytesIn[i].get();
+            stats.framesOut[i] = m_framesOut[i].get();
+            stats.bytesOut[i] = m_bytesOut[i].get();
+        }
+
+        ReconnectStats reconnectStats = getReconnectStats();
+
+        stats.drops = reconnectStats.droppedFrames;
+        stats.reconnects = reconnectStats.reconnects;
+        stats.reconnectAttempts = reconnectStats.attempts;
+
+        // Queue depths are only refreshed when the lock is free, so that
+        // a stats reader never holds up the listening thread.
+        if (pthread_mutex_trylock(&m_openChannelsMutex) == 0) {
+            m_openChannelsGauge = m_openChannels.size();
+            pthread_mutex_unlock(&m_openChannelsMutex);
+        }
+
+        if (pthread_mutex_trylock(&m_resolveMutex) == 0) {
+            m_pendingResolvesGauge = m_pendingResolveRequests.size();
+            pthread_mutex_unlock(&m_resolveMutex);
+        }
+
+        if (pthread_mutex_trylock(&m_pendingMutex) == 0) {
+            m_pendingOpensGauge = m_pendingOpenRequests.size();
+            pthread_mutex_unlock(&m_pendingMutex);
+        }
+
+        if (pthread_mutex_trylock(&m_writeMutex) == 0) {
+            m_reconnectQueueGauge = m_reconnectQueue.size();
+            pthread_mutex_unlock(&m_writeMutex);
+        }
+
+        stats.openChannels = m_openChannelsGauge;
+        stats.pendingResolves = m_pendingResolvesGauge;
+        stats.pendingOpens = m_pendingOpensGauge;
+        stats.reconnectQueue = m_reconnectQueueGauge;
+
+        stats.tls = m_secure;
+        stats.kernelTlsSend = (m_kernelTlsGauge & TlsSession::KERNEL_SEND) != 0;
+        stats.kernelTlsReceive = (m_kernelTlsGauge & TlsSession::KERNEL_RECEIVE) != 0;
+        stats.ioThreadCpu = m_ioThreadCpu;
+        stats.ioThreadConfig = m_ioThreadConfig;
+        stats.memory = m_memory.getStats();
+        stats.rate = m_rateLimiter.getStats();
+
+        stats.resolveLatency = m_resolveLatency;
+        stats.openLatency = m_openLatency;
+        stats.writeLatency = m_writeLatency;
+        stats.roundTripTimes = m_roundTripTimes;
+
+        return stats;
+    }
+
+    ReconnectStats Connection::getReconnectStats() {
+        pthread_mutex_lock(&m_writeMutex);
+        ReconnectStats result = m_reconnectStats;
+        pthread_mutex_unlock(&m_writeMutex);
+        return result;
     }
 
-    ConnectionMap Connection::m_availableConnections = ConnectionMap();
-    pthread_mutex_t Connection::m_connectionMutex;
+    Connection* Connection::m_availableConnections[CONNECTION_BUCKETS];
+    pthread_mutex_t Connection::m_connectionMutex = PTHREAD_MUTEX_INITIALIZER;
     bool Connection::m_followRedirects = true;
+    bool Connection::m_autoReconnect = false;
+    unsigned int Connection::m_reconnectInitialDelay = 100;
+    unsigned int Connection::m_reconnectMaxDelay = 30000;
+    unsigned int Connection::m_reconnectMaxAttempts = 0;
+    unsigned int Connection::m_reconnectQueueLimit = 1024;
+    unsigned int Connection::m_keepaliveInterval = 0;
+    unsigned int Connection::m_idleTimeout = 0;
+    bool Connection::m_tlsVerify = true;
+    string Connection::m_tlsCaFile = "";
+    bool Connection::m_kernelTls = true;
+    vector<unsigned int> Connection::m_ioCpus;
+    int Connection::m_ioNumaNode = -1;
+    int Connection::m_ioPriority = 0;
+    pthread_mutex_t Connection::m_ioSettingsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+    int Connection::m_memoryPolicy = MemoryAccount::BACKPRESSURE;
+    unsigned long long Connection::m_connectionMemoryBudget = 0;
+
+    unsigned long long Connection::m_connectionMessageRate = 0;
+    unsigned long long Connection::m_connectionByteRate = 0;
+    unsigned int Connection::m_connectionRateBurst = RateLimiter::DEFAULT_BURST;
 }
 
@@ -0,0 +1,173 @@
+#include <time.h>
+
+#include "deadlinetimer.h"
+#include "channel.h"
+#include "clock.h"
+#include "iothread.h"
+
+namespace hydna {
+    using namespace std;
+
+    DeadlineTimer* DeadlineTimer::m_shared = NULL;
+    pthread_once_t DeadlineTimer::m_sharedOnce = PTHREAD_ONCE_INIT;
+
+    DeadlineTimer::DeadlineTimer() : m_firing(NULL), m_started(false) {
+        pthread_condattr_t attr;
+
+        // Deadlines are in Clock::now() time, which is monotonic.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_changed, &attr);
+        pthread_cond_init(&m_fired, NULL);
+
+        pthread_condattr_destroy(&attr);
+    }
+
+    DeadlineTimer& DeadlineTimer::getShared() {
+        pthread_once(&m_sharedOnce, createShared);
+        return *m_shared;
+    }
+
+    void DeadlineTimer::createShared() {
+        m_shared = new DeadlineTimer();
+    }
+
+    bool DeadlineTimer::add(Channel* channel, int kind, unsigned long long deadline) {
+        Wakeup wakeup;
+
+        wakeup.channel = channel;
+        wakeup.kind = kind;
+
+        pthread_mutex_lock(&m_mutex);
+
+        if (!m_started) {
+            if (pthread_create(&m_thread, NULL, run, this) != 0) {
+                pthread_mutex_unlock(&m_mutex);
+                return false;
+            }
+
+            pthread_detach(m_thread);
+            m_started = true;
+        }
+
+        DeadlineMap::iterator it = m_deadlines.insert(make_pair(deadline, wakeup));
+
+        if (it == m_deadlines.begin()) {
+            // The timer thread sleeps until the earliest deadline.
+            pthread_cond_signal(&m_changed);
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+        return true;
+    }
+
+    void DeadlineTimer::remove(Channel* channel, int kind, unsigned long long deadline) {
+        pthread_mutex_lock(&m_mutex);
+
+        pair<DeadlineMap::iterator, DeadlineMap::iterator> range = m_deadlines.equal_range(deadline);
+
+        for (DeadlineMap::iterator it = range.first; it != range.second; ++it) {
+            if (it->second.channel == channel && it->second.kind == kind) {
+                m_deadlines.erase(it);
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void DeadlineTimer::removeChannel(Channel* channel) {
+        pthread_mutex_lock(&m_mutex);
+
+        // A channel has at most a few deadlines, but they are not kept by
+        // channel, so all are looked at. Again once the channel is done,
+        // since it may have added one meanwhile.
+        for (;;) {
+            for (DeadlineMap::iterator it = m_deadlines.begin(); it != m_deadlines.end();) {
+                if (it->second.channel == channel) {
+                    m_deadlines.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+
+            if (m_firing != channel || pthread_equal(m_thread, pthread_self())) {
+                break;
+            }
+
+            while (m_firing == channel) {
+                pthread_cond_wait(&m_fired, &m_mutex);
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    bool DeadlineTimer::isTimerThread() {
+        pthread_mutex_lock(&m_mutex);
+        bool timer = m_started && pthread_equal(m_thread, pthread_self());
+        pthread_mutex_unlock(&m_mutex);
+
+        return timer;
+    }
+
+    void* DeadlineTimer::run(void* ptr) {
+        IoThread::setName("hydna-timer");
+        static_cast<DeadlineTimer*>(ptr)->runTimer();
+        return NULL;
+    }
+
+    void DeadlineTimer::runTimer() {
+        pthread_mutex_lock(&m_mutex);
+
+        for (;;) {
+            if (m_deadlines.empty()) {
+                pthread_cond_wait(&m_changed, &m_mutex);
+                continue;
+            }
+
+            DeadlineMap::iterator first = m_deadlines.begin();
+            unsigned long long deadline = first->first;
+
+            if (deadline <= Clock::now()) {
+                Wakeup wakeup = first->second;
+
+                m_deadlines.erase(first);
+                m_firing = wakeup.channel;
+                pthread_mutex_unlock(&m_mutex);
+
+                fire(wakeup, deadline);
+
+                pthread_mutex_lock(&m_mutex);
+                m_firing = NULL;
+                pthread_cond_broadcast(&m_fired);
+                continue;
+            }
+
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000ULL;
+            ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+
+            pthread_cond_timedwait(&m_changed, &m_mutex, &ts);
+        }
+    }
+
+    void DeadlineTimer::fire(Wakeup const &wakeup, unsigned long long deadline) {
+        switch (wakeup.kind) {
+
+            case OPEN:
+                wakeup.channel->openTimedOut();
+                break;
+
+            case PACED:
+                wakeup.channel->sendPaced();
+                break;
+
+            case BATCH:
+                wakeup.channel->batchTimedOut(deadline);
+                break;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#include "endpoint.h"
+
+namespace hydna {
+    using namespace std;
+
+    // 32 bit FNV-1a.
+    static const unsigned int FNV_OFFSET = 2166136261U;
+    static const unsigned int FNV_PRIME = 16777619U;
+
+    static unsigned int mix(unsigned int hash, const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ (unsigned char)data[i]) * FNV_PRIME;
+        }
+
+        return hash;
+    }
+
+    Endpoint::Endpoint(string const &host, unsigned short port, string const &auth, bool secure) :
+                       m_host(host),
+                       m_port(port),
+                       m_auth(auth),
+                       m_secure(secure) {
+        m_hash = hash(host.data(), host.size(), port, auth.data(), auth.size(), secure);
+    }
+
+    unsigned int Endpoint::hash(URL const &url) {
+        URLPart host = url.getHost();
+        URLPart auth = url.getAuth();
+
+        return hash(host.getData(), host.getSize(), url.getPort(),
+                    auth.getData(), auth.getSize(), url.isSecure());
+    }
+
+    unsigned int Endpoint::hash(const char* host,
+                                size_t hostSize,
+                                unsigned short port,
+                                const char* auth,
+                                size_t authSize,
+                                bool secure) {
+        // The separator keeps e.g. host "ab" and auth "c" apart from host
+        // "a" and auth "bc".
+        char rest[4] = { '\0', (char)(port >> 8), (char)(port & 0xff), secure ? '\1' : '\0' };
+        unsigned int result = FNV_OFFSET;
+
+        result = mix(result, host, hostSize);
+        result = mix(result, rest, sizeof(rest));
+        result = mix(result, auth, authSize);
+
+        return result;
+    }
+
+    bool Endpoint::matches(URL const &url, unsigned int hash) const {
+        return hash == m_hash &&
+               url.getPort() == m_port &&
+               url.isSecure() == m_secure &&
+               url.getHost().equals(m_host) &&
+               url.getAuth().equals(m_auth);
+    }
+
+    string const &Endpoint::getHost() const {
+        return m_host;
+    }
+
+    unsigned short Endpoint::getPort() const {
+        return m_port;
+    }
+
+    string const &Endpoint::getAuth() const {
+        return m_auth;
+    }
+
+    bool Endpoint::isSecure() const {
+        return m_secure;
+    }
+
+    unsigned int Endpoint::getHash() const {
+        return m_hash;
+    }
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <netinet/in.h>
+
+#include "envelope.h"
+
+namespace hydna {
+    using namespace std;
+
+    void Envelope::writeHeader(char* header, unsigned char kind) {
+        header[0] = MAGIC;
+        header[1] = kind;
+    }
+
+    bool Envelope::isEnvelope(const char* payload, unsigned int size) {
+        return size >= HEADER_SIZE &&
+               (unsigned char)payload[0] == MAGIC &&
+               (unsigned char)payload[1] <= COMPRESSED;
+    }
+
+    void Envelope::writeFragmentHeader(char* header,
+                                       unsigned int id,
+                                       unsigned int total,
+                                       unsigned int offset)
+    {
+        unsigned int values[3];
+
+        values[0] = htonl(id);
+        values[1] = htonl(total);
+        values[2] = htonl(offset);
+
+        writeHeader(header, FRAGMENT);
+        memcpy(header + HEADER_SIZE, values, sizeof(values));
+    }
+
+    bool Envelope::readFragmentHeader(const char* payload,
+                                      unsigned int size,
+                                      unsigned int& id,
+                                      unsigned int& total,
+                                      unsigned int& offset)
+    {
+        unsigned int values[3];
+
+        if (size < FRAGMENT_HEADER_SIZE) {
+            return false;
+        }
+
+        memcpy(values, payload + HEADER_SIZE, sizeof(values));
+
+        id = ntohl(values[0]);
+        total = ntohl(values[1]);
+        offset = ntohl(values[2]);
+        return true;
+    }
+
+    void Envelope::writeCompressedHeader(char* header, CompressedHeader const &compressed)
+    {
+        unsigned int dictionaryId = htonl(compressed.dictionaryId);
+        unsigned short size = htons(compressed.size);
+
+        writeHeader(header, COMPRESSED);
+        header[HEADER_SIZE] = compressed.codec;
+        header[HEADER_SIZE + 1] = compressed.kind;
+        memcpy(header + HEADER_SIZE + 2, &dictionaryId, sizeof(dictionaryId));
+        memcpy(header + HEADER_SIZE + 6, &size, sizeof(size));
+    }
+
+    bool Envelope::readCompressedHeader(const char* payload,
+                                        unsigned int size,
+                                        CompressedHeader& compressed)
+    {
+        unsigned int dictionaryId;
+        unsigned short decompressedSize;
+
+        if (size < COMPRESSED_HEADER_SIZE) {
+            return false;
+        }
+
+        memcpy(&dictionaryId, payload + HEADER_SIZE + 2, sizeof(dictionaryId));
+        memcpy(&decompressedSize, payload + HEADER_SIZE + 6, sizeof(decompressedSize));
+
+        compressed.codec = payload[HEADER_SIZE];
+        compressed.kind = payload[HEADER_SIZE + 1];
+        compressed.dictionaryId = ntohl(dictionaryId);
+        compressed.size = ntohs(decompressedSize);
+        return true;
+    }
+
+    Reassembler::Reassembler() : m_memory(NULL), m_bytes(0),
+                                 m_maxMessageSize(DEFAULT_MAX_MESSAGE_SIZE), m_dropped(0),
+                                 m_started(0)
+    {
+    }
+
+    Reassembler::~Reassembler() {
+        clear();
+    }
+
+    void Reassembler::setMaxMessageSize(unsigned int value) {
+        m_maxMessageSize = value;
+    }
+
+    unsigned int Reassembler::getMaxMessageSize() const {
+        return m_maxMessageSize;
+    }
+
+    void Reassembler::setMemory(MemoryAccount* memory) {
+        if (m_memory) {
+            m_memory->release(MemoryAccount::REASSEMBLY, m_bytes);
+        }
+
+        m_memory = memory;
+
+        if (m_memory) {
+            m_memory->charge(MemoryAccount::REASSEMBLY, m_bytes);
+        }
+    }
+
+    Buffer* Reassembler::add(const char* payload, unsigned int size) {
+        unsigned int id;
+        unsigned int total;
+        unsigned int offset;
+
+        if (!Envelope::readFragmentHeader(payload, size, id, total, offset)) {
+            m_dropped++;
+            return NULL;
+        }
+
+        const char* data = payload + Envelope::FRAGMENT_HEADER_SIZE;
+        unsigned int length = size - Envelope::FRAGMENT_HEADER_SIZE;
+        PendingMap::iterator it = m_pending.find(id);
+
+        if (it == m_pending.end()) {
+            if (offset != 0 || total > m_maxMessageSize) {
+                m_dropped++;
+                return NULL;
+            }
+
+            if (m_pending.size() >= MAX_PENDING) {
+                // Most likely a message that will never be completed, e.g.
+                // because the sender was disconnected.
+                PendingMap::iterator oldest = m_pending.begin();
+
+                for (it = m_pending.begin(); it != m_pending.end(); ++it) {
+                    if (it->second.started < oldest->second.started) {
+                        oldest = it;
+                    }
+                }
+
+                drop(oldest);
+                m_dropped++;
+            }
+
+            Pending pending;
+            pending.buffer = BufferPool::getShared().acquire(total);
+            pending.total = total;
+            pending.started = m_started++;
+
+            m_bytes += total;
+
+            if (m_memory) {
+                m_memory->charge(MemoryAccount::REASSEMBLY, total);
+            }
+
+            it = m_pending.insert(make_pair(id, pending)).first;
+        }
+
+        Pending& pending = it->second;
+
+        if (offset != pending.buffer->getSize() || length > pending.total - offset) {
+            drop(it);
+            m_dropped++;
+            return NULL;
+        }
+
+        memcpy(pending.buffer->getData() + offset, data, length);
+        pending.buffer->setSize(offset + length);
+
+        if (offset + length < pending.total) {
+            return NULL;
+        }
+
+        // Charged as data from here on, see Channel::addData().
+        Buffer* result = pending.buffer;
+        pending.buffer = NULL;
+        drop(it);
+        return result;
+    }
+
+    void Reassembler::drop(PendingMap::iterator it) {
+        if (it->second.buffer) {
+            it->second.buffer->release();
+        }
+
+        m_bytes -= it->second.total;
+
+        if (m_memory) {
+            m_memory->release(MemoryAccount::REASSEMBLY, it->second.total);
+        }
+
+        m_pending.erase(it);
+    }
+
+    unsigned long long Reassembler::getDropped() const {
+        return m_dropped;
+    }
+
+    void Reassembler::clear() {
+        while (!m_pending.empty()) {
+            drop(m_pending.begin());
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <string.h>
 #include <netinet/in.h>
 
 #include "frame.h"
@@ -20,7 +21,7 @@ namespace hydna {
         }
 
         if (length > PAYLOAD_MAX_LIMIT) {
-            throw new RangeError("Payload max limit reached.");
+            throw RangeError("Payload max limit reached.");
         }
 
         bytes.reserve((length + HEADER_SIZE + LENGTH_OFFSET));
@@ -34,14 +35,76 @@ namespace hydna {
         }
     }
 
+    Frame::Frame(unsigned int ch,
+                        unsigned int ctype,
+                        unsigned int op,
+                        unsigned int flag,
+                        const char* prefix,
+                        unsigned int prefixLength,
+                        const char* payload,
+                        unsigned int offset,
+                        unsigned int length)
+    {
+        if (!payload) {
+            length = 0;
+        }
+
+        if (prefixLength > PAYLOAD_MAX_LIMIT || length > PAYLOAD_MAX_LIMIT - prefixLength) {
+            throw RangeError("Payload max limit reached.");
+        }
+
+        bytes.reserve((prefixLength + length + HEADER_SIZE + LENGTH_OFFSET));
+        writeShort(prefixLength + length + HEADER_SIZE);
+        writeUnsignedInt(ch);
+
+        writeByte(((ctype << Frame::CTYPE_BITPOS) | (op << Frame::OP_BITPOS) | (flag & 7)));
+
+        writeBytes(prefix, 0, prefixLength);
+
+        if (payload) {
+            writeBytes(payload, offset, length);
+        }
+    }
+
+    Frame::Frame(const struct iovec* parts, int count) {
+        unsigned int size = 0;
+
+        for (int i = 0; i < count; i++) {
+            size += parts[i].iov_len;
+        }
+
+        bytes.reserve(size);
+
+        for (int i = 0; i < count; i++) {
+            writeBytes((const char*)parts[i].iov_base, 0, parts[i].iov_len);
+        }
+    }
+
+    void Frame::writeHeader(char* header,
+                            unsigned int ch,
+                            unsigned int ctype,
+                            unsigned int op,
+                            unsigned int flag,
+                            unsigned int length)
+    {
+        if (length > PAYLOAD_MAX_LIMIT) {
+            throw RangeError("Payload max limit reached.");
+        }
+
+        unsigned short size = htons(length + HEADER_SIZE);
+        unsigned int nch = htonl(ch);
+
+        memcpy(header, &size, sizeof(size));
+        memcpy(header + LENGTH_OFFSET, &nch, sizeof(nch));
+        header[LENGTH_OFFSET + 4] = (ctype << Frame::CTYPE_BITPOS) | (op << Frame::OP_BITPOS) | (flag & 7);
+    }
+
     void Frame::writeByte(char value) {
         bytes.push_back(value);
     }
 
     void Frame::writeBytes(const char* value, int offset, int length) {
-        for(int i = offset; i < offset + length; i++) {
-            bytes.push_back(value[i]);
-        }
+        bytes.insert(bytes.end(), value + offset, value + offset + length);
     }
     
     void Frame::writeShort(short value) {
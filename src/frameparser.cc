@@ -0,0 +1,126 @@
+#include <iostream>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "frameparser.h"
+
+namespace hydna {
+    using namespace std;
+
+    FrameParser::FrameParser() : m_data(NULL), m_size(0), m_buffered(0), m_corrupt(false)
+    {
+    }
+
+    void FrameParser::feed(const char* data, unsigned int size) {
+        m_data = data;
+        m_size = size;
+    }
+
+    bool FrameParser::next(FrameView& frame) {
+        unsigned int size;
+
+        if (m_corrupt) {
+            return false;
+        }
+
+        if (m_buffered > 0) {
+            if (!buffer(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET)) {
+                return false;
+            }
+
+            if ((size = frameSize(m_buffer)) == 0) {
+                m_corrupt = true;
+                return false;
+            }
+
+            if (!buffer(size)) {
+                return false;
+            }
+
+            decode(m_buffer, frame);
+            m_buffered = 0;
+            return true;
+        }
+
+        if (m_size < (unsigned int)(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET)) {
+            buffer(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET);
+            return false;
+        }
+
+        if ((size = frameSize(m_data)) == 0) {
+            m_corrupt = true;
+            return false;
+        }
+
+        if (m_size < size) {
+            buffer(size);
+            return false;
+        }
+
+        decode(m_data, frame);
+        m_data += size;
+        m_size -= size;
+        return true;
+    }
+
+    bool FrameParser::isCorrupt() const {
+        return m_corrupt;
+    }
+
+    unsigned int FrameParser::getBuffered() const {
+        return m_buffered;
+    }
+
+    void FrameParser::reset() {
+        m_data = NULL;
+        m_size = 0;
+        m_buffered = 0;
+        m_corrupt = false;
+    }
+
+    unsigned int FrameParser::frameSize(const char* header) {
+        unsigned short length;
+
+        memcpy(&length, header, sizeof(length));
+        length = ntohs(length);
+
+        if (length < Frame::HEADER_SIZE) {
+            return 0;
+        }
+
+        return length + Frame::LENGTH_OFFSET;
+    }
+
+    void FrameParser::decode(const char* data, FrameView& frame) {
+        unsigned int ch;
+        unsigned char desc = data[6];
+
+        memcpy(&ch, data + 2, sizeof(ch));
+
+        frame.ch = ntohl(ch);
+        frame.ctype = desc >> Frame::CTYPE_BITPOS;
+        frame.op = (desc >> Frame::OP_BITPOS) & Frame::OP_BITMASK;
+        frame.flag = desc & Frame::FLAG_BITMASK;
+        frame.payload = data + Frame::HEADER_SIZE + Frame::LENGTH_OFFSET;
+        frame.size = frameSize(data) - (Frame::HEADER_SIZE + Frame::LENGTH_OFFSET);
+    }
+
+    bool FrameParser::buffer(unsigned int size) {
+        if (m_buffered < size) {
+            unsigned int n = size - m_buffered;
+
+            if (n > m_size) {
+                n = m_size;
+            }
+
+            if (n > 0) {
+                memcpy(m_buffer + m_buffered, m_data, n);
+                m_buffered += n;
+                m_data += n;
+                m_size -= n;
+            }
+        }
+
+        return m_buffered >= size;
+    }
+}
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "histogram.h"
+
+namespace hydna {
+
+    Histogram::Histogram() {
+        reset();
+    }
+
+    void Histogram::record(unsigned long long value) {
+        unsigned long long current;
+
+        __sync_fetch_and_add(&m_counts[indexOf(value)], 1);
+        __sync_fetch_and_add(&m_count, 1);
+        __sync_fetch_and_add(&m_total, value);
+
+        current = m_min;
+        while (value < current) {
+            current = __sync_val_compare_and_swap(&m_min, current, value);
+        }
+
+        current = m_max;
+        while (value > current) {
+            current = __sync_val_compare_and_swap(&m_max, current, value);
+        }
+    }
+
+    void Histogram::reset() {
+        memset(m_counts, 0, sizeof(m_counts));
+        m_count = 0;
+        m_total = 0;
+        m_min = ~0ULL;
+        m_max = 0;
+    }
+
+    void Histogram::add(Histogram const &other) {
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            m_counts[i] += other.m_counts[i];
+        }
+
+        m_count += other.m_count;
+        m_total += other.m_total;
+
+        if (other.m_min < m_min) {
+            m_min = other.m_min;
+        }
+
+        if (other.m_max > m_max) {
+            m_max = other.m_max;
+        }
+    }
+
+    unsigned long long Histogram::getCount() const {
+        return m_count;
+    }
+
+    unsigned long long Histogram::getMin() const {
+        return m_count ? m_min : 0;
+    }
+
+    unsigned long long Histogram::getMax() const {
+        return m_max;
+    }
+
+    double Histogram::getMean() const {
+        return m_count ? (double)m_total / m_count : 0;
+    }
+
+    unsigned long long Histogram::getPercentile(double percentile) const {
+        unsigned long long target;
+        unsigned long long seen = 0;
+
+        if (m_count == 0) {
+            return 0;
+        }
+
+        target = (unsigned long long)(percentile / 100.0 * m_count + 0.5);
+
+        if (target == 0) {
+            target = 1;
+        }
+
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += m_counts[i];
+
+            if (seen >= target) {
+                unsigned long long value = valueAt(i);
+                return value > m_max ? m_max : value;
+            }
+        }
+
+        return m_max;
+    }
+
+    int Histogram::indexOf(unsigned long long value) {
+        int msb = 63 - __builtin_clzll(value | 1);
+        int shift;
+        int index;
+
+        if (msb <= SUB_BUCKET_BITS) {
+            return (int)value;
+        }
+
+        shift = msb - SUB_BUCKET_BITS;
+        index = (shift + 1) * SUB_BUCKET_COUNT + (int)(value >> shift) - SUB_BUCKET_COUNT;
+
+        return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+    }
+
+    unsigned long long Histogram::valueAt(int index) {
+        int shift;
+
+        if (index < 2 * SUB_BUCKET_COUNT) {
+            return index;
+        }
+
+        // Report the highest value that maps to the bucket.
+        shift = index / SUB_BUCKET_COUNT - 1;
+
+        return ((unsigned long long)(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT + 1) << shift) - 1;
+    }
+}
@@ -0,0 +1,158 @@
+#include <fstream>
+#include <sstream>
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "iothread.h"
+#include "rangeerror.h"
+
+namespace hydna {
+    using namespace std;
+
+    static bool parseCpu(string const &text, unsigned int& cpu) {
+        char* end;
+
+        if (text.empty() || text.find_first_not_of("0123456789") != string::npos) {
+            return false;
+        }
+
+        cpu = strtoul(text.c_str(), &end, 10);
+        return true;
+    }
+
+    vector<unsigned int> IoThread::parseCpuList(string const &list) {
+        vector<unsigned int> cpus;
+        istringstream in(list);
+        string range;
+
+        while (getline(in, range, ',')) {
+            size_t begin = range.find_first_not_of(" \t\n");
+            size_t end = range.find_last_not_of(" \t\n");
+            size_t dash;
+            unsigned int first;
+            unsigned int last;
+
+            if (begin == string::npos) {
+                continue;
+            }
+
+            range = range.substr(begin, end - begin + 1);
+            dash = range.find('-');
+
+            if (dash == string::npos) {
+                if (!parseCpu(range, first)) {
+                    throw RangeError("Malformed CPU list, " + list);
+                }
+
+                last = first;
+            } else if (!parseCpu(range.substr(0, dash), first) ||
+                       !parseCpu(range.substr(dash + 1), last) ||
+                       last < first) {
+                throw RangeError("Malformed CPU list, " + list);
+            }
+
+#ifdef __linux__
+            if (last >= CPU_SETSIZE) {
+                throw RangeError("CPU out of range in list, " + list);
+            }
+#endif
+
+            for (unsigned int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+
+        return cpus;
+    }
+
+    vector<unsigned int> IoThread::getNodeCpus(int node) {
+        ostringstream path;
+        string list;
+
+        path << "/sys/devices/system/node/node" << node << "/cpulist";
+
+        ifstream in(path.str().c_str());
+
+        if (node < 0 || !getline(in, list)) {
+            return vector<unsigned int>();
+        }
+
+        try {
+            return parseCpuList(list);
+        } catch (RangeError&) {
+            return vector<unsigned int>();
+        }
+    }
+
+    void IoThread::setName(string const &name) {
+        string shortName = name.substr(0, 15);
+
+#if defined(__APPLE__)
+        pthread_setname_np(shortName.c_str());
+#elif defined(__linux__)
+        pthread_setname_np(pthread_self(), shortName.c_str());
+#endif
+    }
+
+    unsigned int IoThread::configure(vector<unsigned int> const &cpus,
+                                     int node,
+                                     int priority) {
+        unsigned int applied = 0;
+
+#ifdef __linux__
+        vector<unsigned int> placement = cpus;
+
+        if (node >= 0) {
+            // One bit per node, the kernel reads maxnode - 1 bits.
+            unsigned long mask[16] = { 0 };
+            unsigned long bits = sizeof(unsigned long) * 8;
+
+            if ((unsigned long)node < sizeof(mask) * 8) {
+                mask[node / bits] |= 1UL << (node % bits);
+
+                if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1) == 0) {
+                    applied |= NUMA_BOUND;
+                }
+            }
+
+            if (placement.empty()) {
+                placement = getNodeCpus(node);
+            }
+        }
+
+        if (!placement.empty()) {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+
+            for (unsigned int i = 0; i < placement.size(); i++) {
+                CPU_SET(placement[i], &set);
+            }
+
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+                applied |= PINNED;
+            }
+        }
+#endif
+
+        if (priority > 0) {
+            struct sched_param param;
+
+            param.sched_priority = priority;
+
+            if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+                applied |= REALTIME;
+            }
+        }
+
+        return applied;
+    }
+}
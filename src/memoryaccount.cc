@@ -0,0 +1,147 @@
+#include <string.h>
+#include <time.h>
+
+#include "memoryaccount.h"
+#include "clock.h"
+
+namespace hydna {
+
+    MemoryAccount* MemoryAccount::m_global = NULL;
+    pthread_once_t MemoryAccount::m_globalOnce = PTHREAD_ONCE_INIT;
+    pthread_mutex_t MemoryAccount::m_releaseMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t MemoryAccount::m_releaseCond;
+    volatile int MemoryAccount::m_waiters = 0;
+
+    MemoryAccount::MemoryAccount(MemoryAccount* parent) : m_parent(parent),
+                                                          m_budget(0),
+                                                          m_pauses(0),
+                                                          m_shed(0) {
+        memset((void*)m_bytes, 0, sizeof(m_bytes));
+    }
+
+    void MemoryAccount::createGlobal() {
+        pthread_condattr_t attr;
+
+        // Timeouts are in Clock::now() time, which is monotonic.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m_releaseCond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        m_global = new MemoryAccount();
+    }
+
+    MemoryAccount& MemoryAccount::getGlobal() {
+        pthread_once(&m_globalOnce, createGlobal);
+        return *m_global;
+    }
+
+    void MemoryAccount::charge(int category, unsigned long long bytes) {
+        for (MemoryAccount* account = this; account; account = account->m_parent) {
+            __sync_fetch_and_add(&account->m_bytes[category], (long long)bytes);
+        }
+    }
+
+    void MemoryAccount::release(int category, unsigned long long bytes) {
+        for (MemoryAccount* account = this; account; account = account->m_parent) {
+            __sync_fetch_and_sub(&account->m_bytes[category], (long long)bytes);
+        }
+
+        // Only a reader paused over budget waits, see waitForRelease().
+        if (m_waiters) {
+            pthread_mutex_lock(&m_releaseMutex);
+            pthread_cond_broadcast(&m_releaseCond);
+            pthread_mutex_unlock(&m_releaseMutex);
+        }
+    }
+
+    void MemoryAccount::attach(int category, unsigned long long bytes) {
+        __sync_fetch_and_add(&m_bytes[category], (long long)bytes);
+    }
+
+    void MemoryAccount::detach(int category, unsigned long long bytes) {
+        __sync_fetch_and_sub(&m_bytes[category], (long long)bytes);
+    }
+
+    unsigned long long MemoryAccount::getTotal() const {
+        long long total = 0;
+
+        for (int i = 0; i < MemoryStats::CATEGORY_COUNT; i++) {
+            total += m_bytes[i];
+        }
+
+        // The categories are read one at a time, and may be off for a
+        // moment while a message moves between them.
+        return total > 0 ? total : 0;
+    }
+
+    unsigned long long MemoryAccount::getBytes(int category) const {
+        long long bytes = m_bytes[category];
+        return bytes > 0 ? bytes : 0;
+    }
+
+    void MemoryAccount::setBudget(unsigned long long budget) {
+        m_budget = budget;
+    }
+
+    unsigned long long MemoryAccount::getBudget() const {
+        return m_budget;
+    }
+
+    bool MemoryAccount::isOverBudget() const {
+        for (const MemoryAccount* account = this; account; account = account->m_parent) {
+            if (account->m_budget && account->getTotal() > account->m_budget) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void MemoryAccount::countPause() {
+        __sync_fetch_and_add(&m_pauses, 1);
+
+        if (m_parent) {
+            m_parent->countPause();
+        }
+    }
+
+    void MemoryAccount::countShed() {
+        __sync_fetch_and_add(&m_shed, 1);
+
+        if (m_parent) {
+            m_parent->countShed();
+        }
+    }
+
+    void MemoryAccount::waitForRelease(unsigned int timeout) {
+        unsigned long long deadline = Clock::now() + timeout * 1000ULL;
+        struct timespec ts;
+
+        getGlobal();
+
+        ts.tv_sec = deadline / 1000000ULL;
+        ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+
+        pthread_mutex_lock(&m_releaseMutex);
+        __sync_fetch_and_add(&m_waiters, 1);
+        pthread_cond_timedwait(&m_releaseCond, &m_releaseMutex, &ts);
+        __sync_fetch_and_sub(&m_waiters, 1);
+        pthread_mutex_unlock(&m_releaseMutex);
+    }
+
+    MemoryStats MemoryAccount::getStats() const {
+        MemoryStats stats;
+
+        for (int i = 0; i < MemoryStats::CATEGORY_COUNT; i++) {
+            stats.bytes[i] = m_bytes[i] > 0 ? m_bytes[i] : 0;
+        }
+
+        stats.total = getTotal();
+        stats.budget = m_budget;
+        stats.pauses = m_pauses;
+        stats.shed = m_shed;
+
+        return stats;
+    }
+}
@@ -1,5 +1,7 @@
 #include "frame.h"
 #include "channel.h"
+#include "clock.h"
+#include "memoryaccount.h"
 
 namespace hydna {
     
@@ -19,9 +21,16 @@ namespace hydna {
                             m_frame(frame){
         
         m_sent = false;
+        m_replay = false;
+        m_created = Clock::now();
+        m_prev = NULL;
+        m_next = NULL;
+        m_last = NULL;
+        m_memory = NULL;
     }
 
     OpenRequest::~OpenRequest() {
+        uncharge();
         delete m_frame;
     }
 
@@ -60,5 +69,85 @@ namespace hydna {
     void OpenRequest::setSent(bool value) {
         m_sent = value;
     }
-}
 
+    bool OpenRequest::isReplay() const {
+        return m_replay;
+    }
+
+    void OpenRequest::setReplay(bool value) {
+        m_replay = value;
+    }
+
+    unsigned long long OpenRequest::getCreated() const {
+        return m_created;
+    }
+
+    void OpenRequest::addWaiting(OpenRequest* request) {
+        request->m_prev = m_last ? m_last : this;
+        request->m_next = NULL;
+        request->m_prev->m_next = request;
+        m_last = request;
+    }
+
+    bool OpenRequest::isWaiting() const {
+        return m_prev != NULL;
+    }
+
+    void OpenRequest::unlinkWaiting(OpenRequest* pending) {
+        m_prev->m_next = m_next;
+
+        if (m_next) {
+            m_next->m_prev = m_prev;
+        } else {
+            pending->m_last = m_prev == pending ? NULL : m_prev;
+        }
+
+        m_prev = NULL;
+        m_next = NULL;
+    }
+
+    OpenRequest* OpenRequest::promoteWaiting() {
+        OpenRequest* next = m_next;
+
+        if (!next) {
+            return NULL;
+        }
+
+        next->m_prev = NULL;
+        next->m_last = m_last == next ? NULL : m_last;
+        m_next = NULL;
+        m_last = NULL;
+
+        return next;
+    }
+
+    void OpenRequest::takeWaiting(std::vector<OpenRequest*>& requests) {
+        OpenRequest* request = m_next;
+
+        while (request) {
+            OpenRequest* next = request->m_next;
+
+            request->m_prev = NULL;
+            request->m_next = NULL;
+            requests.push_back(request);
+            request = next;
+        }
+
+        m_next = NULL;
+        m_last = NULL;
+    }
+
+    void OpenRequest::charge(MemoryAccount* account) {
+        uncharge();
+
+        m_memory = account;
+        m_memory->charge(MemoryAccount::REQUESTS, sizeof(*this) + sizeof(Frame) + m_frame->getSize());
+    }
+
+    void OpenRequest::uncharge() {
+        if (m_memory) {
+            m_memory->release(MemoryAccount::REQUESTS, sizeof(*this) + sizeof(Frame) + m_frame->getSize());
+            m_memory = NULL;
+        }
+    }
+}
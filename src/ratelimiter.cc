@@ -0,0 +1,134 @@
+#include <algorithm>
+
+#include "ratelimiter.h"
+#include "clock.h"
+
+namespace hydna {
+    using namespace std;
+
+    RateLimiter::RateLimiter() : m_refilled(0),
+                                 m_tick(Clock::coarseResolution()),
+                                 m_limited(false),
+                                 m_throttled(0),
+                                 m_throttledTime(0),
+                                 m_rejected(0),
+                                 m_dropped(0)
+    {
+        m_messages.rate = m_messages.capacity = m_messages.tokens = 0;
+        m_bytes.rate = m_bytes.capacity = m_bytes.tokens = 0;
+
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    RateLimiter::~RateLimiter() {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    void RateLimiter::setLimit(unsigned long long messages,
+                               unsigned long long bytes,
+                               unsigned int burst)
+    {
+        Bucket* buckets[2] = { &m_messages, &m_bytes };
+        unsigned long long rates[2] = { messages, bytes };
+
+        pthread_mutex_lock(&m_mutex);
+
+        for (int i = 0; i < 2; i++) {
+            // The bucket must hold at least a couple of clock ticks worth
+            // of tokens, or the rate is capped by how often it is refilled.
+            buckets[i]->rate = rates[i];
+            buckets[i]->capacity = max(1.0, max(rates[i] * (burst / 1000.0),
+                                                rates[i] * (m_tick * 2 / 1000000.0)));
+            buckets[i]->tokens = buckets[i]->capacity;
+        }
+
+        m_refilled = Clock::coarse();
+        m_limited = messages > 0 || bytes > 0;
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    unsigned long long RateLimiter::take(unsigned int bytes) {
+        if (!m_limited) {
+            return 0;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+
+        // Refilled every time, a bucket that was only refilled once it ran
+        // dry would be given the tokens of the whole idle time on top of
+        // the ones it had, twice the burst.
+        unsigned long long now = Clock::coarse();
+
+        refill(m_messages, now - m_refilled);
+        refill(m_bytes, now - m_refilled);
+        m_refilled = now;
+
+        unsigned long long wait = max(waitFor(m_messages, 1), waitFor(m_bytes, bytes));
+
+        if (wait == 0) {
+            m_messages.tokens -= 1;
+            m_bytes.tokens -= bytes;
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+
+        // The refill is not seen until the clock ticks.
+        return wait > 0 ? max(wait, m_tick) : 0;
+    }
+
+    void RateLimiter::refund(unsigned int bytes) {
+        if (!m_limited) {
+            return;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        m_messages.tokens = min(m_messages.capacity, m_messages.tokens + 1);
+        m_bytes.tokens = min(m_bytes.capacity, m_bytes.tokens + bytes);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void RateLimiter::countThrottled(unsigned long long time) {
+        __sync_fetch_and_add(&m_throttled, 1);
+        __sync_fetch_and_add(&m_throttledTime, time);
+    }
+
+    void RateLimiter::countRejected() {
+        __sync_fetch_and_add(&m_rejected, 1);
+    }
+
+    void RateLimiter::countDropped(unsigned long long messages) {
+        __sync_fetch_and_add(&m_dropped, messages);
+    }
+
+    RateStats RateLimiter::getStats() const {
+        RateStats stats;
+
+        pthread_mutex_lock(&m_mutex);
+        stats.messageLimit = (unsigned long long)m_messages.rate;
+        stats.byteLimit = (unsigned long long)m_bytes.rate;
+        pthread_mutex_unlock(&m_mutex);
+
+        stats.throttled = m_throttled;
+        stats.throttledTime = m_throttledTime;
+        stats.rejected = m_rejected;
+        stats.dropped = m_dropped;
+
+        return stats;
+    }
+
+    unsigned long long RateLimiter::waitFor(Bucket const &bucket, double cost) {
+        // A message larger than the bucket waits for it to be full.
+        double needed = min(cost, bucket.capacity);
+
+        if (bucket.rate == 0 || bucket.tokens >= needed) {
+            return 0;
+        }
+
+        return (unsigned long long)((needed - bucket.tokens) * 1000000.0 / bucket.rate) + 1;
+    }
+
+    void RateLimiter::refill(Bucket& bucket, unsigned long long elapsed) {
+        bucket.tokens = min(bucket.capacity, bucket.tokens + elapsed * bucket.rate / 1000000.0);
+    }
+}
@@ -0,0 +1,981 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "relay.h"
+#include "channel.h"
+#include "clock.h"
+#include "iothread.h"
+#include "ioerror.h"
+#include "rangeerror.h"
+
+#ifdef HYDNADEBUG
+#include "debughelper.h"
+#endif
+
+namespace hydna {
+    using namespace std;
+
+    static const unsigned int RELAY_MAGIC = 0x68796472;
+    static const unsigned int RELAY_VERSION = 1;
+    static const unsigned int MIN_CAPACITY = 64 * 1024;
+    static const unsigned int MAX_CAPACITY = 1 << 30;
+
+    // How often waits look for exited processes, in milliseconds.
+    static const unsigned int WAIT_SLICE = 100;
+
+    // Fills the rest of the ring when a message does not fit before the
+    // end, messages are never split.
+    static const int PAD = 3;
+
+    /**
+     *  The header of a message in a ring. The content follows, and the
+     *  next message starts at the next multiple of 8.
+     */
+    struct RelayRecord {
+        unsigned int size;
+        unsigned short channel;
+        unsigned char type;
+        unsigned char ctype;
+        int flag;
+        unsigned int reserved;
+    };
+
+    static const unsigned int RECORD_HEADER = sizeof(RelayRecord);
+
+    struct RelayConsumer {
+        volatile int pid;
+        volatile int dropped;
+
+        // Where the consumer reads, everything before it may be written.
+        volatile unsigned long long cursor;
+    };
+
+    struct RelayPath {
+        char path[Relay::MAX_PATH];
+        volatile int active;
+    };
+
+    /**
+     *  The start of the shared memory, followed by the ring of received
+     *  messages and the ring of messages written by clients. Positions
+     *  only grow, the offset in a ring is the position modulo its
+     *  capacity.
+     */
+    struct RelayShared {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int size;
+        unsigned int capacity;
+        unsigned int upCapacity;
+        volatile int pid;
+        volatile int closed;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t dataCond;
+        pthread_cond_t spaceCond;
+        pthread_cond_t upCond;
+        pthread_cond_t upSpaceCond;
+        volatile int dataWaiters;
+        volatile int spaceWaiters;
+
+        volatile unsigned long long head;
+        volatile unsigned long long upHead;
+        volatile unsigned long long upTail;
+
+        RelayConsumer consumers[Relay::MAX_CONSUMERS];
+        RelayPath channels[Relay::MAX_CHANNELS];
+    };
+
+    static size_t headerSize() {
+        return (sizeof(RelayShared) + 63) & ~(size_t)63;
+    }
+
+    static string sharedName(string const &name) {
+        return "/hydna-relay-" + name;
+    }
+
+    static unsigned long long recordSpace(unsigned int size) {
+        return (RECORD_HEADER + (unsigned long long)size + 7) & ~7ULL;
+    }
+
+    static bool isRunning(int pid) {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+    /**
+     *  Checks if the shared memory of a relay was left behind by one that
+     *  exited without cleaning up, or is not that of a relay at all.
+     */
+    static bool isAbandoned(int fd) {
+        struct stat st;
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RelayShared)) {
+            return true;
+        }
+
+        void* base = mmap(NULL, sizeof(RelayShared), PROT_READ, MAP_SHARED, fd, 0);
+
+        if (base == MAP_FAILED) {
+            return true;
+        }
+
+        RelayShared* shared = (RelayShared*)base;
+        bool abandoned = shared->magic != RELAY_MAGIC || !isRunning(shared->pid);
+
+        munmap(base, sizeof(RelayShared));
+        return abandoned;
+    }
+
+    static void lockShared(pthread_mutex_t* mutex) {
+        int result = pthread_mutex_lock(mutex);
+
+#ifdef __linux__
+        // The owner died, the state it guards is still consistent since
+        // positions are only moved once a message is complete.
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(mutex);
+        }
+#else
+        (void)result;
+#endif
+    }
+
+    /**
+     *  Waits on a shared condition for at most one slice, or until the
+     *  deadline if that comes first.
+     *
+     *  @return False if the deadline has passed.
+     */
+    static bool waitShared(pthread_cond_t* cond, pthread_mutex_t* mutex, unsigned long long deadline) {
+        unsigned long long now = Clock::now();
+        unsigned long long until = now + WAIT_SLICE * 1000ULL;
+        struct timespec ts;
+
+        if (deadline && deadline < until) {
+            until = deadline;
+        }
+
+        ts.tv_sec = until / 1000000ULL;
+        ts.tv_nsec = (until % 1000000ULL) * 1000;
+
+        int result = pthread_cond_timedwait(cond, mutex, &ts);
+
+#ifdef __linux__
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(mutex);
+        }
+#endif
+
+        return !deadline || Clock::now() < deadline;
+    }
+
+    /**
+     *  Writes a message at the head of a ring and returns the new head.
+     *  The caller has made sure that there is room for end - head bytes,
+     *  see skipSpace().
+     */
+    static unsigned long long writeRecord(char* ring,
+                                          unsigned long long capacity,
+                                          unsigned long long head,
+                                          unsigned long long skip,
+                                          unsigned int index,
+                                          int type,
+                                          int flag,
+                                          unsigned int ctype,
+                                          const char* content,
+                                          unsigned int size) {
+        RelayRecord* record;
+
+        if (skip >= RECORD_HEADER) {
+            record = (RelayRecord*)(ring + (head & (capacity - 1)));
+            record->size = skip - RECORD_HEADER;
+            record->type = PAD;
+        }
+
+        head += skip;
+        record = (RelayRecord*)(ring + (head & (capacity - 1)));
+        record->size = size;
+        record->channel = index;
+        record->type = type;
+        record->ctype = ctype;
+        record->flag = flag;
+        record->reserved = 0;
+
+        if (size > 0) {
+            memcpy((char*)record + RECORD_HEADER, content, size);
+        }
+
+        return head + recordSpace(size);
+    }
+
+    /**
+     *  Returns the number of bytes to skip at the end of a ring so that a
+     *  message of the given space starts at head without wrapping.
+     */
+    static unsigned long long skipSpace(unsigned long long capacity,
+                                        unsigned long long head,
+                                        unsigned long long space) {
+        unsigned long long left = capacity - (head & (capacity - 1));
+        return left < space ? left : 0;
+    }
+
+    /**
+     *  Returns the message at a position, skipping padding. The position
+     *  is moved to the message.
+     */
+    static RelayRecord* readRecord(char* ring,
+                                   unsigned long long capacity,
+                                   unsigned long long& position) {
+        unsigned long long left = capacity - (position & (capacity - 1));
+
+        if (left < RECORD_HEADER) {
+            position += left;
+        } else if (((RelayRecord*)(ring + (position & (capacity - 1))))->type == PAD) {
+            position += left;
+        }
+
+        return (RelayRecord*)(ring + (position & (capacity - 1)));
+    }
+
+    RelayMessage::RelayMessage() : m_channel(0), m_type(DATA), m_flag(0), m_ctype(ContentType::BINARY),
+                                   m_content(NULL), m_size(0)
+    {
+    }
+
+    unsigned int RelayMessage::getChannel() const {
+        return m_channel;
+    }
+
+    int RelayMessage::getType() const {
+        return m_type;
+    }
+
+    int RelayMessage::getFlag() const {
+        return m_flag;
+    }
+
+    const char* RelayMessage::getContent() const {
+        return m_content;
+    }
+
+    unsigned int RelayMessage::getSize() const {
+        return m_size;
+    }
+
+    bool RelayMessage::isUtf8Content() const {
+        return m_ctype == ContentType::UTF8;
+    }
+
+    bool RelayMessage::isBinaryContent() const {
+        return m_ctype == ContentType::BINARY;
+    }
+
+    Relay::Relay(string const &name, unsigned int capacity) : m_name(sharedName(name)), m_shared(NULL),
+                                                              m_ring(NULL), m_upRing(NULL), m_mappedSize(0),
+                                                              m_channels(MAX_CHANNELS, (Channel*)NULL),
+                                                              m_forwarding(NULL), m_pins(0),
+                                                              m_limit(0), m_stallTimeout(DEFAULT_STALL_TIMEOUT),
+                                                              m_published(0), m_dropped(0), m_corrupted(0),
+                                                              m_stopping(false)
+    {
+        unsigned int size = MIN_CAPACITY;
+
+        while (size < capacity && size < MAX_CAPACITY) {
+            size <<= 1;
+        }
+
+        m_mappedSize = headerSize() + size + size / 4;
+
+        // A relay that exited without cleaning up leaves its memory
+        // behind, which is replaced. Clients that still have it mapped
+        // see it as closed.
+        int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+
+        if (fd != -1) {
+            bool abandoned = isAbandoned(fd);
+            close(fd);
+
+            if (!abandoned) {
+                throw IOError("The relay \"" + name + "\" already exists");
+            }
+
+            shm_unlink(m_name.c_str());
+        }
+
+        fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+        if (fd == -1) {
+            throw IOError("Could not create the relay \"" + name + "\": " + strerror(errno));
+        }
+
+        if (ftruncate(fd, m_mappedSize) != 0) {
+            string error = strerror(errno);
+            close(fd);
+            shm_unlink(m_name.c_str());
+            throw IOError("Could not size the relay \"" + name + "\": " + error);
+        }
+
+        void* base = mmap(NULL, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (base == MAP_FAILED) {
+            string error = strerror(errno);
+            shm_unlink(m_name.c_str());
+            throw IOError("Could not map the relay \"" + name + "\": " + error);
+        }
+
+        // The memory starts out zeroed.
+        m_shared = (RelayShared*)base;
+        m_ring = (char*)base + headerSize();
+        m_upRing = m_ring + size;
+
+        pthread_mutexattr_t mutexAttr;
+        pthread_condattr_t condAttr;
+
+        pthread_mutexattr_init(&mutexAttr);
+        pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+        pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+#endif
+        pthread_condattr_init(&condAttr);
+        pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+
+        pthread_mutex_init(&m_shared->mutex, &mutexAttr);
+        pthread_cond_init(&m_shared->dataCond, &condAttr);
+        pthread_cond_init(&m_shared->spaceCond, &condAttr);
+        pthread_cond_init(&m_shared->upCond, &condAttr);
+        pthread_cond_init(&m_shared->upSpaceCond, &condAttr);
+
+        pthread_mutexattr_destroy(&mutexAttr);
+        pthread_condattr_destroy(&condAttr);
+
+        m_shared->version = RELAY_VERSION;
+        m_shared->size = sizeof(RelayShared);
+        m_shared->capacity = size;
+        m_shared->upCapacity = size / 4;
+        m_shared->pid = getpid();
+        m_limit = size;
+
+        // Clients check the magic last.
+        __sync_synchronize();
+        m_shared->magic = RELAY_MAGIC;
+
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_mutex_init(&m_publishMutex, NULL);
+        pthread_cond_init(&m_pinCond, NULL);
+
+        if (pthread_create(&m_forwardThread, NULL, run, this) != 0) {
+            pthread_mutex_destroy(&m_mutex);
+            pthread_mutex_destroy(&m_publishMutex);
+            pthread_cond_destroy(&m_pinCond);
+            munmap(base, m_mappedSize);
+            shm_unlink(m_name.c_str());
+            throw Error("Could not create a new thread for the relay");
+        }
+    }
+
+    Relay::~Relay() {
+        // Lets a publish that waits for a consumer give up.
+        m_stopping = true;
+
+        pthread_mutex_lock(&m_mutex);
+        vector<Channel*> channels;
+
+        for (unsigned int i = 0; i < m_channels.size(); i++) {
+            if (m_channels[i]) {
+                channels.push_back(m_channels[i]);
+            }
+        }
+        pthread_mutex_unlock(&m_mutex);
+
+        for (unsigned int i = 0; i < channels.size(); i++) {
+            remove(channels[i]);
+        }
+
+        // No channel can pin the relay once they are all removed.
+        pthread_mutex_lock(&m_mutex);
+        while (m_pins > 0) {
+            pthread_cond_wait(&m_pinCond, &m_mutex);
+        }
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_forwardThread, NULL);
+
+        // The shared mutex and conditions are left as they are, clients
+        // may still be waiting on them.
+        lockShared(&m_shared->mutex);
+        m_shared->closed = 1;
+        pthread_cond_broadcast(&m_shared->dataCond);
+        pthread_cond_broadcast(&m_shared->upSpaceCond);
+        pthread_mutex_unlock(&m_shared->mutex);
+
+        munmap(m_shared, m_mappedSize);
+        shm_unlink(m_name.c_str());
+
+        pthread_mutex_destroy(&m_mutex);
+        pthread_mutex_destroy(&m_publishMutex);
+        pthread_cond_destroy(&m_pinCond);
+    }
+
+    unsigned int Relay::add(Channel* channel) {
+        pthread_mutex_lock(&channel->m_connectMutex);
+        string path = channel->m_path;
+        bool connected = channel->m_connected;
+        pthread_mutex_unlock(&channel->m_connectMutex);
+
+        if (!connected) {
+            throw Error("The channel is not connected");
+        }
+
+        if (path.size() >= MAX_PATH) {
+            throw RangeError("The path of the channel is too long to be relayed");
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        pthread_mutex_lock(&channel->m_dataMutex);
+        pthread_mutex_lock(&channel->m_signalMutex);
+
+        unsigned int index = MAX_CHANNELS;
+
+        if (channel->m_relay == this) {
+            index = channel->m_relayIndex;
+        } else if (!channel->m_relay) {
+            for (index = 0; index < MAX_CHANNELS && m_channels[index]; index++) {
+            }
+        }
+
+        if (index < MAX_CHANNELS && !channel->m_relay) {
+            RelayPath& entry = m_shared->channels[index];
+
+            memcpy(entry.path, path.c_str(), path.size() + 1);
+            __sync_synchronize();
+            entry.active = 1;
+
+            m_channels[index] = channel;
+            channel->m_relay = this;
+            channel->m_relayIndex = index;
+        }
+
+        bool other = channel->m_relay != this;
+
+        pthread_mutex_unlock(&channel->m_signalMutex);
+        pthread_mutex_unlock(&channel->m_dataMutex);
+        pthread_mutex_unlock(&m_mutex);
+
+        if (other) {
+            throw Error("The channel is in another relay");
+        }
+
+        if (index == MAX_CHANNELS) {
+            throw Error("The relay is full");
+        }
+
+        return index;
+    }
+
+    void Relay::remove(Channel* channel) {
+        pthread_mutex_lock(&m_mutex);
+
+        // The channel may be deleted once it is removed.
+        while (m_forwarding == channel && !pthread_equal(pthread_self(), m_forwardThread)) {
+            pthread_cond_wait(&m_pinCond, &m_mutex);
+        }
+
+        pthread_mutex_lock(&channel->m_dataMutex);
+        pthread_mutex_lock(&channel->m_signalMutex);
+
+        if (channel->m_relay == this) {
+            unlink(channel);
+        }
+
+        pthread_mutex_unlock(&channel->m_signalMutex);
+        pthread_mutex_unlock(&channel->m_dataMutex);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void Relay::pin() {
+        __sync_fetch_and_add(&m_pins, 1);
+    }
+
+    void Relay::unpin() {
+        pthread_mutex_lock(&m_mutex);
+        if (__sync_sub_and_fetch(&m_pins, 1) == 0) {
+            pthread_cond_broadcast(&m_pinCond);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void Relay::unlink(Channel* channel) {
+        m_shared->channels[channel->m_relayIndex].active = 0;
+        m_channels[channel->m_relayIndex] = NULL;
+        channel->m_relay = NULL;
+    }
+
+    void Relay::setStallTimeout(unsigned int timeout) {
+        pthread_mutex_lock(&m_publishMutex);
+        m_stallTimeout = timeout;
+        pthread_mutex_unlock(&m_publishMutex);
+    }
+
+    unsigned long long Relay::getPublished() const {
+        return __sync_fetch_and_add(const_cast<unsigned long long*>(&m_published), 0);
+    }
+
+    unsigned long long Relay::getDropped() const {
+        return __sync_fetch_and_add(const_cast<unsigned long long*>(&m_dropped), 0);
+    }
+
+    unsigned long long Relay::getCorrupted() const {
+        return __sync_fetch_and_add(const_cast<unsigned long long*>(&m_corrupted), 0);
+    }
+
+    unsigned int Relay::getConsumers() const {
+        unsigned int count = 0;
+
+        for (unsigned int i = 0; i < MAX_CONSUMERS; i++) {
+            if (m_shared->consumers[i].pid && !m_shared->consumers[i].dropped) {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    void Relay::publish(unsigned int index,
+                        int type,
+                        int flag,
+                        unsigned int ctype,
+                        const char* content,
+                        unsigned int size) {
+        RelayShared* shared = m_shared;
+        unsigned long long capacity = shared->capacity;
+        unsigned long long space = recordSpace(size);
+
+        if (space > capacity / 2) {
+            __sync_fetch_and_add(&m_dropped, 1);
+            return;
+        }
+
+        pthread_mutex_lock(&m_publishMutex);
+
+        unsigned long long head = shared->head;
+        unsigned long long skip = skipSpace(capacity, head, space);
+        unsigned long long end = head + skip + space;
+        unsigned long long started = 0;
+
+        // Only looks at the consumers once the space that was known to be
+        // free is used up.
+        while (end > m_limit && !m_stopping) {
+            bool stalled = started && Clock::now() - started >= m_stallTimeout * 1000ULL;
+
+            lockShared(&shared->mutex);
+            __sync_fetch_and_add(&shared->spaceWaiters, 1);
+
+            m_limit = reapConsumers(head, end - capacity, stalled) + capacity;
+
+            if (end > m_limit) {
+                if (!started) {
+                    started = Clock::now();
+                }
+
+                waitShared(&shared->spaceCond, &shared->mutex, 0);
+            }
+
+            __sync_fetch_and_sub(&shared->spaceWaiters, 1);
+            pthread_mutex_unlock(&shared->mutex);
+        }
+
+        if (end > m_limit) {
+            pthread_mutex_unlock(&m_publishMutex);
+            __sync_fetch_and_add(&m_dropped, 1);
+            return;
+        }
+
+        writeRecord(m_ring, capacity, head, skip, index, type, flag, ctype, content, size);
+
+        __sync_synchronize();
+        shared->head = end;
+        __sync_synchronize();
+
+        if (shared->dataWaiters > 0) {
+            lockShared(&shared->mutex);
+            pthread_cond_broadcast(&shared->dataCond);
+            pthread_mutex_unlock(&shared->mutex);
+        }
+
+        pthread_mutex_unlock(&m_publishMutex);
+
+        __sync_fetch_and_add(&m_published, 1);
+    }
+
+    unsigned long long Relay::reapConsumers(unsigned long long head,
+                                            unsigned long long position,
+                                            bool stalled) {
+        unsigned long long slowest = head;
+
+        for (unsigned int i = 0; i < MAX_CONSUMERS; i++) {
+            RelayConsumer& consumer = m_shared->consumers[i];
+
+            if (!consumer.pid) {
+                continue;
+            }
+
+            if (!isRunning(consumer.pid)) {
+#ifdef HYDNADEBUG
+                debugPrint("Relay", i, "Consumer exited");
+#endif
+                consumer.pid = 0;
+            } else if (consumer.dropped) {
+                continue;
+            } else if (stalled && consumer.cursor < position) {
+#ifdef HYDNADEBUG
+                debugPrint("Relay", i, "Consumer stalled, dropped");
+#endif
+                consumer.dropped = 1;
+                pthread_cond_broadcast(&m_shared->dataCond);
+            } else if (consumer.cursor < slowest) {
+                slowest = consumer.cursor;
+            }
+        }
+
+        return slowest;
+    }
+
+    void* Relay::run(void* ptr) {
+        IoThread::setName("hydna-relay");
+        static_cast<Relay*>(ptr)->runForward();
+        return NULL;
+    }
+
+    void Relay::runForward() {
+        RelayShared* shared = m_shared;
+
+        // Not read from the shared memory, which clients can write.
+        unsigned long long capacity = (m_upRing - m_ring) / 4;
+
+        lockShared(&shared->mutex);
+
+        while (!m_stopping) {
+            unsigned long long tail = shared->upTail;
+            unsigned long long head = shared->upHead;
+
+            if (tail == head) {
+                waitShared(&shared->upCond, &shared->mutex, 0);
+                continue;
+            }
+
+            // Everything written so far is sent without the lock, only
+            // this thread moves the tail.
+            pthread_mutex_unlock(&shared->mutex);
+
+            // The ring is written by clients, nothing in it is trusted.
+            bool corrupt = head < tail || head - tail > capacity;
+
+            while (!corrupt && tail != head) {
+                unsigned long long position = tail;
+                RelayRecord* record = readRecord(m_upRing, capacity, position);
+                unsigned int size = record->size;
+
+                if (position > head || recordSpace(size) > capacity / 2 ||
+                    recordSpace(size) > head - position ||
+                    (position & (capacity - 1)) + recordSpace(size) > capacity) {
+                    corrupt = true;
+                    break;
+                }
+
+                forward(record->channel, record->type, record->flag, record->ctype,
+                        (const char*)record + RECORD_HEADER, size);
+                tail = position + recordSpace(size);
+            }
+
+            if (corrupt) {
+#ifdef HYDNADEBUG
+                debugPrint("Relay", 0, "Corrupt message from a client, skipped to the head");
+#endif
+                __sync_fetch_and_add(&m_corrupted, 1);
+                tail = head;
+            }
+
+            lockShared(&shared->mutex);
+            shared->upTail = tail;
+            pthread_cond_broadcast(&shared->upSpaceCond);
+        }
+
+        pthread_mutex_unlock(&shared->mutex);
+    }
+
+    void Relay::forward(unsigned int index,
+                        int type,
+                        int flag,
+                        unsigned int ctype,
+                        const char* content,
+                        unsigned int size) {
+        bool sent = false;
+
+        // The channel is not removed, and so not deleted, while it is
+        // being sent on, see remove().
+        pthread_mutex_lock(&m_mutex);
+        Channel* channel = index < m_channels.size() ? m_channels[index] : NULL;
+        m_forwarding = channel;
+        pthread_mutex_unlock(&m_mutex);
+
+        if (channel) {
+            try {
+                if (type == RelayMessage::SIGNAL) {
+                    channel->emitBytes(content, ctype, 0, size);
+                } else {
+                    channel->writeBytes(content, 0, size, ctype, flag);
+                }
+
+                sent = true;
+            } catch (Error& e) {
+#ifdef HYDNADEBUG
+                debugPrint("Relay", index, "Could not forward, " + string(e.what()));
+#endif
+            }
+
+            pthread_mutex_lock(&m_mutex);
+            m_forwarding = NULL;
+            pthread_cond_broadcast(&m_pinCond);
+            pthread_mutex_unlock(&m_mutex);
+        }
+
+        if (!sent) {
+            __sync_fetch_and_add(&m_dropped, 1);
+        }
+    }
+
+    RelayClient::RelayClient(string const &name) : m_shared(NULL), m_ring(NULL), m_upRing(NULL),
+                                                   m_mappedSize(0), m_slot(0), m_next(0)
+    {
+        string shared = sharedName(name);
+        int fd = shm_open(shared.c_str(), O_RDWR, 0);
+        struct stat st;
+
+        if (fd == -1) {
+            throw IOError("Could not open the relay \"" + name + "\": " + strerror(errno));
+        }
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < headerSize()) {
+            close(fd);
+            throw IOError("The relay \"" + name + "\" is not ready");
+        }
+
+        m_mappedSize = st.st_size;
+
+        void* base = mmap(NULL, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (base == MAP_FAILED) {
+            throw IOError("Could not map the relay \"" + name + "\": " + strerror(errno));
+        }
+
+        m_shared = (RelayShared*)base;
+
+        if (m_shared->magic != RELAY_MAGIC ||
+            m_shared->version != RELAY_VERSION ||
+            m_shared->size != sizeof(RelayShared) ||
+            headerSize() + m_shared->capacity + m_shared->upCapacity != m_mappedSize) {
+            munmap(base, m_mappedSize);
+            throw IOError("The relay \"" + name + "\" is not ready");
+        }
+
+        __sync_synchronize();
+
+        m_ring = (char*)base + headerSize();
+        m_upRing = m_ring + m_shared->capacity;
+
+        lockShared(&m_shared->mutex);
+
+        for (m_slot = 0; m_slot < Relay::MAX_CONSUMERS && m_shared->consumers[m_slot].pid; m_slot++) {
+        }
+
+        if (m_slot < Relay::MAX_CONSUMERS) {
+            RelayConsumer& consumer = m_shared->consumers[m_slot];
+
+            m_next = m_shared->head;
+            consumer.cursor = m_next;
+            consumer.dropped = 0;
+            consumer.pid = getpid();
+        }
+
+        pthread_mutex_unlock(&m_shared->mutex);
+
+        if (m_slot == Relay::MAX_CONSUMERS) {
+            munmap(base, m_mappedSize);
+            throw Error("The relay \"" + name + "\" has no room for another client");
+        }
+    }
+
+    RelayClient::~RelayClient() {
+        RelayConsumer& consumer = m_shared->consumers[m_slot];
+
+        lockShared(&m_shared->mutex);
+        consumer.pid = 0;
+        pthread_cond_broadcast(&m_shared->spaceCond);
+        pthread_mutex_unlock(&m_shared->mutex);
+
+        munmap(m_shared, m_mappedSize);
+    }
+
+    unsigned int RelayClient::find(string const &path) const {
+        for (unsigned int i = 0; i < Relay::MAX_CHANNELS; i++) {
+            RelayPath& entry = m_shared->channels[i];
+
+            if (entry.active) {
+                __sync_synchronize();
+
+                if (path.size() < Relay::MAX_PATH && path == entry.path) {
+                    return i;
+                }
+            }
+        }
+
+        throw Error("The channel \"" + path + "\" is not relayed");
+    }
+
+    void RelayClient::checkAttached() const {
+        if (m_shared->closed || !isRunning(m_shared->pid)) {
+            throw Error("The relay was closed");
+        }
+
+        if (m_shared->consumers[m_slot].dropped) {
+            throw Error("The relay dropped this client, it fell behind");
+        }
+    }
+
+    bool RelayClient::next(RelayMessage& message, int timeout) {
+        RelayShared* shared = m_shared;
+        RelayConsumer& consumer = shared->consumers[m_slot];
+        unsigned long long capacity = shared->capacity;
+        unsigned long long deadline = 0;
+
+        // Releases the previous message.
+        if (consumer.cursor != m_next) {
+            __sync_synchronize();
+            consumer.cursor = m_next;
+            __sync_synchronize();
+
+            if (shared->spaceWaiters > 0) {
+                lockShared(&shared->mutex);
+                pthread_cond_broadcast(&shared->spaceCond);
+                pthread_mutex_unlock(&shared->mutex);
+            }
+        }
+
+        if (timeout > 0) {
+            deadline = Clock::now() + timeout * 1000ULL;
+        }
+
+        for (;;) {
+            if (consumer.dropped) {
+                checkAttached();
+            }
+
+            unsigned long long head = shared->head;
+            __sync_synchronize();
+
+            if (m_next != head) {
+                break;
+            }
+
+            if (timeout == 0) {
+                return false;
+            }
+
+            checkAttached();
+
+            lockShared(&shared->mutex);
+            __sync_fetch_and_add(&shared->dataWaiters, 1);
+
+            bool waiting = true;
+
+            if (shared->head == m_next && !shared->closed && !consumer.dropped) {
+                waiting = waitShared(&shared->dataCond, &shared->mutex, deadline);
+            }
+
+            __sync_fetch_and_sub(&shared->dataWaiters, 1);
+            pthread_mutex_unlock(&shared->mutex);
+
+            if (!waiting) {
+                return false;
+            }
+        }
+
+        RelayRecord* record = readRecord(m_ring, capacity, m_next);
+
+        message.m_channel = record->channel;
+        message.m_type = record->type;
+        message.m_flag = record->flag;
+        message.m_ctype = record->ctype;
+        message.m_content = (const char*)record + RECORD_HEADER;
+        message.m_size = record->size;
+
+        m_next += recordSpace(record->size);
+
+        return true;
+    }
+
+    void RelayClient::write(unsigned int channel,
+                            const char* data,
+                            unsigned int length,
+                            unsigned int ctype,
+                            unsigned int priority) {
+        send(channel, RelayMessage::DATA, priority, ctype, data, length);
+    }
+
+    void RelayClient::emit(unsigned int channel,
+                           const char* data,
+                           unsigned int length,
+                           unsigned int ctype) {
+        send(channel, RelayMessage::SIGNAL, 0, ctype, data, length);
+    }
+
+    void RelayClient::send(unsigned int channel,
+                           int type,
+                           int flag,
+                           unsigned int ctype,
+                           const char* data,
+                           unsigned int length) {
+        RelayShared* shared = m_shared;
+        unsigned long long capacity = shared->upCapacity;
+        unsigned long long space = recordSpace(length);
+
+        if (channel >= Relay::MAX_CHANNELS) {
+            throw RangeError("Channel index out of range");
+        }
+
+        if (space > capacity / 2) {
+            throw RangeError("The message is too large for the relay");
+        }
+
+        lockShared(&shared->mutex);
+
+        for (;;) {
+            if (shared->closed || !isRunning(shared->pid)) {
+                pthread_mutex_unlock(&shared->mutex);
+                throw Error("The relay was closed");
+            }
+
+            unsigned long long head = shared->upHead;
+            unsigned long long skip = skipSpace(capacity, head, space);
+
+            if (head + skip + space <= shared->upTail + capacity) {
+                shared->upHead = writeRecord(m_upRing, capacity, head, skip, channel, type, flag, ctype, data, length);
+                break;
+            }
+
+            waitShared(&shared->upSpaceCond, &shared->mutex, 0);
+        }
+
+        pthread_cond_signal(&shared->upCond);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+}
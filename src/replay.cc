@@ -0,0 +1,276 @@
+#include <set>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "capture.h"
+#include "channel.h"
+#include "connection.h"
+#include "frameparser.h"
+#include "clock.h"
+#include "ioerror.h"
+
+#ifdef HYDNADEBUG
+#include "debughelper.h"
+#endif
+
+namespace hydna {
+    using namespace std;
+
+    // Waits shorter than this are spun, longer ones sleep until then.
+    static const unsigned long long SPIN_TIME = 1000000;
+
+    static size_t recordSize(CaptureRecord const* record) {
+        return sizeof(CaptureRecord) + ((record->size + 7) & ~7U);
+    }
+
+    static void waitUntil(unsigned long long deadline) {
+        unsigned long long now;
+
+        while ((now = Clock::nanos()) < deadline) {
+            if (deadline - now > SPIN_TIME) {
+                usleep((deadline - now - SPIN_TIME) / 1000);
+            }
+        }
+    }
+
+    FrameReplay::FrameReplay(string const &path) : m_data(NULL),
+                                                   m_size(0),
+                                                   m_chunkSize(0),
+                                                   m_frames(0),
+                                                   m_duration(0),
+                                                   m_source(ALL_SOURCES),
+                                                   m_connection(NULL),
+                                                   m_skipped(0)
+    {
+        struct stat st;
+        CaptureHeader const* header;
+        int fd;
+
+        fd = open(path.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            throw IOError("Could not open the capture file " + path);
+        }
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CaptureHeader)) {
+            close(fd);
+            throw IOError("Not a capture file, " + path);
+        }
+
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED) {
+            throw IOError("Could not map the capture file " + path);
+        }
+
+        m_data = (char*)data;
+        m_size = st.st_size;
+
+        header = (CaptureHeader const*)m_data;
+
+        if (memcmp(header->magic, FrameCapture::MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != FrameCapture::VERSION ||
+            header->chunkSize < sizeof(CaptureHeader) + sizeof(CaptureRecord)) {
+            munmap(m_data, m_size);
+            throw IOError("Not a capture file, " + path);
+        }
+
+        m_chunkSize = header->chunkSize;
+
+        // Sequential reads from here on.
+        madvise(m_data, m_size, MADV_SEQUENTIAL);
+
+        unsigned long long first = 0;
+
+        for (size_t offset = sizeof(CaptureHeader); seek(offset); offset += recordSize((CaptureRecord const*)(m_data + offset))) {
+            CaptureRecord const* record = (CaptureRecord const*)(m_data + offset);
+
+            if (m_frames++ == 0) {
+                first = record->time;
+            }
+
+            // Files written by older versions may have records out of
+            // order by a little.
+            if (record->time > first + m_duration) {
+                m_duration = record->time - first;
+            }
+        }
+
+        // The channels have no server, they are only bound to this
+        // connection, which is never made available to others.
+        m_connection = new Connection("replay", 0, "", false);
+    }
+
+    FrameReplay::~FrameReplay() {
+        m_connection->destroy(ChannelError("The replay ended"));
+        delete m_connection;
+
+        munmap(m_data, m_size);
+    }
+
+    void FrameReplay::bind(Channel* channel, unsigned int ch) {
+        pthread_mutex_lock(&m_connection->m_openChannelsMutex);
+        if (m_connection->m_openChannels.count(ch) > 0) {
+            pthread_mutex_unlock(&m_connection->m_openChannelsMutex);
+            throw Error("The channel id is already bound");
+        }
+
+        m_connection->m_openChannels[ch] = channel;
+        pthread_mutex_unlock(&m_connection->m_openChannelsMutex);
+
+        try {
+            channel->openOffline(m_connection, ch);
+        } catch (Error&) {
+            pthread_mutex_lock(&m_connection->m_openChannelsMutex);
+            m_connection->m_openChannels.erase(ch);
+            pthread_mutex_unlock(&m_connection->m_openChannelsMutex);
+            throw;
+        }
+    }
+
+    void FrameReplay::setSource(int source) {
+        m_source = source;
+    }
+
+    unsigned long long FrameReplay::run(double speed) {
+        FrameParser parser;
+        FrameView frame;
+        unsigned long long dispatched = 0;
+        unsigned long long started = Clock::nanos();
+        unsigned long long first = 0;
+        bool bound;
+
+        m_skipped = 0;
+
+        for (size_t offset = sizeof(CaptureHeader); seek(offset); offset += recordSize((CaptureRecord const*)(m_data + offset))) {
+            CaptureRecord const* record = (CaptureRecord const*)(m_data + offset);
+
+            if (m_source != ALL_SOURCES && record->source != (unsigned int)m_source) {
+                continue;
+            }
+
+            if (speed > 0) {
+                if (!first) {
+                    first = record->time;
+                }
+
+                // A record from before the first is sent right away.
+                unsigned long long elapsed = record->time > first ? record->time - first : 0;
+
+                waitUntil(started + (unsigned long long)(elapsed / speed));
+            }
+
+            parser.feed((const char*)(record + 1), record->size);
+
+            if (!parser.next(frame)) {
+                parser.reset();
+                m_skipped++;
+                continue;
+            }
+
+            // Only frames that a bound channel would have received are
+            // dispatched, the handlers of the other frames expect the
+            // requests that the capture was made with. A channel that is
+            // closed by a replayed signal is no longer bound. Signals on
+            // channel 0 go to every channel.
+            pthread_mutex_lock(&m_connection->m_openChannelsMutex);
+            bound = m_connection->m_openChannels.count(frame.ch) > 0 ||
+                    (frame.ch == 0 && frame.op == Frame::SIGNAL);
+            pthread_mutex_unlock(&m_connection->m_openChannelsMutex);
+
+            if (!bound || (frame.op != Frame::DATA && frame.op != Frame::SIGNAL)) {
+                m_skipped++;
+                continue;
+            }
+
+            m_connection->dispatchFrame(frame);
+            dispatched++;
+        }
+
+#ifdef HYDNADEBUG
+        debugPrint("FrameReplay", 0, "Replay done");
+#endif
+
+        return dispatched;
+    }
+
+    vector<unsigned int> FrameReplay::getChannels() const {
+        set<unsigned int> found;
+
+        for (size_t offset = sizeof(CaptureHeader); seek(offset); offset += recordSize((CaptureRecord const*)(m_data + offset))) {
+            CaptureRecord const* record = (CaptureRecord const*)(m_data + offset);
+            const char* data = (const char*)(record + 1);
+            unsigned int ch;
+
+            if ((m_source != ALL_SOURCES && record->source != (unsigned int)m_source) ||
+                record->size < (unsigned int)(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET)) {
+                continue;
+            }
+
+            int op = (data[Frame::LENGTH_OFFSET + 4] >> Frame::OP_BITPOS) & Frame::OP_BITMASK;
+
+            if (op != Frame::DATA && op != Frame::SIGNAL) {
+                continue;
+            }
+
+            memcpy(&ch, data + Frame::LENGTH_OFFSET, sizeof(ch));
+
+            // Signals on channel 0 are for every channel.
+            if (ch != 0) {
+                found.insert(ntohl(ch));
+            }
+        }
+
+        return vector<unsigned int>(found.begin(), found.end());
+    }
+
+    unsigned long long FrameReplay::getFrames() const {
+        return m_frames;
+    }
+
+    unsigned long long FrameReplay::getDuration() const {
+        return m_duration;
+    }
+
+    unsigned long long FrameReplay::getSkipped() const {
+        return m_skipped;
+    }
+
+    bool FrameReplay::seek(size_t& offset) const {
+        for (;;) {
+            size_t chunkEnd = (offset / m_chunkSize + 1) * m_chunkSize;
+            CaptureRecord const* record;
+
+            if (offset + sizeof(CaptureRecord) > chunkEnd) {
+                offset = chunkEnd;
+                continue;
+            }
+
+            if (offset + sizeof(CaptureRecord) > m_size) {
+                return false;
+            }
+
+            record = (CaptureRecord const*)(m_data + offset);
+
+            if (record->source == FrameCapture::PAD) {
+                offset = chunkEnd;
+                continue;
+            }
+
+            // The rest of the file is zeroes if the capture was never
+            // stopped.
+            if (record->time == 0 && record->size == 0) {
+                return false;
+            }
+
+            return offset + recordSize(record) <= m_size;
+        }
+    }
+}
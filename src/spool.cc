@@ -0,0 +1,238 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+#include "connection.h"
+#include "frame.h"
+#include "ioerror.h"
+
+#ifdef HYDNADEBUG
+#include "debughelper.h"
+#endif
+
+namespace hydna {
+    using namespace std;
+
+    const char Spool::MAGIC[8] = { 'H', 'Y', 'D', 'N', 'A', 'S', 'P', 'L' };
+
+    static const unsigned int MIN_CAPACITY = 64 * 1024;
+    static const unsigned int MAX_CAPACITY = 1 << 30;
+
+    static unsigned int roundCapacity(unsigned int capacity) {
+        unsigned int rounded = MIN_CAPACITY;
+
+        while (rounded < capacity && rounded < MAX_CAPACITY) {
+            rounded <<= 1;
+        }
+
+        return rounded;
+    }
+
+    static bool isPowerOfTwo(unsigned int value) {
+        return value && (value & (value - 1)) == 0;
+    }
+
+    Spool::Spool(string const &path, unsigned int capacity) : m_path(path),
+                                                              m_header(NULL),
+                                                              m_ring(NULL),
+                                                              m_mappedSize(0),
+                                                              m_mask(0)
+    {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        SpoolHeader existing;
+        struct stat st;
+        bool valid = false;
+        int fd;
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd == -1) {
+            throw IOError("Could not open the spool file " + path);
+        }
+
+        // The frames of an earlier spool are kept, with the capacity that
+        // they were written with.
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= pageSize &&
+            pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)) {
+            valid = memcmp(existing.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                    existing.version == VERSION &&
+                    isPowerOfTwo(existing.capacity) &&
+                    existing.capacity >= MIN_CAPACITY && existing.capacity <= MAX_CAPACITY &&
+                    existing.head <= existing.tail &&
+                    existing.tail - existing.head <= existing.capacity &&
+                    (size_t)st.st_size == pageSize + existing.capacity;
+        }
+
+        if (valid) {
+            capacity = existing.capacity;
+        } else {
+            capacity = roundCapacity(capacity);
+        }
+
+        m_mappedSize = pageSize + capacity;
+
+        if (!valid && ftruncate(fd, m_mappedSize) != 0) {
+            close(fd);
+            throw IOError("Could not size the spool file " + path);
+        }
+
+        void* base = mmap(NULL, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (base == MAP_FAILED) {
+            throw IOError("Could not map the spool file " + path);
+        }
+
+        m_header = (SpoolHeader*)base;
+        m_ring = (char*)base + pageSize;
+        m_mask = capacity - 1;
+
+        if (!valid) {
+            memset(m_header, 0, sizeof(SpoolHeader));
+            memcpy(m_header->magic, MAGIC, sizeof(MAGIC));
+            m_header->version = VERSION;
+            m_header->capacity = capacity;
+        }
+
+#ifdef HYDNADEBUG
+        if (m_header->frames > 0) {
+            debugPrint("Spool", 0, "Kept frames from an earlier spool in " + path);
+        }
+#endif
+    }
+
+    Spool::~Spool() {
+        munmap(m_header, m_mappedSize);
+    }
+
+    bool Spool::append(const struct iovec* parts, int count) {
+        unsigned long long position = m_header->tail;
+        size_t size = 0;
+
+        for (int i = 0; i < count; i++) {
+            size += parts[i].iov_len;
+        }
+
+        if (size > m_header->capacity - (m_header->tail - m_header->head)) {
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            copyIn(position, (const char*)parts[i].iov_base, parts[i].iov_len);
+            position += parts[i].iov_len;
+        }
+
+        // Moved last, so that a frame is only in the file once it is
+        // whole.
+        m_header->tail = position;
+        m_header->frames++;
+
+        return true;
+    }
+
+    bool Spool::flush(Connection* connection, unsigned int ch) {
+        unsigned int nch = htonl(ch);
+
+        while (m_header->head != m_header->tail) {
+            unsigned long long position = m_header->head;
+            unsigned int bytes = 0;
+            unsigned int frames = 0;
+            bool corrupt = false;
+
+            // Whole frames, so that nothing is left half sent between
+            // writes, with the channel of today.
+            while (position != m_header->tail) {
+                unsigned long long left = m_header->tail - position;
+                unsigned int size = 0;
+
+                if (left >= (unsigned long long)Frame::LENGTH_OFFSET) {
+                    size = ((byteAt(position) << 8) | byteAt(position + 1)) + Frame::LENGTH_OFFSET;
+                }
+
+                // E.g. a file that was changed, or written by a process
+                // that crashed while it wrote.
+                if (size < (unsigned int)(Frame::HEADER_SIZE + Frame::LENGTH_OFFSET) || size > left) {
+                    corrupt = true;
+                    break;
+                }
+
+                if (bytes > 0 && bytes + size > BATCH_SIZE) {
+                    break;
+                }
+
+                copyIn(position + Frame::LENGTH_OFFSET, (const char*)&nch, sizeof(nch));
+
+                position += size;
+                bytes += size;
+                frames++;
+            }
+
+            // The frames before it are sent first.
+            if (corrupt && frames == 0) {
+#ifdef HYDNADEBUG
+                debugPrint("Spool", ch, "Discarded an inconsistent spool in " + m_path);
+#endif
+                m_header->head = m_header->tail;
+                m_header->frames = 0;
+                break;
+            }
+
+            size_t start = m_header->head & m_mask;
+            size_t first = min((size_t)bytes, (size_t)m_header->capacity - start);
+            struct iovec parts[2];
+            int count = 1;
+
+            parts[0].iov_base = m_ring + start;
+            parts[0].iov_len = first;
+
+            if (first < bytes) {
+                parts[1].iov_base = m_ring;
+                parts[1].iov_len = bytes - first;
+                count = 2;
+            }
+
+            if (!connection->writeEncoded(parts, count, frames)) {
+                return false;
+            }
+
+            m_header->head = position;
+            m_header->frames -= frames;
+        }
+
+        return true;
+    }
+
+    bool Spool::isEmpty() const {
+        return m_header->head == m_header->tail;
+    }
+
+    unsigned long long Spool::getFrames() const {
+        return m_header->frames;
+    }
+
+    unsigned long long Spool::getBytes() const {
+        return m_header->tail - m_header->head;
+    }
+
+    string const &Spool::getPath() const {
+        return m_path;
+    }
+
+    unsigned char Spool::byteAt(unsigned long long position) const {
+        return (unsigned char)m_ring[position & m_mask];
+    }
+
+    void Spool::copyIn(unsigned long long position, const char* data, size_t size) {
+        size_t start = position & m_mask;
+        size_t first = min(size, (size_t)m_header->capacity - start);
+
+        memcpy(m_ring + start, data, first);
+        memcpy(m_ring, data + first, size - first);
+    }
+}
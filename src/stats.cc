@@ -0,0 +1,306 @@
+#include <sstream>
+#include <string.h>
+
+#include "stats.h"
+
+namespace hydna {
+    using namespace std;
+
+    static const char* OP_NAMES[ConnectionStats::OP_COUNT] = {
+        "keepalive", "open", "data", "signal", "resolve"
+    };
+
+    static const char* CATEGORY_NAMES[MemoryStats::CATEGORY_COUNT] = {
+        "data", "signals", "requests", "reconnect_queue", "channels", "reassembly"
+    };
+
+    static int nextStripe = 0;
+    static __thread int threadStripe = -1;
+
+    Counter::Counter() {
+        memset(m_stripes, 0, sizeof(m_stripes));
+    }
+
+    void Counter::add(unsigned long long value) {
+        if (threadStripe == -1) {
+            threadStripe = __sync_fetch_and_add(&nextStripe, 1) % STRIPE_COUNT;
+        }
+
+        __sync_fetch_and_add(&m_stripes[threadStripe].value, value);
+    }
+
+    unsigned long long Counter::get() const {
+        unsigned long long result = 0;
+
+        for (int i = 0; i < STRIPE_COUNT; i++) {
+            result += m_stripes[i].value;
+        }
+
+        return result;
+    }
+
+    static void histogramText(ostringstream& out, string const &name, Histogram const &histogram) {
+        out << name << ".count " << histogram.getCount() << "\n";
+        out << name << ".min " << histogram.getMin() << "\n";
+        out << name << ".mean " << histogram.getMean() << "\n";
+        out << name << ".p50 " << histogram.getPercentile(50) << "\n";
+        out << name << ".p99 " << histogram.getPercentile(99) << "\n";
+        out << name << ".p999 " << histogram.getPercentile(99.9) << "\n";
+        out << name << ".max " << histogram.getMax() << "\n";
+    }
+
+    static void histogramJSON(ostringstream& out, string const &name, Histogram const &histogram) {
+        out << "\"" << name << "\":{";
+        out << "\"count\":" << histogram.getCount();
+        out << ",\"min\":" << histogram.getMin();
+        out << ",\"mean\":" << histogram.getMean();
+        out << ",\"p50\":" << histogram.getPercentile(50);
+        out << ",\"p99\":" << histogram.getPercentile(99);
+        out << ",\"p999\":" << histogram.getPercentile(99.9);
+        out << ",\"max\":" << histogram.getMax();
+        out << "}";
+    }
+
+    static void opsJSON(ostringstream& out, string const &name, const unsigned long long* values) {
+        out << "\"" << name << "\":{";
+        for (int i = 0; i < ConnectionStats::OP_COUNT; i++) {
+            out << (i ? "," : "") << "\"" << OP_NAMES[i] << "\":" << values[i];
+        }
+        out << "}";
+    }
+
+    static void memoryText(ostringstream& out, string const &prefix, MemoryStats const &memory) {
+        for (int i = 0; i < MemoryStats::CATEGORY_COUNT; i++) {
+            out << prefix << "bytes." << CATEGORY_NAMES[i] << " " << memory.bytes[i] << "\n";
+        }
+
+        out << prefix << "total " << memory.total << "\n";
+        out << prefix << "budget " << memory.budget << "\n";
+        out << prefix << "pauses " << memory.pauses << "\n";
+        out << prefix << "shed " << memory.shed << "\n";
+    }
+
+    static void memoryJSON(ostringstream& out, MemoryStats const &memory) {
+        out << "{\"bytes\":{";
+        for (int i = 0; i < MemoryStats::CATEGORY_COUNT; i++) {
+            out << (i ? "," : "") << "\"" << CATEGORY_NAMES[i] << "\":" << memory.bytes[i];
+        }
+        out << "}";
+        out << ",\"total\":" << memory.total;
+        out << ",\"budget\":" << memory.budget;
+        out << ",\"pauses\":" << memory.pauses;
+        out << ",\"shed\":" << memory.shed;
+        out << "}";
+    }
+
+    static void rateText(ostringstream& out, string const &prefix, RateStats const &rate) {
+        out << prefix << "message_limit " << rate.messageLimit << "\n";
+        out << prefix << "byte_limit " << rate.byteLimit << "\n";
+        out << prefix << "throttled " << rate.throttled << "\n";
+        out << prefix << "throttled_us " << rate.throttledTime << "\n";
+        out << prefix << "rejected " << rate.rejected << "\n";
+        out << prefix << "dropped " << rate.dropped << "\n";
+        out << prefix << "queue " << rate.queue << "\n";
+    }
+
+    static void rateJSON(ostringstream& out, RateStats const &rate) {
+        out << "{\"message_limit\":" << rate.messageLimit;
+        out << ",\"byte_limit\":" << rate.byteLimit;
+        out << ",\"throttled\":" << rate.throttled;
+        out << ",\"throttled_us\":" << rate.throttledTime;
+        out << ",\"rejected\":" << rate.rejected;
+        out << ",\"dropped\":" << rate.dropped;
+        out << ",\"queue\":" << rate.queue;
+        out << "}";
+    }
+
+    MemoryStats::MemoryStats() : total(0), budget(0), pauses(0), shed(0)
+    {
+        memset(bytes, 0, sizeof(bytes));
+    }
+
+    string MemoryStats::toText() const {
+        ostringstream out;
+
+        memoryText(out, "", *this);
+
+        return out.str();
+    }
+
+    string MemoryStats::toJSON() const {
+        ostringstream out;
+
+        memoryJSON(out, *this);
+
+        return out.str();
+    }
+
+    RateStats::RateStats() : messageLimit(0), byteLimit(0), throttled(0),
+                             throttledTime(0), rejected(0), dropped(0), queue(0)
+    {
+    }
+
+    string RateStats::toText() const {
+        ostringstream out;
+
+        rateText(out, "", *this);
+
+        return out.str();
+    }
+
+    string RateStats::toJSON() const {
+        ostringstream out;
+
+        rateJSON(out, *this);
+
+        return out.str();
+    }
+
+    ConnectionStats::ConnectionStats() : drops(0), reconnects(0), reconnectAttempts(0),
+                                         openChannels(0), pendingResolves(0),
+                                         pendingOpens(0), reconnectQueue(0),
+                                         tls(false), kernelTlsSend(false),
+                                         kernelTlsReceive(false), ioThreadCpu(-1),
+                                         ioThreadConfig(0)
+    {
+        memset(framesIn, 0, sizeof(framesIn));
+        memset(bytesIn, 0, sizeof(bytesIn));
+        memset(framesOut, 0, sizeof(framesOut));
+        memset(bytesOut, 0, sizeof(bytesOut));
+    }
+
+    string ConnectionStats::toText() const {
+        ostringstream out;
+
+        for (int i = 0; i < OP_COUNT; i++) {
+            out << "frames_in." << OP_NAMES[i] << " " << framesIn[i] << "\n";
+            out << "bytes_in." << OP_NAMES[i] << " " << bytesIn[i] << "\n";
+            out << "frames_out." << OP_NAMES[i] << " " << framesOut[i] << "\n";
+            out << "bytes_out." << OP_NAMES[i] << " " << bytesOut[i] << "\n";
+        }
+
+        out << "drops " << drops << "\n";
+        out << "reconnects " << reconnects << "\n";
+        out << "reconnect_attempts " << reconnectAttempts << "\n";
+        out << "open_channels " << openChannels << "\n";
+        out << "pending_resolves " << pendingResolves << "\n";
+        out << "pending_opens " << pendingOpens << "\n";
+        out << "reconnect_queue " << reconnectQueue << "\n";
+        out << "tls " << tls << "\n";
+        out << "ktls_send " << kernelTlsSend << "\n";
+        out << "ktls_receive " << kernelTlsReceive << "\n";
+        out << "io_thread_cpu " << ioThreadCpu << "\n";
+        out << "io_thread_config " << ioThreadConfig << "\n";
+
+        memoryText(out, "memory.", memory);
+        rateText(out, "rate.", rate);
+
+        histogramText(out, "resolve_latency_us", resolveLatency);
+        histogramText(out, "open_latency_us", openLatency);
+        histogramText(out, "write_latency_us", writeLatency);
+        histogramText(out, "rtt_us", roundTripTimes);
+
+        return out.str();
+    }
+
+    string ConnectionStats::toJSON() const {
+        ostringstream out;
+
+        out << "{";
+        opsJSON(out, "frames_in", framesIn);
+        out << ",";
+        opsJSON(out, "bytes_in", bytesIn);
+        out << ",";
+        opsJSON(out, "frames_out", framesOut);
+        out << ",";
+        opsJSON(out, "bytes_out", bytesOut);
+
+        out << ",\"drops\":" << drops;
+        out << ",\"reconnects\":" << reconnects;
+        out << ",\"reconnect_attempts\":" << reconnectAttempts;
+        out << ",\"open_channels\":" << openChannels;
+        out << ",\"pending_resolves\":" << pendingResolves;
+        out << ",\"pending_opens\":" << pendingOpens;
+        out << ",\"reconnect_queue\":" << reconnectQueue;
+        out << ",\"tls\":" << (tls ? "true" : "false");
+        out << ",\"ktls_send\":" << (kernelTlsSend ? "true" : "false");
+        out << ",\"ktls_receive\":" << (kernelTlsReceive ? "true" : "false");
+        out << ",\"io_thread_cpu\":" << ioThreadCpu;
+        out << ",\"io_thread_config\":" << ioThreadConfig;
+        out << ",\"memory\":";
+        memoryJSON(out, memory);
+        out << ",\"rate\":";
+        rateJSON(out, rate);
+
+        out << ",";
+        histogramJSON(out, "resolve_latency_us", resolveLatency);
+        out << ",";
+        histogramJSON(out, "open_latency_us", openLatency);
+        out << ",";
+        histogramJSON(out, "write_latency_us", writeLatency);
+        out << ",";
+        histogramJSON(out, "rtt_us", roundTripTimes);
+        out << "}";
+
+        return out.str();
+    }
+
+    ChannelStats::ChannelStats() : dataIn(0), dataBytesIn(0), signalsIn(0),
+                                   dataOut(0), dataBytesOut(0), signalsOut(0),
+                                   dataQueue(0), signalQueue(0), openLatency(0),
+                                   dataLooped(0), echoesDropped(0), echoesExpired(0), dataSpooled(0),
+                                   spoolQueue(0), batchDropped(0), dataPlain(0)
+    {
+    }
+
+    string ChannelStats::toText() const {
+        ostringstream out;
+
+        out << "data_in " << dataIn << "\n";
+        out << "data_bytes_in " << dataBytesIn << "\n";
+        out << "signals_in " << signalsIn << "\n";
+        out << "data_out " << dataOut << "\n";
+        out << "data_bytes_out " << dataBytesOut << "\n";
+        out << "signals_out " << signalsOut << "\n";
+        out << "data_queue " << dataQueue << "\n";
+        out << "signal_queue " << signalQueue << "\n";
+        out << "open_latency_us " << openLatency << "\n";
+        out << "data_looped " << dataLooped << "\n";
+        out << "echoes_dropped " << echoesDropped << "\n";
+        out << "echoes_expired " << echoesExpired << "\n";
+        out << "data_spooled " << dataSpooled << "\n";
+        out << "spool_queue " << spoolQueue << "\n";
+        out << "batch_dropped " << batchDropped << "\n";
+        out << "data_plain " << dataPlain << "\n";
+
+        rateText(out, "rate.", rate);
+
+        return out.str();
+    }
+
+    string ChannelStats::toJSON() const {
+        ostringstream out;
+
+        out << "{\"data_in\":" << dataIn;
+        out << ",\"data_bytes_in\":" << dataBytesIn;
+        out << ",\"signals_in\":" << signalsIn;
+        out << ",\"data_out\":" << dataOut;
+        out << ",\"data_bytes_out\":" << dataBytesOut;
+        out << ",\"signals_out\":" << signalsOut;
+        out << ",\"data_queue\":" << dataQueue;
+        out << ",\"signal_queue\":" << signalQueue;
+        out << ",\"open_latency_us\":" << openLatency;
+        out << ",\"data_looped\":" << dataLooped;
+        out << ",\"echoes_dropped\":" << echoesDropped;
+        out << ",\"echoes_expired\":" << echoesExpired;
+        out << ",\"data_spooled\":" << dataSpooled;
+        out << ",\"spool_queue\":" << spoolQueue;
+        out << ",\"batch_dropped\":" << batchDropped;
+        out << ",\"data_plain\":" << dataPlain;
+        out << ",\"rate\":";
+        rateJSON(out, rate);
+        out << "}";
+
+        return out.str();
+    }
+}
@@ -0,0 +1,334 @@
+#include <string>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#ifdef HYDNA_WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "tlssession.h"
+
+namespace hydna {
+    using namespace std;
+
+#ifdef HYDNA_WITH_TLS
+    /**
+     *  Blocks SIGPIPE while OpenSSL writes to the socket, since it writes
+     *  without MSG_NOSIGNAL. A SIGPIPE raised meanwhile is discarded.
+     */
+    class SigpipeGuard {
+    public:
+        SigpipeGuard() {
+            sigset_t set;
+
+            sigemptyset(&set);
+            sigaddset(&set, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &set, &m_old);
+        }
+
+        ~SigpipeGuard() {
+            if (!sigismember(&m_old, SIGPIPE)) {
+                sigset_t pending;
+
+                sigpending(&pending);
+
+                if (sigismember(&pending, SIGPIPE)) {
+                    sigset_t set;
+                    struct timespec zero = { 0, 0 };
+
+                    sigemptyset(&set);
+                    sigaddset(&set, SIGPIPE);
+                    sigtimedwait(&set, NULL, &zero);
+                }
+            }
+
+            pthread_sigmask(SIG_SETMASK, &m_old, NULL);
+        }
+
+    private:
+        sigset_t m_old;
+    };
+
+    static string lastError(string const &fallback) {
+        char message[256];
+        unsigned long code = ERR_get_error();
+
+        if (code == 0) {
+            return fallback;
+        }
+
+        ERR_error_string_n(code, message, sizeof(message));
+        return message;
+    }
+
+    bool TlsSession::isAvailable() {
+        return true;
+    }
+
+    TlsSession::TlsSession(int fd) : m_fd(fd), m_kernelOffload(0), m_context(NULL), m_ssl(NULL)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    TlsSession::~TlsSession() {
+        if (m_ssl) {
+            SSL_free(m_ssl);
+        }
+
+        if (m_context) {
+            SSL_CTX_free(m_context);
+        }
+
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    bool TlsSession::handshake(string const &host, bool verify, string const &caFile, bool kernel) {
+        struct in_addr address;
+        int result;
+
+        ERR_clear_error();
+
+        if ((m_context = SSL_CTX_new(TLS_client_method())) == NULL) {
+            m_error = lastError("Could not create the TLS context");
+            return false;
+        }
+
+        SSL_CTX_set_min_proto_version(m_context, TLS1_2_VERSION);
+        SSL_CTX_set_mode(m_context, SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+        // A server that closes without close_notify ends the stream,
+        // just like a plain connection.
+        SSL_CTX_set_options(m_context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+        if (kernel) {
+            SSL_CTX_set_options(m_context, SSL_OP_ENABLE_KTLS);
+        }
+#endif
+
+        if (verify) {
+            SSL_CTX_set_verify(m_context, SSL_VERIFY_PEER, NULL);
+
+            if (caFile.empty()) {
+                result = SSL_CTX_set_default_verify_paths(m_context);
+            } else {
+                result = SSL_CTX_load_verify_locations(m_context, caFile.c_str(), NULL);
+            }
+
+            if (result != 1) {
+                m_error = lastError("Could not load the trusted certificates");
+                return false;
+            }
+        }
+
+        if ((m_ssl = SSL_new(m_context)) == NULL || SSL_set_fd(m_ssl, m_fd) != 1) {
+            m_error = lastError("Could not create the TLS session");
+            return false;
+        }
+
+        if (inet_pton(AF_INET, host.c_str(), &address) == 1) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl), host.c_str());
+        } else {
+            SSL_set_tlsext_host_name(m_ssl, host.c_str());
+            SSL_set1_host(m_ssl, host.c_str());
+        }
+
+        {
+            SigpipeGuard guard;
+            result = SSL_connect(m_ssl);
+        }
+
+        if (result != 1) {
+            long verified = SSL_get_verify_result(m_ssl);
+
+            if (verified != X509_V_OK) {
+                m_error = string("Could not verify the certificate, ") + X509_verify_cert_error_string(verified);
+            } else {
+                m_error = lastError("The TLS handshake failed");
+            }
+
+            return false;
+        }
+
+#ifndef OPENSSL_NO_KTLS
+        if (BIO_get_ktls_send(SSL_get_wbio(m_ssl))) {
+            m_kernelOffload |= KERNEL_SEND;
+        }
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(m_ssl))) {
+            m_kernelOffload |= KERNEL_RECEIVE;
+        }
+#endif
+
+        // From here on the socket never blocks while the session is
+        // locked, so that a blocking read does not hold up writes.
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+
+        return true;
+    }
+
+    bool TlsSession::hasPending() {
+        bool result;
+
+        pthread_mutex_lock(&m_mutex);
+        result = SSL_pending(m_ssl) > 0;
+        pthread_mutex_unlock(&m_mutex);
+
+        return result;
+    }
+
+    int TlsSession::read(char* buffer, int size) {
+        int n;
+        int error;
+
+        do {
+            pthread_mutex_lock(&m_mutex);
+            {
+                SigpipeGuard guard;
+
+                ERR_clear_error();
+                n = SSL_read(m_ssl, buffer, size);
+                error = SSL_get_error(m_ssl, n);
+            }
+            pthread_mutex_unlock(&m_mutex);
+
+            if (n > 0) {
+                return n;
+            }
+
+            if (error == SSL_ERROR_ZERO_RETURN) {
+                return 0;
+            }
+        } while (wait(error));
+
+        return -1;
+    }
+
+    int TlsSession::write(const struct iovec* parts, int count) {
+        int n;
+        int error;
+
+        if (m_kernelOffload & KERNEL_SEND) {
+            struct msghdr message;
+
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = (struct iovec*)parts;
+            message.msg_iovlen = count;
+
+            // The kernel encrypts, the data path is the same as for a
+            // plain socket.
+            for (;;) {
+                n = sendmsg(m_fd, &message, MSG_NOSIGNAL);
+
+                if (n >= 0) {
+                    return n;
+                }
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait(SSL_ERROR_WANT_WRITE);
+                } else if (errno != EINTR) {
+                    return -1;
+                }
+            }
+        }
+
+        // OpenSSL copies into a record anyway, so the parts are joined
+        // into one write rather than sent as separate records.
+        m_gather.clear();
+
+        for (int i = 0; i < count; i++) {
+            const char* base = (const char*)parts[i].iov_base;
+            m_gather.insert(m_gather.end(), base, base + parts[i].iov_len);
+        }
+
+        do {
+            pthread_mutex_lock(&m_mutex);
+            {
+                SigpipeGuard guard;
+
+                ERR_clear_error();
+                n = SSL_write(m_ssl, &m_gather[0], m_gather.size());
+                error = SSL_get_error(m_ssl, n);
+            }
+            pthread_mutex_unlock(&m_mutex);
+
+            if (n > 0) {
+                return n;
+            }
+        } while (wait(error));
+
+        return -1;
+    }
+
+    bool TlsSession::wait(int error) {
+        struct pollfd pfd;
+
+        if (error == SSL_ERROR_WANT_READ) {
+            pfd.events = POLLIN;
+        } else if (error == SSL_ERROR_WANT_WRITE) {
+            pfd.events = POLLOUT;
+        } else {
+            return false;
+        }
+
+        pfd.fd = m_fd;
+        pfd.revents = 0;
+
+        return poll(&pfd, 1, -1) >= 0 || errno == EINTR;
+    }
+#else
+    bool TlsSession::isAvailable() {
+        return false;
+    }
+
+    TlsSession::TlsSession(int fd) : m_fd(fd), m_kernelOffload(0), m_context(NULL), m_ssl(NULL)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    TlsSession::~TlsSession() {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    bool TlsSession::handshake(string const &, bool, string const &, bool) {
+        m_error = "The library is compiled without TLS support";
+        return false;
+    }
+
+    bool TlsSession::hasPending() {
+        return false;
+    }
+
+    int TlsSession::read(char*, int) {
+        return -1;
+    }
+
+    int TlsSession::write(const struct iovec*, int) {
+        return -1;
+    }
+
+    bool TlsSession::wait(int) {
+        return false;
+    }
+#endif
+
+    string TlsSession::getError() const {
+        return m_error;
+    }
+
+    unsigned int TlsSession::getKernelOffload() const {
+        return m_kernelOffload;
+    }
+}
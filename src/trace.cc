@@ -0,0 +1,246 @@
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <string.h>
+
+#include "trace.h"
+#include "clock.h"
+
+namespace hydna {
+    using namespace std;
+
+    static const char TRACE_MAGIC[4] = { 'H', 'Y', 'T', 'R' };
+    static const unsigned int TRACE_VERSION = 2;
+
+    static __thread void* currentRing = NULL;
+    static unsigned short threadCount = 0;
+
+
+    static bool compareTime(TraceRecord const &a, TraceRecord const &b) {
+        return a.time < b.time;
+    }
+
+    void Trace::setEnabled(bool value) {
+        m_enabled = value;
+    }
+
+    void Trace::createKey() {
+        pthread_key_create(&m_ringKey, releaseRing);
+    }
+
+    void Trace::releaseRing(void* ring) {
+        Ring** link;
+
+        pthread_mutex_lock(&m_ringsMutex);
+        for (link = &m_rings; *link; link = &(*link)->next) {
+            if (*link == ring) {
+                *link = (*link)->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&m_ringsMutex);
+
+        currentRing = NULL;
+        delete (Ring*)ring;
+    }
+
+    Trace::Ring* Trace::threadRing() {
+        Ring* ring = (Ring*)currentRing;
+
+        if (ring) {
+            return ring;
+        }
+
+        pthread_once(&m_ringKeyOnce, createKey);
+
+        ring = new Ring();
+        ring->head = 0;
+        ring->thread = __sync_add_and_fetch(&threadCount, 1);
+        memset(ring->records, 0, sizeof(ring->records));
+
+        pthread_mutex_lock(&m_ringsMutex);
+        ring->next = m_rings;
+        m_rings = ring;
+        pthread_mutex_unlock(&m_ringsMutex);
+
+        // The ring is freed by releaseRing() when the thread exits.
+        pthread_setspecific(m_ringKey, ring);
+
+        currentRing = ring;
+        return ring;
+    }
+
+    void Trace::record(unsigned short event,
+                       unsigned int ch,
+                       unsigned long long arg0,
+                       unsigned long long arg1)
+    {
+        Ring* ring = threadRing();
+        unsigned long long head = ring->head;
+        volatile TraceRecord& record = ring->records[head & (RING_SIZE - 1)];
+
+        // dump() skips records with a sequence number that changed while
+        // it copied them.
+        record.seq = 0;
+        __sync_synchronize();
+
+        record.time = Clock::nanos();
+        record.ch = ch;
+        record.event = event;
+        record.thread = ring->thread;
+        record.arg0 = arg0;
+        record.arg1 = arg1;
+
+        __sync_synchronize();
+        record.seq = head + 1;
+        ring->head = head + 1;
+    }
+
+    bool Trace::dump(string const &path) {
+        TraceRecords records;
+        TraceRecord record;
+        Ring* ring;
+
+        pthread_mutex_lock(&m_ringsMutex);
+        for (ring = m_rings; ring; ring = ring->next) {
+            unsigned long long head = ring->head;
+            unsigned long long start = head > RING_SIZE ? head - RING_SIZE : 0;
+
+            __sync_synchronize();
+
+            for (unsigned long long i = start; i < head; i++) {
+                volatile TraceRecord& slot = ring->records[i & (RING_SIZE - 1)];
+                unsigned long long seq = slot.seq;
+
+                __sync_synchronize();
+                record.seq = seq;
+                record.time = slot.time;
+                record.ch = slot.ch;
+                record.event = slot.event;
+                record.thread = slot.thread;
+                record.arg0 = slot.arg0;
+                record.arg1 = slot.arg1;
+                __sync_synchronize();
+
+                // Overwritten, or being written, while it was copied.
+                if (seq != i + 1 || slot.seq != seq) {
+                    continue;
+                }
+
+                records.push_back(record);
+            }
+        }
+        pthread_mutex_unlock(&m_ringsMutex);
+
+        ofstream out(path.c_str(), ios::binary | ios::trunc);
+        unsigned int header[2];
+        header[0] = TRACE_VERSION;
+        header[1] = records.size();
+
+        out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        out.write((const char*)header, sizeof(header));
+
+        if (records.size() > 0) {
+            out.write((const char*)&records[0], records.size() * sizeof(TraceRecord));
+        }
+
+        return out.good();
+    }
+
+    bool Trace::read(string const &path, TraceRecords& records) {
+        ifstream in(path.c_str(), ios::binary);
+        char magic[sizeof(TRACE_MAGIC)];
+        unsigned int header[2];
+        streamoff size;
+
+        in.seekg(0, ios::end);
+        size = in.tellg();
+        in.seekg(0, ios::beg);
+
+        in.read(magic, sizeof(magic));
+        in.read((char*)header, sizeof(header));
+
+        if (!in.good() || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+            header[0] != TRACE_VERSION) {
+            return false;
+        }
+
+        size -= sizeof(magic) + sizeof(header);
+
+        if ((unsigned long long)size / sizeof(TraceRecord) < header[1]) {
+            return false;
+        }
+
+        records.resize(header[1]);
+
+        if (header[1] > 0) {
+            in.read((char*)&records[0], header[1] * sizeof(TraceRecord));
+        }
+
+        stable_sort(records.begin(), records.end(), compareTime);
+
+        return !in.fail();
+    }
+
+    string Trace::format(TraceRecord const &record) {
+        ostringstream out;
+
+        out << record.time / 1000000000ULL << ".";
+        out.width(9);
+        out.fill('0');
+        out << record.time % 1000000000ULL;
+        out.fill(' ');
+
+        out << " T";
+        out.width(3);
+        out.setf(ios::left);
+        out << record.thread;
+        out << " ";
+        out.width(16);
+        out << eventName(record.event);
+        out.unsetf(ios::left);
+        out << " ch=";
+        out.width(10);
+        out << record.ch;
+        out << " " << record.arg0 << " " << record.arg1;
+
+        return out.str();
+    }
+
+    const char* Trace::eventName(unsigned short event) {
+        switch (event) {
+            case FRAME_IN: return "frame-in";
+            case FRAME_OUT: return "frame-out";
+            case RESOLVE_REQUEST: return "resolve-request";
+            case OPEN_REQUEST: return "open-request";
+            case REQUEST_QUEUED: return "request-queued";
+            case OPEN_ALLOWED: return "open-allowed";
+            case OPEN_DENIED: return "open-denied";
+            case CHANNEL_ALLOC: return "channel-alloc";
+            case CHANNEL_DEALLOC: return "channel-dealloc";
+            case CHANNEL_CLOSE: return "channel-close";
+            case KEEPALIVE_SENT: return "keepalive-sent";
+            case KEEPALIVE_RTT: return "keepalive-rtt";
+            case IDLE_TIMEOUT: return "idle-timeout";
+            case RECONNECT: return "reconnect";
+            case RECONNECTED: return "reconnected";
+            case DESTROY: return "destroy";
+            case OPEN_TIMEOUT: return "open-timeout";
+            case IO_THREAD: return "io-thread";
+            case MEMORY_PAUSE: return "memory-pause";
+            case MEMORY_SHED: return "memory-shed";
+        }
+
+        return "unknown";
+    }
+
+#ifdef HYDNADEBUG
+    volatile bool Trace::m_enabled = true;
+#else
+    volatile bool Trace::m_enabled = false;
+#endif
+    Trace::Ring* Trace::m_rings = NULL;
+    pthread_mutex_t Trace::m_ringsMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_key_t Trace::m_ringKey;
+    pthread_once_t Trace::m_ringKeyOnce = PTHREAD_ONCE_INIT;
+}
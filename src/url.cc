@@ -1,7 +1,4 @@
-#include <pthread.h>
-#include <iomanip>
-#include <sstream>
-#include <algorithm>
+#include <string.h>
 
 #include "url.h"
 
@@ -12,7 +9,81 @@
 namespace hydna {
     using namespace std;
 
-    URL::URL() : m_port(80), m_path(""), m_host(""), m_token(""), m_auth(""), m_protocol("http"), m_error("")
+    static const char DEFAULT_PROTOCOL[] = "http";
+
+    static char toLower(char c) {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    static const char* findFirst(const char* begin, const char* end, char c) {
+        const char* found = (const char*)memchr(begin, c, end - begin);
+        return found ? found : end;
+    }
+
+    static const char* findLast(const char* begin, const char* end, char c) {
+        for (const char* it = end; it != begin; --it) {
+            if (it[-1] == c) {
+                return it - 1;
+            }
+        }
+
+        return end;
+    }
+
+    URLPart::URLPart() : m_data(""), m_size(0)
+    {
+    }
+
+    URLPart::URLPart(const char* data, size_t size) : m_data(data), m_size(size)
+    {
+    }
+
+    const char* URLPart::getData() const
+    {
+        return m_data;
+    }
+
+    size_t URLPart::getSize() const
+    {
+        return m_size;
+    }
+
+    bool URLPart::isEmpty() const
+    {
+        return m_size == 0;
+    }
+
+    string URLPart::toString() const
+    {
+        return string(m_data, m_size);
+    }
+
+    bool URLPart::equals(const char* text) const
+    {
+        return strlen(text) == m_size && memcmp(m_data, text, m_size) == 0;
+    }
+
+    bool URLPart::equalsIgnoreCase(const char* text) const
+    {
+        if (strlen(text) != m_size) {
+            return false;
+        }
+
+        for (size_t i = 0; i < m_size; i++) {
+            if (toLower(m_data[i]) != toLower(text[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool URLPart::equals(string const &text) const
+    {
+        return text.size() == m_size && memcmp(m_data, text.data(), m_size) == 0;
+    }
+
+    URL::URL() : m_port(80), m_protocol(DEFAULT_PROTOCOL, sizeof(DEFAULT_PROTOCOL) - 1), m_error(false)
     {
     }
 
@@ -24,99 +95,123 @@ namespace hydna {
         return m_port;
     }
 
-    string URL::getPath() const
+    URLPart URL::getPath() const
     {
         return m_path;
     }
-    
-    string URL::getHost() const
+
+    URLPart URL::getHost() const
     {
         return m_host;
     }
 
-    string URL::getToken() const
+    URLPart URL::getToken() const
     {
         return m_token;
     }
-    
-    string URL::getAuth() const
+
+    URLPart URL::getAuth() const
     {
         return m_auth;
     }
-    
-    string URL::getProtocol() const
+
+    URLPart URL::getProtocol() const
     {
         return m_protocol;
     }
-    
-    string URL::getError() const
+
+    bool URL::isSecure() const
+    {
+        return m_protocol.equalsIgnoreCase("https");
+    }
+
+    bool URL::isSupported() const
+    {
+        return isSecure() || m_protocol.equalsIgnoreCase("http");
+    }
+
+    bool URL::hasError() const
     {
         return m_error;
     }
-    
+
+    string URL::getError() const
+    {
+        if (!m_error) {
+            return "";
+        }
+
+        return "Could not read the port \"" + m_badPort.toString() + "\"";
+    }
+
     URL URL::parse(string const &expr) {
+        return parse(expr.data(), expr.size());
+    }
+
+    URL URL::parse(const char* expr, size_t size) {
         URL url;
-        string host = expr;
-        unsigned short port = 80;
-        string path = "";
-        string tokens = "";
-        string auth = "";
-        string protocol = "http";
-        string error = "";
-        size_t pos;
+        const char* begin = expr;
+        const char* end = expr + size;
+        const char* pos;
 
         // Expr can be on the form "http://auth@localhost:80/x00112233?token"
 
         // Take out the protocol
-        pos = host.find("://");
-        if (pos != string::npos) {
-            protocol = host.substr(0, pos);
-            std::transform(protocol.begin(), protocol.end(), protocol.begin(), ::tolower);
-            host = host.substr(pos + 3);
+        for (pos = begin; pos + 3 <= end; pos++) {
+            if (pos[0] == ':' && pos[1] == '/' && pos[2] == '/') {
+                url.m_protocol = URLPart(begin, pos - begin);
+                begin = pos + 3;
+
+                if (url.isSecure()) {
+                    url.m_port = 443;
+                }
+                break;
+            }
         }
 
         // Take out the auth
-        pos = host.find("@");
-        if (pos != string::npos) {
-            auth = host.substr(0, pos);
-            host = host.substr(pos + 1);
+        pos = findFirst(begin, end, '@');
+        if (pos != end) {
+            url.m_auth = URLPart(begin, pos - begin);
+            begin = pos + 1;
         }
 
         // Take out the token
-        pos = host.find_last_of("?");
-        if (pos != string::npos) {
-            tokens = host.substr(pos + 1);
-            host = host.substr(0, pos);
+        pos = findLast(begin, end, '?');
+        if (pos != end) {
+            url.m_token = URLPart(pos + 1, end - pos - 1);
+            end = pos;
         }
 
         // Take out the path
-        pos = host.find("/");
-        if (pos != string::npos) {
-            path = host.substr(pos + 1);
-            host = host.substr(0, pos);
+        pos = findFirst(begin, end, '/');
+        if (pos != end) {
+            url.m_path = URLPart(pos + 1, end - pos - 1);
+            end = pos;
         }
 
         // Take out the port
-        pos = host.find_last_of(":");
-        if (pos != string::npos) {
-            istringstream iss(host.substr(pos + 1));
+        pos = findLast(begin, end, ':');
+        if (pos != end) {
+            unsigned long port = 0;
+            const char* digit = pos + 1;
 
-            if ((iss >> port).fail()) {
-               error = "Could not read the port \"" + host.substr(pos + 1) + "\"";
+            for (; digit != end && *digit >= '0' && *digit <= '9' && port <= 65535; digit++) {
+                port = port * 10 + (*digit - '0');
             }
 
-            host = host.substr(0, pos);
+            if (digit == pos + 1 || digit != end || port > 65535) {
+                url.m_badPort = URLPart(pos + 1, end - pos - 1);
+                url.m_error = true;
+            } else {
+                url.m_port = (unsigned short)port;
+            }
+
+            end = pos;
         }
-        
-        url.m_path = path;
-        url.m_token = tokens;
-        url.m_host = host;
-        url.m_port = port;
-        url.m_auth = auth;
-        url.m_protocol = protocol;
-        url.m_error = error;
+
+        url.m_host = URLPart(begin, end - begin);
 
         return url;
     }
 }
-